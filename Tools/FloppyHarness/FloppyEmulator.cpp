@@ -0,0 +1,1001 @@
+/*
+ * File: FloppyEmulator.cpp
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+#include <IOKit/IOMemoryDescriptor.h>
+
+#include "FloppyEmulator.hpp"
+
+// Controller registers, as offsets from the I/O base.
+#define kEmuRegDor      2
+#define kEmuRegMsr      4 // DSR when written.
+#define kEmuRegFifo     5
+#define kEmuRegDir      7 // CCR when written.
+
+// Main status register bits.
+#define kEmuMsrRqm      0x80
+#define kEmuMsrDio      0x40
+#define kEmuMsrNonDma   0x20
+#define kEmuMsrBusy     0x10
+
+// Status register bits.
+#define kEmuSt0Abnormal 0x40
+#define kEmuSt0Invalid  0x80
+#define kEmuSt0Polling  0xC0
+#define kEmuSt0SeekEnd  0x20
+#define kEmuSt0Check    0x10
+#define kEmuSt1Missing  0x01
+#define kEmuSt1NotWrite 0x02
+#define kEmuSt1NoData   0x04
+#define kEmuSt1Overrun  0x10
+#define kEmuSt1Crc      0x20
+#define kEmuSt1EndTrack 0x80
+#define kEmuSt2ScanMiss 0x04
+#define kEmuSt2ScanHit  0x08
+#define kEmuSt2WrongCyl 0x10
+#define kEmuSt2Crc      0x20
+
+// 8237 mode transfer types.
+#define kEmuDmaModeWrite    0x04 // Device to memory.
+#define kEmuDmaModeRead     0x08 // Memory to device.
+#define kEmuDmaModeMask     0x0C
+#define kEmuDmaAutoInit     0x10
+
+// Page registers for channels 0-3.
+static const UInt16 dmaPagePorts[4] = { 0x87, 0x83, 0x81, 0x82 };
+
+/**
+ * Gets the number of bytes in a command, or 0 if the command is not emulated.
+ */
+static UInt8 getCommandLength(UInt8 command) {
+    switch (command & 0x1F) {
+        case 0x03: // SPECIFY.
+        case 0x0F: // SEEK.
+            return 3;
+        case 0x04: // SENSE DRIVE STATUS.
+        case 0x07: // RECALIBRATE.
+        case 0x0A: // READ ID.
+        case 0x12: // PERPENDICULAR MODE.
+            return 2;
+        case 0x0D: // FORMAT TRACK.
+            return 6;
+        case 0x05: // WRITE DATA.
+        case 0x06: // READ DATA.
+        case 0x11: // SCAN EQUAL.
+        case 0x19: // SCAN LOW OR EQUAL.
+        case 0x1D: // SCAN HIGH OR EQUAL.
+            return 9;
+        case 0x08: // SENSE INTERRUPT.
+        case 0x0E: // DUMPREG.
+        case 0x10: // VERSION.
+        case 0x14: // LOCK.
+            return 1;
+        case 0x13: // CONFIGURE.
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+FloppyEmulator::FloppyEmulator(UInt16 ioBase, UInt8 dmaChannel, FloppyFaultInjector *faults) {
+    _ioBase = ioBase;
+    _dmaChannel = dmaChannel & 0x03;
+    _faults = faults;
+    _interruptHandler = NULL;
+    _interruptContext = NULL;
+    bzero(&_stats, sizeof (_stats));
+
+    // Controller powers up held in reset.
+    _dor = 0;
+    _dataRate = 2;
+    _phase = kPhaseReset;
+    _commandLength = 0;
+    _commandIndex = 0;
+    _resultLength = 0;
+    _resultIndex = 0;
+    _specify[0] = 0;
+    _specify[1] = 0;
+    _configure[0] = 0x20;
+    _configure[1] = 0;
+    _locked = false;
+    _lastEot = 0;
+    _rqmTime = 0;
+    _retryPending = false;
+    _lostIrqTime = kFloppyEmuNever;
+    _event = kEventNone;
+    _eventTime = kFloppyEmuNever;
+    _eventInterrupt = false;
+    _senseCount = 0;
+
+    for (UInt8 i = 0; i < kFloppyEmuDrives; i++) {
+        Drive *drive = &_drives[i];
+        drive->present = false;
+        drive->mediaPresent = false;
+        drive->writeProtected = false;
+        drive->diskChanged = true;
+        drive->cylinder = 0;
+        drive->pcn = 0;
+        drive->seekEnd = kFloppyEmuNever;
+        drive->speedTime = 0;
+        drive->sectors = kFloppyEmuSectors;
+        drive->sizeCode = kFloppyEmuSizeCode;
+    }
+    _drives[0].present = true;
+    insertMedia(0, false);
+
+    bzero(_dma, sizeof (_dma));
+    for (UInt8 i = 0; i < 4; i++)
+        _dma[i].masked = true;
+    _dmaFlipFlop = false;
+    _cmosIndex = 0;
+    _cmosDriveTypes = 0x40; // 1.44MB drive 0, nothing on drive 1.
+}
+
+void FloppyEmulator::setInterruptHandler(FloppyEmulatorInterruptHandler handler, void *context) {
+    _interruptHandler = handler;
+    _interruptContext = context;
+}
+
+void FloppyEmulator::setCmosDriveTypes(UInt8 types) {
+    bool attach = (types & 0x0F) && !_drives[1].present;
+    _cmosDriveTypes = types;
+    _drives[1].present = (types & 0x0F) != 0;
+    if (attach)
+        insertMedia(1, false);
+}
+
+void FloppyEmulator::insertMedia(UInt8 drive, bool writeProtected, UInt8 sectors, UInt8 sizeCode) {
+    Drive *floppy = &_drives[drive & 0x03];
+
+    // The pattern runs over 512-byte blocks, so it reads the same whatever the sector size.
+    if (floppy->image.empty() || floppy->sectors != sectors || floppy->sizeCode != sizeCode) {
+        floppy->sectors = sectors;
+        floppy->sizeCode = sizeCode;
+        floppy->image.resize(kFloppyEmuCylinders * kFloppyEmuHeads * sectors * (128U << sizeCode));
+        for (UInt32 offset = 0; offset < floppy->image.size(); offset++)
+            floppy->image[offset] = getPatternByte(offset / kFloppyEmuSectorSize, offset % kFloppyEmuSectorSize);
+    }
+    floppy->mediaPresent = true;
+    floppy->writeProtected = writeProtected;
+    floppy->diskChanged = true;
+}
+
+void FloppyEmulator::ejectMedia(UInt8 drive) {
+    _drives[drive & 0x03].mediaPresent = false;
+    _drives[drive & 0x03].diskChanged = true;
+}
+
+UInt8 FloppyEmulator::readPort(UInt16 port) {
+    if (port >= _ioBase && port <= _ioBase + kEmuRegDir) {
+        switch (port - _ioBase) {
+            case kEmuRegDor:
+                return _dor;
+            case kEmuRegMsr:
+                return getMsr();
+            case kEmuRegFifo:
+                return readFifo();
+            case kEmuRegDir:
+                return _drives[_dor & 0x03].diskChanged ? 0x80 : 0x00;
+            default:
+                return 0x00;
+        }
+    }
+
+    if (port <= 0x0F || (port >= 0x80 && port <= 0x8F))
+        return readDmaPort(port);
+    if (port == 0x71)
+        return _cmosIndex == 0x10 ? _cmosDriveTypes : 0x00;
+    return 0xFF;
+}
+
+void FloppyEmulator::writePort(UInt16 port, UInt8 data) {
+    if (port >= _ioBase && port <= _ioBase + kEmuRegDir) {
+        switch (port - _ioBase) {
+            case kEmuRegDor:
+                writeDor(data);
+                break;
+
+            case kEmuRegMsr:
+                // Software reset through the DSR clears itself.
+                if (data & 0x80) {
+                    enterReset();
+                    exitReset();
+                }
+                _dataRate = data & 0x03;
+                break;
+
+            case kEmuRegFifo:
+                writeFifo(data);
+                break;
+
+            case kEmuRegDir:
+                _dataRate = data & 0x03;
+                break;
+        }
+        return;
+    }
+
+    if (port <= 0x0F || (port >= 0x80 && port <= 0x8F))
+        writeDmaPort(port, data);
+    else if (port == 0x70)
+        _cmosIndex = data & 0x7F;
+}
+
+UInt64 FloppyEmulator::nextEventTime() {
+    UInt64 next = _event != kEventNone ? _eventTime : kFloppyEmuNever;
+    for (UInt8 i = 0; i < kFloppyEmuDrives; i++)
+        if (_drives[i].seekEnd < next)
+            next = _drives[i].seekEnd;
+    return next;
+}
+
+void FloppyEmulator::runEvents(UInt64 now) {
+    // State is updated before raising interrupts, as the handler may do port I/O.
+    if (_event != kEventNone && _eventTime <= now) {
+        UInt8 event = _event;
+        _event = kEventNone;
+
+        if (event == kEventReset) {
+            for (UInt8 i = 0; i < kFloppyEmuDrives; i++)
+                addSenseStatus(kEmuSt0Polling | i, _drives[i].pcn);
+            raiseInterrupt();
+        } else if (event == kEventResult) {
+            setResult(_pendingResult, sizeof (_pendingResult));
+            if (_eventInterrupt)
+                raiseInterrupt();
+            else
+                _lostIrqTime = now;
+        }
+    }
+
+    for (UInt8 i = 0; i < kFloppyEmuDrives; i++)
+        if (_drives[i].seekEnd <= now)
+            finishSeek(i);
+}
+
+void FloppyEmulator::writeDor(UInt8 value) {
+    UInt8 oldValue = _dor;
+    _dor = value;
+
+    // Spindles only start turning when their motor bit is newly set.
+    for (UInt8 i = 0; i < kFloppyEmuDrives; i++)
+        if ((value & ~oldValue) & (0x10 << i))
+            _drives[i].speedTime = FloppyShimGetTime() + kFloppyEmuSpinUpNs;
+
+    if (!(value & 0x04) && (oldValue & 0x04))
+        enterReset();
+    else if ((value & 0x04) && _phase == kPhaseReset)
+        exitReset();
+}
+
+void FloppyEmulator::enterReset() {
+    _stats.resets++;
+    noticeLostInterrupt();
+    _phase = kPhaseReset;
+    _event = kEventNone;
+    _senseCount = 0;
+    _resultLength = 0;
+
+    // Seeks in progress stop where they are.
+    for (UInt8 i = 0; i < kFloppyEmuDrives; i++)
+        _drives[i].seekEnd = kFloppyEmuNever;
+
+    // LOCK keeps CONFIGURE settings across resets.
+    if (!_locked) {
+        _configure[0] = 0x20;
+        _configure[1] = 0;
+    }
+}
+
+void FloppyEmulator::exitReset() {
+    _phase = kPhaseIdle;
+    _event = kEventReset;
+    _eventTime = FloppyShimGetTime() + kFloppyEmuResetNs;
+    _eventInterrupt = true;
+}
+
+void FloppyEmulator::raiseInterrupt() {
+    // IRQ line is only driven with DMA and interrupts enabled in the DOR.
+    if (!(_dor & 0x08))
+        return;
+    _stats.interrupts++;
+    if (_interruptHandler)
+        _interruptHandler(_interruptContext);
+}
+
+/**
+ * Counts the time status sat without an interrupt as recovery, once the host comes for it.
+ */
+void FloppyEmulator::noticeLostInterrupt() {
+    if (_lostIrqTime == kFloppyEmuNever)
+        return;
+    _stats.recoveryNs += FloppyShimGetTime() - _lostIrqTime;
+    _lostIrqTime = kFloppyEmuNever;
+}
+
+UInt8 FloppyEmulator::getMsr() {
+    UInt8 msr = 0;
+    for (UInt8 i = 0; i < kFloppyEmuDrives; i++)
+        if (_drives[i].seekEnd != kFloppyEmuNever)
+            msr |= 1 << i;
+
+    switch (_phase) {
+        case kPhaseIdle:
+            msr |= kEmuMsrRqm;
+            break;
+        case kPhaseCommand:
+            msr |= kEmuMsrRqm | kEmuMsrBusy;
+            break;
+        case kPhaseExecution:
+            msr |= kEmuMsrBusy;
+            break;
+        case kPhaseResult:
+            msr |= kEmuMsrRqm | kEmuMsrDio | kEmuMsrBusy;
+            break;
+        default:
+            return 0;
+    }
+
+    // The controller takes a few microseconds to get ready for the next byte.
+    if (FloppyShimGetTime() < _rqmTime)
+        msr &= ~kEmuMsrRqm;
+    return msr;
+}
+
+void FloppyEmulator::writeFifo(UInt8 data) {
+    _rqmTime = FloppyShimGetTime() + kFloppyEmuRqmNs;
+    if (_phase == kPhaseIdle) {
+        _command[0] = data;
+        _commandLength = getCommandLength(data);
+        _commandIndex = 1;
+
+        if (_commandLength == 0) {
+            UInt8 invalid = kEmuSt0Invalid;
+            setResult(&invalid, 1);
+        } else if (_commandLength == 1) {
+            startCommand();
+        } else {
+            _phase = kPhaseCommand;
+        }
+    } else if (_phase == kPhaseCommand) {
+        _command[_commandIndex++] = data;
+        if (_commandIndex == _commandLength)
+            startCommand();
+    }
+}
+
+UInt8 FloppyEmulator::readFifo() {
+    if (_phase != kPhaseResult)
+        return 0x00;
+
+    _rqmTime = FloppyShimGetTime() + kFloppyEmuRqmNs;
+    noticeLostInterrupt();
+    UInt8 data = _result[_resultIndex++];
+    if (_resultIndex == _resultLength)
+        _phase = kPhaseIdle;
+    return data;
+}
+
+void FloppyEmulator::startCommand() {
+    UInt8 result[10];
+    UInt8 drive = _command[1] & 0x03;
+    UInt8 head = (_command[1] >> 2) & 0x01;
+
+    switch (_command[0] & 0x1F) {
+        case 0x03: // SPECIFY.
+            _specify[0] = _command[1];
+            _specify[1] = _command[2];
+            _phase = kPhaseIdle;
+            break;
+
+        case 0x04: // SENSE DRIVE STATUS.
+            result[0] = 0x28 | (head << 2) | drive;
+            if (_drives[drive].writeProtected)
+                result[0] |= 0x40;
+            if (_drives[drive].cylinder == 0)
+                result[0] |= 0x10;
+            setResult(result, 1);
+            break;
+
+        case 0x05: // WRITE DATA.
+        case 0x06: // READ DATA.
+        case 0x11: // SCAN EQUAL.
+        case 0x19: // SCAN LOW OR EQUAL.
+        case 0x1D: // SCAN HIGH OR EQUAL.
+            startReadWrite(_command[0] & 0x1F);
+            break;
+
+        case 0x07: // RECALIBRATE.
+            startSeek(drive, 0, true);
+            break;
+
+        case 0x08: // SENSE INTERRUPT.
+            _stats.senseInterrupts++;
+            noticeLostInterrupt();
+            if (_senseCount == 0) {
+                result[0] = kEmuSt0Invalid;
+                setResult(result, 1);
+                break;
+            }
+
+            result[0] = _senseSt0[0];
+            result[1] = _sensePcn[0];
+            _senseCount--;
+            memmove(_senseSt0, _senseSt0 + 1, _senseCount);
+            memmove(_sensePcn, _sensePcn + 1, _senseCount);
+            setResult(result, 2);
+            break;
+
+        case 0x0A: // READ ID.
+            startReadId();
+            break;
+
+        case 0x0D: // FORMAT TRACK.
+            startFormat();
+            break;
+
+        case 0x0E: // DUMPREG.
+            for (UInt8 i = 0; i < kFloppyEmuDrives; i++)
+                result[i] = _drives[i].pcn;
+            result[4] = _specify[0];
+            result[5] = _specify[1];
+            result[6] = _lastEot;
+            result[7] = _locked ? 0x80 : 0x00;
+            result[8] = _configure[0];
+            result[9] = _configure[1];
+            setResult(result, 10);
+            break;
+
+        case 0x0F: // SEEK.
+            startSeek(drive, _command[2], false);
+            break;
+
+        case 0x10: // VERSION.
+            result[0] = 0x90;
+            setResult(result, 1);
+            break;
+
+        case 0x12: // PERPENDICULAR MODE.
+            _phase = kPhaseIdle;
+            break;
+
+        case 0x13: // CONFIGURE.
+            _configure[0] = _command[2];
+            _configure[1] = _command[3];
+            _phase = kPhaseIdle;
+            break;
+
+        case 0x14: // LOCK.
+            _locked = (_command[0] & 0x80) != 0;
+            result[0] = _locked ? 0x10 : 0x00;
+            setResult(result, 1);
+            break;
+    }
+}
+
+/**
+ * Runs READ DATA or WRITE DATA. The whole command is worked out up front, with data moved
+ * through DMA immediately and the result phase scheduled for when the last sector passes the head.
+ */
+void FloppyEmulator::startReadWrite(UInt8 opcode) {
+    bool write = opcode == 0x05;
+    bool scan = opcode != 0x05 && opcode != 0x06;
+    UInt8 driveNumber = _command[1] & 0x03;
+    UInt8 headSelect = (_command[1] >> 2) & 0x01;
+    UInt8 cylinder = _command[2];
+    UInt8 head = _command[3];
+    UInt8 sector = _command[4];
+    UInt8 sizeCode = _command[5];
+    UInt8 eot = _command[6];
+    bool multiTrack = (_command[0] & 0x80) != 0;
+    bool mfm = (_command[0] & 0x40) != 0;
+    Drive *drive = &_drives[driveNumber];
+    UInt64 now = FloppyShimGetTime();
+    UInt64 end = now;
+    UInt64 firstSector = now;
+    UInt8 st0 = 0;
+    UInt8 st1 = 0;
+    UInt8 st2 = 0;
+    UInt8 endCylinder = cylinder;
+    UInt8 endHead = head;
+    UInt8 endSector = sector;
+    bool terminalCount = false;
+
+    _stats.dataCommands++;
+    _lastEot = eot;
+    _phase = kPhaseExecution;
+
+    // Without a spinning disk there are no index pulses, and the command never finishes.
+    if (!drive->present || !drive->mediaPresent || !(_dor & (0x10 << driveNumber)))
+        return;
+
+    if (_faults->check(kFloppyFaultDiskChange, cylinder, head, sector))
+        drive->diskChanged = true;
+
+    // Only DMA is emulated; the host never services PIO, so the first byte overruns.
+    if (_specify[1] & 0x01) {
+        st0 = kEmuSt0Abnormal;
+        st1 = kEmuSt1Overrun;
+        end = now + kFloppyEmuIdFieldNs;
+        goto finish;
+    }
+
+    if (write && (drive->writeProtected || _faults->check(kFloppyFaultWriteProtect, cylinder, head, sector))) {
+        st0 = kEmuSt0Abnormal;
+        st1 = kEmuSt1NotWrite;
+        end = now + kFloppyEmuIdFieldNs;
+        goto finish;
+    }
+
+    // Wrong data rate or encoding, or a spindle still coming up to speed: no IDs can be read at all.
+    if (now < drive->speedTime)
+        _stats.earlyCommands++;
+    if (_dataRate != kFloppyEmuDataRate || !mfm || now < drive->speedTime) {
+        st0 = kEmuSt0Abnormal;
+        st1 = kEmuSt1Missing;
+        end = now + 2 * kFloppyEmuRotationNs;
+        goto finish;
+    }
+
+    // No ID on the track matches; the controller gives up after two index pulses.
+    if (drive->cylinder != cylinder || head != headSelect || sizeCode != drive->sizeCode
+        || sector < 1 || sector > drive->sectors) {
+        st0 = kEmuSt0Abnormal;
+        st1 = kEmuSt1NoData;
+        st2 = drive->cylinder != cylinder ? kEmuSt2WrongCyl : 0;
+        end = now + 2 * kFloppyEmuRotationNs;
+        goto finish;
+    }
+
+    // A retry's wait for its first sector to come round again is recovery. A clean run waits once.
+    end = now + getTimeToSector(now, drive, sector);
+    firstSector = end;
+    if (_retryPending)
+        _stats.recoveryNs += end - now;
+    _retryPending = false;
+    while (true) {
+        endCylinder = cylinder;
+        endHead = headSelect;
+        endSector = sector;
+
+        if (_faults->check(kFloppyFaultMissingAddressMark, cylinder, headSelect, sector)) {
+            st0 = kEmuSt0Abnormal;
+            st1 = kEmuSt1Missing;
+            end += 2 * kFloppyEmuRotationNs;
+            break;
+        }
+        if (_faults->check(kFloppyFaultOverrun, cylinder, headSelect, sector)) {
+            st0 = kEmuSt0Abnormal;
+            st1 = kEmuSt1Overrun;
+            end += getSectorNs(drive) / 4;
+            break;
+        }
+        if (_faults->check(kFloppyFaultCrc, cylinder, headSelect, sector)) {
+            st0 = kEmuSt0Abnormal;
+            st1 = kEmuSt1Crc;
+            st2 = write ? 0 : kEmuSt2Crc;
+            end += getSectorNs(drive);
+            break;
+        }
+
+        // Move the sector, or take the pattern to scan it with. An unserviced DMA request is an overrun.
+        UInt32 sectorSize = 128U << sizeCode;
+        UInt32 lba = (cylinder * kFloppyEmuHeads + headSelect) * drive->sectors + sector - 1;
+        UInt8 *data = &drive->image[lba * sectorSize];
+        std::vector<UInt8> pattern(scan ? sectorSize : 0);
+        UInt32 moved = scan ? transferDma(false, &pattern[0], sectorSize, &terminalCount) : transferDma(!write, data, sectorSize, &terminalCount);
+        if (moved < sectorSize && !terminalCount) {
+            st0 = kEmuSt0Abnormal;
+            st1 = kEmuSt1Overrun;
+            end += getSectorNs(drive) / 4;
+            break;
+        }
+        end += getSectorNs(drive);
+
+        // Result points to the sector after the last one transferred.
+        if (sector == eot) {
+            if (multiTrack && headSelect == 0) {
+                endHead = 1;
+                endSector = 1;
+            } else {
+                endCylinder = cylinder + 1;
+                endHead = multiTrack ? 0 : headSelect;
+                endSector = 1;
+            }
+        } else {
+            endSector = sector + 1;
+        }
+
+        // Scans stop at the first sector meeting the condition. Bytes of 0xFF from either side match anything.
+        if (scan) {
+            bool equal = true;
+            bool satisfied = true;
+            for (UInt32 i = 0; i < sectorSize; i++) {
+                if (pattern[i] == 0xFF || data[i] == 0xFF)
+                    continue;
+                equal = equal && data[i] == pattern[i];
+                if ((opcode == 0x11 && data[i] != pattern[i]) || (opcode == 0x19 && data[i] > pattern[i]) || (opcode == 0x1D && data[i] < pattern[i]))
+                    satisfied = false;
+            }
+            if (satisfied) {
+                st2 = equal ? kEmuSt2ScanHit : 0;
+                break;
+            }
+            if (terminalCount || (sector == eot && !(multiTrack && headSelect == 0))) {
+                st2 = kEmuSt2ScanMiss;
+                break;
+            }
+        }
+
+        if (terminalCount)
+            break;
+
+        if (sector == eot) {
+            // Multi-track carries on with head 1 from sector 1.
+            if (multiTrack && headSelect == 0) {
+                headSelect = 1;
+                sector = 1;
+                end += getTimeToSector(end, drive, sector);
+                continue;
+            }
+
+            // Ran off the end of the track before the DMA count ran out.
+            st0 = kEmuSt0Abnormal;
+            st1 = kEmuSt1EndTrack;
+            break;
+        }
+        sector++;
+    }
+
+finish:
+    // A failed command's time past its first sector is lost, as is all of it if no sector was found.
+    if (st0 & kEmuSt0Abnormal) {
+        _stats.recoveryNs += end - firstSector;
+        _retryPending = true;
+    }
+    _pendingResult[0] = st0 | (headSelect << 2) | driveNumber;
+    _pendingResult[1] = st1;
+    _pendingResult[2] = st2;
+    _pendingResult[3] = endCylinder;
+    _pendingResult[4] = endHead;
+    _pendingResult[5] = endSector;
+    _pendingResult[6] = sizeCode;
+    scheduleResult(end, !_faults->check(kFloppyFaultLostIrq, cylinder, head, _command[4]));
+}
+
+void FloppyEmulator::startReadId() {
+    UInt8 driveNumber = _command[1] & 0x03;
+    UInt8 head = (_command[1] >> 2) & 0x01;
+    Drive *drive = &_drives[driveNumber];
+    UInt64 now = FloppyShimGetTime();
+
+    _stats.readIds++;
+    _phase = kPhaseExecution;
+    if (!drive->present || !drive->mediaPresent || !(_dor & (0x10 << driveNumber)))
+        return;
+
+    _pendingResult[0] = (head << 2) | driveNumber;
+    _pendingResult[1] = 0;
+    _pendingResult[2] = 0;
+    _pendingResult[3] = drive->cylinder;
+    _pendingResult[4] = head;
+    _pendingResult[6] = drive->sizeCode;
+
+    // The data separator can't lock onto ID fields until the spindle is up to speed.
+    if (now < drive->speedTime)
+        now = drive->speedTime;
+
+    if (_dataRate != kFloppyEmuDataRate || !(_command[0] & 0x40)) {
+        _pendingResult[0] |= kEmuSt0Abnormal;
+        _pendingResult[1] = kEmuSt1Missing;
+        _pendingResult[5] = 1;
+        scheduleResult(now + 2 * kFloppyEmuRotationNs, true);
+        return;
+    }
+
+    // Next ID field to come round under the head.
+    UInt64 position = now % kFloppyEmuRotationNs;
+    UInt8 slot = (UInt8)((position / getSectorNs(drive) + 1) % drive->sectors);
+    _pendingResult[5] = slot + 1;
+    scheduleResult(now + getTimeToSector(now, drive, slot + 1) + kFloppyEmuIdFieldNs,
+                   !_faults->check(kFloppyFaultLostIrq, drive->cylinder, head, slot + 1));
+}
+
+/**
+ * Runs FORMAT TRACK. The ID fields are fetched through DMA, and the track is rewritten from one index pulse to the next.
+ * Media keeps one layout for the whole disk, so a track formatted in a new layout reformats every track.
+ */
+void FloppyEmulator::startFormat() {
+    UInt8 driveNumber = _command[1] & 0x03;
+    UInt8 head = (_command[1] >> 2) & 0x01;
+    UInt8 sizeCode = _command[2];
+    UInt8 sectors = _command[3];
+    UInt8 fill = _command[5];
+    Drive *drive = &_drives[driveNumber];
+    UInt64 now = FloppyShimGetTime();
+    UInt64 end = now + (kFloppyEmuRotationNs - now % kFloppyEmuRotationNs) + kFloppyEmuRotationNs;
+    std::vector<UInt8> ids(sectors * 4);
+    bool terminalCount = false;
+    UInt8 st0 = 0;
+    UInt8 st1 = 0;
+
+    _stats.formats++;
+    _phase = kPhaseExecution;
+    if (!drive->present || !drive->mediaPresent || !(_dor & (0x10 << driveNumber)))
+        return;
+
+    if (drive->writeProtected) {
+        st0 = kEmuSt0Abnormal;
+        st1 = kEmuSt1NotWrite;
+        end = now + kFloppyEmuIdFieldNs;
+        goto finish;
+    }
+
+    // A track written off speed can't be read back.
+    if (now < drive->speedTime) {
+        _stats.earlyCommands++;
+        st0 = kEmuSt0Abnormal;
+        st1 = kEmuSt1Missing;
+        goto finish;
+    }
+
+    // Only DMA is emulated, and every ID must be there before the index pulse.
+    if ((_specify[1] & 0x01) || sectors == 0 || transferDma(false, &ids[0], (UInt32)ids.size(), &terminalCount) < ids.size()) {
+        st0 = kEmuSt0Abnormal;
+        st1 = kEmuSt1Overrun;
+        goto finish;
+    }
+
+    // Sectors are found by position in the image, so only IDs for this track in order can be laid down.
+    for (UInt8 i = 0; i < sectors; i++) {
+        if (ids[i * 4] != drive->cylinder || ids[i * 4 + 1] != head || ids[i * 4 + 2] != i + 1 || ids[i * 4 + 3] != sizeCode) {
+            st0 = kEmuSt0Abnormal;
+            st1 = kEmuSt1Missing;
+            goto finish;
+        }
+    }
+
+    if (drive->sectors != sectors || drive->sizeCode != sizeCode) {
+        drive->sectors = sectors;
+        drive->sizeCode = sizeCode;
+        drive->image.assign(kFloppyEmuCylinders * kFloppyEmuHeads * sectors * (128U << sizeCode), fill);
+    } else {
+        UInt32 trackBytes = sectors * (128U << sizeCode);
+        memset(&drive->image[(drive->cylinder * kFloppyEmuHeads + head) * trackBytes], fill, trackBytes);
+    }
+
+finish:
+    _pendingResult[0] = st0 | (head << 2) | driveNumber;
+    _pendingResult[1] = st1;
+    _pendingResult[2] = 0;
+    _pendingResult[3] = drive->cylinder;
+    _pendingResult[4] = head;
+    _pendingResult[5] = sectors;
+    _pendingResult[6] = sizeCode;
+    scheduleResult(end, true);
+}
+
+void FloppyEmulator::startSeek(UInt8 driveNumber, UInt8 target, bool recalibrate) {
+    Drive *drive = &_drives[driveNumber];
+    UInt8 head = (_command[1] >> 2) & 0x01;
+    UInt8 stepRate = 16 - (_specify[0] >> 4);
+    UInt32 steps;
+
+    if (recalibrate)
+        _stats.recalibrates++;
+    else
+        _stats.seeks++;
+    _phase = kPhaseIdle;
+
+    drive->seekSt0 = kEmuSt0SeekEnd | (head << 2) | driveNumber;
+    drive->seekCylinder = drive->cylinder;
+    if (recalibrate) {
+        // Track 0 is not found if the heads start further out than the step limit.
+        steps = drive->cylinder;
+        if (!drive->present || steps > kFloppyEmuMaxRecalSteps) {
+            steps = kFloppyEmuMaxRecalSteps;
+            drive->seekSt0 |= kEmuSt0Abnormal | kEmuSt0Check;
+            if (drive->present)
+                drive->seekCylinder = drive->cylinder - kFloppyEmuMaxRecalSteps;
+        } else {
+            drive->seekCylinder = 0;
+        }
+    } else {
+        steps = target > drive->cylinder ? target - drive->cylinder : drive->cylinder - target;
+        drive->seekCylinder = target;
+    }
+
+    if (_faults->check(kFloppyFaultSeek, target, head, kFloppyFaultAny)) {
+        drive->seekSt0 |= kEmuSt0Abnormal;
+        drive->seekCylinder = drive->cylinder;
+    }
+
+    drive->seekStepped = drive->seekCylinder != drive->cylinder;
+    drive->seekInterrupt = !_faults->check(kFloppyFaultLostIrq, target, head, kFloppyFaultAny);
+    drive->seekEnd = FloppyShimGetTime() + steps * stepRate * 1000000ULL + 1000;
+
+    // Clean runs never recalibrate, and a failed seek has to be made again.
+    if (recalibrate || (drive->seekSt0 & kEmuSt0Abnormal))
+        _stats.recoveryNs += drive->seekEnd - FloppyShimGetTime();
+
+    // Controller keeps its own idea of the head position.
+    drive->pcn = recalibrate ? 0 : target;
+}
+
+void FloppyEmulator::finishSeek(UInt8 driveNumber) {
+    Drive *drive = &_drives[driveNumber];
+    drive->seekEnd = kFloppyEmuNever;
+
+    // Step pulses with media in the drive clear the disk change line.
+    if (drive->seekStepped && drive->mediaPresent)
+        drive->diskChanged = false;
+    drive->cylinder = drive->seekCylinder;
+    if (drive->seekSt0 & kEmuSt0Abnormal)
+        drive->pcn = drive->cylinder;
+
+    addSenseStatus(drive->seekSt0, drive->pcn);
+    if (drive->seekInterrupt)
+        raiseInterrupt();
+    else {
+        _stats.lostInterrupts++;
+        _lostIrqTime = FloppyShimGetTime();
+    }
+}
+
+void FloppyEmulator::setResult(const UInt8 *bytes, UInt8 length) {
+    memcpy(_result, bytes, length);
+    _resultLength = length;
+    _resultIndex = 0;
+    _phase = kPhaseResult;
+}
+
+void FloppyEmulator::scheduleResult(UInt64 time, bool interrupt) {
+    _phase = kPhaseExecution;
+    _event = kEventResult;
+    _eventTime = time;
+    _eventInterrupt = interrupt;
+    if (!interrupt)
+        _stats.lostInterrupts++;
+}
+
+void FloppyEmulator::addSenseStatus(UInt8 st0, UInt8 pcn) {
+    if (_senseCount >= kFloppyEmuDrives)
+        return;
+    _senseSt0[_senseCount] = st0;
+    _sensePcn[_senseCount] = pcn;
+    _senseCount++;
+}
+
+/**
+ * Gets the time until the start of a sector's ID field.
+ */
+UInt64 FloppyEmulator::getTimeToSector(UInt64 now, const Drive *drive, UInt8 sector) {
+    UInt64 position = now % kFloppyEmuRotationNs;
+    UInt64 start = (sector - 1) * getSectorNs(drive);
+    return (start + kFloppyEmuRotationNs - position) % kFloppyEmuRotationNs;
+}
+
+/**
+ * Moves bytes through the floppy DMA channel. Stops early if the channel is masked
+ * or its count runs out, which raises terminal count.
+ */
+UInt32 FloppyEmulator::transferDma(bool toMemory, UInt8 *data, UInt32 length, bool *terminalCount) {
+    DmaChannel *channel = &_dma[_dmaChannel];
+    UInt8 type = channel->mode & kEmuDmaModeMask;
+    bool copy = toMemory ? type == kEmuDmaModeWrite : type == kEmuDmaModeRead;
+    UInt32 moved = 0;
+
+    *terminalCount = false;
+    if (channel->masked)
+        return 0;
+
+    while (moved < length) {
+        // Address wraps within the 64KB page.
+        UInt8 *memory = FloppyShimPhysicalToVirtual(((UInt32)channel->page << 16) | channel->address, 1);
+        if (copy && memory) {
+            if (toMemory)
+                *memory = data[moved];
+            else
+                data[moved] = *memory;
+        }
+        moved++;
+        channel->address++;
+
+        if (channel->count-- == 0) {
+            *terminalCount = true;
+            if (channel->mode & kEmuDmaAutoInit) {
+                channel->address = channel->baseAddress;
+                channel->count = channel->baseCount;
+            } else {
+                channel->masked = true;
+            }
+            break;
+        }
+    }
+    return moved;
+}
+
+UInt8 FloppyEmulator::readDmaPort(UInt16 port) {
+    if (port <= 0x07) {
+        DmaChannel *channel = &_dma[port >> 1];
+        UInt16 value = (port & 0x01) ? channel->count : channel->address;
+        UInt8 data = _dmaFlipFlop ? value >> 8 : value & 0xFF;
+        _dmaFlipFlop = !_dmaFlipFlop;
+        return data;
+    }
+
+    for (UInt8 i = 0; i < 4; i++)
+        if (port == dmaPagePorts[i])
+            return _dma[i].page;
+    return port == 0x08 ? 0x00 : 0xFF;
+}
+
+void FloppyEmulator::writeDmaPort(UInt16 port, UInt8 data) {
+    if (port <= 0x07) {
+        DmaChannel *channel = &_dma[port >> 1];
+        UInt16 *base = (port & 0x01) ? &channel->baseCount : &channel->baseAddress;
+        if (_dmaFlipFlop)
+            *base = (*base & 0x00FF) | (data << 8);
+        else
+            *base = (*base & 0xFF00) | data;
+        _dmaFlipFlop = !_dmaFlipFlop;
+
+        // Writes load both the base and current registers.
+        if (port & 0x01)
+            channel->count = channel->baseCount;
+        else
+            channel->address = channel->baseAddress;
+        return;
+    }
+
+    switch (port) {
+        case 0x0A: // Single mask.
+            _dma[data & 0x03].masked = (data & 0x04) != 0;
+            break;
+        case 0x0B: // Mode.
+            _dma[data & 0x03].mode = data;
+            break;
+        case 0x0C: // Clear flip-flop.
+            _dmaFlipFlop = false;
+            break;
+        case 0x0D: // Master clear.
+            for (UInt8 i = 0; i < 4; i++)
+                _dma[i].masked = true;
+            _dmaFlipFlop = false;
+            break;
+        case 0x0E: // Clear all masks.
+            for (UInt8 i = 0; i < 4; i++)
+                _dma[i].masked = false;
+            break;
+        case 0x0F: // Write all masks.
+            for (UInt8 i = 0; i < 4; i++)
+                _dma[i].masked = (data >> i) & 0x01;
+            break;
+        default:
+            for (UInt8 i = 0; i < 4; i++)
+                if (port == dmaPagePorts[i])
+                    _dma[i].page = data;
+            break;
+    }
+}
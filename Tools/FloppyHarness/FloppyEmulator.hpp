@@ -0,0 +1,216 @@
+/*
+ * File: FloppyEmulator.hpp
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FloppyEmulator_hpp
+#define FloppyEmulator_hpp
+
+#include <IOKit/IOTypes.h>
+#include <vector>
+
+#include "FloppyShim.h"
+#include "FloppyFaultInjector.hpp"
+
+// Emulated media geometry (1.44MB). Sectors per track and sector size change if the media is formatted differently.
+#define kFloppyEmuCylinders     80
+#define kFloppyEmuHeads         2
+#define kFloppyEmuSectors       18
+#define kFloppyEmuSectorSize    512
+#define kFloppyEmuSizeCode      2
+#define kFloppyEmuDataRate      0 // 500 Kbps.
+
+// Drive timing.
+#define kFloppyEmuRotationNs    200000000ULL // 300 RPM.
+#define kFloppyEmuIdFieldNs     300000ULL
+#define kFloppyEmuResetNs       10000ULL
+#define kFloppyEmuRqmNs         8000ULL // RQM drops after each FIFO byte.
+#define kFloppyEmuSpinUpNs      300000000ULL // Drives are specified to reach speed within 500 ms.
+#define kFloppyEmuMaxRecalSteps 79
+
+#define kFloppyEmuDrives        4
+#define kFloppyEmuNever         UINT64_MAX
+
+// Counters for commands run by the controller.
+typedef struct {
+    UInt32 dataCommands;
+    UInt32 readIds;
+    UInt32 seeks;
+    UInt32 recalibrates;
+    UInt32 senseInterrupts;
+    UInt32 resets;
+    UInt32 interrupts;
+    UInt32 lostInterrupts;
+    UInt32 formats;
+    UInt32 earlyCommands; // Data and format commands started before the spindle reached speed.
+    UInt64 recoveryNs; // Time spent failing, retrying, recalibrating and waiting for a lost interrupt to be noticed.
+} FloppyEmulatorStats;
+
+typedef void (*FloppyEmulatorInterruptHandler)(void *context);
+
+// Intel 82077AA and the first 8237 DMA controller, with drives attached. DMA mode only.
+class FloppyEmulator : public FloppyShimDevice {
+public:
+    FloppyEmulator(UInt16 ioBase, UInt8 dmaChannel, FloppyFaultInjector *faults);
+
+    // Port I/O.
+    UInt8 readPort(UInt16 port);
+    void writePort(UInt16 port, UInt8 data);
+
+    // FloppyShimDevice.
+    virtual UInt64 nextEventTime();
+    virtual void runEvents(UInt64 now);
+
+    void setInterruptHandler(FloppyEmulatorInterruptHandler handler, void *context);
+
+    // Drives and media. Drive 0 is a 1.44MB drive with formatted media by default.
+    // Drive 1 is attached, with formatted media, when the CMOS gives it a type.
+    void setCmosDriveTypes(UInt8 types);
+    void insertMedia(UInt8 drive, bool writeProtected, UInt8 sectors = kFloppyEmuSectors, UInt8 sizeCode = kFloppyEmuSizeCode);
+    void ejectMedia(UInt8 drive);
+    // Images are linear, so 512-byte blocks sit at the same offsets whatever the sector size.
+    UInt8 *getImage(UInt8 drive) { return _drives[drive].image.empty() ? NULL : &_drives[drive].image[0]; }
+    UInt32 getImageSize(UInt8 drive) { return (UInt32)_drives[drive].image.size(); }
+
+    const FloppyEmulatorStats &getStats() const { return _stats; }
+
+    // Contents of freshly inserted media.
+    static UInt8 getPatternByte(UInt32 lba, UInt32 offset) { return (UInt8)((lba * 151 + offset * 7 + (offset >> 8)) ^ 0x5A); }
+
+private:
+    // Controller phases.
+    enum {
+        kPhaseReset,
+        kPhaseIdle,
+        kPhaseCommand,
+        kPhaseExecution,
+        kPhaseResult
+    };
+
+    // Work left to finish when the execution event fires.
+    enum {
+        kEventNone,
+        kEventReset,
+        kEventResult
+    };
+
+    typedef struct {
+        bool present;
+        bool mediaPresent;
+        bool writeProtected;
+        bool diskChanged;
+        UInt8 cylinder; // Physical head position.
+        UInt8 pcn; // Present cylinder number held by the controller.
+        UInt64 seekEnd; // Pending SEEK or RECALIBRATE, or kFloppyEmuNever.
+        UInt8 seekSt0;
+        UInt8 seekCylinder;
+        bool seekStepped;
+        bool seekInterrupt;
+        UInt64 speedTime; // When the spindle reaches speed after the motor was turned on.
+        UInt8 sectors; // Sectors per track on the media.
+        UInt8 sizeCode; // Sector size on the media, as N.
+        std::vector<UInt8> image;
+    } Drive;
+
+    typedef struct {
+        UInt16 baseAddress;
+        UInt16 baseCount;
+        UInt16 address;
+        UInt16 count;
+        UInt8 page;
+        UInt8 mode;
+        bool masked;
+    } DmaChannel;
+
+    UInt16 _ioBase;
+    UInt8 _dmaChannel;
+    FloppyFaultInjector *_faults;
+    FloppyEmulatorInterruptHandler _interruptHandler;
+    void *_interruptContext;
+    FloppyEmulatorStats _stats;
+
+    // Controller registers.
+    UInt8 _dor;
+    UInt8 _dataRate;
+    UInt8 _phase;
+    UInt8 _command[9];
+    UInt8 _commandLength;
+    UInt8 _commandIndex;
+    UInt8 _result[10];
+    UInt8 _resultLength;
+    UInt8 _resultIndex;
+    UInt8 _specify[2];
+    UInt8 _configure[2];
+    bool _locked;
+    UInt8 _lastEot;
+    UInt64 _rqmTime;
+
+    // Recovery accounting.
+    bool _retryPending; // The last data command failed, so the next one waits for its sector again.
+    UInt64 _lostIrqTime; // When status was left without an interrupt, or kFloppyEmuNever.
+
+    // Pending execution event.
+    UInt8 _event;
+    UInt64 _eventTime;
+    bool _eventInterrupt;
+    UInt8 _pendingResult[7];
+
+    // Interrupt status for SENSE INTERRUPT.
+    UInt8 _senseSt0[kFloppyEmuDrives];
+    UInt8 _sensePcn[kFloppyEmuDrives];
+    UInt8 _senseCount;
+
+    Drive _drives[kFloppyEmuDrives];
+
+    // DMA controller and CMOS.
+    DmaChannel _dma[4];
+    bool _dmaFlipFlop;
+    UInt8 _cmosIndex;
+    UInt8 _cmosDriveTypes;
+
+    void writeDor(UInt8 value);
+    void enterReset();
+    void exitReset();
+    void raiseInterrupt();
+    void noticeLostInterrupt();
+    void writeFifo(UInt8 data);
+    UInt8 readFifo();
+    UInt8 getMsr();
+
+    void startCommand();
+    void startReadWrite(UInt8 opcode);
+    void startReadId();
+    void startFormat();
+    void startSeek(UInt8 drive, UInt8 target, bool recalibrate);
+    void setResult(const UInt8 *bytes, UInt8 length);
+    void scheduleResult(UInt64 time, bool interrupt);
+    void finishSeek(UInt8 drive);
+    void addSenseStatus(UInt8 st0, UInt8 pcn);
+
+    UInt64 getSectorNs(const Drive *drive) { return kFloppyEmuRotationNs / drive->sectors; }
+    UInt64 getTimeToSector(UInt64 now, const Drive *drive, UInt8 sector);
+    UInt32 transferDma(bool toMemory, UInt8 *data, UInt32 length, bool *terminalCount);
+    UInt8 readDmaPort(UInt16 port);
+    void writeDmaPort(UInt16 port, UInt8 data);
+};
+
+#endif /* FloppyEmulator_hpp */
@@ -0,0 +1,253 @@
+/*
+ * File: FloppyFaultBench.cpp
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "FloppyHarness.hpp"
+
+#define kBenchBlocksPerCylinder (kFloppyEmuHeads * kFloppyEmuSectors)
+
+// A run of the workload with a set of faults.
+typedef struct {
+    const char *name;
+    bool write;
+    const char *faults[4];
+} FloppyBenchScenario;
+
+// Fault sites sit inside the default workload of cylinders 4-7.
+static const FloppyBenchScenario scenarios[] = {
+    { "none-read",      false,  { NULL } },
+    { "none-write",     true,   { NULL } },
+    { "crc",            false,  { "crc:c=5,h=0,s=7", NULL } },
+    { "missing-am",     false,  { "missing-am:c=5,h=0,s=7", NULL } },
+    { "overrun",        false,  { "overrun:c=5,h=0,s=7", NULL } },
+    { "lost-irq",       false,  { "lost-irq:c=5", NULL } },
+    { "disk-change",    false,  { "disk-change:c=5", NULL } },
+    { "seek",           false,  { "seek:c=5", NULL } },
+    { "write-protect",  true,   { "write-protect:c=5", NULL } }
+};
+
+typedef struct {
+    IOReturn status;
+    bool dataGood;
+    UInt32 hits;
+    FloppyEmulatorStats stats;
+    UInt64 elapsedNs;
+} FloppyBenchResult;
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-s seed] [-c cylinder] [-n cylinders] [-f fault]... [-v]\n", name);
+    fprintf(stderr, "  -s seed       Seed for faults with a rate below 1 (default 1).\n");
+    fprintf(stderr, "  -c cylinder   First cylinder of the workload (default 4).\n");
+    fprintf(stderr, "  -n cylinders  Number of cylinders to transfer (default 4).\n");
+    fprintf(stderr, "  -f fault      Run a single custom scenario; may be repeated.\n");
+    fprintf(stderr, "                Format: type[:c=N,h=N,s=N,rate=R,limit=N], * is a wildcard.\n");
+    fprintf(stderr, "                Types: crc missing-am overrun lost-irq disk-change seek write-protect.\n");
+    fprintf(stderr, "  -w            Custom scenario writes instead of reads.\n");
+    fprintf(stderr, "  -v            Log driver output.\n");
+}
+
+/**
+ * Runs the workload on a freshly started controller, with faults armed after bring-up.
+ */
+static bool runScenario(UInt64 seed, const std::vector<FloppyFault> &faults, bool write,
+                        UInt32 firstCylinder, UInt32 cylinders, FloppyBenchResult *result) {
+    FloppyFaultInjector injector(seed);
+    FloppyHarness harness(&injector);
+    if (!harness.start())
+        return false;
+
+    UInt64 block = firstCylinder * kBenchBlocksPerCylinder;
+    UInt64 nblks = cylinders * kBenchBlocksPerCylinder;
+    std::vector<UInt8> data(nblks * kFloppyEmuSectorSize);
+    for (UInt64 i = 0; i < nblks; i++)
+        for (UInt32 j = 0; j < kFloppyEmuSectorSize; j++)
+            data[i * kFloppyEmuSectorSize + j] = write ? ~FloppyEmulator::getPatternByte((UInt32)(block + i), j) : 0;
+
+    for (size_t i = 0; i < faults.size(); i++)
+        injector.addFault(faults[i]);
+    injector.setArmed(true);
+
+    // Counters cover the workload only, not bring-up.
+    FloppyEmulatorStats before = harness.getEmulator()->getStats();
+
+    UInt64 start = FloppyShimGetTime();
+    result->status = harness.readWrite(write, block, nblks, &data[0]);
+    result->elapsedNs = FloppyShimGetTime() - start;
+    result->hits = injector.getTotalHits();
+    const FloppyEmulatorStats &after = harness.getEmulator()->getStats();
+    result->stats.dataCommands = after.dataCommands - before.dataCommands;
+    result->stats.readIds = after.readIds - before.readIds;
+    result->stats.seeks = after.seeks - before.seeks;
+    result->stats.recalibrates = after.recalibrates - before.recalibrates;
+    result->stats.senseInterrupts = after.senseInterrupts - before.senseInterrupts;
+    result->stats.resets = after.resets - before.resets;
+    result->stats.interrupts = after.interrupts - before.interrupts;
+    result->stats.lostInterrupts = after.lostInterrupts - before.lostInterrupts;
+    result->stats.recoveryNs = after.recoveryNs - before.recoveryNs;
+
+    // Read data must match the media; written data must have reached it.
+    result->dataGood = true;
+    UInt8 *image = harness.getEmulator()->getImage(0);
+    for (UInt64 i = 0; i < nblks && result->dataGood; i++) {
+        for (UInt32 j = 0; j < kFloppyEmuSectorSize; j++) {
+            UInt32 offset = (UInt32)(i * kFloppyEmuSectorSize + j);
+            UInt8 expected = write ? data[offset] : FloppyEmulator::getPatternByte((UInt32)(block + i), j);
+            UInt8 actual = write ? image[block * kFloppyEmuSectorSize + offset] : data[offset];
+            if (expected != actual) {
+                result->dataGood = false;
+                break;
+            }
+        }
+    }
+
+    harness.stop();
+    return true;
+}
+
+static const char *getStatusName(IOReturn status) {
+    switch (status) {
+        case kIOReturnSuccess:      return "success";
+        case kIOReturnNoMedia:      return "no-media";
+        case kIOReturnNotWritable:  return "not-writable";
+        case kIOReturnTimeout:      return "timeout";
+        case kIOReturnAborted:      return "aborted";
+        case kIOReturnDMAError:     return "dma-error";
+        case kIOReturnNotResponding: return "stalled";
+        default:                    return "error";
+    }
+}
+
+static void printResult(const char *name, const FloppyBenchResult *result, bool faulted) {
+    printf("%-14s %-12s %-4s %4u %5u %5u %5u %6u %4u %10.1f", name,
+           getStatusName(result->status), result->status == kIOReturnSuccess ? (result->dataGood ? "ok" : "BAD") : "-",
+           result->hits, result->stats.dataCommands, result->stats.seeks, result->stats.recalibrates,
+           result->stats.resets, result->stats.lostInterrupts, result->elapsedNs / 1000000.0);
+
+    // Recovery is the time the emulator saw go on failed commands, retries, recalibrates and lost interrupts.
+    // Elapsed time against a clean run isn't used, as a fault also shifts where later commands catch the disk.
+    // Failed requests only have time to fail.
+    if (!faulted || result->status != kIOReturnSuccess) {
+        printf(" %10s %6s\n", "-", "-");
+        return;
+    }
+    double recoveryMs = result->stats.recoveryNs / 1000000.0;
+    printf(" %10.1f %6.1f\n", recoveryMs, recoveryMs * 1000000.0 / kFloppyEmuRotationNs);
+}
+
+int main(int argc, char **argv) {
+    UInt64 seed = 1;
+    UInt32 firstCylinder = 4;
+    UInt32 cylinders = 4;
+    bool customWrite = false;
+    std::vector<FloppyFault> customFaults;
+    int option;
+
+    while ((option = getopt(argc, argv, "s:c:n:f:wvh")) != -1) {
+        FloppyFault fault;
+        switch (option) {
+            case 's':
+                seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'c':
+                firstCylinder = (UInt32)strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                cylinders = (UInt32)strtoul(optarg, NULL, 0);
+                break;
+            case 'f':
+                if (!FloppyFaultInjector::parseFault(optarg, &fault)) {
+                    fprintf(stderr, "Invalid fault: %s\n", optarg);
+                    return 1;
+                }
+                customFaults.push_back(fault);
+                break;
+            case 'w':
+                customWrite = true;
+                break;
+            case 'v':
+                FloppyShimSetLogging(true);
+                break;
+            default:
+                usage(argv[0]);
+                return option == 'h' ? 0 : 1;
+        }
+    }
+
+    if (cylinders == 0 || firstCylinder + cylinders > kFloppyEmuCylinders) {
+        fprintf(stderr, "Workload must fit within %u cylinders.\n", kFloppyEmuCylinders);
+        return 1;
+    }
+
+    printf("Workload: %s cylinders %u-%u, seed %llu, %.0f ms per revolution.\n\n",
+           customFaults.empty() ? "read/write" : (customWrite ? "write" : "read"),
+           firstCylinder, firstCylinder + cylinders - 1, seed, kFloppyEmuRotationNs / 1000000.0);
+    printf("%-14s %-12s %-4s %4s %5s %5s %5s %6s %4s %10s %10s %6s\n", "scenario", "status", "data",
+           "hits", "cmds", "seeks", "recal", "resets", "lost", "elapsed-ms", "recover-ms", "revs");
+
+    // Clean runs are shown for comparison.
+    std::vector<FloppyFault> noFaults;
+    FloppyBenchResult baselines[2];
+    for (UInt8 i = 0; i < 2; i++) {
+        if (!runScenario(seed, noFaults, i == 1, firstCylinder, cylinders, &baselines[i])) {
+            fprintf(stderr, "Failed to start the controller.\n");
+            return 1;
+        }
+    }
+
+    if (!customFaults.empty()) {
+        FloppyBenchResult result;
+        if (!runScenario(seed, customFaults, customWrite, firstCylinder, cylinders, &result))
+            return 1;
+        printResult(customWrite ? "none-write" : "none-read", &baselines[customWrite ? 1 : 0], false);
+        printResult("custom", &result, true);
+        return 0;
+    }
+
+    for (size_t i = 0; i < sizeof (scenarios) / sizeof (scenarios[0]); i++) {
+        const FloppyBenchScenario *scenario = &scenarios[i];
+        const FloppyBenchResult *baseline = &baselines[scenario->write ? 1 : 0];
+        if (!scenario->faults[0]) {
+            printResult(scenario->name, baseline, false);
+            continue;
+        }
+
+        std::vector<FloppyFault> faults;
+        for (UInt8 j = 0; scenario->faults[j]; j++) {
+            FloppyFault fault;
+            FloppyFaultInjector::parseFault(scenario->faults[j], &fault);
+            faults.push_back(fault);
+        }
+
+        FloppyBenchResult result;
+        if (!runScenario(seed, faults, scenario->write, firstCylinder, cylinders, &result))
+            return 1;
+        printResult(scenario->name, &result, true);
+    }
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * File: FloppyFaultInjector.cpp
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "FloppyFaultInjector.hpp"
+
+static const char *faultTypeNames[kFloppyFaultTypeCount] = {
+    "crc", "missing-am", "overrun", "lost-irq", "disk-change", "seek", "write-protect"
+};
+
+FloppyFaultInjector::FloppyFaultInjector(UInt64 seed) {
+    // Xorshift state must not be zero.
+    _state = seed ? seed : 0x9E3779B97F4A7C15ULL;
+    _armed = false;
+    bzero(_hits, sizeof (_hits));
+}
+
+void FloppyFaultInjector::addFault(const FloppyFault &fault) {
+    _faults.push_back(fault);
+    _faults.back().hits = 0;
+}
+
+void FloppyFaultInjector::clearFaults() {
+    _faults.clear();
+    bzero(_hits, sizeof (_hits));
+}
+
+bool FloppyFaultInjector::check(UInt8 type, int cylinder, int head, int sector) {
+    if (!_armed)
+        return false;
+
+    for (size_t i = 0; i < _faults.size(); i++) {
+        FloppyFault *fault = &_faults[i];
+        if (fault->type != type || (fault->limit && fault->hits >= fault->limit))
+            continue;
+        if ((fault->cylinder != kFloppyFaultAny && fault->cylinder != cylinder)
+            || (fault->head != kFloppyFaultAny && fault->head != head)
+            || (fault->sector != kFloppyFaultAny && fault->sector != sector))
+            continue;
+
+        // Only draw when the outcome depends on it, so certain faults don't shift the sequence.
+        if (fault->rate < 1.0 && nextRandom() >= fault->rate)
+            continue;
+
+        fault->hits++;
+        _hits[type]++;
+        return true;
+    }
+    return false;
+}
+
+UInt32 FloppyFaultInjector::getTotalHits() const {
+    UInt32 total = 0;
+    for (UInt8 i = 0; i < kFloppyFaultTypeCount; i++)
+        total += _hits[i];
+    return total;
+}
+
+/**
+ * Gets the next number in [0, 1) from a xorshift64* generator.
+ */
+double FloppyFaultInjector::nextRandom() {
+    _state ^= _state >> 12;
+    _state ^= _state << 25;
+    _state ^= _state >> 27;
+    return ((_state * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+bool FloppyFaultInjector::parseFault(const char *spec, FloppyFault *fault) {
+    std::string text(spec);
+    std::string typeName = text.substr(0, text.find(':'));
+
+    fault->type = kFloppyFaultTypeCount;
+    for (UInt8 i = 0; i < kFloppyFaultTypeCount; i++) {
+        if (typeName == faultTypeNames[i])
+            fault->type = i;
+    }
+    if (fault->type == kFloppyFaultTypeCount)
+        return false;
+
+    fault->cylinder = kFloppyFaultAny;
+    fault->head = kFloppyFaultAny;
+    fault->sector = kFloppyFaultAny;
+    fault->rate = 1.0;
+    fault->limit = 1;
+    fault->hits = 0;
+    if (text.find(':') == std::string::npos)
+        return true;
+
+    // Parse comma separated key=value fields.
+    std::string fields = text.substr(text.find(':') + 1);
+    size_t start = 0;
+    while (start < fields.length()) {
+        size_t end = fields.find(',', start);
+        if (end == std::string::npos)
+            end = fields.length();
+        std::string field = fields.substr(start, end - start);
+        start = end + 1;
+
+        size_t equals = field.find('=');
+        if (equals == std::string::npos)
+            return false;
+        std::string key = field.substr(0, equals);
+        std::string value = field.substr(equals + 1);
+        bool any = value == "*";
+
+        if (key == "c")
+            fault->cylinder = any ? kFloppyFaultAny : atoi(value.c_str());
+        else if (key == "h")
+            fault->head = any ? kFloppyFaultAny : atoi(value.c_str());
+        else if (key == "s")
+            fault->sector = any ? kFloppyFaultAny : atoi(value.c_str());
+        else if (key == "rate")
+            fault->rate = atof(value.c_str());
+        else if (key == "limit")
+            fault->limit = (UInt32)strtoul(value.c_str(), NULL, 0);
+        else
+            return false;
+    }
+    return fault->rate >= 0.0 && fault->rate <= 1.0;
+}
+
+const char *FloppyFaultInjector::getTypeName(UInt8 type) {
+    return type < kFloppyFaultTypeCount ? faultTypeNames[type] : "none";
+}
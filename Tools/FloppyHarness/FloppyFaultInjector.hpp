@@ -0,0 +1,87 @@
+/*
+ * File: FloppyFaultInjector.hpp
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FloppyFaultInjector_hpp
+#define FloppyFaultInjector_hpp
+
+#include <IOKit/IOTypes.h>
+#include <vector>
+
+// Fault types.
+enum {
+    kFloppyFaultCrc                 = 0, // CRC error in the data field (ID field when writing).
+    kFloppyFaultMissingAddressMark  = 1, // Sector ID not found; the controller gives up after two index pulses.
+    kFloppyFaultOverrun             = 2, // DMA not serviced in time part way through a sector.
+    kFloppyFaultLostIrq             = 3, // Command completes but its interrupt never arrives.
+    kFloppyFaultDiskChange          = 4, // Disk change line latches as the command starts.
+    kFloppyFaultSeek                = 5, // SEEK or RECALIBRATE ends abnormally without moving the heads.
+    kFloppyFaultWriteProtect        = 6, // Write protect sensed for the command.
+    kFloppyFaultTypeCount
+};
+
+// Wildcard for fault sites.
+#define kFloppyFaultAny -1
+
+// A fault and where it applies. Sites use command cylinder/head/sector; seeks use the target cylinder.
+typedef struct {
+    UInt8 type;
+    SInt16 cylinder;
+    SInt8 head;
+    SInt8 sector;
+    double rate;    // Chance of firing each time the site is reached, 0-1.
+    UInt32 limit;   // Number of times it can fire, or 0 for no limit.
+    UInt32 hits;
+} FloppyFault;
+
+// Decides deterministically, from a seed, where faults fire.
+class FloppyFaultInjector {
+public:
+    FloppyFaultInjector(UInt64 seed = 1);
+
+    void addFault(const FloppyFault &fault);
+    void clearFaults();
+
+    // Faults only fire while armed, so bring-up can run clean.
+    void setArmed(bool armed) { _armed = armed; }
+
+    // Checks if a fault of the type fires at the site. Each call is one opportunity.
+    bool check(UInt8 type, int cylinder, int head, int sector);
+
+    UInt32 getHits(UInt8 type) const { return type < kFloppyFaultTypeCount ? _hits[type] : 0; }
+    UInt32 getTotalHits() const;
+
+    // Parses "type:c=5,h=0,s=7,rate=0.5,limit=1". Missing fields are wildcards, rate 1 and limit 1.
+    static bool parseFault(const char *spec, FloppyFault *fault);
+    static const char *getTypeName(UInt8 type);
+
+private:
+    std::vector<FloppyFault> _faults;
+    UInt64 _state;
+    bool _armed;
+    UInt32 _hits[kFloppyFaultTypeCount];
+
+    double nextRandom();
+};
+
+#endif /* FloppyFaultInjector_hpp */
@@ -0,0 +1,201 @@
+/*
+ * File: FloppyHarness.cpp
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+
+#include "FloppyHarness.hpp"
+#include "VoodooFloppyController.hpp"
+#include "VoodooFloppyStorageDevice.hpp"
+
+// Port I/O cost on the ISA bus.
+#define kFloppyHarnessPortIoNs  1000
+
+// Time given for controller bring-up before requests are accepted.
+#define kFloppyHarnessBringUpNs 1000000ULL
+
+kmod_info_t kmod_info = { "VoodooFloppy", "harness" };
+
+static FloppyEmulator *sEmulator;
+
+void FloppyHarnessOutb(uint16_t port, uint8_t data) {
+    FloppyShimAdvanceTime(kFloppyHarnessPortIoNs);
+    if (sEmulator)
+        sEmulator->writePort(port, data);
+}
+
+uint8_t FloppyHarnessInb(uint16_t port) {
+    FloppyShimAdvanceTime(kFloppyHarnessPortIoNs);
+    return sEmulator ? sEmulator->readPort(port) : 0xFF;
+}
+
+typedef struct {
+    bool done;
+    IOReturn status;
+    UInt64 actualByteCount;
+} FloppyHarnessRequest;
+
+FloppyHarness::FloppyHarness(FloppyFaultInjector *faults) {
+    _faults = faults;
+    _cmosDriveTypes = 0x40;
+    _emulator = NULL;
+    _nub = NULL;
+    _controller = NULL;
+    _device = NULL;
+}
+
+FloppyHarness::~FloppyHarness() {
+    stop();
+}
+
+bool FloppyHarness::start() {
+    FloppyShimResetTime(0);
+    _emulator = new FloppyEmulator(FLOPPY_BASE_PRIMARY, FLOPPY_DMA_CHANNEL, _faults);
+    _emulator->setInterruptHandler(interruptHandler, this);
+    _emulator->setCmosDriveTypes(_cmosDriveTypes);
+    sEmulator = _emulator;
+    FloppyShimSetDevice(_emulator);
+
+    // Stand-in for the ACPI device the controller matches on.
+    _nub = new IOService;
+    _nub->init();
+
+    // Personality as in Info.plist. Only DMA is emulated.
+    OSDictionary *personality = OSDictionary::withCapacity(4);
+    OSNumber *maxGateHold = OSNumber::withNumber(250, 32);
+    OSString *transferMode = OSString::withCString(kFloppyTransferModeDma);
+    personality->setObject(kFloppyPropertyMaxGateHoldKey, maxGateHold);
+    personality->setObject(kFloppyPropertyTransferModeKey, transferMode);
+    personality->setObject(kFloppyPropertyPioPollingKey, kOSBooleanFalse);
+    maxGateHold->release();
+    transferMode->release();
+
+    SInt32 score = 0;
+    _controller = OSTypeAlloc(VoodooFloppyController);
+    bool started = _controller->init(personality) && _controller->attach(_nub)
+        && _controller->probe(_nub, &score) && _controller->start(_nub);
+    personality->release();
+    if (!started)
+        goto fail;
+
+    // Bring-up runs on the work loop, from a timer just after start.
+    runFor(kFloppyHarnessBringUpNs);
+    _device = OSDynamicCast(VoodooFloppyStorageDevice, _controller->getClient());
+    if (!_device)
+        goto fail;
+    return true;
+
+fail:
+    IOLog("FloppyHarness: Failed to start controller.\n");
+    stop();
+    return false;
+}
+
+void FloppyHarness::stop() {
+    if (_controller) {
+        _controller->stop(_nub);
+        _controller->detach(_nub);
+    }
+    OSSafeReleaseNULL(_controller);
+    OSSafeReleaseNULL(_nub);
+    _device = NULL;
+
+    FloppyShimSetDevice(NULL);
+    sEmulator = NULL;
+    delete _emulator;
+    _emulator = NULL;
+}
+
+IOReturn FloppyHarness::readWrite(bool write, UInt64 block, UInt64 nblks, UInt8 *data) {
+    IOByteCount length = nblks * kFloppyEmuSectorSize;
+    IOBufferMemoryDescriptor *buffer = IOBufferMemoryDescriptor::withCapacity(length, write ? kIODirectionOut : kIODirectionIn);
+    if (!buffer)
+        return kIOReturnNoMemory;
+    if (write)
+        buffer->writeBytes(0, data, length);
+
+    FloppyHarnessRequest request = { false, kIOReturnSuccess, 0 };
+    IOStorageCompletion completion = { this, completionHandler, &request };
+    IOStorageAttributes attributes = { kIOStorageOptionNone, kIOStoragePriorityDefault, 0, 0 };
+    IOReturn status = _device->doAsyncReadWrite(buffer, block, nblks, &attributes, &completion);
+    if (status != kIOReturnSuccess) {
+        buffer->release();
+        return status;
+    }
+
+    // Keep the work loops going until the request completes.
+    while (!request.done) {
+        if (!runOnce(kFloppyEmuNever)) {
+            IOLog("FloppyHarness: Request stalled with nothing left to run.\n");
+            buffer->release();
+            return kIOReturnNotResponding;
+        }
+    }
+
+    if (!write)
+        buffer->readBytes(0, data, length);
+    buffer->release();
+    return request.status;
+}
+
+void FloppyHarness::runFor(UInt64 nanoseconds) {
+    UInt64 end = FloppyShimGetTime() + nanoseconds;
+    while (runOnce(end));
+    if (FloppyShimGetTime() < end)
+        FloppyShimAdvanceTimeTo(end);
+}
+
+/**
+ * Runs ready event sources, or advances to the next timer or device event before the limit.
+ * @return True if anything ran; otherwise false.
+ */
+bool FloppyHarness::runOnce(UInt64 limit) {
+    if (IOWorkLoop::runAll())
+        return true;
+
+    UInt64 next = IOWorkLoop::nextDeadlineAll();
+    if (!next)
+        next = kFloppyEmuNever;
+    if (_emulator && _emulator->nextEventTime() < next)
+        next = _emulator->nextEventTime();
+    if (next == kFloppyEmuNever || next > limit)
+        return false;
+
+    if (next > FloppyShimGetTime())
+        FloppyShimAdvanceTimeTo(next);
+    return true;
+}
+
+void FloppyHarness::interruptHandler(void *context) {
+    FloppyHarness *harness = (FloppyHarness*)context;
+    if (harness->_nub)
+        harness->_nub->deliverInterrupt(0);
+}
+
+void FloppyHarness::completionHandler(void *target, void *parameter, IOReturn status, UInt64 actualByteCount) {
+    FloppyHarnessRequest *request = (FloppyHarnessRequest*)parameter;
+    request->status = status;
+    request->actualByteCount = actualByteCount;
+    request->done = true;
+}
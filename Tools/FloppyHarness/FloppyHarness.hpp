@@ -0,0 +1,71 @@
+/*
+ * File: FloppyHarness.hpp
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FloppyHarness_hpp
+#define FloppyHarness_hpp
+
+#include "FloppyEmulator.hpp"
+#include "FloppyFaultInjector.hpp"
+
+class IOService;
+class VoodooFloppyController;
+class VoodooFloppyStorageDevice;
+
+// Runs the driver against the emulated controller on the virtual clock.
+class FloppyHarness {
+public:
+    FloppyHarness(FloppyFaultInjector *faults);
+    ~FloppyHarness();
+
+    // Drive types given by the CMOS at start. Only drive A is attached by default.
+    void setCmosDriveTypes(UInt8 types) { _cmosDriveTypes = types; }
+
+    // Matches and starts the controller, then lets bring-up finish.
+    bool start();
+    void stop();
+
+    // Runs a request to completion through the storage device.
+    IOReturn readWrite(bool write, UInt64 block, UInt64 nblks, UInt8 *data);
+
+    // Runs the work loops for a span of virtual time.
+    void runFor(UInt64 nanoseconds);
+
+    FloppyEmulator *getEmulator() { return _emulator; }
+    VoodooFloppyController *getController() { return _controller; }
+    VoodooFloppyStorageDevice *getDevice() { return _device; }
+
+private:
+    FloppyFaultInjector *_faults;
+    UInt8 _cmosDriveTypes;
+    FloppyEmulator *_emulator;
+    IOService *_nub;
+    VoodooFloppyController *_controller;
+    VoodooFloppyStorageDevice *_device;
+
+    static void interruptHandler(void *context);
+    static void completionHandler(void *target, void *parameter, IOReturn status, UInt64 actualByteCount);
+    bool runOnce(UInt64 limit);
+};
+
+#endif /* FloppyHarness_hpp */
@@ -0,0 +1,572 @@
+/*
+ * File: FloppyMicroBench.cpp
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <new>
+#include <vector>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+
+#include "FloppyShim.h"
+#include "VoodooFloppyController.hpp"
+#include "VoodooFloppyStorageDevice.hpp"
+
+// Inputs are drawn from a fixed seed, so runs are comparable.
+#define kMicroBenchSeed         1
+#define kMicroBenchInputCount   4096
+#define kMicroBenchRequestCount 64
+#define kMicroBenchBlockSize    512
+#define kMicroBenchMediaBlocks  2880
+
+// Largest client buffer a single chunk touches: one cylinder of 1024-byte sectors.
+#define kMicroBenchBufferSize   (2 * 10 * 1024)
+
+kmod_info_t kmod_info = { "VoodooFloppy", "microbench" };
+
+// The controller is never started. Port I/O goes to a stand-in that is always ready, so only CPU time is measured.
+static UInt8 sMsr = FLOPPY_MSR_RQM;
+
+void FloppyHarnessOutb(uint16_t port, uint8_t data) {
+}
+
+uint8_t FloppyHarnessInb(uint16_t port) {
+    return port == FLOPPY_BASE_PRIMARY + FLOPPY_REG_MSR ? sMsr : 0;
+}
+
+// C++ heap allocations, such as OSObjects. Counted along with the shim's IOMalloc calls.
+static UInt64 sNewCount = 0;
+
+void *operator new(size_t size) {
+    sNewCount++;
+    void *address = malloc(size ? size : 1);
+    if (!address)
+        throw std::bad_alloc();
+    return address;
+}
+
+void operator delete(void *address) noexcept {
+    free(address);
+}
+
+static UInt64 getAllocations() {
+    return sNewCount + FloppyShimGetAllocations();
+}
+
+// Keeps results live so the compiler can't drop the work.
+static volatile UInt64 sSink;
+
+class FloppyMicroBench;
+typedef void (FloppyMicroBench::*FloppyMicroBenchFunction)(UInt64 iterations, UInt32 size, UInt8 sizeCode);
+
+// A routine and its input. Size is in bytes or blocks depending on the routine.
+typedef struct {
+    const char *name;
+    FloppyMicroBenchFunction function;
+    UInt32 size;
+    UInt8 sizeCode;
+    const char *description;
+} FloppyMicroBenchCase;
+
+class FloppyMicroBench {
+public:
+    FloppyMicroBench();
+    ~FloppyMicroBench();
+
+    bool setUp();
+
+    // Routines under test. Each runs the given number of operations.
+    void runLbaToChs(UInt64 iterations, UInt32 size, UInt8 sizeCode);
+    void runParseError(UInt64 iterations, UInt32 size, UInt8 sizeCode);
+    void runSendCommand(UInt64 iterations, UInt32 size, UInt8 sizeCode);
+    void runReadResult(UInt64 iterations, UInt32 size, UInt8 sizeCode);
+    void runReadBytes(UInt64 iterations, UInt32 size, UInt8 sizeCode);
+    void runWriteBytes(UInt64 iterations, UInt32 size, UInt8 sizeCode);
+    void runHashSector(UInt64 iterations, UInt32 size, UInt8 sizeCode);
+    void runPredictSector(UInt64 iterations, UInt32 size, UInt8 sizeCode);
+    void runMirrorRead(UInt64 iterations, UInt32 size, UInt8 sizeCode);
+    void runElidedWrite(UInt64 iterations, UInt32 size, UInt8 sizeCode);
+
+    bool getFailed() { return _failed; }
+
+private:
+    VoodooFloppyController *_controller;
+    VoodooFloppyStorageDevice *_device;
+    IOBufferMemoryDescriptor *_dmaMemory;
+    IOBufferMemoryDescriptor *_readBuffer;
+    IOBufferMemoryDescriptor *_writeBuffers[kMicroBenchRequestCount];
+    UInt8 _scratch[kMicroBenchBufferSize];
+    UInt8 _mediaSizeCode;
+    bool _failed;
+
+    // Realistic inputs.
+    UInt64 _random;
+    std::vector<UInt32> _lbas;
+    std::vector<UInt8> _statuses;
+    FloppyRequest _requests[kMicroBenchRequestCount];
+
+    UInt32 nextRandom();
+    void buildLbaStream();
+    void buildStatuses();
+    bool setMedia(UInt8 sizeCode);
+    void freeMedia();
+    bool buildRequests(UInt32 blocks, bool write);
+    void runChunks(UInt64 iterations);
+};
+
+FloppyMicroBench::FloppyMicroBench() {
+    _controller = NULL;
+    _device = NULL;
+    _dmaMemory = NULL;
+    _readBuffer = NULL;
+    bzero(_writeBuffers, sizeof (_writeBuffers));
+    bzero(_requests, sizeof (_requests));
+    _mediaSizeCode = FLOPPY_BYTES_SECTOR_UNKNOWN;
+    _failed = false;
+    _random = kMicroBenchSeed;
+}
+
+FloppyMicroBench::~FloppyMicroBench() {
+    freeMedia();
+    for (UInt32 i = 0; i < kMicroBenchRequestCount; i++)
+        OSSafeReleaseNULL(_writeBuffers[i]);
+    OSSafeReleaseNULL(_readBuffer);
+    if (_controller) {
+        _controller->_dmaBuffer = NULL;
+        OSSafeReleaseNULL(_controller->_tmrMotorOffSource);
+    }
+    OSSafeReleaseNULL(_dmaMemory);
+    if (_device)
+        _device->detach(_controller);
+    OSSafeReleaseNULL(_device);
+    OSSafeReleaseNULL(_controller);
+}
+
+/**
+ * Creates a controller with drive A selected, as it would be mid-request, without starting it.
+ */
+bool FloppyMicroBench::setUp() {
+    _controller = OSTypeAlloc(VoodooFloppyController);
+    if (!_controller || !_controller->init())
+        return false;
+
+    _device = OSTypeAlloc(VoodooFloppyStorageDevice);
+    OSDictionary *properties = OSDictionary::withCapacity(2);
+    OSNumber *driveId = OSNumber::withNumber((UInt64)0, 8);
+    OSNumber *driveType = OSNumber::withNumber(FLOPPY_TYPE_1440_35, 8);
+    properties->setObject(kFloppyPropertyDriveIdKey, driveId);
+    properties->setObject(FLOPPY_IOREG_DRIVE_TYPE, driveType);
+    driveId->release();
+    driveType->release();
+    bool attached = _device && _device->init(properties) && _device->attach(_controller);
+    properties->release();
+    if (!attached)
+        return false;
+
+    // Mirror hits and elided writes start the motor to check for a disk change. The timer is never run.
+    _controller->_tmrMotorOffSource = IOTimerEventSource::timerEventSource(_controller, NULL);
+    _dmaMemory = IOBufferMemoryDescriptor::withCapacity(FLOPPY_DMALENGTH, kIODirectionInOut);
+    _readBuffer = IOBufferMemoryDescriptor::withCapacity(kMicroBenchBufferSize, kIODirectionIn);
+    if (!_controller->_tmrMotorOffSource || !_dmaMemory || !_readBuffer)
+        return false;
+
+    _controller->_currentDevice = _device;
+    _controller->_driveADevice = _device;
+    _controller->_dmaBuffer = (UInt8*)_dmaMemory->getBytesNoCopy();
+    _controller->_useDma = true;
+    _controller->_controllerReady = true;
+    _controller->_driveState[0].cylinder = 0;
+
+    buildLbaStream();
+    buildStatuses();
+    return setMedia(FLOPPY_BYTES_SECTOR_512);
+}
+
+UInt32 FloppyMicroBench::nextRandom() {
+    _random = _random * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (UInt32)(_random >> 33);
+}
+
+/**
+ * Physical sectors in the order readWriteChunk converts them, for a mix of filesystem requests.
+ * Most are single metadata blocks; the rest are 4KB allocation blocks and whole-cylinder reads.
+ */
+void FloppyMicroBench::buildLbaStream() {
+    while (_lbas.size() < kMicroBenchInputCount) {
+        UInt32 pick = nextRandom() % 100;
+        UInt32 count = pick < 60 ? 1 : pick < 85 ? 8 : 36;
+        UInt32 start = nextRandom() % (kMicroBenchMediaBlocks - count);
+        for (UInt32 i = 0; i < count; i++)
+            _lbas.push_back(start + i);
+    }
+}
+
+/**
+ * Status bytes as READ DATA and WRITE DATA return them. Nearly all commands succeed, on either head.
+ */
+void FloppyMicroBench::buildStatuses() {
+    static const struct {
+        UInt8 weight;
+        UInt8 st0, st1, st2;
+    } kinds[] = {
+        { 48, 0x00, 0x00, 0x00 },
+        { 48, FLOPPY_ST0_ACTIVE_HEAD, 0x00, 0x00 },
+        { 1,  FLOPPY_ST0_IC_ABNORMAL, FLOPPY_ST1_DATA_ERROR, FLOPPY_ST2_DATA_ERROR_IN_FIELD },
+        { 1,  FLOPPY_ST0_IC_ABNORMAL, FLOPPY_ST1_MISSING_ADDR_MARK, 0x00 },
+        { 1,  FLOPPY_ST0_IC_ABNORMAL, FLOPPY_ST1_OVERRUN_UNDERRUN, 0x00 },
+        { 1,  FLOPPY_ST0_IC_ABNORMAL, FLOPPY_ST1_NOT_WRITABLE, 0x00 }
+    };
+
+    while (_statuses.size() < kMicroBenchInputCount * 3) {
+        UInt32 pick = nextRandom() % 100;
+        UInt32 i = 0;
+        while (pick >= kinds[i].weight) {
+            pick -= kinds[i].weight;
+            i++;
+        }
+        _statuses.push_back(kinds[i].st0);
+        _statuses.push_back(kinds[i].st1);
+        _statuses.push_back(kinds[i].st2);
+    }
+}
+
+/**
+ * Puts media of the given sector size in drive A, fully mirrored in RAM with every sector hash known.
+ */
+bool FloppyMicroBench::setMedia(UInt8 sizeCode) {
+    if (sizeCode == _mediaSizeCode)
+        return true;
+    freeMedia();
+
+    const FloppyMediaFormat *format = _controller->findMediaFormat(FLOPPY_SPEED_500KBPS, sizeCode);
+    if (!format)
+        return false;
+    _controller->_driveState[0].format = format;
+
+    FloppyDriveState *driveState = &_controller->_driveState[0];
+    UInt32 sectors = format->cylinders * 2 * format->sectorsPerTrack;
+    UInt32 sectorSize = FLOPPY_SECTOR_SIZE(sizeCode);
+    driveState->mirror = (UInt8*)IOMalloc(sectors * sectorSize);
+    driveState->mirrorValid = (UInt8*)IOMalloc(sectors);
+    UInt64 *sectorHashes = _controller->getSectorHashes(true);
+    if (!driveState->mirror || !driveState->mirrorValid || !sectorHashes)
+        return false;
+
+    driveState->mirrorSectors = sectors;
+    driveState->mirrorBlockSize = sectorSize;
+    driveState->mirrorCylinder = format->cylinders;
+    memset(driveState->mirrorValid, 1, sectors);
+    for (UInt32 i = 0; i < sectors * sectorSize; i++)
+        driveState->mirror[i] = (UInt8)((i / kMicroBenchBlockSize) * 151 + i * 7);
+    for (UInt32 lba = 0; lba < sectors && lba < kFloppyHashSectors; lba++)
+        sectorHashes[lba] = _controller->hashSector(driveState->mirror + lba * sectorSize, sectorSize);
+
+    _mediaSizeCode = sizeCode;
+    return true;
+}
+
+void FloppyMicroBench::freeMedia() {
+    if (!_controller)
+        return;
+
+    FloppyDriveState *driveState = &_controller->_driveState[0];
+    if (driveState->mirror)
+        IOFree(driveState->mirror, driveState->mirrorSectors * driveState->mirrorBlockSize);
+    if (driveState->mirrorValid)
+        IOFree(driveState->mirrorValid, driveState->mirrorSectors);
+    if (driveState->sectorHashes)
+        IOFree(driveState->sectorHashes, kFloppyHashSectors * sizeof (UInt64));
+    driveState->mirror = NULL;
+    driveState->mirrorValid = NULL;
+    driveState->sectorHashes = NULL;
+    driveState->mirrorSectors = 0;
+    driveState->mirrorCylinder = kFloppyMirrorStopped;
+    _mediaSizeCode = FLOPPY_BYTES_SECTOR_UNKNOWN;
+}
+
+/**
+ * Builds requests of the given length that each fit in one cylinder, at varying offsets into it.
+ * Writes carry what the media already holds, so every sector is elided.
+ */
+bool FloppyMicroBench::buildRequests(UInt32 blocks, bool write) {
+    const FloppyMediaFormat *format = _controller->getFormat();
+    UInt32 sectorSize = FLOPPY_SECTOR_SIZE(format->sizeCode);
+    UInt32 cylinderBlocks = 2 * format->sectorsPerTrack * (sectorSize / kMicroBenchBlockSize);
+    if (blocks > cylinderBlocks)
+        return false;
+
+    for (UInt32 i = 0; i < kMicroBenchRequestCount; i++) {
+        FloppyRequest *request = &_requests[i];
+        bzero(request, sizeof (*request));
+        request->device = _device;
+        request->block = (nextRandom() % format->cylinders) * cylinderBlocks + nextRandom() % (cylinderBlocks - blocks + 1);
+        request->nblks = blocks;
+        request->buffer = _readBuffer;
+
+        if (write) {
+            if (!_writeBuffers[i])
+                _writeBuffers[i] = IOBufferMemoryDescriptor::withCapacity(kMicroBenchBufferSize, kIODirectionOut);
+            if (!_writeBuffers[i])
+                return false;
+            _writeBuffers[i]->writeBytes(0, _controller->_driveState[0].mirror + request->block * kMicroBenchBlockSize, blocks * kMicroBenchBlockSize);
+            request->buffer = _writeBuffers[i];
+        }
+    }
+    return true;
+}
+
+void FloppyMicroBench::runChunks(UInt64 iterations) {
+    for (UInt64 i = 0; i < iterations; i++) {
+        FloppyRequest *request = &_requests[i % kMicroBenchRequestCount];
+        request->blocksDone = 0;
+        if (_controller->readWriteChunk(request) != kIOReturnSuccess || request->blocksDone != request->nblks)
+            _failed = true;
+    }
+}
+
+void FloppyMicroBench::runLbaToChs(UInt64 iterations, UInt32 size, UInt8 sizeCode) {
+    UInt64 sum = 0;
+    for (UInt64 i = 0; i < iterations; i++) {
+        UInt16 cyl, head, sector;
+        _controller->lbaToChs(_lbas[i % kMicroBenchInputCount], &cyl, &head, &sector);
+        sum += cyl + head + sector;
+    }
+    sSink = sum;
+}
+
+void FloppyMicroBench::runParseError(UInt64 iterations, UInt32 size, UInt8 sizeCode) {
+    UInt64 sum = 0;
+    for (UInt64 i = 0; i < iterations; i++) {
+        const UInt8 *status = &_statuses[(i % kMicroBenchInputCount) * 3];
+        sum += _controller->parseError(status[0], status[1], status[2]);
+    }
+    sSink = sum;
+}
+
+void FloppyMicroBench::runSendCommand(UInt64 iterations, UInt32 size, UInt8 sizeCode) {
+    UInt8 command[9] = { FLOPPY_CMD_READ_DATA | FLOPPY_CMD_EXT_MFM, 0, 0, 0, 1, FLOPPY_BYTES_SECTOR_512, 18, FLOPPY_GAP3_3_5, 0xFF };
+    sMsr = FLOPPY_MSR_RQM;
+    for (UInt64 i = 0; i < iterations; i++) {
+        UInt32 lba = _lbas[i % kMicroBenchInputCount];
+        command[2] = lba / 36;
+        command[4] = lba % 18 + 1;
+        if (!_controller->sendCommand(command, sizeof (command)))
+            _failed = true;
+    }
+}
+
+void FloppyMicroBench::runReadResult(UInt64 iterations, UInt32 size, UInt8 sizeCode) {
+    UInt8 result[7];
+    UInt64 sum = 0;
+    sMsr = FLOPPY_MSR_RQM | FLOPPY_MSR_DIO | FLOPPY_MSR_CMD_BUSY;
+    for (UInt64 i = 0; i < iterations; i++) {
+        if (!_controller->readResult(result, sizeof (result)))
+            _failed = true;
+        sum += result[0];
+    }
+    sMsr = FLOPPY_MSR_RQM;
+    sSink = sum;
+}
+
+void FloppyMicroBench::runReadBytes(UInt64 iterations, UInt32 size, UInt8 sizeCode) {
+    for (UInt64 i = 0; i < iterations; i++) {
+        if (_readBuffer->readBytes(0, _controller->_dmaBuffer, size) != size)
+            _failed = true;
+    }
+}
+
+void FloppyMicroBench::runWriteBytes(UInt64 iterations, UInt32 size, UInt8 sizeCode) {
+    for (UInt64 i = 0; i < iterations; i++) {
+        if (_readBuffer->writeBytes(0, _controller->_dmaBuffer, size) != size)
+            _failed = true;
+    }
+}
+
+void FloppyMicroBench::runHashSector(UInt64 iterations, UInt32 size, UInt8 sizeCode) {
+    const UInt8 *mirror = _controller->_driveState[0].mirror;
+    UInt32 sectors = kMicroBenchMediaBlocks * kMicroBenchBlockSize / size;
+    UInt64 sum = 0;
+    for (UInt64 i = 0; i < iterations; i++)
+        sum += _controller->hashSector(mirror + (_lbas[i % kMicroBenchInputCount] % sectors) * size, size);
+    sSink = sum;
+}
+
+void FloppyMicroBench::runPredictSector(UInt64 iterations, UInt32 size, UInt8 sizeCode) {
+    FloppyDriveState *driveState = &_controller->_driveState[0];
+    driveState->rotationTime = mach_absolute_time();
+    UInt64 sum = 0;
+    for (UInt64 i = 0; i < iterations; i++) {
+        driveState->rotationSector = _lbas[i % kMicroBenchInputCount] % 18 + 1;
+        sum += _controller->predictSector();
+    }
+    driveState->rotationSector = 0;
+    sSink = sum;
+}
+
+void FloppyMicroBench::runMirrorRead(UInt64 iterations, UInt32 size, UInt8 sizeCode) {
+    if (!setMedia(sizeCode) || !buildRequests(size, false)) {
+        _failed = true;
+        return;
+    }
+    runChunks(iterations);
+}
+
+void FloppyMicroBench::runElidedWrite(UInt64 iterations, UInt32 size, UInt8 sizeCode) {
+    if (!setMedia(sizeCode) || !buildRequests(size, true)) {
+        _failed = true;
+        return;
+    }
+    runChunks(iterations);
+}
+
+static const FloppyMicroBenchCase cases[] = {
+    { "lba-to-chs",         &FloppyMicroBench::runLbaToChs,      0,     FLOPPY_BYTES_SECTOR_512,  "per sector, request-mix LBAs" },
+    { "parse-error",        &FloppyMicroBench::runParseError,    0,     FLOPPY_BYTES_SECTOR_512,  "per result, 4% errors" },
+    { "send-command",       &FloppyMicroBench::runSendCommand,   0,     FLOPPY_BYTES_SECTOR_512,  "9-byte READ DATA" },
+    { "read-result",        &FloppyMicroBench::runReadResult,    0,     FLOPPY_BYTES_SECTOR_512,  "7-byte result phase" },
+    { "read-bytes-512",     &FloppyMicroBench::runReadBytes,     512,   FLOPPY_BYTES_SECTOR_512,  "client to DMA buffer" },
+    { "read-bytes-9216",    &FloppyMicroBench::runReadBytes,     9216,  FLOPPY_BYTES_SECTOR_512,  "one track" },
+    { "read-bytes-18432",   &FloppyMicroBench::runReadBytes,     18432, FLOPPY_BYTES_SECTOR_512,  "one cylinder" },
+    { "write-bytes-512",    &FloppyMicroBench::runWriteBytes,    512,   FLOPPY_BYTES_SECTOR_512,  "DMA buffer to client" },
+    { "write-bytes-9216",   &FloppyMicroBench::runWriteBytes,    9216,  FLOPPY_BYTES_SECTOR_512,  "one track" },
+    { "write-bytes-18432",  &FloppyMicroBench::runWriteBytes,    18432, FLOPPY_BYTES_SECTOR_512,  "one cylinder" },
+    { "hash-sector-512",    &FloppyMicroBench::runHashSector,    512,   FLOPPY_BYTES_SECTOR_512,  "write elision hash" },
+    { "hash-sector-1024",   &FloppyMicroBench::runHashSector,    1024,  FLOPPY_BYTES_SECTOR_512,  "write elision hash" },
+    { "predict-sector",     &FloppyMicroBench::runPredictSector, 0,     FLOPPY_BYTES_SECTOR_512,  "rotation estimate" },
+    { "mirror-read-1",      &FloppyMicroBench::runMirrorRead,    1,     FLOPPY_BYTES_SECTOR_512,  "readWriteChunk, mirrored" },
+    { "mirror-read-8",      &FloppyMicroBench::runMirrorRead,    8,     FLOPPY_BYTES_SECTOR_512,  "readWriteChunk, mirrored" },
+    { "mirror-read-36",     &FloppyMicroBench::runMirrorRead,    36,    FLOPPY_BYTES_SECTOR_512,  "readWriteChunk, mirrored" },
+    { "mirror-read-1k-7",   &FloppyMicroBench::runMirrorRead,    7,     FLOPPY_BYTES_SECTOR_1024, "1024-byte sectors, split edges" },
+    { "elided-write-1",     &FloppyMicroBench::runElidedWrite,   1,     FLOPPY_BYTES_SECTOR_512,  "readWriteChunk, unchanged data" },
+    { "elided-write-8",     &FloppyMicroBench::runElidedWrite,   8,     FLOPPY_BYTES_SECTOR_512,  "readWriteChunk, unchanged data" },
+    { "elided-write-36",    &FloppyMicroBench::runElidedWrite,   36,    FLOPPY_BYTES_SECTOR_512,  "readWriteChunk, unchanged data" },
+    { "elided-write-1k-7",  &FloppyMicroBench::runElidedWrite,   7,     FLOPPY_BYTES_SECTOR_1024, "1024-byte sectors, merged edges" }
+};
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-t ms] [-r repeats] [-b name]... [-l]\n", name);
+    fprintf(stderr, "  -t ms       Time to spend on each benchmark (default 200).\n");
+    fprintf(stderr, "  -r repeats  Timed runs per benchmark; the fastest is reported (default 5).\n");
+    fprintf(stderr, "  -b name     Only run benchmarks whose name starts with this; may be repeated.\n");
+    fprintf(stderr, "  -l          List benchmarks.\n");
+}
+
+static UInt64 getNanoseconds() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Runs a case for a number of operations.
+ * @return Elapsed wall time in nanoseconds.
+ */
+static UInt64 timeCase(FloppyMicroBench *bench, const FloppyMicroBenchCase *benchCase, UInt64 iterations, UInt64 *allocations) {
+    UInt64 startAllocations = getAllocations();
+    UInt64 start = getNanoseconds();
+    (bench->*benchCase->function)(iterations, benchCase->size, benchCase->sizeCode);
+    UInt64 elapsed = getNanoseconds() - start;
+    if (allocations)
+        *allocations = getAllocations() - startAllocations;
+    return elapsed;
+}
+
+int main(int argc, char **argv) {
+    UInt32 budgetMs = 200;
+    UInt32 repeats = 5;
+    std::vector<const char*> filters;
+
+    int option;
+    while ((option = getopt(argc, argv, "t:r:b:lh")) != -1) {
+        switch (option) {
+            case 't':
+                budgetMs = (UInt32)strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                repeats = (UInt32)strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                filters.push_back(optarg);
+                break;
+            case 'l':
+                for (size_t i = 0; i < sizeof (cases) / sizeof (cases[0]); i++)
+                    printf("%-18s %s\n", cases[i].name, cases[i].description);
+                return 0;
+            default:
+                usage(argv[0]);
+                return option == 'h' ? 0 : 1;
+        }
+    }
+    if (!budgetMs || !repeats) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FloppyMicroBench bench;
+    if (!bench.setUp()) {
+        fprintf(stderr, "Failed to set up the controller.\n");
+        return 1;
+    }
+
+    printf("%-18s %10s %12s %12s  %s\n", "benchmark", "ns/op", "allocs/op", "ops", "input");
+    bool failed = false;
+    for (size_t i = 0; i < sizeof (cases) / sizeof (cases[0]); i++) {
+        const FloppyMicroBenchCase *benchCase = &cases[i];
+        bool selected = filters.empty();
+        for (size_t j = 0; j < filters.size() && !selected; j++)
+            selected = strncmp(benchCase->name, filters[j], strlen(filters[j])) == 0;
+        if (!selected)
+            continue;
+
+        // Grow the run until it fills its share of the budget. This also warms the caches.
+        UInt64 runNs = (UInt64)budgetMs * 1000000 / repeats;
+        UInt64 iterations = 1;
+        UInt64 elapsed;
+        while ((elapsed = timeCase(&bench, benchCase, iterations, NULL)) < runNs / 2 && iterations < (1ULL << 40))
+            iterations *= 2;
+        if (elapsed && elapsed < runNs)
+            iterations = iterations * runNs / elapsed;
+
+        // Report the fastest run, as slower ones were disturbed by something else.
+        UInt64 best = UINT64_MAX;
+        UInt64 allocations = 0;
+        for (UInt32 run = 0; run < repeats; run++) {
+            UInt64 runAllocations;
+            elapsed = timeCase(&bench, benchCase, iterations, &runAllocations);
+            if (elapsed < best) {
+                best = elapsed;
+                allocations = runAllocations;
+            }
+        }
+
+        if (bench.getFailed()) {
+            printf("%-18s %10s %12s %12s  %s\n", benchCase->name, "failed", "-", "-", benchCase->description);
+            failed = true;
+            break;
+        }
+        printf("%-18s %10.1f %12.2f %12llu  %s\n", benchCase->name, (double)best / iterations,
+               (double)allocations / iterations, iterations, benchCase->description);
+    }
+    return failed ? 1 : 0;
+}
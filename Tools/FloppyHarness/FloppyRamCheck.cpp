@@ -0,0 +1,344 @@
+/*
+ * File: FloppyRamCheck.cpp
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+
+#include "FloppyShim.h"
+#include "VoodooFloppyController.hpp"
+#include "VoodooFloppyRamStorageDevice.hpp"
+
+#define kRamCheckBlockSize      512
+#define kRamCheckStartNs        1000000000ULL
+#define kRamCheckSmallBlocks    1440 // 720KB media, 9 blocks per track.
+
+// A request through the device, and what became of it.
+typedef struct {
+    IOBufferMemoryDescriptor *buffer;
+    bool done;
+    IOReturn status;
+    UInt64 actualByteCount;
+    UInt64 completeTime;
+    UInt32 order;
+} FloppyRamCheckRequest;
+
+static UInt32 sChecks = 0;
+static UInt32 sFailures = 0;
+static UInt32 sCompletions = 0;
+
+static void check(bool passed, const char *name) {
+    sChecks++;
+    if (!passed)
+        sFailures++;
+    printf("%-4s %s\n", passed ? "ok" : "FAIL", name);
+}
+
+static UInt8 getPatternByte(UInt64 block, UInt32 offset, UInt8 seed) {
+    return (UInt8)((block * 151 + offset * 7 + (offset >> 8)) ^ seed);
+}
+
+static void completionHandler(void *target, void *parameter, IOReturn status, UInt64 actualByteCount) {
+    FloppyRamCheckRequest *request = (FloppyRamCheckRequest*)parameter;
+    request->done = true;
+    request->status = status;
+    request->actualByteCount = actualByteCount;
+    request->completeTime = FloppyShimGetTime();
+    request->order = sCompletions++;
+}
+
+/**
+ * Creates and starts a RAM device as its personality would, on a stand-in provider.
+ */
+static VoodooFloppyRamStorageDevice *startDevice(IOService *nub, bool mechanics) {
+    OSDictionary *properties = OSDictionary::withCapacity(2);
+    properties->setObject(kFloppyRamPropertyEnabledKey, kOSBooleanTrue);
+    properties->setObject(kFloppyRamPropertyMechanicsKey, mechanics ? kOSBooleanTrue : kOSBooleanFalse);
+
+    SInt32 score = 0;
+    VoodooFloppyRamStorageDevice *device = OSTypeAlloc(VoodooFloppyRamStorageDevice);
+    bool started = device && device->init(properties) && device->attach(nub)
+        && device->probe(nub, &score) && device->start(nub);
+    properties->release();
+    if (!started) {
+        OSSafeReleaseNULL(device);
+        return NULL;
+    }
+    return device;
+}
+
+static void stopDevice(IOService *nub, VoodooFloppyRamStorageDevice *device) {
+    device->stop(nub);
+    device->detach(nub);
+    device->release();
+}
+
+/**
+ * Hands a request to the device without waiting for it. Writes carry a pattern made from the seed.
+ */
+static void submit(VoodooFloppyRamStorageDevice *device, FloppyRamCheckRequest *request, bool write, UInt64 block, UInt64 nblks, UInt8 seed) {
+    // Requests meant to be refused get a single block of buffer.
+    IOByteCount length = (nblks && nblks <= kFloppyRamBlocksMax ? nblks : 1) * kRamCheckBlockSize;
+    bzero(request, sizeof (*request));
+    request->buffer = IOBufferMemoryDescriptor::withCapacity(length, write ? kIODirectionOut : kIODirectionIn);
+    if (write) {
+        std::vector<UInt8> data(length);
+        for (IOByteCount i = 0; i < length; i++)
+            data[i] = getPatternByte(block + i / kRamCheckBlockSize, (UInt32)(i % kRamCheckBlockSize), seed);
+        request->buffer->writeBytes(0, &data[0], length);
+    }
+
+    IOStorageCompletion completion = { NULL, completionHandler, request };
+    IOStorageAttributes attributes = { kIOStorageOptionNone, kIOStoragePriorityDefault, 0, 0 };
+    IOReturn status = device->doAsyncReadWrite(request->buffer, block, nblks, &attributes, &completion);
+    if (status != kIOReturnSuccess) {
+        request->done = true;
+        request->status = status;
+    }
+}
+
+/**
+ * Runs the work loop, advancing virtual time to each timer, until the request completes.
+ */
+static void waitFor(FloppyRamCheckRequest *request) {
+    while (!request->done) {
+        if (IOWorkLoop::runAll())
+            continue;
+        UInt64 next = IOWorkLoop::nextDeadlineAll();
+        if (!next)
+            break;
+        if (next > FloppyShimGetTime())
+            FloppyShimAdvanceTimeTo(next);
+    }
+}
+
+/**
+ * Checks a finished read against the pattern from the given seed.
+ */
+static bool readMatches(FloppyRamCheckRequest *request, UInt64 block, UInt64 nblks, UInt8 seed) {
+    std::vector<UInt8> data(nblks * kRamCheckBlockSize);
+    request->buffer->readBytes(0, &data[0], data.size());
+    for (size_t i = 0; i < data.size(); i++) {
+        if (data[i] != getPatternByte(block + i / kRamCheckBlockSize, (UInt32)(i % kRamCheckBlockSize), seed))
+            return false;
+    }
+    return true;
+}
+
+static IOReturn runRequest(VoodooFloppyRamStorageDevice *device, bool write, UInt64 block, UInt64 nblks, UInt8 seed, bool *matches = NULL) {
+    FloppyRamCheckRequest request;
+    submit(device, &request, write, block, nblks, seed);
+    waitFor(&request);
+    if (matches)
+        *matches = request.done && request.status == kIOReturnSuccess && readMatches(&request, block, nblks, seed);
+    OSSafeReleaseNULL(request.buffer);
+    return request.done ? request.status : kIOReturnNotResponding;
+}
+
+/**
+ * Waits for a sector to start passing under the head, as a real drive spinning at 300 RPM would.
+ */
+static UInt64 waitForSector(UInt64 timeUs, UInt32 sector, UInt32 sectorUs) {
+    UInt64 startUs = sector * sectorUs;
+    UInt64 positionUs = timeUs % FLOPPY_ROTATION_300RPM_US;
+    return timeUs + (startUs + FLOPPY_ROTATION_300RPM_US - positionUs) % FLOPPY_ROTATION_300RPM_US;
+}
+
+/**
+ * Checks the media states a real drive can be in, with transfers completing at memory speed.
+ */
+static void checkMediaStates(IOService *nub) {
+    VoodooFloppyRamStorageDevice *device = startDevice(nub, false);
+    check(device != NULL, "device starts");
+    if (!device)
+        return;
+
+    UInt64 maxBlock = 0;
+    device->reportMaxValidBlock(&maxBlock);
+    check(maxBlock == kFloppyRamBlocksDefault - 1, "blank media has the default size");
+
+    // Completion is immediate, before the work loop runs.
+    FloppyRamCheckRequest request;
+    submit(device, &request, true, 100, 8, 0x11);
+    check(request.done && request.status == kIOReturnSuccess && request.actualByteCount == 8 * kRamCheckBlockSize, "write completes immediately");
+    OSSafeReleaseNULL(request.buffer);
+    bool matches = false;
+    check(runRequest(device, false, 100, 8, 0x11, &matches) == kIOReturnSuccess && matches, "read returns written data");
+    check(runRequest(device, true, kFloppyRamBlocksDefault - 1, 1, 0x22) == kIOReturnSuccess, "write to last block");
+    check(runRequest(device, false, kFloppyRamBlocksDefault - 1, 1, 0x22, &matches) == kIOReturnSuccess && matches, "read from last block");
+
+    // Out of range requests fail without touching the media.
+    check(runRequest(device, false, kFloppyRamBlocksDefault, 1, 0) == kIOReturnBadArgument, "read past end is rejected");
+    check(runRequest(device, true, kFloppyRamBlocksDefault - 1, 2, 0x33) == kIOReturnBadArgument, "write running past end is rejected");
+    check(runRequest(device, true, 1, UINT64_MAX, 0x33) == kIOReturnBadArgument, "block count that wraps is rejected");
+    check(runRequest(device, false, kFloppyRamBlocksDefault - 1, 1, 0x22, &matches) == kIOReturnSuccess && matches, "rejected write left media alone");
+
+    // Write protect fails writes only.
+    device->setWriteProtected(true);
+    check(runRequest(device, true, 100, 8, 0x44) == kIOReturnNotWritable, "write protected media refuses writes");
+    check(runRequest(device, false, 100, 8, 0x11, &matches) == kIOReturnSuccess && matches, "write protected media still reads");
+    device->setWriteProtected(false);
+    check(runRequest(device, true, 100, 1, 0x55) == kIOReturnSuccess, "write after clearing write protect");
+
+    // Without media, everything fails. The image comes back with the media.
+    device->setMediaPresent(false);
+    check(runRequest(device, false, 100, 1, 0x55) == kIOReturnNoMedia, "read without media");
+    check(runRequest(device, true, 100, 1, 0x66) == kIOReturnNoMedia, "write without media");
+    device->setMediaPresent(true);
+    check(runRequest(device, false, 100, 1, 0x55, &matches) == kIOReturnSuccess && matches, "media reinserted with its data");
+
+    // Loading an image changes the media size.
+    std::vector<UInt8> image(kRamCheckSmallBlocks * kRamCheckBlockSize);
+    for (size_t i = 0; i < image.size(); i++)
+        image[i] = getPatternByte(i / kRamCheckBlockSize, (UInt32)(i % kRamCheckBlockSize), 0x77);
+    check(device->loadImage(&image[0], image.size() - 1) == kIOReturnBadArgument, "image of partial blocks is rejected");
+    check(device->loadImage(&image[0], 0) == kIOReturnBadArgument, "empty image is rejected");
+    check(device->loadImage(&image[0], image.size()) == kIOReturnSuccess, "image loads");
+    device->reportMaxValidBlock(&maxBlock);
+    check(maxBlock == kRamCheckSmallBlocks - 1, "loaded image sets the media size");
+    check(runRequest(device, false, 0, kRamCheckSmallBlocks, 0x77, &matches) == kIOReturnSuccess && matches, "whole image reads back");
+    check(runRequest(device, false, kRamCheckSmallBlocks, 1, 0) == kIOReturnBadArgument, "read past smaller image is rejected");
+
+    stopDevice(nub, device);
+}
+
+/**
+ * Checks requests complete in order, at the times the mechanics model gives for them.
+ */
+static void checkMechanics(IOService *nub) {
+    VoodooFloppyRamStorageDevice *device = startDevice(nub, true);
+    check(device != NULL, "device with mechanics starts");
+    if (!device)
+        return;
+
+    UInt32 sectorsPerTrack = kFloppyRamBlocksDefault / (kFloppyRamCylinders * 2);
+    UInt32 sectorUs = FLOPPY_ROTATION_300RPM_US / sectorsPerTrack;
+    UInt64 startUs = FloppyShimGetTime() / 1000;
+
+    // Queue requests back to back. The failed one waits its turn, but takes no time.
+    FloppyRamCheckRequest requests[4];
+    submit(device, &requests[0], false, 0, 1, 0);
+    submit(device, &requests[1], true, 10 * sectorsPerTrack * 2 + 2, 3, 0x88);
+    submit(device, &requests[2], false, kFloppyRamBlocksDefault, 1, 0);
+    submit(device, &requests[3], false, 10 * sectorsPerTrack * 2 + 16, 4, 0);
+    check(!requests[0].done, "completion waits for the mechanics");
+    waitFor(&requests[3]);
+
+    // Spin-up, then the first sector of cylinder 0.
+    UInt64 expectedUs[4];
+    UInt64 timeUs = waitForSector(startUs + kFloppyRamSpinUpUs, 0, sectorUs) + sectorUs;
+    expectedUs[0] = timeUs;
+
+    // Step out 10 cylinders. Sector 2 passes while stepping, so the three sectors wait a revolution.
+    timeUs = waitForSector(timeUs + 10 * kFloppyRamStepUs, 2, sectorUs) + 3 * sectorUs;
+    expectedUs[1] = timeUs;
+    expectedUs[2] = timeUs;
+
+    // Last two sectors of head 0, then the first two of head 1 on the next revolution.
+    timeUs = waitForSector(timeUs, 16, sectorUs) + 2 * sectorUs;
+    timeUs = waitForSector(timeUs, 0, sectorUs) + 2 * sectorUs;
+    expectedUs[3] = timeUs;
+
+    bool inOrder = true;
+    bool onTime = true;
+    for (UInt32 i = 0; i < 4; i++) {
+        inOrder = inOrder && requests[i].done && requests[i].order == requests[0].order + i;
+        onTime = onTime && requests[i].completeTime == expectedUs[i] * 1000;
+        if (requests[i].completeTime != expectedUs[i] * 1000)
+            printf("     request %u completed at %llu us, model gives %llu us\n", i, requests[i].completeTime / 1000, expectedUs[i]);
+    }
+    check(inOrder, "requests complete in order");
+    check(onTime, "completion times follow spin-up, steps and rotation");
+    check(requests[1].status == kIOReturnSuccess && requests[2].status == kIOReturnBadArgument, "failed request keeps its place in the queue");
+    for (UInt32 i = 0; i < 4; i++)
+        OSSafeReleaseNULL(requests[i].buffer);
+
+    // A request straight after the last one finds the disk spinning, and the next sector already under the head.
+    FloppyRamCheckRequest request;
+    submit(device, &request, false, 10 * sectorsPerTrack * 2 + sectorsPerTrack + 2, 1, 0);
+    waitFor(&request);
+    check(request.completeTime == (timeUs + sectorUs) * 1000, "following request streams without spin-up");
+    OSSafeReleaseNULL(request.buffer);
+    timeUs += sectorUs;
+
+    // After the motor timeout the drive spins up again, and steps back from cylinder 10.
+    FloppyShimAdvanceTimeTo((timeUs + kFloppyMotorTimeoutMs * 1000ULL + 1000) * 1000);
+    startUs = FloppyShimGetTime() / 1000;
+    submit(device, &request, false, 0, 1, 0);
+    waitFor(&request);
+    timeUs = waitForSector(startUs + kFloppyRamSpinUpUs + 10 * kFloppyRamStepUs, 0, sectorUs) + sectorUs;
+    check(request.completeTime == timeUs * 1000, "idle drive spins up again");
+    OSSafeReleaseNULL(request.buffer);
+
+    // Loaded images are modelled with their own track length.
+    std::vector<UInt8> image(kRamCheckSmallBlocks * kRamCheckBlockSize);
+    device->loadImage(&image[0], image.size());
+    sectorsPerTrack = kRamCheckSmallBlocks / (kFloppyRamCylinders * 2);
+    sectorUs = FLOPPY_ROTATION_300RPM_US / sectorsPerTrack;
+    startUs = FloppyShimGetTime() / 1000;
+    submit(device, &request, false, 3 * sectorsPerTrack * 2 + 4, 2, 0);
+    waitFor(&request);
+    timeUs = waitForSector(startUs + 3 * kFloppyRamStepUs, 4, sectorUs) + 2 * sectorUs;
+    check(request.completeTime == timeUs * 1000, "loaded image is modelled with its track length");
+    OSSafeReleaseNULL(request.buffer);
+
+    // Requests still waiting when the device stops are failed.
+    submit(device, &request, false, 0, 1, 0);
+    stopDevice(nub, device);
+    check(request.done && request.status == kIOReturnAborted, "stop fails waiting requests");
+    OSSafeReleaseNULL(request.buffer);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-v]\n", name);
+    fprintf(stderr, "  -v            Log driver output.\n");
+}
+
+int main(int argc, char **argv) {
+    int option;
+    while ((option = getopt(argc, argv, "vh")) != -1) {
+        switch (option) {
+            case 'v':
+                FloppyShimSetLogging(true);
+                break;
+            default:
+                usage(argv[0]);
+                return option == 'h' ? 0 : 1;
+        }
+    }
+
+    // Round start time, so rotational positions are easy to follow in the output.
+    FloppyShimResetTime(kRamCheckStartNs);
+    IOService *nub = new IOService;
+    nub->init();
+
+    checkMediaStates(nub);
+    checkMechanics(nub);
+    nub->release();
+
+    printf("\n%u of %u checks passed.\n", sChecks - sFailures, sChecks);
+    return sFailures ? 1 : 0;
+}
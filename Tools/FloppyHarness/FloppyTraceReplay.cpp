@@ -0,0 +1,348 @@
+/*
+ * File: FloppyTraceReplay.cpp
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+
+#include "FloppyHarness.hpp"
+#include "VoodooFloppyController.hpp"
+#include "VoodooFloppyStorageDevice.hpp"
+
+#define kReplayMediaBlocks  (kFloppyEmuCylinders * kFloppyEmuHeads * kFloppyEmuSectors)
+
+// Virtual time run between checks once every request is in, and how long stragglers are given.
+#define kReplayStepNs       1000000ULL
+#define kReplayDrainNs      60000000000ULL
+
+// Priority classes, as the driver reports them.
+enum {
+    kReplayClassHigh,
+    kReplayClassDefault,
+    kReplayClassLow,
+    kReplayClassCount
+};
+
+static const char *classNames[kReplayClassCount] = { "high", "default", "low" };
+
+// A trace record in flight.
+typedef struct {
+    FloppyTraceRecord record;
+    IOBufferMemoryDescriptor *buffer;
+    UInt64 submitTime;
+    UInt64 completeTime;
+    IOReturn status;
+    bool done;
+} ReplayRequest;
+
+static UInt32 sOutstanding;
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-g requests] [-s seed] [-x scale] [-o file] [-v] [trace]\n", name);
+    fprintf(stderr, "  trace         Trace file of FloppyTraceRecord entries, as read from the driver's trace ring.\n");
+    fprintf(stderr, "  -g requests   Replay a generated filesystem workload instead of a file.\n");
+    fprintf(stderr, "  -s seed       Seed for the generated workload (default 1).\n");
+    fprintf(stderr, "  -x scale      Scale the time between requests (default 1, 0 submits them all at once).\n");
+    fprintf(stderr, "  -o file       Save the trace the driver captured during the replay.\n");
+    fprintf(stderr, "  -v            Log driver output.\n");
+}
+
+static UInt8 getPriorityClass(UInt8 priority) {
+    if (priority < kIOStoragePriorityDefault)
+        return kReplayClassHigh;
+    return priority == kIOStoragePriorityDefault ? kReplayClassDefault : kReplayClassLow;
+}
+
+static bool loadTrace(const char *path, std::vector<FloppyTraceRecord> *records) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Failed to open %s.\n", path);
+        return false;
+    }
+
+    FloppyTraceRecord record;
+    while (fread(&record, sizeof (record), 1, file) == 1)
+        records->push_back(record);
+    fclose(file);
+    return true;
+}
+
+static bool saveTrace(const char *path, const FloppyTraceRecord *records, size_t count) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Failed to create %s.\n", path);
+        return false;
+    }
+
+    bool written = fwrite(records, sizeof (FloppyTraceRecord), count, file) == count;
+    fclose(file);
+    return written;
+}
+
+/**
+ * Generates a filesystem-like workload: bursts of metadata reads and writes near the start of the disk,
+ * 4KB allocation blocks and whole-cylinder file reads, with some background work at low priority.
+ */
+static void generateTrace(UInt32 count, UInt64 seed, std::vector<FloppyTraceRecord> *records) {
+    UInt64 random = seed;
+    UInt64 timestamp = 0;
+    for (UInt32 i = 0; i < count; i++) {
+        random = random * 6364136223846793005ULL + 1442695040888963407ULL;
+        UInt32 pick = (UInt32)(random >> 33) % 100;
+        random = random * 6364136223846793005ULL + 1442695040888963407ULL;
+        UInt32 where = (UInt32)(random >> 33);
+
+        FloppyTraceRecord record;
+        record.blockCount = pick < 60 ? 1 : (pick < 85 ? 8 : 36);
+        record.block = pick < 40 ? where % 33 : where % (kReplayMediaBlocks - record.blockCount);
+        record.flags = (pick < 25 || (pick >= 60 && pick < 70)) ? kFloppyTraceFlagWrite : 0;
+        record.priority = pick >= 95 ? kIOStoragePriorityLow : kIOStoragePriorityDefault;
+
+        // Requests come in bursts, with think time between them.
+        random = random * 6364136223846793005ULL + 1442695040888963407ULL;
+        UInt64 gap = random >> 16;
+        timestamp += (where & 0x3) ? gap % 20000000ULL : 1000000000ULL + gap % 3000000000ULL;
+        record.timestamp = timestamp;
+        records->push_back(record);
+    }
+}
+
+static void completionHandler(void *target, void *parameter, IOReturn status, UInt64 actualByteCount) {
+    ReplayRequest *request = (ReplayRequest*)parameter;
+    request->completeTime = FloppyShimGetTime();
+    request->status = status;
+    request->done = true;
+    sOutstanding--;
+}
+
+static bool submitRequest(FloppyHarness *harness, ReplayRequest *request, UInt32 index) {
+    bool write = request->record.flags & kFloppyTraceFlagWrite;
+    IOByteCount length = request->record.blockCount * kFloppyEmuSectorSize;
+    request->buffer = IOBufferMemoryDescriptor::withCapacity(length, write ? kIODirectionOut : kIODirectionIn);
+    if (!request->buffer)
+        return false;
+
+    // Written data differs from what is on the media, so it is never elided as unchanged.
+    if (write) {
+        UInt8 *bytes = (UInt8*)request->buffer->getBytesNoCopy();
+        for (IOByteCount i = 0; i < length; i++)
+            bytes[i] = (UInt8)((index * 31 + i) ^ 0xA5);
+    }
+
+    IOStorageCompletion completion = { harness, completionHandler, request };
+    IOStorageAttributes attributes = { kIOStorageOptionNone, request->record.priority, 0, 0 };
+    request->submitTime = FloppyShimGetTime();
+    sOutstanding++;
+    IOReturn status = harness->getDevice()->doAsyncReadWrite(request->buffer, request->record.block, request->record.blockCount, &attributes, &completion);
+    if (status != kIOReturnSuccess) {
+        sOutstanding--;
+        request->status = status;
+        request->done = true;
+    }
+    return true;
+}
+
+static UInt64 getLatencyProperty(FloppyHarness *harness, UInt8 priorityClass, const char *key) {
+    OSDictionary *latency = OSDynamicCast(OSDictionary, harness->getController()->getProperty(kFloppyPropertyLatencyKey));
+    OSDictionary *stats = latency ? OSDynamicCast(OSDictionary, latency->getObject(classNames[priorityClass])) : NULL;
+    OSNumber *number = stats ? OSDynamicCast(OSNumber, stats->getObject(key)) : NULL;
+    return number ? number->unsigned64BitValue() : 0;
+}
+
+static double getPercentile(std::vector<UInt64> &values, double percentile) {
+    if (values.empty())
+        return 0;
+    size_t index = (size_t)ceil(percentile / 100.0 * values.size());
+    return values[index ? index - 1 : 0] / 1000.0;
+}
+
+int main(int argc, char **argv) {
+    UInt32 generateCount = 0;
+    UInt64 seed = 1;
+    double scale = 1.0;
+    const char *outputPath = NULL;
+    int option;
+
+    while ((option = getopt(argc, argv, "g:s:x:o:vh")) != -1) {
+        switch (option) {
+            case 'g':
+                generateCount = (UInt32)strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'x':
+                scale = strtod(optarg, NULL);
+                break;
+            case 'o':
+                outputPath = optarg;
+                break;
+            case 'v':
+                FloppyShimSetLogging(true);
+                break;
+            default:
+                usage(argv[0]);
+                return option == 'h' ? 0 : 1;
+        }
+    }
+
+    std::vector<FloppyTraceRecord> trace;
+    if (generateCount) {
+        generateTrace(generateCount, seed, &trace);
+    } else if (optind < argc) {
+        if (!loadTrace(argv[optind], &trace))
+            return 1;
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+    if (scale < 0) {
+        fprintf(stderr, "Time scale must not be negative.\n");
+        return 1;
+    }
+
+    // Only drive A is emulated, with 1.44MB media.
+    std::vector<ReplayRequest> requests;
+    UInt32 skipped = 0;
+    for (size_t i = 0; i < trace.size(); i++) {
+        const FloppyTraceRecord *record = &trace[i];
+        if ((record->flags >> kFloppyTraceDriveShift) != 0 || record->blockCount == 0 || record->block + record->blockCount > kReplayMediaBlocks) {
+            skipped++;
+            continue;
+        }
+        ReplayRequest request;
+        bzero(&request, sizeof (request));
+        request.record = *record;
+        requests.push_back(request);
+    }
+    if (requests.empty()) {
+        fprintf(stderr, "No requests to replay.\n");
+        return 1;
+    }
+
+    // Faults are never armed; the replay runs on clean media.
+    FloppyFaultInjector injector(seed);
+    FloppyHarness harness(&injector);
+    if (!harness.start()) {
+        fprintf(stderr, "Failed to start the controller.\n");
+        return 1;
+    }
+    harness.getController()->setTracing(true);
+    FloppyEmulatorStats before = harness.getEmulator()->getStats();
+
+    // Submit each request at its recorded time, relative to the first.
+    UInt64 start = FloppyShimGetTime();
+    UInt64 firstTimestamp = requests[0].record.timestamp;
+    for (size_t i = 0; i < requests.size(); i++) {
+        UInt64 due = start + (UInt64)((requests[i].record.timestamp - firstTimestamp) * scale);
+        if (due > FloppyShimGetTime())
+            harness.runFor(due - FloppyShimGetTime());
+        if (!submitRequest(&harness, &requests[i], (UInt32)i)) {
+            fprintf(stderr, "Failed to allocate a request buffer.\n");
+            return 1;
+        }
+    }
+
+    // Let the queue drain.
+    UInt64 drainEnd = FloppyShimGetTime() + kReplayDrainNs;
+    while (sOutstanding && FloppyShimGetTime() < drainEnd)
+        harness.runFor(kReplayStepNs);
+    if (sOutstanding) {
+        fprintf(stderr, "%u requests stalled.\n", sOutstanding);
+        return 1;
+    }
+    UInt64 end = 0;
+    for (size_t i = 0; i < requests.size(); i++)
+        end = std::max(end, requests[i].completeTime);
+
+    // Latency for each priority class, from submission to completion.
+    std::vector<UInt64> latencies[kReplayClassCount];
+    UInt32 reads = 0;
+    UInt32 writes = 0;
+    UInt32 failed = 0;
+    for (size_t i = 0; i < requests.size(); i++) {
+        ReplayRequest *request = &requests[i];
+        if (request->record.flags & kFloppyTraceFlagWrite)
+            writes++;
+        else
+            reads++;
+        if (request->status != kIOReturnSuccess)
+            failed++;
+        latencies[getPriorityClass(request->record.priority)].push_back(request->completeTime - request->submitTime);
+        OSSafeReleaseNULL(request->buffer);
+    }
+
+    printf("Replayed %zu requests (%u reads, %u writes) over %.1f ms, %u skipped, %u failed, time scale %.2f.\n\n",
+           requests.size(), reads, writes, (end - start) / 1000000.0, skipped, failed, scale);
+
+    // Counts, averages and maximums are the driver's own, as published on real hardware.
+    printf("%-8s %6s %10s %10s %10s %10s %8s %8s\n", "class", "count", "avg-us", "max-us", "p50-us", "p99-us", "avg-revs", "max-revs");
+    for (UInt8 i = 0; i < kReplayClassCount; i++) {
+        std::sort(latencies[i].begin(), latencies[i].end());
+        UInt64 averageUs = getLatencyProperty(&harness, i, "average-us");
+        UInt64 maxUs = getLatencyProperty(&harness, i, "max-us");
+        printf("%-8s %6llu %10llu %10llu %10.0f %10.0f %8.2f %8.2f\n", classNames[i], getLatencyProperty(&harness, i, "count"),
+               averageUs, maxUs, getPercentile(latencies[i], 50), getPercentile(latencies[i], 99),
+               averageUs * 1000.0 / kFloppyEmuRotationNs, maxUs * 1000.0 / kFloppyEmuRotationNs);
+    }
+
+    const FloppyEmulatorStats &after = harness.getEmulator()->getStats();
+    printf("\nDrive: %u data commands, %u seeks, %u recalibrates, %u READ IDs, %.1f revolutions elapsed.\n",
+           after.dataCommands - before.dataCommands, after.seeks - before.seeks, after.recalibrates - before.recalibrates,
+           after.readIds - before.readIds, (double)(end - start) / kFloppyEmuRotationNs);
+
+    OSDictionary *elision = OSDynamicCast(OSDictionary, harness.getController()->getProperty(kFloppyPropertyElisionKey));
+    OSNumber *revolutionsSaved = elision ? OSDynamicCast(OSNumber, elision->getObject("revolutions-saved")) : NULL;
+    if (revolutionsSaved)
+        printf("Write elision: %llu revolutions saved.\n", revolutionsSaved->unsigned64BitValue());
+
+    OSDictionary *merging = OSDynamicCast(OSDictionary, harness.getController()->getProperty(kFloppyPropertyMergingKey));
+    OSNumber *mergedCommands = merging ? OSDynamicCast(OSNumber, merging->getObject("merged-commands")) : NULL;
+    OSNumber *mergedRequests = merging ? OSDynamicCast(OSNumber, merging->getObject("merged-requests")) : NULL;
+    if (mergedCommands && mergedRequests && mergedCommands->unsigned64BitValue())
+        printf("Request merging: %llu commands carried %llu more requests, %.2f merges per command.\n",
+               mergedCommands->unsigned64BitValue(), mergedRequests->unsigned64BitValue(),
+               (double)mergedRequests->unsigned64BitValue() / mergedCommands->unsigned64BitValue());
+
+    // The driver's own trace of the replay, in the same format it was read in.
+    FloppyTraceRing *ring = (FloppyTraceRing*)harness.getController()->getTraceMemory()->getBytesNoCopy();
+    UInt32 producer = ring->producer;
+    UInt32 captured = std::min(producer, ring->recordCount);
+    if (outputPath) {
+        std::vector<FloppyTraceRecord> records;
+        for (UInt32 i = producer - captured; i != producer; i++)
+            records.push_back(ring->records[i % ring->recordCount]);
+        if (!saveTrace(outputPath, records.empty() ? NULL : &records[0], records.size()))
+            return 1;
+        printf("Saved %u captured requests to %s.\n", captured, outputPath);
+    }
+
+    harness.stop();
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,64 @@
+/*
+ * File: FloppyShim.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Virtual time for the host harness. Everything that takes time in the driver, such as
+// IOSleep, IODelay and port I/O, advances the clock and runs device events that fall due.
+
+#ifndef FloppyShim_h
+#define FloppyShim_h
+
+#include <IOKit/IOTypes.h>
+
+// Emulated hardware driven by the virtual clock.
+class FloppyShimDevice {
+public:
+    virtual ~FloppyShimDevice() {}
+    
+    // Absolute time of the next pending event, or UINT64_MAX if there is none.
+    virtual UInt64 nextEventTime() = 0;
+    
+    // Runs events due at or before the current time.
+    virtual void runEvents(UInt64 now) = 0;
+};
+
+// Sets the device driven by the clock.
+void FloppyShimSetDevice(FloppyShimDevice *device);
+
+// Gets the current virtual time in nanoseconds.
+UInt64 FloppyShimGetTime();
+
+// Advances virtual time, running device events in order as they fall due.
+void FloppyShimAdvanceTime(UInt64 nanoseconds);
+void FloppyShimAdvanceTimeTo(UInt64 time);
+
+// Resets the clock. Only valid with no device set.
+void FloppyShimResetTime(UInt64 time);
+
+// Enables IOLog output.
+void FloppyShimSetLogging(bool enabled);
+
+// Counts IOMalloc and IOMallocAligned calls. C++ allocations such as OSObjects are not included.
+UInt64 FloppyShimGetAllocations();
+
+#endif /* FloppyShim_h */
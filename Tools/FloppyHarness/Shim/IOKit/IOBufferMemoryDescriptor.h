@@ -0,0 +1,51 @@
+/*
+ * File: IOBufferMemoryDescriptor.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Buffers owned by their descriptor. Physically restricted buffers come from emulated physical memory.
+
+#ifndef FloppyShim_IOBufferMemoryDescriptor_h
+#define FloppyShim_IOBufferMemoryDescriptor_h
+
+#include <IOKit/IOMemoryDescriptor.h>
+
+class IOBufferMemoryDescriptor : public IOGeneralMemoryDescriptor {
+public:
+    IOBufferMemoryDescriptor() : _capacity(0), _owned(false) {}
+    virtual void free();
+    
+    static IOBufferMemoryDescriptor *withCapacity(IOByteCount capacity, IODirection withDirection, bool withContiguousMemory = false);
+    static IOBufferMemoryDescriptor *inTaskWithOptions(task_t inTask, IOOptionBits options, IOByteCount capacity, IOByteCount alignment = 1);
+    static IOBufferMemoryDescriptor *inTaskWithPhysicalMask(task_t inTask, IOOptionBits options, mach_vm_size_t capacity, mach_vm_address_t physicalMask);
+    
+    void *getBytesNoCopy() { return _bytes; }
+    void *getBytesNoCopy(IOByteCount start, IOByteCount withLength) { return start + withLength <= _capacity ? _bytes + start : NULL; }
+    void setLength(IOByteCount length) { _length = length <= _capacity ? length : _capacity; }
+    IOByteCount getCapacity() const { return _capacity; }
+    
+private:
+    IOByteCount _capacity;
+    bool _owned;
+};
+
+#endif /* FloppyShim_IOBufferMemoryDescriptor_h */
@@ -0,0 +1,56 @@
+/*
+ * File: IOCommandGate.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Command gates. The harness is single threaded, so actions run directly and sleeping
+// waits out virtual time.
+
+#ifndef FloppyShim_IOCommandGate_h
+#define FloppyShim_IOCommandGate_h
+
+#include <IOKit/IOWorkLoop.h>
+
+enum {
+    THREAD_AWAKENED     = 0,
+    THREAD_TIMED_OUT    = 1,
+    THREAD_INTERRUPTED  = 2,
+    THREAD_UNINT        = 0,
+    THREAD_INTERRUPTIBLE = 1,
+    THREAD_ABORTSAFE    = 2
+};
+
+class IOCommandGate : public IOEventSource {
+public:
+    typedef IOReturn (*Action)(OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3);
+    
+    static IOCommandGate *commandGate(OSObject *owner, Action action = 0);
+    
+    IOReturn runAction(Action action, void *arg0 = 0, void *arg1 = 0, void *arg2 = 0, void *arg3 = 0);
+    IOReturn attemptAction(Action action, void *arg0 = 0, void *arg1 = 0, void *arg2 = 0, void *arg3 = 0);
+    IOReturn runCommand(void *arg0 = 0, void *arg1 = 0, void *arg2 = 0, void *arg3 = 0);
+    IOReturn commandSleep(void *event, UInt32 interruptible = THREAD_ABORTSAFE);
+    IOReturn commandSleep(void *event, UInt64 deadline, UInt32 interruptible = THREAD_ABORTSAFE);
+    void commandWakeup(void *event, bool oneThread = false) {}
+};
+
+#endif /* FloppyShim_IOCommandGate_h */
@@ -0,0 +1,46 @@
+/*
+ * File: IOInterruptEventSource.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Interrupt event sources. Occurrences are counted and handed to the action on the work loop.
+
+#ifndef FloppyShim_IOInterruptEventSource_h
+#define FloppyShim_IOInterruptEventSource_h
+
+#include <IOKit/IOWorkLoop.h>
+
+class IOInterruptEventSource : public IOEventSource {
+public:
+    typedef void (*Action)(OSObject *owner, IOInterruptEventSource *sender, int count);
+    
+    static IOInterruptEventSource *interruptEventSource(OSObject *owner, Action action, IOService *provider = 0, int intIndex = 0);
+    void interruptOccurred(void *refCon, IOService *nub, int source);
+    
+protected:
+    virtual bool checkForWork();
+    
+private:
+    int _pending;
+};
+
+#endif /* FloppyShim_IOInterruptEventSource_h */
@@ -0,0 +1,60 @@
+/*
+ * File: IOLib.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// IOLib for the host harness. Sleeping and delaying advance virtual time instead of blocking.
+
+#ifndef FloppyShim_IOLib_h
+#define FloppyShim_IOLib_h
+
+#include <IOKit/IOTypes.h>
+
+typedef struct _IOLock IOLock;
+typedef struct _IOSimpleLock IOSimpleLock;
+typedef int IOInterruptState;
+
+extern "C" {
+void IOLog(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void IOSleep(unsigned milliseconds);
+void IODelay(unsigned microseconds);
+
+void *IOMalloc(size_t size);
+void IOFree(void *address, size_t size);
+void *IOMallocAligned(size_t size, size_t alignment);
+void IOFreeAligned(void *address, size_t size);
+
+// The harness is single threaded, so locks only check that they are balanced.
+IOLock *IOLockAlloc(void);
+void IOLockFree(IOLock *lock);
+void IOLockLock(IOLock *lock);
+void IOLockUnlock(IOLock *lock);
+
+IOSimpleLock *IOSimpleLockAlloc(void);
+void IOSimpleLockFree(IOSimpleLock *lock);
+void IOSimpleLockLock(IOSimpleLock *lock);
+void IOSimpleLockUnlock(IOSimpleLock *lock);
+IOInterruptState IOSimpleLockLockDisableInterrupt(IOSimpleLock *lock);
+void IOSimpleLockUnlockEnableInterrupt(IOSimpleLock *lock, IOInterruptState state);
+}
+
+#endif /* FloppyShim_IOLib_h */
@@ -0,0 +1,87 @@
+/*
+ * File: IOMemoryDescriptor.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Memory descriptors over host memory. Physical addresses refer to the emulated
+// machine's memory, which the emulated DMA controller reads and writes.
+
+#ifndef FloppyShim_IOMemoryDescriptor_h
+#define FloppyShim_IOMemoryDescriptor_h
+
+#include <IOKit/IOService.h>
+
+class IOMemoryDescriptor;
+
+// Size of emulated physical memory. ISA DMA can only reach the first 16MB.
+#define kFloppyShimPhysicalMemorySize   (16 * 1024 * 1024)
+
+// Gets the host address of emulated physical memory, or NULL if the range is outside it.
+UInt8 *FloppyShimPhysicalToVirtual(IOPhysicalAddress address, IOByteCount length);
+
+class IOMemoryMap : public OSObject {
+public:
+    IOMemoryMap(IOMemoryDescriptor *memory);
+    virtual void free();
+    
+    IOVirtualAddress getVirtualAddress();
+    IOVirtualAddress getAddress() { return getVirtualAddress(); }
+    IOByteCount getLength();
+    IOPhysicalAddress getPhysicalAddress();
+    
+private:
+    IOMemoryDescriptor *_memory;
+};
+
+class IOMemoryDescriptor : public OSObject {
+    friend class IOMemoryMap;
+    
+public:
+    IOMemoryDescriptor() : _bytes(NULL), _length(0), _direction(kIODirectionNone), _physicalAddress(0), _physical(false), _prepareCount(0) {}
+    
+    static IOMemoryDescriptor *withPhysicalAddress(IOPhysicalAddress address, IOByteCount withLength, IODirection withDirection);
+    static IOMemoryDescriptor *withAddress(void *address, IOByteCount withLength, IODirection withDirection);
+    
+    IOByteCount readBytes(IOByteCount offset, void *bytes, IOByteCount withLength);
+    IOByteCount writeBytes(IOByteCount offset, const void *bytes, IOByteCount withLength);
+    IODirection getDirection() const { return _direction; }
+    IOByteCount getLength() const { return _length; }
+    IOMemoryMap *map(IOOptionBits options = 0);
+    IOReturn prepare(IODirection forDirection = kIODirectionNone);
+    IOReturn complete(IODirection forDirection = kIODirectionNone);
+    IOPhysicalAddress getPhysicalSegment(IOByteCount offset, IOByteCount *length, IOOptionBits options = 0);
+    
+    // Number of prepare calls not yet balanced by complete.
+    int getPrepareCount() const { return _prepareCount; }
+    
+protected:
+    UInt8 *_bytes;
+    IOByteCount _length;
+    IODirection _direction;
+    IOPhysicalAddress _physicalAddress;
+    bool _physical;
+    int _prepareCount;
+};
+
+class IOGeneralMemoryDescriptor : public IOMemoryDescriptor {};
+
+#endif /* FloppyShim_IOMemoryDescriptor_h */
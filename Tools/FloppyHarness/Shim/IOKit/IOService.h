@@ -0,0 +1,136 @@
+/*
+ * File: IOService.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Registry entries and services. Enough of IOService to attach, start and stop the driver,
+// with interrupts delivered by the harness.
+
+#ifndef FloppyShim_IOService_h
+#define FloppyShim_IOService_h
+
+#include <IOKit/IOTypes.h>
+#include <IOKit/IOLib.h>
+#include <libkern/c++/OSObject.h>
+#include <libkern/c++/OSNumber.h>
+#include <libkern/c++/OSString.h>
+#include <libkern/c++/OSBoolean.h>
+#include <libkern/c++/OSDictionary.h>
+#include <vector>
+
+class IOService;
+class IOWorkLoop;
+class IOUserClient;
+
+typedef void (*IOInterruptAction)(OSObject *target, void *refCon, IOService *nub, int source);
+
+struct IOPMPowerState {
+    unsigned long version;
+    unsigned long capabilityFlags;
+    unsigned long outputPowerCharacter;
+    unsigned long inputPowerRequirement;
+    unsigned long staticPower;
+    unsigned long unbudgetedPower;
+    unsigned long powerToAttain;
+    unsigned long timeToAttain;
+    unsigned long settleUpTime;
+    unsigned long timeToLower;
+    unsigned long settleDownTime;
+    unsigned long powerDomainBudget;
+};
+
+enum {
+    kIOPMDeviceUsable   = 0x00008000,
+    IOPMPowerOn         = 0x00000002,
+    IOPMAckImplied      = 0
+};
+
+#define kIOMessageServiceIsTerminated ((UInt32)0xE0000010)
+
+class IORegistryEntry : public OSObject {
+public:
+    IORegistryEntry() : _properties(NULL) {}
+    
+    virtual bool init(OSDictionary *dictionary = 0);
+    virtual void free();
+    
+    OSObject *getProperty(const char *key) const;
+    bool setProperty(const char *key, OSObject *object);
+    bool setProperty(const char *key, const char *string);
+    bool setProperty(const char *key, bool value);
+    bool setProperty(const char *key, unsigned long long value, unsigned int numberOfBits);
+    void removeProperty(const char *key);
+    virtual IOReturn setProperties(OSObject *properties) { return kIOReturnUnsupported; }
+    OSDictionary *getPropertyTable() const { return _properties; }
+    
+private:
+    OSDictionary *_properties;
+};
+
+class IOService : public IORegistryEntry {
+public:
+    IOService() : _provider(NULL) {}
+    
+    virtual IOService *probe(IOService *provider, SInt32 *score) { return this; }
+    virtual bool start(IOService *provider) { return true; }
+    virtual void stop(IOService *provider) {}
+    virtual bool attach(IOService *provider);
+    virtual void detach(IOService *provider);
+    virtual void registerService(IOOptionBits options = 0) {}
+    virtual bool terminate(IOOptionBits options = 0) { return true; }
+    virtual IOWorkLoop *getWorkLoop() const { return NULL; }
+    virtual IOReturn message(UInt32 type, IOService *provider, void *argument = 0) { return kIOReturnUnsupported; }
+    
+    IOService *getProvider() const { return _provider; }
+    IOService *getClient() const { return _clients.empty() ? NULL : _clients.front(); }
+    IOReturn messageClients(UInt32 type, void *argument = 0, size_t argSize = 0);
+    
+    // Power management is not modelled; power changes are made by calling setPowerState directly.
+    virtual IOReturn setPowerState(unsigned long powerStateOrdinal, IOService *whatDevice) { return IOPMAckImplied; }
+    void PMinit() {}
+    void PMstop() {}
+    IOReturn registerPowerDriver(IOService *controllingDriver, IOPMPowerState *powerStates, unsigned long numberOfStates) { return kIOReturnSuccess; }
+    IOReturn joinPMtree(IOService *driver) { return kIOReturnSuccess; }
+    void acknowledgeSetPowerState() {}
+    
+    // Interrupts registered here are raised by the harness with deliverInterrupt.
+    IOReturn registerInterrupt(int source, OSObject *target, IOInterruptAction handler, void *refCon = 0);
+    IOReturn unregisterInterrupt(int source);
+    IOReturn enableInterrupt(int source);
+    IOReturn disableInterrupt(int source);
+    void deliverInterrupt(int source);
+    
+private:
+    struct Interrupt {
+        OSObject *target;
+        IOInterruptAction handler;
+        void *refCon;
+        bool enabled;
+        bool pending;
+    };
+    
+    IOService *_provider;
+    std::vector<IOService*> _clients;
+    std::vector<Interrupt> _interrupts;
+};
+
+#endif /* FloppyShim_IOService_h */
@@ -0,0 +1,52 @@
+/*
+ * File: IOTimerEventSource.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// One-shot timers on virtual time.
+
+#ifndef FloppyShim_IOTimerEventSource_h
+#define FloppyShim_IOTimerEventSource_h
+
+#include <IOKit/IOWorkLoop.h>
+
+class IOTimerEventSource : public IOEventSource {
+public:
+    typedef void (*Action)(OSObject *owner, IOTimerEventSource *sender);
+    
+    static IOTimerEventSource *timerEventSource(OSObject *owner, Action action = 0);
+    
+    IOReturn setTimeoutMS(UInt32 ms);
+    IOReturn setTimeoutUS(UInt32 us);
+    IOReturn setTimeout(UInt64 interval);
+    IOReturn wakeAtTime(UInt64 abstime);
+    void cancelTimeout();
+    
+protected:
+    virtual bool checkForWork();
+    virtual UInt64 nextDeadline() const { return _enabled ? _deadline : 0; }
+    
+private:
+    UInt64 _deadline;
+};
+
+#endif /* FloppyShim_IOTimerEventSource_h */
@@ -0,0 +1,106 @@
+/*
+ * File: IOTypes.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// IOKit types and return codes, using the same values as the kernel.
+
+#ifndef FloppyShim_IOTypes_h
+#define FloppyShim_IOTypes_h
+
+#include <sys/systm.h>
+
+typedef kern_return_t IOReturn;
+typedef UInt32 IOOptionBits;
+typedef UInt32 IOItemCount;
+typedef UInt64 IOByteCount;
+typedef UInt64 IOPhysicalAddress;
+typedef UInt64 IOPhysicalAddress64;
+typedef UInt64 IOVirtualAddress;
+
+#define iokit_common_err(return)    ((IOReturn)(0xE0000000 | (return)))
+
+#define kIOReturnSuccess            0
+#define kIOReturnError              iokit_common_err(0x2BC)
+#define kIOReturnNoMemory           iokit_common_err(0x2BD)
+#define kIOReturnNoResources        iokit_common_err(0x2BE)
+#define kIOReturnNoDevice           iokit_common_err(0x2C0)
+#define kIOReturnNotPrivileged      iokit_common_err(0x2C1)
+#define kIOReturnBadArgument        iokit_common_err(0x2C2)
+#define kIOReturnExclusiveAccess    iokit_common_err(0x2C5)
+#define kIOReturnUnsupported        iokit_common_err(0x2C7)
+#define kIOReturnInternalError      iokit_common_err(0x2C9)
+#define kIOReturnIOError            iokit_common_err(0x2CA)
+#define kIOReturnNotOpen            iokit_common_err(0x2CD)
+#define kIOReturnNotReadable        iokit_common_err(0x2CE)
+#define kIOReturnNotWritable        iokit_common_err(0x2CF)
+#define kIOReturnNotAligned         iokit_common_err(0x2D0)
+#define kIOReturnBadMedia           iokit_common_err(0x2D1)
+#define kIOReturnStillOpen          iokit_common_err(0x2D2)
+#define kIOReturnDMAError           iokit_common_err(0x2D4)
+#define kIOReturnBusy               iokit_common_err(0x2D5)
+#define kIOReturnTimeout            iokit_common_err(0x2D6)
+#define kIOReturnOffline            iokit_common_err(0x2D7)
+#define kIOReturnNotReady           iokit_common_err(0x2D8)
+#define kIOReturnNotAttached        iokit_common_err(0x2D9)
+#define kIOReturnNoSpace            iokit_common_err(0x2DB)
+#define kIOReturnCannotWire         iokit_common_err(0x2DE)
+#define kIOReturnNoInterrupt        iokit_common_err(0x2DF)
+#define kIOReturnNotPermitted       iokit_common_err(0x2E2)
+#define kIOReturnNoPower            iokit_common_err(0x2E3)
+#define kIOReturnNoMedia            iokit_common_err(0x2E4)
+#define kIOReturnUnformattedMedia   iokit_common_err(0x2E5)
+#define kIOReturnUnsupportedMode    iokit_common_err(0x2E6)
+#define kIOReturnUnderrun           iokit_common_err(0x2E7)
+#define kIOReturnOverrun            iokit_common_err(0x2E8)
+#define kIOReturnDeviceError        iokit_common_err(0x2E9)
+#define kIOReturnAborted            iokit_common_err(0x2EB)
+#define kIOReturnNotResponding      iokit_common_err(0x2ED)
+#define kIOReturnNotFound           iokit_common_err(0x2F0)
+#define kIOReturnInvalid            iokit_common_err(0x001)
+
+typedef UInt32 IODirection;
+enum {
+    kIODirectionNone    = 0x0,
+    kIODirectionIn      = 0x1,
+    kIODirectionOut     = 0x2,
+    kIODirectionInOut   = kIODirectionIn | kIODirectionOut
+};
+
+enum {
+    kIOMemoryPhysicallyContiguous   = 0x00000010,
+    kIOMemoryKernelUserShared       = 0x00000200,
+    kIOMemoryMapperNone             = 0x00000800
+};
+
+enum {
+    kIOMapAnywhere      = 0x00000001,
+    kIOMapDefaultCache  = 0x00000000,
+    kIOMapInhibitCache  = 0x00000100,
+    kIOMapReadOnly      = 0x00001000
+};
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+
+#endif /* FloppyShim_IOTypes_h */
@@ -0,0 +1,42 @@
+/*
+ * File: IOUserClient.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Privilege checks. Every caller on the host is an administrator.
+
+#ifndef FloppyShim_IOUserClient_h
+#define FloppyShim_IOUserClient_h
+
+#include <IOKit/IOService.h>
+#include <sys/systm.h>
+
+#define kIOClientPrivilegeAdministrator "root"
+
+class IOUserClient : public IOService {
+public:
+    static IOReturn clientHasPrivilege(void *securityToken, const char *privilegeName) { return kIOReturnSuccess; }
+};
+
+inline task_t current_task(void) { return kernel_task; }
+
+#endif /* FloppyShim_IOUserClient_h */
@@ -0,0 +1,81 @@
+/*
+ * File: IOWorkLoop.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Work loops and event sources. Sources run when the harness pumps the work loops,
+// never from inside another source, which matches the ordering of a real work loop thread.
+
+#ifndef FloppyShim_IOWorkLoop_h
+#define FloppyShim_IOWorkLoop_h
+
+#include <IOKit/IOService.h>
+#include <vector>
+
+class IOEventSource : public OSObject {
+    friend class IOWorkLoop;
+    
+public:
+    IOEventSource() : _owner(NULL), _action(NULL), _enabled(true), _workLoop(NULL) {}
+    
+    virtual void enable() { _enabled = true; }
+    virtual void disable() { _enabled = false; }
+    bool isEnabled() const { return _enabled; }
+    IOWorkLoop *getWorkLoop() const { return _workLoop; }
+    bool onThread() const { return true; }
+    
+protected:
+    OSObject *_owner;
+    void *_action;
+    bool _enabled;
+    IOWorkLoop *_workLoop;
+    
+    // Does any work that is due. Returns true if an action was called.
+    virtual bool checkForWork() { return false; }
+    // Absolute time the source next needs to run at, or 0 if it is not waiting on time.
+    virtual UInt64 nextDeadline() const { return 0; }
+};
+
+class IOWorkLoop : public OSObject {
+public:
+    static IOWorkLoop *workLoop();
+    virtual void free();
+    
+    IOReturn addEventSource(IOEventSource *source);
+    IOReturn removeEventSource(IOEventSource *source);
+    bool onThread() const { return true; }
+    bool inGate() const { return true; }
+    void closeGate() {}
+    void openGate() {}
+    
+    // Harness entry points covering all work loops.
+    static bool runAll();
+    static UInt64 nextDeadlineAll();
+    
+private:
+    std::vector<IOEventSource*> _sources;
+    
+    bool run();
+    UInt64 nextDeadline() const;
+};
+
+#endif /* FloppyShim_IOWorkLoop_h */
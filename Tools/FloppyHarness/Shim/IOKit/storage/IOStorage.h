@@ -0,0 +1,77 @@
+/*
+ * File: IOStorage.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Storage completions and attributes.
+
+#ifndef FloppyShim_IOStorage_h
+#define FloppyShim_IOStorage_h
+
+#include <IOKit/IOService.h>
+#include <IOKit/IOMemoryDescriptor.h>
+
+typedef UInt32 IOStorageOptions;
+typedef UInt32 IOStoragePriority;
+
+enum {
+    kIOStorageOptionNone            = 0x00000000,
+    kIOStorageOptionForceUnitAccess = 0x00000001
+};
+
+enum {
+    kIOStoragePriorityHigh      = 0x00000000,
+    kIOStoragePriorityDefault   = 0x0000007F,
+    kIOStoragePriorityLow       = 0x000000FF
+};
+
+struct IOStorageAttributes {
+    IOStorageOptions options;
+    IOStoragePriority priority;
+    UInt64 bufattr;
+    UInt64 adjustedOffset;
+};
+
+typedef void (*IOStorageCompletionAction)(void *target, void *parameter, IOReturn status, UInt64 actualByteCount);
+
+struct IOStorageCompletion {
+    void *target;
+    IOStorageCompletionAction action;
+    void *parameter;
+};
+
+enum {
+    kIOMediaStateOffline    = 0,
+    kIOMediaStateOnline     = 1,
+    kIOMediaStateBusy       = 2
+};
+typedef UInt32 IOMediaState;
+
+class IOStorage : public IOService {
+public:
+    static void complete(IOStorageCompletion *completion, IOReturn status, UInt64 actualByteCount = 0) {
+        if (completion && completion->action)
+            completion->action(completion->target, completion->parameter, status, actualByteCount);
+    }
+};
+
+#endif /* FloppyShim_IOStorage_h */
@@ -0,0 +1,713 @@
+/*
+ * File: Shim.cpp
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Host implementation of the kernel and IOKit pieces used by the driver.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <algorithm>
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOService.h>
+#include <IOKit/IOWorkLoop.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOInterruptEventSource.h>
+#include <IOKit/IOCommandGate.h>
+#include <IOKit/IOMemoryDescriptor.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include "FloppyShim.h"
+
+task_t kernel_task = NULL;
+
+static OSBoolean sBooleanTrue(true);
+static OSBoolean sBooleanFalse(false);
+OSBoolean *const kOSBooleanTrue = &sBooleanTrue;
+OSBoolean *const kOSBooleanFalse = &sBooleanFalse;
+
+// Virtual clock.
+static UInt64 sNow = 0;
+static FloppyShimDevice *sDevice = NULL;
+static bool sLogging = false;
+
+// IOMalloc and IOMallocAligned calls so far.
+static UInt64 sAllocations = 0;
+
+// All work loops, so the harness can pump them.
+static std::vector<IOWorkLoop*> sWorkLoops;
+
+// Emulated physical memory. Buffers restricted by physical mask are carved out of it from 1MB up.
+static UInt8 *sPhysicalMemory = NULL;
+static IOPhysicalAddress sPhysicalNext = 0x100000;
+
+// Interrupt delivery state. Interrupts raised while a handler runs are delivered once it returns.
+static bool sInInterrupt = false;
+
+/*
+ *
+ * Virtual time.
+ */
+
+void FloppyShimSetDevice(FloppyShimDevice *device) {
+    sDevice = device;
+}
+
+UInt64 FloppyShimGetTime() {
+    return sNow;
+}
+
+void FloppyShimAdvanceTimeTo(UInt64 time) {
+    // Device events can raise interrupts whose handlers touch ports and advance time themselves.
+    UInt64 eventTime;
+    while (sDevice && (eventTime = sDevice->nextEventTime()) <= time) {
+        if (eventTime > sNow)
+            sNow = eventTime;
+        sDevice->runEvents(sNow);
+    }
+    if (time > sNow)
+        sNow = time;
+}
+
+void FloppyShimAdvanceTime(UInt64 nanoseconds) {
+    FloppyShimAdvanceTimeTo(sNow + nanoseconds);
+}
+
+void FloppyShimResetTime(UInt64 time) {
+    if (!sDevice)
+        sNow = time;
+}
+
+void FloppyShimSetLogging(bool enabled) {
+    sLogging = enabled;
+}
+
+UInt64 FloppyShimGetAllocations() {
+    return sAllocations;
+}
+
+extern "C" {
+
+void panic(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "panic: ");
+    vfprintf(stderr, format, args);
+    va_end(args);
+    abort();
+}
+
+UInt64 mach_absolute_time(void) {
+    return sNow;
+}
+
+void clock_get_uptime(UInt64 *result) {
+    *result = sNow;
+}
+
+void absolutetime_to_nanoseconds(UInt64 abstime, UInt64 *result) {
+    *result = abstime;
+}
+
+void nanoseconds_to_absolutetime(UInt64 nanoseconds, UInt64 *result) {
+    *result = nanoseconds;
+}
+
+void clock_interval_to_absolutetime_interval(uint32_t interval, uint32_t scaleFactor, UInt64 *result) {
+    *result = (UInt64)interval * scaleFactor;
+}
+
+void clock_interval_to_deadline(uint32_t interval, uint32_t scaleFactor, UInt64 *result) {
+    *result = sNow + (UInt64)interval * scaleFactor;
+}
+
+/*
+ *
+ * IOLib.
+ */
+
+void IOLog(const char *format, ...) {
+    if (!sLogging)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "[%10.3f] ", sNow / 1000000.0);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+void IOSleep(unsigned milliseconds) {
+    FloppyShimAdvanceTime((UInt64)milliseconds * kMillisecondScale);
+}
+
+void IODelay(unsigned microseconds) {
+    FloppyShimAdvanceTime((UInt64)microseconds * kMicrosecondScale);
+}
+
+void *IOMalloc(size_t size) {
+    sAllocations++;
+    return malloc(size);
+}
+
+void IOFree(void *address, size_t size) {
+    free(address);
+}
+
+void *IOMallocAligned(size_t size, size_t alignment) {
+    void *address = NULL;
+    sAllocations++;
+    if (posix_memalign(&address, alignment < sizeof (void*) ? sizeof (void*) : alignment, size))
+        return NULL;
+    return address;
+}
+
+void IOFreeAligned(void *address, size_t size) {
+    free(address);
+}
+
+struct _IOLock {
+    int held;
+};
+
+struct _IOSimpleLock {
+    int held;
+};
+
+IOLock *IOLockAlloc(void) {
+    return (IOLock*)calloc(1, sizeof (IOLock));
+}
+
+void IOLockFree(IOLock *lock) {
+    if (lock->held)
+        panic("IOLockFree: lock is held\n");
+    free(lock);
+}
+
+void IOLockLock(IOLock *lock) {
+    if (lock->held++)
+        panic("IOLockLock: recursive lock\n");
+}
+
+void IOLockUnlock(IOLock *lock) {
+    lock->held--;
+}
+
+IOSimpleLock *IOSimpleLockAlloc(void) {
+    return (IOSimpleLock*)calloc(1, sizeof (IOSimpleLock));
+}
+
+void IOSimpleLockFree(IOSimpleLock *lock) {
+    free(lock);
+}
+
+void IOSimpleLockLock(IOSimpleLock *lock) {
+    lock->held++;
+}
+
+void IOSimpleLockUnlock(IOSimpleLock *lock) {
+    lock->held--;
+}
+
+IOInterruptState IOSimpleLockLockDisableInterrupt(IOSimpleLock *lock) {
+    IOSimpleLockLock(lock);
+    return 0;
+}
+
+void IOSimpleLockUnlockEnableInterrupt(IOSimpleLock *lock, IOInterruptState state) {
+    IOSimpleLockUnlock(lock);
+}
+
+}
+
+/*
+ *
+ * Registry entries and services.
+ */
+
+bool IORegistryEntry::init(OSDictionary *dictionary) {
+    if (!OSObject::init())
+        return false;
+
+    // Like the kernel, the dictionary becomes the property table.
+    if (dictionary) {
+        _properties = dictionary;
+        _properties->retain();
+    } else
+        _properties = OSDictionary::withCapacity(8);
+    return true;
+}
+
+void IORegistryEntry::free() {
+    OSSafeReleaseNULL(_properties);
+    OSObject::free();
+}
+
+OSObject *IORegistryEntry::getProperty(const char *key) const {
+    return _properties ? _properties->getObject(key) : NULL;
+}
+
+bool IORegistryEntry::setProperty(const char *key, OSObject *object) {
+    if (!_properties)
+        _properties = OSDictionary::withCapacity(8);
+    return _properties->setObject(key, object);
+}
+
+bool IORegistryEntry::setProperty(const char *key, const char *string) {
+    OSString *object = OSString::withCString(string);
+    bool result = setProperty(key, object);
+    object->release();
+    return result;
+}
+
+bool IORegistryEntry::setProperty(const char *key, bool value) {
+    return setProperty(key, value ? kOSBooleanTrue : kOSBooleanFalse);
+}
+
+bool IORegistryEntry::setProperty(const char *key, unsigned long long value, unsigned int numberOfBits) {
+    OSNumber *object = OSNumber::withNumber(value, numberOfBits);
+    bool result = setProperty(key, object);
+    object->release();
+    return result;
+}
+
+void IORegistryEntry::removeProperty(const char *key) {
+    if (_properties)
+        _properties->removeObject(key);
+}
+
+bool IOService::attach(IOService *provider) {
+    _provider = provider;
+    provider->_clients.push_back(this);
+    provider->retain();
+    return true;
+}
+
+void IOService::detach(IOService *provider) {
+    std::vector<IOService*>::iterator it = std::find(provider->_clients.begin(), provider->_clients.end(), this);
+    if (it != provider->_clients.end())
+        provider->_clients.erase(it);
+    if (_provider == provider) {
+        _provider = NULL;
+        provider->release();
+    }
+}
+
+IOReturn IOService::messageClients(UInt32 type, void *argument, size_t argSize) {
+    for (size_t i = 0; i < _clients.size(); i++)
+        _clients[i]->message(type, this, argument);
+    return kIOReturnSuccess;
+}
+
+IOReturn IOService::registerInterrupt(int source, OSObject *target, IOInterruptAction handler, void *refCon) {
+    if (source < 0)
+        return kIOReturnBadArgument;
+    if ((size_t)source >= _interrupts.size()) {
+        Interrupt empty = { NULL, NULL, NULL, false, false };
+        _interrupts.resize(source + 1, empty);
+    }
+    if (_interrupts[source].handler)
+        return kIOReturnNoResources;
+
+    Interrupt interrupt = { target, handler, refCon, false, false };
+    _interrupts[source] = interrupt;
+    return kIOReturnSuccess;
+}
+
+IOReturn IOService::unregisterInterrupt(int source) {
+    if (source < 0 || (size_t)source >= _interrupts.size() || !_interrupts[source].handler)
+        return kIOReturnNoInterrupt;
+    _interrupts[source].handler = NULL;
+    _interrupts[source].enabled = false;
+    return kIOReturnSuccess;
+}
+
+IOReturn IOService::enableInterrupt(int source) {
+    if (source < 0 || (size_t)source >= _interrupts.size() || !_interrupts[source].handler)
+        return kIOReturnNoInterrupt;
+    _interrupts[source].enabled = true;
+
+    // Deliver anything raised while disabled.
+    if (_interrupts[source].pending)
+        deliverInterrupt(source);
+    return kIOReturnSuccess;
+}
+
+IOReturn IOService::disableInterrupt(int source) {
+    if (source < 0 || (size_t)source >= _interrupts.size() || !_interrupts[source].handler)
+        return kIOReturnNoInterrupt;
+    _interrupts[source].enabled = false;
+    return kIOReturnSuccess;
+}
+
+void IOService::deliverInterrupt(int source) {
+    if (source < 0 || (size_t)source >= _interrupts.size() || !_interrupts[source].handler)
+        return;
+
+    // Hold the interrupt while it is masked or another handler is running.
+    Interrupt *interrupt = &_interrupts[source];
+    interrupt->pending = true;
+    if (!interrupt->enabled || sInInterrupt)
+        return;
+
+    sInInterrupt = true;
+    while (interrupt->pending && interrupt->enabled && interrupt->handler) {
+        interrupt->pending = false;
+        interrupt->handler(interrupt->target, interrupt->refCon, this, source);
+        interrupt = &_interrupts[source];
+    }
+    sInInterrupt = false;
+}
+
+/*
+ *
+ * Work loops and event sources.
+ */
+
+IOWorkLoop *IOWorkLoop::workLoop() {
+    IOWorkLoop *workLoop = new IOWorkLoop;
+    sWorkLoops.push_back(workLoop);
+    return workLoop;
+}
+
+void IOWorkLoop::free() {
+    // Sources are retained by the work loop they are in.
+    while (!_sources.empty())
+        removeEventSource(_sources.back());
+    sWorkLoops.erase(std::find(sWorkLoops.begin(), sWorkLoops.end(), this));
+    OSObject::free();
+}
+
+IOReturn IOWorkLoop::addEventSource(IOEventSource *source) {
+    if (source->_workLoop)
+        return kIOReturnExclusiveAccess;
+    source->retain();
+    source->_workLoop = this;
+    _sources.push_back(source);
+    return kIOReturnSuccess;
+}
+
+IOReturn IOWorkLoop::removeEventSource(IOEventSource *source) {
+    std::vector<IOEventSource*>::iterator it = std::find(_sources.begin(), _sources.end(), source);
+    if (it == _sources.end())
+        return kIOReturnNotFound;
+    _sources.erase(it);
+    source->_workLoop = NULL;
+    source->release();
+    return kIOReturnSuccess;
+}
+
+bool IOWorkLoop::run() {
+    // Sources can be removed by actions, so hold references while running them.
+    std::vector<IOEventSource*> sources = _sources;
+    for (size_t i = 0; i < sources.size(); i++)
+        sources[i]->retain();
+
+    bool worked = false;
+    for (size_t i = 0; i < sources.size(); i++) {
+        if (sources[i]->_workLoop == this && sources[i]->checkForWork())
+            worked = true;
+        sources[i]->release();
+    }
+    return worked;
+}
+
+UInt64 IOWorkLoop::nextDeadline() const {
+    UInt64 next = 0;
+    for (size_t i = 0; i < _sources.size(); i++) {
+        UInt64 deadline = _sources[i]->nextDeadline();
+        if (deadline && (!next || deadline < next))
+            next = deadline;
+    }
+    return next;
+}
+
+bool IOWorkLoop::runAll() {
+    bool worked = false;
+    std::vector<IOWorkLoop*> workLoops = sWorkLoops;
+    for (size_t i = 0; i < workLoops.size(); i++) {
+        if (std::find(sWorkLoops.begin(), sWorkLoops.end(), workLoops[i]) != sWorkLoops.end() && workLoops[i]->run())
+            worked = true;
+    }
+    return worked;
+}
+
+UInt64 IOWorkLoop::nextDeadlineAll() {
+    UInt64 next = 0;
+    for (size_t i = 0; i < sWorkLoops.size(); i++) {
+        UInt64 deadline = sWorkLoops[i]->nextDeadline();
+        if (deadline && (!next || deadline < next))
+            next = deadline;
+    }
+    return next;
+}
+
+IOTimerEventSource *IOTimerEventSource::timerEventSource(OSObject *owner, Action action) {
+    IOTimerEventSource *timer = new IOTimerEventSource;
+    timer->_owner = owner;
+    timer->_action = (void*)action;
+    timer->_deadline = 0;
+    return timer;
+}
+
+IOReturn IOTimerEventSource::setTimeoutMS(UInt32 ms) {
+    return setTimeout((UInt64)ms * kMillisecondScale);
+}
+
+IOReturn IOTimerEventSource::setTimeoutUS(UInt32 us) {
+    return setTimeout((UInt64)us * kMicrosecondScale);
+}
+
+IOReturn IOTimerEventSource::setTimeout(UInt64 interval) {
+    return wakeAtTime(sNow + interval);
+}
+
+IOReturn IOTimerEventSource::wakeAtTime(UInt64 abstime) {
+    _deadline = abstime ? abstime : 1;
+    return kIOReturnSuccess;
+}
+
+void IOTimerEventSource::cancelTimeout() {
+    _deadline = 0;
+}
+
+bool IOTimerEventSource::checkForWork() {
+    if (!_enabled || !_deadline || _deadline > sNow)
+        return false;
+
+    _deadline = 0;
+    if (_action)
+        ((Action)_action)(_owner, this);
+    return true;
+}
+
+IOInterruptEventSource *IOInterruptEventSource::interruptEventSource(OSObject *owner, Action action, IOService *provider, int intIndex) {
+    IOInterruptEventSource *source = new IOInterruptEventSource;
+    source->_owner = owner;
+    source->_action = (void*)action;
+    source->_pending = 0;
+    return source;
+}
+
+void IOInterruptEventSource::interruptOccurred(void *refCon, IOService *nub, int source) {
+    _pending++;
+}
+
+bool IOInterruptEventSource::checkForWork() {
+    if (!_enabled || !_pending)
+        return false;
+
+    int count = _pending;
+    _pending = 0;
+    if (_action)
+        ((Action)_action)(_owner, this, count);
+    return true;
+}
+
+IOCommandGate *IOCommandGate::commandGate(OSObject *owner, Action action) {
+    IOCommandGate *gate = new IOCommandGate;
+    gate->_owner = owner;
+    gate->_action = (void*)action;
+    return gate;
+}
+
+IOReturn IOCommandGate::runAction(Action action, void *arg0, void *arg1, void *arg2, void *arg3) {
+    if (!action)
+        return kIOReturnBadArgument;
+
+    // A disabled gate would block the caller until it is enabled again. Nothing can enable it
+    // while the only thread is blocked, so fail instead.
+    if (!_enabled)
+        return kIOReturnNotPermitted;
+    return action(_owner, arg0, arg1, arg2, arg3);
+}
+
+IOReturn IOCommandGate::attemptAction(Action action, void *arg0, void *arg1, void *arg2, void *arg3) {
+    return runAction(action, arg0, arg1, arg2, arg3);
+}
+
+IOReturn IOCommandGate::runCommand(void *arg0, void *arg1, void *arg2, void *arg3) {
+    return runAction((Action)_action, arg0, arg1, arg2, arg3);
+}
+
+IOReturn IOCommandGate::commandSleep(void *event, UInt32 interruptible) {
+    // Nothing else can run to wake us.
+    return THREAD_INTERRUPTED;
+}
+
+IOReturn IOCommandGate::commandSleep(void *event, UInt64 deadline, UInt32 interruptible) {
+    FloppyShimAdvanceTimeTo(deadline);
+    return THREAD_TIMED_OUT;
+}
+
+/*
+ *
+ * Memory.
+ */
+
+UInt8 *FloppyShimPhysicalToVirtual(IOPhysicalAddress address, IOByteCount length) {
+    if (address + length > kFloppyShimPhysicalMemorySize || address + length < address)
+        return NULL;
+    if (!sPhysicalMemory)
+        sPhysicalMemory = (UInt8*)calloc(1, kFloppyShimPhysicalMemorySize);
+    return sPhysicalMemory + address;
+}
+
+IOMemoryMap::IOMemoryMap(IOMemoryDescriptor *memory) : _memory(memory) {
+    _memory->retain();
+}
+
+void IOMemoryMap::free() {
+    OSSafeReleaseNULL(_memory);
+    OSObject::free();
+}
+
+IOVirtualAddress IOMemoryMap::getVirtualAddress() {
+    return (IOVirtualAddress)_memory->_bytes;
+}
+
+IOByteCount IOMemoryMap::getLength() {
+    return _memory->_length;
+}
+
+IOPhysicalAddress IOMemoryMap::getPhysicalAddress() {
+    return _memory->_physical ? _memory->_physicalAddress : 0;
+}
+
+IOMemoryDescriptor *IOMemoryDescriptor::withPhysicalAddress(IOPhysicalAddress address, IOByteCount withLength, IODirection withDirection) {
+    UInt8 *bytes = FloppyShimPhysicalToVirtual(address, withLength);
+    if (!bytes)
+        return NULL;
+
+    IOMemoryDescriptor *memory = new IOMemoryDescriptor;
+    memory->_bytes = bytes;
+    memory->_length = withLength;
+    memory->_direction = withDirection;
+    memory->_physicalAddress = address;
+    memory->_physical = true;
+    return memory;
+}
+
+IOMemoryDescriptor *IOMemoryDescriptor::withAddress(void *address, IOByteCount withLength, IODirection withDirection) {
+    IOMemoryDescriptor *memory = new IOMemoryDescriptor;
+    memory->_bytes = (UInt8*)address;
+    memory->_length = withLength;
+    memory->_direction = withDirection;
+    return memory;
+}
+
+IOByteCount IOMemoryDescriptor::readBytes(IOByteCount offset, void *bytes, IOByteCount withLength) {
+    if (offset >= _length)
+        return 0;
+    if (withLength > _length - offset)
+        withLength = _length - offset;
+    memcpy(bytes, _bytes + offset, withLength);
+    return withLength;
+}
+
+IOByteCount IOMemoryDescriptor::writeBytes(IOByteCount offset, const void *bytes, IOByteCount withLength) {
+    if (offset >= _length)
+        return 0;
+    if (withLength > _length - offset)
+        withLength = _length - offset;
+    memcpy(_bytes + offset, bytes, withLength);
+    return withLength;
+}
+
+IOMemoryMap *IOMemoryDescriptor::map(IOOptionBits options) {
+    return new IOMemoryMap(this);
+}
+
+IOReturn IOMemoryDescriptor::prepare(IODirection forDirection) {
+    _prepareCount++;
+    return kIOReturnSuccess;
+}
+
+IOReturn IOMemoryDescriptor::complete(IODirection forDirection) {
+    if (!_prepareCount)
+        panic("IOMemoryDescriptor::complete: not prepared\n");
+    _prepareCount--;
+    return kIOReturnSuccess;
+}
+
+IOPhysicalAddress IOMemoryDescriptor::getPhysicalSegment(IOByteCount offset, IOByteCount *length, IOOptionBits options) {
+    if (!_physical || offset >= _length) {
+        if (length)
+            *length = 0;
+        return 0;
+    }
+    if (length)
+        *length = _length - offset;
+    return _physicalAddress + offset;
+}
+
+void IOBufferMemoryDescriptor::free() {
+    if (_owned)
+        ::free(_bytes);
+    else if (_physical && _physicalAddress + _capacity == sPhysicalNext)
+        sPhysicalNext = _physicalAddress; // Hand back the most recent carve-out.
+    _bytes = NULL;
+    IOMemoryDescriptor::free();
+}
+
+IOBufferMemoryDescriptor *IOBufferMemoryDescriptor::withCapacity(IOByteCount capacity, IODirection withDirection, bool withContiguousMemory) {
+    return inTaskWithOptions(kernel_task, withDirection, capacity, 1);
+}
+
+IOBufferMemoryDescriptor *IOBufferMemoryDescriptor::inTaskWithOptions(task_t inTask, IOOptionBits options, IOByteCount capacity, IOByteCount alignment) {
+    UInt8 *bytes = (UInt8*)IOMallocAligned(capacity ? capacity : 1, alignment);
+    if (!bytes)
+        return NULL;
+    bzero(bytes, capacity);
+
+    IOBufferMemoryDescriptor *memory = new IOBufferMemoryDescriptor;
+    memory->_bytes = bytes;
+    memory->_length = capacity;
+    memory->_capacity = capacity;
+    memory->_direction = options & kIODirectionInOut;
+    memory->_owned = true;
+    return memory;
+}
+
+IOBufferMemoryDescriptor *IOBufferMemoryDescriptor::inTaskWithPhysicalMask(task_t inTask, IOOptionBits options, mach_vm_size_t capacity, mach_vm_address_t physicalMask) {
+    // Clear low bits of the mask give the alignment; the mask also limits the highest address.
+    IOPhysicalAddress alignment = physicalMask ? (physicalMask & ~(physicalMask - 1)) : 1;
+    IOPhysicalAddress address = (sPhysicalNext + alignment - 1) & ~(alignment - 1);
+    if ((address + capacity - 1) & ~(physicalMask | (alignment - 1)))
+        return NULL;
+
+    UInt8 *bytes = FloppyShimPhysicalToVirtual(address, capacity);
+    if (!bytes)
+        return NULL;
+    sPhysicalNext = address + capacity;
+    bzero(bytes, capacity);
+
+    IOBufferMemoryDescriptor *memory = new IOBufferMemoryDescriptor;
+    memory->_bytes = bytes;
+    memory->_length = capacity;
+    memory->_capacity = capacity;
+    memory->_direction = options & kIODirectionInOut;
+    memory->_physicalAddress = address;
+    memory->_physical = true;
+    return memory;
+}
@@ -0,0 +1,60 @@
+/*
+ * File: OSAtomic.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Atomic operations. Return values match the kernel: the value before the operation.
+
+#ifndef FloppyShim_OSAtomic_h
+#define FloppyShim_OSAtomic_h
+
+#include <sys/systm.h>
+
+static inline SInt32 OSAddAtomic(SInt32 amount, volatile SInt32 *address) {
+    return __sync_fetch_and_add(address, amount);
+}
+
+static inline SInt32 OSIncrementAtomic(volatile SInt32 *address) {
+    return OSAddAtomic(1, address);
+}
+
+static inline SInt32 OSDecrementAtomic(volatile SInt32 *address) {
+    return OSAddAtomic(-1, address);
+}
+
+static inline SInt64 OSAddAtomic64(SInt64 amount, volatile SInt64 *address) {
+    return __sync_fetch_and_add(address, amount);
+}
+
+static inline bool OSCompareAndSwap(UInt32 oldValue, UInt32 newValue, volatile UInt32 *address) {
+    return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+
+static inline bool OSCompareAndSwapPtr(void *oldValue, void *newValue, void * volatile *address) {
+    return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+
+static inline void OSMemoryBarrier(void) {
+    __sync_synchronize();
+}
+
+#endif /* FloppyShim_OSAtomic_h */
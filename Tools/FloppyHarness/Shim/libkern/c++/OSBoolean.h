@@ -0,0 +1,57 @@
+/*
+ * File: OSBoolean.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Boolean singletons.
+
+#ifndef FloppyShim_OSBoolean_h
+#define FloppyShim_OSBoolean_h
+
+#include <libkern/c++/OSObject.h>
+
+class OSBoolean : public OSObject {
+public:
+    explicit OSBoolean(bool value) : _value(value) {}
+    
+    static OSBoolean *withBoolean(bool value);
+    bool isTrue() const { return _value; }
+    bool isFalse() const { return !_value; }
+    bool getValue() const { return _value; }
+    
+    // Singletons are never freed.
+    virtual void free() {}
+    
+private:
+    bool _value;
+};
+
+extern OSBoolean *const kOSBooleanTrue;
+extern OSBoolean *const kOSBooleanFalse;
+
+inline OSBoolean *OSBoolean::withBoolean(bool value) {
+    OSBoolean *boolean = value ? kOSBooleanTrue : kOSBooleanFalse;
+    boolean->retain();
+    return boolean;
+}
+
+#endif /* FloppyShim_OSBoolean_h */
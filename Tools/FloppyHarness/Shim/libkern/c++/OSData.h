@@ -0,0 +1,48 @@
+/*
+ * File: OSData.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Byte buffers stored in property tables.
+
+#ifndef FloppyShim_OSData_h
+#define FloppyShim_OSData_h
+
+#include <libkern/c++/OSObject.h>
+#include <vector>
+
+class OSData : public OSObject {
+public:
+    static OSData *withBytes(const void *bytes, unsigned int numBytes) {
+        OSData *data = new OSData;
+        data->_bytes.assign((const unsigned char*)bytes, (const unsigned char*)bytes + numBytes);
+        return data;
+    }
+    
+    const void *getBytesNoCopy() const { return _bytes.empty() ? NULL : &_bytes[0]; }
+    unsigned int getLength() const { return (unsigned int)_bytes.size(); }
+    
+private:
+    std::vector<unsigned char> _bytes;
+};
+
+#endif /* FloppyShim_OSData_h */
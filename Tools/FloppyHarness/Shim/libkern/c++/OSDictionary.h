@@ -0,0 +1,75 @@
+/*
+ * File: OSDictionary.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Property tables. Objects are retained while they are in the dictionary.
+
+#ifndef FloppyShim_OSDictionary_h
+#define FloppyShim_OSDictionary_h
+
+#include <libkern/c++/OSObject.h>
+#include <map>
+#include <string>
+
+class OSCollection : public OSObject {};
+
+class OSDictionary : public OSCollection {
+public:
+    static OSDictionary *withCapacity(unsigned int capacity) { return new OSDictionary; }
+    
+    bool setObject(const char *key, const OSObject *object) {
+        if (!key || !object)
+            return false;
+        object->retain();
+        removeObject(key);
+        _objects[key] = const_cast<OSObject*>(object);
+        return true;
+    }
+    
+    OSObject *getObject(const char *key) const {
+        std::map<std::string, OSObject*>::const_iterator it = _objects.find(key);
+        return it == _objects.end() ? NULL : it->second;
+    }
+    
+    void removeObject(const char *key) {
+        std::map<std::string, OSObject*>::iterator it = _objects.find(key);
+        if (it == _objects.end())
+            return;
+        it->second->release();
+        _objects.erase(it);
+    }
+    
+    unsigned int getCount() const { return (unsigned int)_objects.size(); }
+    
+    virtual void free() {
+        for (std::map<std::string, OSObject*>::iterator it = _objects.begin(); it != _objects.end(); it++)
+            it->second->release();
+        _objects.clear();
+        OSCollection::free();
+    }
+    
+private:
+    std::map<std::string, OSObject*> _objects;
+};
+
+#endif /* FloppyShim_OSDictionary_h */
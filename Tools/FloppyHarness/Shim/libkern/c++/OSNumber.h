@@ -0,0 +1,56 @@
+/*
+ * File: OSNumber.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Numbers stored in property tables.
+
+#ifndef FloppyShim_OSNumber_h
+#define FloppyShim_OSNumber_h
+
+#include <libkern/c++/OSObject.h>
+
+class OSNumber : public OSObject {
+public:
+    static OSNumber *withNumber(unsigned long long value, unsigned int numberOfBits) {
+        OSNumber *number = new OSNumber;
+        number->_bits = numberOfBits;
+        number->setValue(value);
+        return number;
+    }
+    
+    void setValue(unsigned long long value) {
+        _value = _bits >= 64 ? value : (value & ((1ULL << _bits) - 1));
+    }
+    
+    UInt8 unsigned8BitValue() const { return (UInt8)_value; }
+    UInt16 unsigned16BitValue() const { return (UInt16)_value; }
+    UInt32 unsigned32BitValue() const { return (UInt32)_value; }
+    UInt64 unsigned64BitValue() const { return _value; }
+    unsigned int numberOfBits() const { return _bits; }
+    
+private:
+    UInt64 _value;
+    unsigned int _bits;
+};
+
+#endif /* FloppyShim_OSNumber_h */
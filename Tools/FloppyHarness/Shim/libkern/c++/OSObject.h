@@ -0,0 +1,70 @@
+/*
+ * File: OSObject.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Reference counted root class and the libkern macros the driver uses.
+
+#ifndef FloppyShim_OSObject_h
+#define FloppyShim_OSObject_h
+
+#include <sys/systm.h>
+#include <libkern/OSAtomic.h>
+
+class OSObject {
+public:
+    OSObject() : _retainCount(1) {}
+    virtual ~OSObject() {}
+    
+    virtual bool init() { return true; }
+    virtual void free() { delete this; }
+    
+    void retain() const { _retainCount++; }
+    void release() const {
+        if (--_retainCount == 0)
+            const_cast<OSObject*>(this)->free();
+    }
+    int getRetainCount() const { return _retainCount; }
+    
+private:
+    mutable int _retainCount;
+};
+
+#define OSDeclareDefaultStructors(className) \
+    public: \
+        className(); \
+        virtual ~className(); \
+    private:
+
+#define OSDefineMetaClassAndStructors(className, superclassName) \
+    className::className() : superclassName() {} \
+    className::~className() {}
+
+#define OSTypeAlloc(type)       (new type)
+#define OSDynamicCast(type, inst) (dynamic_cast<type *>(inst))
+#define OSSafeReleaseNULL(inst) do { if (inst) { (inst)->release(); (inst) = NULL; } } while (0)
+
+// Like the kernel, this relies on the compiler resolving a bound member function to a plain function
+// that takes the object as its first argument. GCC needs -Wno-pmf-conversions for this.
+#define OSMemberFunctionCast(cptrtype, self, func) ((cptrtype)((self)->*(func)))
+
+#endif /* FloppyShim_OSObject_h */
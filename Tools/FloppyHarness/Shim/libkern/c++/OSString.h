@@ -0,0 +1,50 @@
+/*
+ * File: OSString.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Strings stored in property tables.
+
+#ifndef FloppyShim_OSString_h
+#define FloppyShim_OSString_h
+
+#include <libkern/c++/OSObject.h>
+#include <string>
+
+class OSString : public OSObject {
+public:
+    static OSString *withCString(const char *cString) {
+        OSString *string = new OSString;
+        string->_string = cString;
+        return string;
+    }
+    static OSString *withCStringNoCopy(const char *cString) { return withCString(cString); }
+    
+    bool isEqualTo(const char *cString) const { return _string == cString; }
+    const char *getCStringNoCopy() const { return _string.c_str(); }
+    unsigned int getLength() const { return (unsigned int)_string.length(); }
+    
+private:
+    std::string _string;
+};
+
+#endif /* FloppyShim_OSString_h */
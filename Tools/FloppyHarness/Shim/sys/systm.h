@@ -0,0 +1,74 @@
+/*
+ * File: systm.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Kernel basics for building the driver on the host. Time is virtual and owned by the harness.
+
+#ifndef FloppyShim_systm_h
+#define FloppyShim_systm_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+typedef uint8_t UInt8;
+typedef int8_t SInt8;
+typedef uint16_t UInt16;
+typedef int16_t SInt16;
+typedef uint32_t UInt32;
+typedef int32_t SInt32;
+typedef unsigned long long UInt64;
+typedef long long SInt64;
+
+typedef int kern_return_t;
+typedef UInt64 mach_vm_address_t;
+typedef UInt64 mach_vm_size_t;
+typedef struct task *task_t;
+extern task_t kernel_task;
+
+typedef struct kmod_info {
+    char name[64];
+    char version[64];
+} kmod_info_t;
+
+enum {
+    kNanosecondScale    = 1,
+    kMicrosecondScale   = 1000,
+    kMillisecondScale   = 1000 * 1000,
+    kSecondScale        = 1000 * 1000 * 1000
+};
+
+extern "C" {
+void panic(const char *format, ...) __attribute__((noreturn, format(printf, 1, 2)));
+
+// Absolute time is in nanoseconds of virtual time.
+UInt64 mach_absolute_time(void);
+void clock_get_uptime(UInt64 *result);
+void absolutetime_to_nanoseconds(UInt64 abstime, UInt64 *result);
+void nanoseconds_to_absolutetime(UInt64 nanoseconds, UInt64 *result);
+void clock_interval_to_deadline(uint32_t interval, uint32_t scaleFactor, UInt64 *result);
+void clock_interval_to_absolutetime_interval(uint32_t interval, uint32_t scaleFactor, UInt64 *result);
+}
+
+#endif /* FloppyShim_systm_h */
@@ -28,6 +28,21 @@
 #include <sys/systm.h>
 #include <mach/mach_types.h>
 
+#ifdef FLOPPY_HOST_HARNESS
+// Port I/O goes to the emulated controller when built into the host harness.
+void FloppyHarnessOutb(uint16_t port, uint8_t data);
+uint8_t FloppyHarnessInb(uint16_t port);
+
+static inline void outb(uint16_t port, uint8_t data)
+{
+    FloppyHarnessOutb(port, data);
+}
+
+static inline uint8_t inb(uint16_t port)
+{
+    return FloppyHarnessInb(port);
+}
+#else
 // Outputs a byte to the specified port.
 static inline void outb(uint16_t port, uint8_t data)
 {
@@ -41,6 +56,7 @@ static inline uint8_t inb(uint16_t port)
     asm volatile("inb %1, %0" : "=a"(data) : "Nd"(port));
     return data;
 }
+#endif
 
 #define DIVIDE_ROUND_UP(a, b) (((a - 1) / b) + 1)
 
@@ -23,6 +23,7 @@
  */
 
 #include <IOKit/IOLib.h>
+#include <kern/clock.h>
 #include "IO.h"
 
 #include "VoodooFloppyController.hpp"
@@ -45,6 +46,24 @@ static const IOPMPowerState FloppyPowerStateArray[kFloppyPowerStateCount] = {
     { 1, kIOPMDeviceUsable, IOPMPowerOn, IOPMPowerOn, 0,0,0,0,0,0,0,0 }
 };
 
+// 8237 address and page ports for channels 0-3. Count ports follow each address port.
+static const UInt8 dmaAddressPorts[4] = { 0x00, 0x02, 0x04, 0x06 };
+static const UInt8 dmaPagePorts[4] = { 0x87, 0x83, 0x81, 0x82 };
+
+// Media formats, found by the sector size READ ID reports. The first is assumed until the media is probed.
+// 1024-byte sectors fit 10 KB on a track instead of 9 KB, as there are fewer ID fields and gaps.
+static const FloppyMediaFormat floppyMediaFormats[] = {
+    { FLOPPY_SPEED_500KBPS, FLOPPY_BYTES_SECTOR_512,  18, 80, FLOPPY_GAP3_3_5,  FLOPPY_GAP3_FORMAT_512 },
+    { FLOPPY_SPEED_500KBPS, FLOPPY_BYTES_SECTOR_1024, 10, 80, FLOPPY_GAP3_1024, FLOPPY_GAP3_FORMAT_1024 }
+};
+
+// The 8237 is shared by all controllers.
+static IOSimpleLock *volatile gDmaLock = NULL;
+static volatile SInt32 gDmaLockUsers = 0;
+
+// A channel carries one transfer at a time, so each is owned by the controller that claimed it first.
+static VoodooFloppyController *volatile gDmaChannelOwners[4] = { NULL, NULL, NULL, NULL };
+
 /*! @function init
  @abstract Initializes generic IOService data structures (expansion data, etc). */
 bool VoodooFloppyController::init(OSDictionary *dictionary) {
@@ -55,16 +74,87 @@ bool VoodooFloppyController::init(OSDictionary *dictionary) {
     // Ensure variables are cleared.
     _driveAType = 0;
     _driveBType = 0;
+    _ioBase = FLOPPY_BASE_PRIMARY;
+    _dmaChannel = FLOPPY_DMA_CHANNEL;
+    _dmaPhysAddr = 0;
     _driveADevice = NULL;
     _driveBDevice = NULL;
+    for (UInt8 i = 0; i < FLOPPY_MAX_DRIVES; i++) {
+        _driveState[i].format = &floppyMediaFormats[0];
+        _driveState[i].sectorHashes = NULL;
+        _driveState[i].mirror = NULL;
+        _driveState[i].mirrorValid = NULL;
+        _driveState[i].mirrorSectors = 0;
+        _driveState[i].mirrorBlockSize = 0;
+        _driveState[i].mirrorCylinder = kFloppyMirrorStopped;
+        _driveState[i].motorOnTime = 0;
+        _driveState[i].spinUpCount = 0;
+        _driveState[i].spinUpTimeouts = 0;
+        _driveState[i].spinUpLastUs = 0;
+        _driveState[i].spinUpMaxUs = 0;
+        _driveState[i].spinUpTotalUs = 0;
+    }
+    invalidateCylinder();
     
     _workLoop = NULL;
     _tmrMotorOffSource = NULL;
+    _tmrBringUpSource = NULL;
+    _tmrMirrorSource = NULL;
+    _dispatchSource = NULL;
+    _queueLock = NULL;
+    _queueHead = NULL;
+    _maxGateHoldMs = kFloppyMaxGateHoldMsDefault;
+    _requestTimeoutMs = kFloppyRequestTimeoutMsDefault;
+    _requestDeadline = 0;
+    _abortStatus = kIOReturnSuccess;
+    bzero(_latencyCount, sizeof (_latencyCount));
+    bzero(_latencyTotalUs, sizeof (_latencyTotalUs));
+    bzero(_latencyMaxUs, sizeof (_latencyMaxUs));
+    _controllerReady = false;
+    _motorHeld = false;
+    _imageSessionRunning = false;
+    _mirrorEnabled = false;
+    _mirrorFilling = false;
+    _mirrorPreempt = false;
     _irqTriggered = false;
+    _irqTime = 0;
+    _traceMemory = NULL;
+    _traceRing = NULL;
+    _traceStartTime = 0;
+    _traceEnabled = false;
     
     _dmaMemoryDesc = NULL;
-    _dmaMemoryMap = NULL;
     _dmaBuffer = NULL;
+    _useDma = true;
+    
+    _pioLock = NULL;
+    _pioBuffer = NULL;
+    _pioLength = 0;
+    _pioOffset = 0;
+    _pioWrite = false;
+    _pioActive = false;
+    _pioPolling = false;
+    
+    _dorShadow = 0;
+    invalidateRegisterShadow(true);
+    _fifoThreshold = FLOPPY_FIFO_THRESHOLD_MIN;
+    _fifoOverruns = 0;
+    _fifoTransfers = 0;
+    _fifoCleanTransfers = 0;
+    _handshakeStalls = 0;
+    _handshakeErrors = 0;
+    _irqLost = 0;
+    _irqRecovered = 0;
+    _resetting = false;
+    _elidedSectors = 0;
+    _elidedBytes = 0;
+    _elidedCommands = 0;
+    _elisionChanged = false;
+    _mergedCommands = 0;
+    _mergedRequests = 0;
+    _mergedGapSectors = 0;
+    _savedRegsValid = false;
+    _needsRestore = false;
 
     return true;
 }
@@ -80,6 +170,9 @@ IOService *VoodooFloppyController::probe(IOService *provider, SInt32 *score) {
     if (!super::probe(provider, score))
         return NULL;
     
+    // Get I/O base and DMA channel for this controller.
+    getResources(provider);
+    
     // Detect drives to see if we should match or not.
     if (!detectDrives(&_driveAType, &_driveBType)) {
         IOLog("VoodooFloppyController: No drives found in CMOS. Aborting.\n");
@@ -108,8 +201,32 @@ bool VoodooFloppyController::start(IOService *provider) {
     provider->joinPMtree(this);
     
     // Create variables.
-    UInt8 version;
     IOReturn status;
+    OSNumber *maxGateHold;
+    OSNumber *requestTimeout;
+    OSBoolean *ramMirror;
+    OSBoolean *trace;
+    
+    // Get shared lock for the DMA controller, creating it for the first controller.
+    OSIncrementAtomic(&gDmaLockUsers);
+    if (!gDmaLock) {
+        IOSimpleLock *dmaLock = IOSimpleLockAlloc();
+        if (!dmaLock || !OSCompareAndSwapPtr(NULL, dmaLock, (void* volatile*)&gDmaLock)) {
+            if (dmaLock)
+                IOSimpleLockFree(dmaLock);
+        }
+        if (!gDmaLock) {
+            IOLog("VoodooFloppyController: Failed to create IOSimpleLock.\n");
+            goto fail;
+        }
+    }
+    
+    // Create lock for PIO state shared with the interrupt handler.
+    _pioLock = IOSimpleLockAlloc();
+    if (!_pioLock) {
+        IOLog("VoodooFloppyController: Failed to create IOSimpleLock.\n");
+        goto fail;
+    }
     
     // Setup new workloop.
     _workLoop = IOWorkLoop::workLoop();
@@ -133,37 +250,25 @@ bool VoodooFloppyController::start(IOService *provider) {
         goto fail;
     }
     
-    // Reset controller.
-    resetController();
-    
-    // Get version. If version is 0xFF, that means there isn't a floppy controller.
-    version = getControllerVersion();
-    if (version == FLOPPY_VERSION_NONE) {
-        IOLog("VoodooFloppyController: No floppy controller present.\n");
-        goto fail;
-    }
-    
-    // Print version and configure controller.
-    IOLog("VoodooFloppyController: Version: 0x%X.\n", version);
-    configureController();
-    
-    // Create descriptor for DMA buffer.
-    _dmaMemoryDesc = IOMemoryDescriptor::withPhysicalAddress(FLOPPY_DMASTART, FLOPPY_DMALENGTH, kIODirectionInOut);
+    // Allocate DMA buffer. ISA DMA only reaches the first 16MB, and a transfer can't cross a 64KB page.
+    _dmaMemoryDesc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, kIODirectionInOut | kIOMemoryPhysicallyContiguous, FLOPPY_DMALENGTH, FLOPPY_DMAMASK);
     if (!_dmaMemoryDesc) {
-        IOLog("VoodooFloppyController: Failed to create IOMemoryDescriptor.\n");
+        IOLog("VoodooFloppyController: Failed to allocate DMA buffer.\n");
         goto fail;
     }
     
-    // Map DMA buffer into addressable memory.
-    _dmaMemoryMap = _dmaMemoryDesc->map();
-    if (!_dmaMemoryMap) {
-        IOLog("VoodooFloppyController: Failed to map IOMemoryDescriptor.\n");
+    // Wire DMA buffer.
+    status = _dmaMemoryDesc->prepare();
+    if (status != kIOReturnSuccess) {
+        IOLog("VoodooFloppyController: Failed to prepare DMA buffer: 0x%X\n", status);
+        OSSafeReleaseNULL(_dmaMemoryDesc);
         goto fail;
     }
     
-    // Get pointer to buffer.
-    _dmaBuffer = (UInt8*)_dmaMemoryMap->getAddress();
-    IOLog("VoodooFloppyController: Mapped %u bytes at physical address 0x%X.\n", FLOPPY_DMALENGTH, FLOPPY_DMASTART);
+    // Get pointer to buffer and its physical address.
+    _dmaBuffer = (UInt8*)_dmaMemoryDesc->getBytesNoCopy();
+    _dmaPhysAddr = (UInt32)_dmaMemoryDesc->getPhysicalSegment(0, NULL, kIOMemoryMapperNone);
+    IOLog("VoodooFloppyController: Allocated %u bytes of DMA buffer at physical address 0x%X.\n", FLOPPY_DMALENGTH, _dmaPhysAddr);
     
     // Create IOTimerEventSource for turning off the motor.
     _tmrMotorOffSource = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &VoodooFloppyController::timerHandler));
@@ -193,27 +298,90 @@ bool VoodooFloppyController::start(IOService *provider) {
         goto fail;
     }
     
-    // Publish drive A if present.
+    // Create request queue lock.
+    _queueLock = IOLockAlloc();
+    if (!_queueLock) {
+        IOLog("VoodooFloppyController: Failed to create IOLock.\n");
+        goto fail;
+    }
+    
+    // Create IOInterruptEventSource for dispatching queued requests on the work loop.
+    _dispatchSource = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &VoodooFloppyController::dispatchHandler));
+    if (!_dispatchSource) {
+        IOLog("VoodooFloppyController: Failed to create IOInterruptEventSource.\n");
+        goto fail;
+    }
+    
+    // Add to work loop.
+    status = _workLoop->addEventSource(_dispatchSource);
+    if (status != kIOReturnSuccess) {
+        IOLog("VoodooFloppyController: Failed to add IOInterruptEventSource to work loop: 0x%X\n", status);
+        goto fail;
+    }
+    
+    // Get maximum time a run of queued transfers can hold the gate.
+    maxGateHold = OSDynamicCast(OSNumber, getProperty(kFloppyPropertyMaxGateHoldKey));
+    if (maxGateHold)
+        _maxGateHoldMs = maxGateHold->unsigned32BitValue();
+    
+    // Get base time allowed for each request.
+    requestTimeout = OSDynamicCast(OSNumber, getProperty(kFloppyPropertyRequestTimeoutKey));
+    if (requestTimeout)
+        _requestTimeoutMs = requestTimeout->unsigned32BitValue();
+    
+    // Optionally mirror whole disks into RAM while idle.
+    ramMirror = OSDynamicCast(OSBoolean, getProperty(kFloppyPropertyRamMirrorKey));
+    _mirrorEnabled = ramMirror && ramMirror->isTrue();
+    
+    // Optionally trace requests from the start, so boot-time access patterns can be captured.
+    trace = OSDynamicCast(OSBoolean, getProperty(kFloppyPropertyTraceKey));
+    if (trace && trace->isTrue())
+        setTracing(true);
+    
+    // Create IOTimerEventSource for filling the mirror.
+    _tmrMirrorSource = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &VoodooFloppyController::mirrorHandler));
+    if (!_tmrMirrorSource) {
+        IOLog("VoodooFloppyController: Failed to create IOTimerEventSource.\n");
+        goto fail;
+    }
+    
+    // Add to work loop.
+    status = _workLoop->addEventSource(_tmrMirrorSource);
+    if (status != kIOReturnSuccess) {
+        IOLog("VoodooFloppyController: Failed to add IOTimerEventSource to work loop: 0x%X\n", status);
+        goto fail;
+    }
+    
+    // Publish drives that are present. Drive A is selected first if there is one.
     if (_driveAType) {
-       IOLog("VoodooFloppyController: Creating VoodooFloppyStorageDevice for drive A.\n");
-        _driveADevice = OSTypeAlloc(VoodooFloppyStorageDevice);
-        _currentDevice = _driveADevice;
-        
-        OSDictionary *proper = OSDictionary::withCapacity(2);
-        
-        proper->setObject(kFloppyPropertyDriveIdKey, OSNumber::withNumber((UInt64)0, 8));
-        proper->setObject(FLOPPY_IOREG_DRIVE_TYPE, OSNumber::withNumber(_driveAType, 8));
-        if (!_driveADevice || !_driveADevice->init(proper) || !_driveADevice->attach(this)) {
-            IOLog("VoodooFloppyController: Failed to create VoodooFloppyStorageDevice.\n");
+        _driveADevice = createDevice(0, _driveAType);
+        if (!_driveADevice)
             goto fail;
-        }
-        
-        // Register device.
-        
-        _driveADevice->retain();
-        _driveADevice->registerService();
+    }
+    if (_driveBType) {
+        _driveBDevice = createDevice(1, _driveBType);
+        if (!_driveBDevice)
+            goto fail;
+    }
+    _currentDevice = _driveADevice ? _driveADevice : _driveBDevice;
+    
+    // Create IOTimerEventSource for bringing up the controller.
+    _tmrBringUpSource = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &VoodooFloppyController::bringUpHandler));
+    if (!_tmrBringUpSource) {
+        IOLog("VoodooFloppyController: Failed to create IOTimerEventSource.\n");
+        goto fail;
     }
     
+    // Add to work loop.
+    status = _workLoop->addEventSource(_tmrBringUpSource);
+    if (status != kIOReturnSuccess) {
+        IOLog("VoodooFloppyController: Failed to add IOTimerEventSource to work loop: 0x%X\n", status);
+        goto fail;
+    }
+    
+    // Controller reset and media probing happen on the work loop, off the matching thread.
+    _tmrBringUpSource->setTimeoutUS(1);
+    
     // Kext started successfully.
     return true;
     
@@ -224,30 +392,127 @@ fail:
     return false;
 }
 
+/**
+ * Creates and registers the storage device for a drive.
+ * @return The device, with a reference held for the controller; otherwise NULL on failure.
+ */
+VoodooFloppyStorageDevice *VoodooFloppyController::createDevice(UInt8 driveNumber, UInt8 driveType) {
+    IOLog("VoodooFloppyController: Creating VoodooFloppyStorageDevice for drive %c.\n", 'A' + driveNumber);
+    VoodooFloppyStorageDevice *floppyDevice = OSTypeAlloc(VoodooFloppyStorageDevice);
+    OSDictionary *properties = OSDictionary::withCapacity(2);
+    OSNumber *driveId = OSNumber::withNumber(driveNumber, 8);
+    OSNumber *type = OSNumber::withNumber(driveType, 8);
+    bool created = false;
+    
+    if (floppyDevice && properties && driveId && type) {
+        properties->setObject(kFloppyPropertyDriveIdKey, driveId);
+        properties->setObject(FLOPPY_IOREG_DRIVE_TYPE, type);
+        created = floppyDevice->init(properties) && floppyDevice->attach(this);
+    }
+    OSSafeReleaseNULL(properties);
+    OSSafeReleaseNULL(driveId);
+    OSSafeReleaseNULL(type);
+    if (!created) {
+        IOLog("VoodooFloppyController: Failed to create VoodooFloppyStorageDevice.\n");
+        OSSafeReleaseNULL(floppyDevice);
+        return NULL;
+    }
+    
+    // Register device.
+    floppyDevice->registerService();
+    return floppyDevice;
+}
+
 /*! @function stop
  @abstract During an IOService termination, the stop method is called in its clients before they are detached & it is destroyed.
  @discussion The termination process for an IOService (the provider) will call stop in each of its clients, after they have closed the provider if they had it open, or immediately on termination. */
 void VoodooFloppyController::stop(IOService *provider) {
     DBGLOG("VoodooFloppyController::stop()\n");
     
+    // Abort the request in progress and fail anything still queued.
+    _abortStatus = kIOReturnAborted;
+    if (_cmdGate && _queueLock)
+        _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooFloppyController::abortQueueGated));
+    
     // Free device objects.
     OSSafeReleaseNULL(_driveADevice);
     OSSafeReleaseNULL(_driveBDevice);
     
-    // Free command gate.
+    // Stop the timers and take all event sources off the work loop, so none of them runs while their state is freed.
+    if (_tmrBringUpSource)
+        _tmrBringUpSource->cancelTimeout();
+    if (_tmrMirrorSource)
+        _tmrMirrorSource->cancelTimeout();
+    if (_tmrMotorOffSource)
+        _tmrMotorOffSource->cancelTimeout();
+    if (_workLoop) {
+        if (_tmrBringUpSource)
+            _workLoop->removeEventSource(_tmrBringUpSource);
+        if (_tmrMirrorSource)
+            _workLoop->removeEventSource(_tmrMirrorSource);
+        if (_tmrMotorOffSource)
+            _workLoop->removeEventSource(_tmrMotorOffSource);
+        if (_dispatchSource)
+            _workLoop->removeEventSource(_dispatchSource);
+        if (_cmdGate)
+            _workLoop->removeEventSource(_cmdGate);
+    }
+    
+    // Free command gate and dispatcher, then the queue lock they use.
     OSSafeReleaseNULL(_cmdGate);
+    OSSafeReleaseNULL(_dispatchSource);
+    if (_queueLock) {
+        IOLockFree(_queueLock);
+        _queueLock = NULL;
+    }
+    
+    // Release trace ring. Clients that mapped it hold their own reference.
+    _traceEnabled = false;
+    _traceRing = NULL;
+    OSSafeReleaseNULL(_traceMemory);
     
-    // Release DMA buffer objects.
-    OSSafeReleaseNULL(_dmaMemoryMap);
+    // Release DMA buffer.
+    if (_dmaMemoryDesc)
+        _dmaMemoryDesc->complete();
     OSSafeReleaseNULL(_dmaMemoryDesc);
+    _dmaBuffer = NULL;
+    
+    // Free sector hashes and mirrors.
+    for (UInt8 i = 0; i < FLOPPY_MAX_DRIVES; i++) {
+        if (_driveState[i].sectorHashes) {
+            IOFree(_driveState[i].sectorHashes, kFloppyHashSectors * sizeof (UInt64));
+            _driveState[i].sectorHashes = NULL;
+        }
+        if (_driveState[i].mirror) {
+            IOFree(_driveState[i].mirror, _driveState[i].mirrorSectors * _driveState[i].mirrorBlockSize);
+            IOFree(_driveState[i].mirrorValid, _driveState[i].mirrorSectors);
+            _driveState[i].mirror = NULL;
+            _driveState[i].mirrorValid = NULL;
+        }
+    }
     
-    // Free IOTimerEventSource.
+    // Free IOTimerEventSources.
+    OSSafeReleaseNULL(_tmrBringUpSource);
+    OSSafeReleaseNULL(_tmrMirrorSource);
     OSSafeReleaseNULL(_tmrMotorOffSource);
     
     // Unregister interrupt.
     getProvider()->disableInterrupt(0);
     getProvider()->unregisterInterrupt(0);
     
+    // Free PIO lock.
+    if (_pioLock) {
+        IOSimpleLockFree(_pioLock);
+        _pioLock = NULL;
+    }
+    
+    // Give up the DMA channel, and free the DMA lock once the last controller is gone.
+    OSCompareAndSwapPtr(this, NULL, (void* volatile*)&gDmaChannelOwners[_dmaChannel]);
+    if (OSDecrementAtomic(&gDmaLockUsers) == 1 && gDmaLock) {
+        IOSimpleLockFree(gDmaLock);
+        gDmaLock = NULL;
+    }
+    
     // Free work loop.
     OSSafeReleaseNULL(_workLoop);
     super::stop(provider);
@@ -272,9 +537,15 @@ IOReturn VoodooFloppyController::setPowerState(unsigned long powerStateOrdinal,
     if (!_cmdGate)
         return kIOReturnSuccess;
     
+    // Stop the request in progress before sleeping. It is resumed after wake.
+    if (powerStateOrdinal == kFloppyPowerStateSleep)
+        _abortStatus = kIOReturnOffline;
+    
     // Wake up command gate if we moving to normal power state.
-    if (powerStateOrdinal == kFloppyPowerStateNormal)
+    if (powerStateOrdinal == kFloppyPowerStateNormal) {
         _cmdGate->enable();
+        _dispatchSource->enable();
+    }
     return _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooFloppyController::setPowerStateGated), &powerStateOrdinal);
 }
 
@@ -282,25 +553,197 @@ IOReturn VoodooFloppyController::probeDriveMedia(VoodooFloppyStorageDevice *flop
     return _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooFloppyController::probeMediaGated), floppyDevice);
 }
 
-IOReturn VoodooFloppyController::readWriteDrive(VoodooFloppyStorageDevice *floppyDevice, IOMemoryDescriptor *buffer, UInt64 block, UInt64 nblks) {
-    return _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooFloppyController::readWriteGated), floppyDevice, buffer, &block, &nblks);
+/**
+ * Queues a read or write. The completion is called once the request finishes.
+ */
+IOReturn VoodooFloppyController::submitReadWrite(VoodooFloppyStorageDevice *floppyDevice, IOMemoryDescriptor *buffer, UInt64 block, UInt64 nblks, IOStorageAttributes *attributes, IOStorageCompletion *completion) {
+    FloppyRequest *request = (FloppyRequest*)IOMalloc(sizeof (FloppyRequest));
+    if (!request)
+        return kIOReturnNoMemory;
+    
+    bzero(request, sizeof (FloppyRequest));
+    request->device = floppyDevice;
+    request->buffer = buffer;
+    request->block = block;
+    request->nblks = nblks;
+    request->priority = attributes ? attributes->priority : (IOStoragePriority)kIOStoragePriorityDefault;
+    request->completion = *completion;
+    request->submitTime = mach_absolute_time();
+    buffer->retain();
+    
+    // Add to end of queue. The queue has its own lock so requests can be added while a transfer holds the gate.
+    IOLockLock(_queueLock);
+    FloppyRequest **tail = &_queueHead;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = request;
+    
+    // Record the request as given, before any queueing or merging.
+    if (_traceEnabled) {
+        UInt64 timestampNs;
+        absolutetime_to_nanoseconds(request->submitTime - _traceStartTime, &timestampNs);
+        FloppyTraceRecord *record = &_traceRing->records[_traceRing->producer % kFloppyTraceRecordCount];
+        record->timestamp = timestampNs;
+        record->block = (UInt32)block;
+        record->blockCount = (UInt16)nblks;
+        record->priority = request->priority > 0xFF ? 0xFF : (UInt8)request->priority;
+        record->flags = (buffer->getDirection() == kIODirectionOut ? kFloppyTraceFlagWrite : 0) | (floppyDevice->getDriveNumber() << kFloppyTraceDriveShift);
+        __sync_synchronize();
+        _traceRing->producer++;
+    }
+    IOLockUnlock(_queueLock);
+    
+    // Stop any mirror fill in progress, and kick dispatcher.
+    _mirrorPreempt = true;
+    _dispatchSource->interruptOccurred(NULL, this, 0);
+    return kIOReturnSuccess;
+}
+
+/**
+ * Starts or stops request tracing. Starting again clears the ring.
+ */
+IOReturn VoodooFloppyController::setTracing(bool enabled) {
+    IOReturn status = kIOReturnSuccess;
+    IOLockLock(_queueLock);
+    
+    // Allocate ring on first use. It is kept when tracing stops, so the last records can still be read.
+    if (enabled && !_traceMemory) {
+        _traceMemory = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionInOut | kIOMemoryKernelUserShared, sizeof (FloppyTraceRing), PAGE_SIZE);
+        if (!_traceMemory) {
+            IOLog("VoodooFloppyController: Failed to allocate trace ring.\n");
+            status = kIOReturnNoMemory;
+            goto done;
+        }
+        _traceRing = (FloppyTraceRing*)_traceMemory->getBytesNoCopy();
+        bzero(_traceRing, sizeof (FloppyTraceRing));
+    }
+    
+    if (enabled && !_traceEnabled) {
+        _traceRing->producer = 0;
+        _traceRing->recordCount = kFloppyTraceRecordCount;
+        _traceStartTime = mach_absolute_time();
+    }
+    _traceEnabled = enabled;
+    
+done:
+    IOLockUnlock(_queueLock);
+    if (status == kIOReturnSuccess)
+        setProperty(kFloppyPropertyTraceKey, enabled);
+    return status;
+}
+
+/**
+ * Gets the trace ring for mapping into a client, or NULL if tracing has never been started.
+ */
+IOBufferMemoryDescriptor *VoodooFloppyController::getTraceMemory() {
+    return _traceMemory;
+}
+
+IOReturn VoodooFloppyController::imageDrive(UInt8 driveNumber, bool write, FloppyImageRing *ring, UInt32 firstCylinder, UInt32 cylinderCount, volatile bool *abort) {
+    // Get device for drive.
+    FloppyImageSession session;
+    session.device = driveNumber == 0 ? _driveADevice : (driveNumber == 1 ? _driveBDevice : NULL);
+    if (!session.device)
+        return kIOReturnNoDevice;
+    
+    session.write = write;
+    session.ring = ring;
+    session.firstCylinder = firstCylinder;
+    session.cylinderCount = cylinderCount;
+    session.abort = abort;
+    return _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooFloppyController::imageGated), &session);
+}
+
+/**
+ * Wakes an imaging session waiting on a ring, so an abort is seen without waiting for the next poll.
+ */
+void VoodooFloppyController::wakeImageSession(FloppyImageRing *ring) {
+    _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooFloppyController::wakeImageSessionGated), ring);
+}
+
+IOReturn VoodooFloppyController::formatDrive(UInt8 driveNumber, UInt32 firstCylinder, UInt32 cylinderCount, UInt8 sizeCode) {
+    // Get device for drive.
+    FloppyFormatSession session;
+    session.device = driveNumber == 0 ? _driveADevice : (driveNumber == 1 ? _driveBDevice : NULL);
+    if (!session.device)
+        return kIOReturnNoDevice;
+    
+    session.firstCylinder = firstCylinder;
+    session.cylinderCount = cylinderCount;
+    session.sizeCode = sizeCode;
+    return _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooFloppyController::formatGated), &session);
+}
+
+IOReturn VoodooFloppyController::scanDrive(UInt8 driveNumber, UInt32 firstCylinder, UInt32 cylinderCount, UInt8 condition, const UInt8 *pattern, UInt32 patternLength,
+                                           FloppyScanMatch *matches, UInt32 *matchCount, UInt32 *cylindersScanned) {
+    // Get device for drive.
+    FloppyScanSession session;
+    session.device = driveNumber == 0 ? _driveADevice : (driveNumber == 1 ? _driveBDevice : NULL);
+    if (!session.device)
+        return kIOReturnNoDevice;
+    
+    session.firstCylinder = firstCylinder;
+    session.cylinderCount = cylinderCount;
+    session.condition = condition;
+    session.pattern = pattern;
+    session.patternLength = patternLength;
+    session.matches = matches;
+    session.maxMatches = *matchCount;
+    session.matchCount = 0;
+    session.cylindersScanned = 0;
+    IOReturn status = _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooFloppyController::scanGated), &session);
+    *matchCount = session.matchCount;
+    *cylindersScanned = session.cylindersScanned;
+    return status;
+}
+
+IOReturn VoodooFloppyController::copyDrive(UInt8 sourceDrive, UInt8 destinationDrive, FloppyImageRing *ring, UInt32 firstCylinder, UInt32 cylinderCount,
+                                           volatile bool *abort, FloppyCopyCylinder *results, UInt32 *cylindersCopied) {
+    // Get devices for the drives.
+    FloppyCopySession session;
+    session.source = sourceDrive == 0 ? _driveADevice : (sourceDrive == 1 ? _driveBDevice : NULL);
+    session.destination = destinationDrive == 0 ? _driveADevice : (destinationDrive == 1 ? _driveBDevice : NULL);
+    if (!session.source || !session.destination)
+        return kIOReturnNoDevice;
+    if (session.source == session.destination)
+        return kIOReturnBadArgument;
+    
+    session.ring = ring;
+    session.firstCylinder = firstCylinder;
+    session.cylinderCount = cylinderCount;
+    session.abort = abort;
+    session.results = results;
+    session.cylindersCopied = 0;
+    IOReturn status = _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooFloppyController::copyGated), &session);
+    *cylindersCopied = session.cylindersCopied;
+    return status;
 }
 
 void VoodooFloppyController::selectDrive(VoodooFloppyStorageDevice *floppyDevice) {
     if (_currentDevice == floppyDevice)
         return;
     
-    // Set current drive.
+    // Set current drive. Data rate and timings are applied on the next command.
     _currentDevice = floppyDevice;
     
-    // Determine speed.
-    UInt8 speed = FLOPPY_SPEED_500KBPS;
-    switch (0) {
-            // TODO
+    // Recalibrate drive if we don't know where its heads are.
+    if (_driveState[floppyDevice->getDriveNumber()].cylinder == FLOPPY_CYLINDER_UNKNOWN)
+        recalibrate();
+}
+
+/**
+ * Marks the head position of a drive as unknown, forcing the next seek to be issued.
+ * @param driveNumber The drive, or -1 for all drives.
+ */
+void VoodooFloppyController::invalidateCylinder(SInt8 driveNumber) {
+    for (UInt8 i = 0; i < FLOPPY_MAX_DRIVES; i++) {
+        if (driveNumber == -1 || driveNumber == i) {
+            _driveState[i].cylinder = FLOPPY_CYLINDER_UNKNOWN;
+            
+            // The disk may have changed too, so drop the rotational reference.
+            _driveState[i].rotationSector = 0;
+        }
     }
-    
-    // Recalibrate drive.
-    recalibrate();
 }
 
 
@@ -310,36 +753,335 @@ void VoodooFloppyController::selectDrive(VoodooFloppyStorageDevice *floppyDevice
  */
 
 void VoodooFloppyController::interruptHandler(OSObject *target, void *refCon, IOService *nub, int source) {
+    VoodooFloppyController *controller = (VoodooFloppyController*)refCon;
+    
+    // During PIO transfers, each FIFO burst raises an interrupt. Service it here.
+    if (controller->_pioActive && controller->servicePio())
+        return;
+    
     // IRQ was triggered, set flag.
     //DBGLOG("VoodooFloppyController::interruptHandler()\n");
-    ((VoodooFloppyController*)refCon)->_irqTriggered = true;
+    controller->_irqTime = mach_absolute_time();
+    controller->_irqTriggered = true;
 }
 
 void VoodooFloppyController::timerHandler(OSObject *owner, IOTimerEventSource *sender) {
-    // Turn off motor after inactivity.
+    // Turn off motor after inactivity, unless an imaging session is holding it on.
     //DBGLOG("VoodooFloppyController::timerHandler()\n");
-    setMotorOff();
+    if (!_motorHeld)
+        setMotorOff();
+}
+
+/**
+ * Brings up the controller and probes media. Runs once on the work loop after start.
+ */
+void VoodooFloppyController::bringUpHandler(OSObject *owner, IOTimerEventSource *sender) {
+    DBGLOG("VoodooFloppyController::bringUpHandler()\n");
+    
+    // Reset controller.
+    resetController();
+    
+    // Get version. If version is 0xFF, that means there isn't a floppy controller.
+    UInt8 version = getControllerVersion();
+    if (version == FLOPPY_VERSION_NONE) {
+        IOLog("VoodooFloppyController: No floppy controller present.\n");
+        return;
+    }
+    
+    // Print version and configure controller.
+    IOLog("VoodooFloppyController: Version: 0x%X.\n", version);
+    configureController();
+    publishFifoStatistics();
+    publishHandshakeStatistics();
+    publishInterruptStatistics();
+    
+    // Determine transfer mode. Automatic mode uses DMA if the ISA DMA controller responds.
+    // Transfers of two controllers on one channel would cut each other short, so only the first controller on a channel gets it.
+    OSString *transferMode = OSDynamicCast(OSString, getProperty(kFloppyPropertyTransferModeKey));
+    if (transferMode && transferMode->isEqualTo(kFloppyTransferModePio))
+        _useDma = false;
+    else if (!OSCompareAndSwapPtr(NULL, this, (void* volatile*)&gDmaChannelOwners[_dmaChannel])) {
+        IOLog("VoodooFloppyController: DMA channel %u is in use by another controller.\n", _dmaChannel);
+        _useDma = false;
+    } else {
+        _useDma = (transferMode && transferMode->isEqualTo(kFloppyTransferModeDma)) || probeDma();
+        if (!_useDma)
+            OSCompareAndSwapPtr(this, NULL, (void* volatile*)&gDmaChannelOwners[_dmaChannel]);
+    }
+    
+    // FIFO can optionally be serviced by polling MSR instead of the per-burst interrupt.
+    OSBoolean *pioPolling = OSDynamicCast(OSBoolean, getProperty(kFloppyPropertyPioPollingKey));
+    _pioPolling = pioPolling && pioPolling->isTrue();
+    IOLog("VoodooFloppyController: Using %s transfers.\n", _useDma ? "DMA" : (_pioPolling ? "polled PIO" : "interrupt-driven PIO"));
+    
+    // Save configuration so it can be replayed after wake. DUMPREG is only on enhanced controllers.
+    if (version == FLOPPY_VERSION_ENHANCED) {
+        setDriveData(FLOPPY_SPECIFY_STEP_RATE, FLOPPY_SPECIFY_HEAD_LOAD, FLOPPY_SPECIFY_HEAD_UNLOAD, _useDma);
+        _savedRegsValid = dumpRegisters(_savedRegs);
+    }
+    
+    // Controller is usable. Any wake that happened meanwhile is covered by the reset above.
+    _needsRestore = false;
+    _controllerReady = true;
+    
+    // Probe media. Drives post a media state change if media is found.
+    if (_driveADevice)
+        _driveADevice->probeMedia();
+    if (_driveBDevice)
+        _driveBDevice->probeMedia();
+}
+
+/**
+ * Runs queued requests on the work loop, a cylinder at a time, highest priority first.
+ * Returns once the maximum gate hold time is used up so other gated work can get in.
+ */
+void VoodooFloppyController::dispatchHandler(OSObject *owner, IOInterruptEventSource *sender, int count) {
+    UInt64 deadline;
+    clock_interval_to_deadline(_maxGateHoldMs, kMillisecondScale, &deadline);
+    
+    FloppyRequest *request;
+    while (_abortStatus != kIOReturnOffline && (request = nextRequest()) != NULL) {
+        // Deadline starts once the request is first worked on, so queueing behind others doesn't count against it.
+        if (!request->deadline) {
+            const FloppyMediaFormat *format = _driveState[request->device->getDriveNumber()].format;
+            UInt32 cylinderBlocks = format->sectorsPerTrack * 2 * FLOPPY_SECTOR_SIZE(format->sizeCode) / request->device->getBlockSize();
+            UInt32 cylinders = (UInt32)(request->nblks / cylinderBlocks) + 1;
+            clock_interval_to_deadline(_requestTimeoutMs + cylinders * kFloppyCylinderTimeoutMs, kMillisecondScale, &request->deadline);
+        }
+        
+        // Queued requests on the same cylinder go in the same command where they can.
+        _requestDeadline = request->deadline;
+        IOReturn status = _controllerReady ? readWriteMerged(request) : kIOReturnNotReady;
+        if (status == kIOReturnUnsupported)
+            status = readWriteChunk(request);
+        IOReturn abortStatus = checkAbort();
+        _requestDeadline = 0;
+        
+        // Requests carried along by a merged command are done with it.
+        while (request->mergeNext) {
+            FloppyRequest *merged = request->mergeNext;
+            request->mergeNext = merged->mergeNext;
+            completeRequest(merged, kIOReturnSuccess);
+        }
+        
+        // On abort the controller may be in the middle of a command, so reset it.
+        if (status != kIOReturnSuccess && abortStatus != kIOReturnSuccess) {
+            IOLog("VoodooFloppyController: Request aborted: 0x%X\n", abortStatus);
+            resetController();
+            
+            // Requests interrupted by sleep are picked up again after wake, with a new deadline.
+            if (abortStatus == kIOReturnOffline) {
+                request->deadline = 0;
+                break;
+            }
+            status = abortStatus;
+            if (_abortStatus == kIOReturnNoMedia)
+                _abortStatus = kIOReturnSuccess;
+        }
+        
+        if (status != kIOReturnSuccess || request->blocksDone >= request->nblks)
+            completeRequest(request, status);
+        
+        // Give up the gate if we've held it long enough, and come back for the rest.
+        if (mach_absolute_time() >= deadline) {
+            if (nextRequest())
+                _dispatchSource->interruptOccurred(NULL, this, 0);
+            break;
+        }
+    }
+    
+    if (!nextRequest()) {
+        // Elision counts change with nearly every write, so they are only exported once the queue drains.
+        if (_elisionChanged)
+            publishElisionStatistics();
+        
+        // Carry on filling mirrors once things have been quiet for a while.
+        if (_mirrorEnabled && _abortStatus != kIOReturnOffline)
+            _tmrMirrorSource->setTimeoutMS(kFloppyMirrorIdleMs);
+    }
+}
+
+/**
+ * Reads the next cylinder into a RAM mirror while the controller is idle.
+ * Queued requests go first; the dispatcher re-arms the timer once they are done.
+ */
+void VoodooFloppyController::mirrorHandler(OSObject *owner, IOTimerEventSource *sender) {
+    if (!_controllerReady || _abortStatus != kIOReturnSuccess)
+        return;
+    
+    // Fill drive A before drive B.
+    VoodooFloppyStorageDevice *devices[2] = { _driveADevice, _driveBDevice };
+    for (UInt8 i = 0; i < 2; i++) {
+        if (!devices[i])
+            continue;
+        
+        FloppyDriveState *driveState = &_driveState[devices[i]->getDriveNumber()];
+        if (driveState->mirror && driveState->mirrorCylinder < driveState->mirrorSectors / (driveState->format->sectorsPerTrack * 2)) {
+            if (fillMirror(devices[i]))
+                _tmrMirrorSource->setTimeoutUS(1);
+            return;
+        }
+    }
+}
+
+/**
+ * Checks if the current request should stop.
+ * @param watchDiskChange True to treat the disk change line as the disk being removed.
+ * @param betweenCommands True if no command is running, so a mirror fill can give way without a reset.
+ * @return kIOReturnSuccess to carry on, otherwise the error to complete the request with.
+ */
+IOReturn VoodooFloppyController::checkAbort(bool watchDiskChange, bool betweenCommands) {
+    // Only requests from the queue and mirror fills can be aborted.
+    if (!_requestDeadline)
+        return kIOReturnSuccess;
+    
+    // Mirror fills give way to a queued request once the command in flight is done.
+    if (betweenCommands && _mirrorFilling && _mirrorPreempt)
+        return kIOReturnAborted;
+    
+    if (watchDiskChange && (readRegister(FLOPPY_REG_DIR) & kFloppyDirDskChg)) {
+        DBGLOG("VoodooFloppyController::checkAbort(): disk changed.\n");
+        invalidateCylinder(_currentDevice->getDriveNumber());
+        forgetMedia(_currentDevice->getDriveNumber());
+        _abortStatus = kIOReturnNoMedia;
+    }
+    if (_abortStatus != kIOReturnSuccess)
+        return _abortStatus;
+    if (mach_absolute_time() >= _requestDeadline)
+        return kIOReturnTimeout;
+    return kIOReturnSuccess;
+}
+
+/**
+ * Fails all queued requests. Used when stopping.
+ */
+IOReturn VoodooFloppyController::abortQueueGated() {
+    FloppyRequest *request;
+    while ((request = nextRequest()) != NULL)
+        completeRequest(request, kIOReturnAborted);
+    return kIOReturnSuccess;
+}
+
+/**
+ * Gets the queued request to work on next. Lower priority values go first; equal priorities go in order.
+ */
+FloppyRequest *VoodooFloppyController::nextRequest() {
+    IOLockLock(_queueLock);
+    FloppyRequest *best = _queueHead;
+    for (FloppyRequest *request = _queueHead; request; request = request->next) {
+        if (request->priority < best->priority)
+            best = request;
+    }
+    IOLockUnlock(_queueLock);
+    return best;
+}
+
+/**
+ * Removes a request from the queue, records its latency and calls its completion.
+ */
+void VoodooFloppyController::completeRequest(FloppyRequest *request, IOReturn status) {
+    IOLockLock(_queueLock);
+    for (FloppyRequest **link = &_queueHead; *link; link = &(*link)->next) {
+        if (*link == request) {
+            *link = request->next;
+            break;
+        }
+    }
+    IOLockUnlock(_queueLock);
+    
+    // Record latency for the priority class.
+    UInt64 latencyNs;
+    absolutetime_to_nanoseconds(mach_absolute_time() - request->submitTime, &latencyNs);
+    UInt8 priorityClass = request->priority < kIOStoragePriorityDefault ? kFloppyPriorityClassHigh
+        : (request->priority == kIOStoragePriorityDefault ? kFloppyPriorityClassDefault : kFloppyPriorityClassLow);
+    _latencyCount[priorityClass]++;
+    _latencyTotalUs[priorityClass] += latencyNs / 1000;
+    if (latencyNs / 1000 > _latencyMaxUs[priorityClass])
+        _latencyMaxUs[priorityClass] = latencyNs / 1000;
+    publishLatencyStatistics();
+    
+    // Release client buffer mapping.
+    if (request->bufferMap) {
+        request->bufferMap->release();
+        request->buffer->complete();
+    }
+    
+    // Let the drive handle media errors, then complete.
+    if (status != kIOReturnSuccess)
+        request->device->handleError(status);
+    IOStorage::complete(&request->completion, status, status == kIOReturnSuccess ? request->nblks * request->device->getBlockSize() : 0);
+    request->buffer->release();
+    IOFree(request, sizeof (FloppyRequest));
+}
+
+/**
+ * Adds a number to a statistics dictionary.
+ */
+void VoodooFloppyController::setNumber(OSDictionary *dictionary, const char *key, UInt64 value, UInt32 bits) {
+    OSNumber *number = OSNumber::withNumber(value, bits);
+    if (!number)
+        return;
+    dictionary->setObject(key, number);
+    number->release();
+}
+
+/**
+ * Exports request latency for each priority class to the registry.
+ */
+void VoodooFloppyController::publishLatencyStatistics() {
+    static const char *classNames[kFloppyPriorityClassCount] = { "high", "default", "low" };
+    OSDictionary *latency = OSDictionary::withCapacity(kFloppyPriorityClassCount);
+    if (!latency)
+        return;
+    
+    for (UInt8 i = 0; i < kFloppyPriorityClassCount; i++) {
+        OSDictionary *stats = OSDictionary::withCapacity(3);
+        if (!stats)
+            continue;
+        
+        setNumber(stats, "count", _latencyCount[i]);
+        setNumber(stats, "average-us", _latencyCount[i] ? _latencyTotalUs[i] / _latencyCount[i] : 0);
+        setNumber(stats, "max-us", _latencyMaxUs[i]);
+        
+        latency->setObject(classNames[i], stats);
+        stats->release();
+    }
+    setProperty(kFloppyPropertyLatencyKey, latency);
+    latency->release();
 }
 
 IOReturn VoodooFloppyController::setPowerStateGated(UInt32 *powerState) {
+    // Register contents are lost across power transitions.
+    invalidateRegisterShadow(true);
+    _abortStatus = kIOReturnSuccess;
+    
     switch (*powerState) {
         case kFloppyPowerStateNormal:
-            // Reconfigure and reset controller.
-            resetController();
-            configureController();
+            // Controller is restored by the first command after wake, keeping the floppy out of the wake path.
+            _needsRestore = true;
             
+            // Run anything left in the queue from before sleep.
+            _dispatchSource->interruptOccurred(NULL, this, 0);
             break;
             
         case kFloppyPowerStateSleep:
-            // Disable gate to prevent further actions.
+            // Disable gate and dispatcher to prevent further actions. Queued requests run after wake.
             _cmdGate->disable();
+            _dispatchSource->disable();
+            _tmrMirrorSource->cancelTimeout();
             break;
     }
     return kIOReturnSuccess;
 }
 
-IOReturn VoodooFloppyController::readWriteGated(VoodooFloppyStorageDevice *floppyDevice, IOMemoryDescriptor *buffer, UInt64 *block, UInt64 *nblks) {
-    DBGLOG("VoodooFloppyController::readWriteGated()\n");
+/**
+ * Transfers the part of a request that falls on its current cylinder.
+ * Large requests are done a cylinder at a time so other requests can run in between.
+ */
+IOReturn VoodooFloppyController::readWriteChunk(FloppyRequest *request) {
+    DBGLOG("VoodooFloppyController::readWriteChunk()\n");
+    VoodooFloppyStorageDevice *floppyDevice = request->device;
+    IOMemoryDescriptor *buffer = request->buffer;
     
     // Ensure buffer direction is valid.
     IODirection bufferDirection = buffer->getDirection();
@@ -348,138 +1090,861 @@ IOReturn VoodooFloppyController::readWriteGated(VoodooFloppyStorageDevice *flopp
     
     // Determine if we are reading or writing.
     bool write = bufferDirection == kIODirectionOut;
+    IOReturn status = kIOReturnSuccess;
+    restoreController();
+    
+    // PIO transfers move data directly between the FIFO and the client buffer. The mapping lasts for the whole request.
+    UInt8 *bufferData = NULL;
+    if (!_useDma) {
+        if (!request->bufferMap) {
+            if (buffer->prepare() != kIOReturnSuccess)
+                return kIOReturnNoMemory;
+            request->bufferMap = buffer->map();
+            if (!request->bufferMap) {
+                buffer->complete();
+                return kIOReturnNoMemory;
+            }
+        }
+        bufferData = (UInt8*)request->bufferMap->getVirtualAddress();
+    }
     
     // Select drive.
     selectDrive(floppyDevice);
     
-    // Read/write sectors.
-    UInt32 bufferOffset = 0;
-    UInt16 lastTrack = -1;
-    UInt32 currentSectorLba = (UInt32)*block;
-    UInt64 remainingSectors = *nblks;
-    while (currentSectorLba < *block + *nblks) {
-        // Convert LBA to CHS.
+    // Requests are in blocks, while the media may have bigger physical sectors.
+    UInt32 blockSize = floppyDevice->getBlockSize();
+    UInt32 sectorSize = FLOPPY_SECTOR_SIZE(getFormat()->sizeCode);
+    UInt32 blocksPerSector = sectorSize / blockSize;
+    UInt32 bufferOffset = (UInt32)(request->blocksDone * blockSize);
+    UInt16 chunkTrack = 0, chunkHead = 0, chunkSector = 1;
+    lbaToChs((UInt32)((request->block + request->blocksDone) / blocksPerSector), &chunkTrack, &chunkHead, &chunkSector);
+    
+    // Read/write sectors on the current cylinder.
+    while (request->blocksDone < request->nblks) {
+        UInt64 block = request->block + request->blocksDone;
+        UInt64 remainingBlocks = request->nblks - request->blocksDone;
+        UInt32 currentSectorLba = (UInt32)(block / blocksPerSector);
+        UInt32 skipBlocks = (UInt32)(block % blocksPerSector);
+        
+        // Convert LBA to CHS. Stop at the end of the cylinder.
         UInt16 head = 0, track = 0, sector = 1;
         lbaToChs(currentSectorLba, &track, &head, &sector);
+        if (track != chunkTrack)
+            break;
         
-        // Have we changed tracks?. If so we need to seek.
-        if (lastTrack != track) {
-            IOReturn status = seek(track);
-            if (status != kIOReturnSuccess)
-                return status;
-            lastTrack = track;
+        // A request starting or ending part way into a sector moves that sector on its own through the DMA buffer.
+        // Writes merge the client's blocks into the sector's current contents and write it back whole.
+        bool partial = skipBlocks || remainingBlocks < blocksPerSector;
+        UInt8 nextSectorCount = 1;
+        if (!partial) {
+            // Variables used for determing remaining sectors in track.
+            UInt16 nextHead = 0, nextTrack = 0, nextSector = 1;
+            UInt32 nextSectorLba = currentSectorLba;
+            UInt64 remainingSectors = remainingBlocks / blocksPerSector;
+            nextSectorCount = 0;
+            
+            // Calculate remaining sectors in track. PIO commands have no TC and stay on one head.
+            do {
+                nextSectorLba++;
+                nextSectorCount++;
+                lbaToChs(nextSectorLba, &nextTrack, &nextHead, &nextSector);
+            } while (nextTrack == track && (_useDma || nextHead == head) && nextSectorCount < remainingSectors);
         }
         
-        // Variables used for determing remaining sectors in track.
-        UInt16 nextHead = 0, nextTrack = 0, nextSector = 1;
-        UInt32 nextSectorLba = currentSectorLba;
-        UInt8 nextSectorCount = 0;
+        // Determine total bytes, on the media and in the client buffer.
+        UInt32 blockCount = nextSectorCount * blocksPerSector;
+        if (partial)
+            blockCount = remainingBlocks < blocksPerSector - skipBlocks ? (UInt32)remainingBlocks : blocksPerSector - skipBlocks;
+        IOByteCount byteCount = blockCount * blockSize;
+        IOByteCount sectorBytes = nextSectorCount * sectorSize;
+        bool bounce = _useDma || partial;
+        UInt8 *sectorData = bounce ? _dmaBuffer : bufferData + bufferOffset;
+        UInt8 *blockData = sectorData + skipBlocks * blockSize;
+        bool mirrored = isMirrored(currentSectorLba, nextSectorCount) && !isDiskChanged();
         
-        // Calculate remaining sectors in track.
-        do {
-            nextSectorLba++;
-            nextSectorCount++;
-            lbaToChs(nextSectorLba, &nextTrack, &nextHead, &nextSector);
-        } while (nextTrack == track && nextSectorCount < remainingSectors);
+        // Reads of mirrored sectors don't need the disk at all, unless it has been changed.
+        if (!write && mirrored) {
+            if (buffer->writeBytes(bufferOffset, getMirror(currentSectorLba, nextSectorCount) + skipBlocks * blockSize, byteCount) != byteCount)
+                return kIOReturnIOError;
+            
+            bufferOffset += byteCount;
+            request->blocksDone += blockCount;
+            continue;
+        }
         
-        // Determine total bytes.
-        IOByteCount byteCount = nextSectorCount * floppyDevice->getBlockSize();
+        // Partial writes need the rest of the sector first.
+        if (write && partial) {
+            if (mirrored)
+                memcpy(sectorData, getMirror(currentSectorLba, 1), sectorSize);
+            else {
+                status = seek(track);
+                if (status == kIOReturnSuccess)
+                    status = readWriteTrack(false, track, head, sector, 1, _useDma ? NULL : sectorData);
+                if (status != kIOReturnSuccess)
+                    return status;
+                updateSectorHashes(currentSectorLba, 1, sectorData);
+            }
+        }
         
         // Are we writing? If so we need to write data to DMA buffer.
-        if (write && buffer->readBytes(bufferOffset, _dmaBuffer, byteCount) != byteCount)
+        if (write && bounce && buffer->readBytes(bufferOffset, blockData, byteCount) != byteCount)
             return kIOReturnIOError;
         
-        // Read/write sectors from/to disk.
-        IOReturn status = readWriteSectors(write, track, head, sector, nextSectorCount);
-        if (status != kIOReturnSuccess)
+        // Read/write sectors from/to disk. Writes skip sectors the media already holds, and only seek if there are any left.
+        // Seeking does nothing if the heads are already there.
+        if (write)
+            status = writeChangedSectors(track, head, sector, currentSectorLba, nextSectorCount, sectorData);
+        else {
+            status = seek(track);
+            if (status == kIOReturnSuccess)
+                status = readWriteTrack(write, track, head, sector, nextSectorCount, _useDma ? NULL : sectorData);
+        }
+        if (status != kIOReturnSuccess) {
+            setMirrorValid(currentSectorLba, nextSectorCount, false);
             return status;
+        }
+        if (!write)
+            updateSectorHashes(currentSectorLba, nextSectorCount, sectorData);
+        
+        // Keep the mirror in step. Whole written sectors come from the client buffer, as the DMA buffer was rearranged.
+        UInt8 *mirror = getMirror(currentSectorLba, nextSectorCount);
+        if (mirror) {
+            if (write && !partial)
+                setMirrorValid(currentSectorLba, nextSectorCount, buffer->readBytes(bufferOffset, mirror, byteCount) == byteCount);
+            else {
+                memcpy(mirror, sectorData, sectorBytes);
+                setMirrorValid(currentSectorLba, nextSectorCount, true);
+            }
+        }
         
         // Are we reading? If so we need to read data from DMA buffer.
-        if (!write && buffer->writeBytes(bufferOffset, _dmaBuffer, byteCount) != byteCount)
+        if (!write && bounce && buffer->writeBytes(bufferOffset, blockData, byteCount) != byteCount)
             return kIOReturnIOError;
         
         // Move to next sector.
-        currentSectorLba += nextSectorCount;
-        remainingSectors -= nextSectorCount;
-        bufferOffset += 512 * nextSectorCount;
+        bufferOffset += byteCount;
+        request->blocksDone += blockCount;
     }
-    
-    // Operation was successful.
+    return kIOReturnSuccess;
+}
+
+/**
+ * Transfers the rest of a request together with other queued requests on the same cylinder, in one command.
+ * Reads are merged wherever they fall on the cylinder, and any sectors between them are read as well.
+ * Writes only merge when they follow on from each other, as there is nothing to write in a gap.
+ * Data is gathered from and scattered to each request's own buffer through the DMA buffer.
+ * @return kIOReturnUnsupported if the request should be done on its own instead, including after a failed merged command.
+ */
+IOReturn VoodooFloppyController::readWriteMerged(FloppyRequest *request) {
+    VoodooFloppyStorageDevice *floppyDevice = request->device;
+    IODirection direction = request->buffer->getDirection();
+    bool write = direction == kIODirectionOut;
+    FloppyRequest *merged[kFloppyMergeMaxRequests];
+    UInt32 mergedCount = 0;
+    IOReturn status;
+    
+    // PIO transfers go straight to each client buffer, so only DMA transfers are merged.
+    if (!_useDma || (direction != kIODirectionIn && direction != kIODirectionOut))
+        return kIOReturnUnsupported;
+    restoreController();
+    selectDrive(floppyDevice);
+    
+    // Only whole sectors on one cylinder are merged. Mirrored reads don't need the disk anyway.
+    UInt32 blockSize = floppyDevice->getBlockSize();
+    UInt32 sectorSize = FLOPPY_SECTOR_SIZE(getFormat()->sizeCode);
+    UInt32 blocksPerSector = sectorSize / blockSize;
+    UInt32 cylinderBlocks = getFormat()->sectorsPerTrack * 2 * blocksPerSector;
+    UInt64 first = request->block + request->blocksDone;
+    UInt64 end = request->block + request->nblks;
+    UInt64 cylinder = first / cylinderBlocks;
+    if (first % blocksPerSector || end % blocksPerSector || (end - 1) / cylinderBlocks != cylinder
+        || (!write && isMirrored((UInt32)(first / blocksPerSector), (UInt32)((end - first) / blocksPerSector))))
+        return kIOReturnUnsupported;
+    
+    // Writes are chained on at either end until no more follow on. Reads only need one pass.
+    IOLockLock(_queueLock);
+    bool extended = true;
+    while (extended && mergedCount < kFloppyMergeMaxRequests) {
+        extended = false;
+        for (FloppyRequest *other = _queueHead; other && mergedCount < kFloppyMergeMaxRequests; other = other->next) {
+            UInt64 otherEnd = other->block + other->nblks;
+            if (other == request || other->device != floppyDevice || other->blocksDone || !other->nblks
+                || other->buffer->getDirection() != direction || other->block % blocksPerSector || otherEnd % blocksPerSector
+                || other->block / cylinderBlocks != cylinder || (otherEnd - 1) / cylinderBlocks != cylinder)
+                continue;
+            
+            bool chained = false;
+            for (UInt32 i = 0; i < mergedCount && !chained; i++)
+                chained = merged[i] == other;
+            if (chained || (write && other->block != end && otherEnd != first))
+                continue;
+            
+            merged[mergedCount++] = other;
+            first = other->block < first ? other->block : first;
+            end = otherEnd > end ? otherEnd : end;
+            extended = write;
+        }
+    }
+    IOLockUnlock(_queueLock);
+    if (!mergedCount)
+        return kIOReturnUnsupported;
+    
+    UInt32 lba = (UInt32)(first / blocksPerSector);
+    UInt8 count = (UInt8)((end - first) / blocksPerSector);
+    UInt16 track = 0, head = 0, sector = 1;
+    lbaToChs(lba, &track, &head, &sector);
+    DBGLOG("VoodooFloppyController::readWriteMerged(): %u requests in %u sectors at LBA %u\n", mergedCount + 1, count, lba);
+    
+    // Each request's data sits at its own place in the DMA buffer. The mirror takes writes first, as writing rearranges the buffer.
+    UInt8 *mirror = getMirror(lba, count);
+    if (write) {
+        IOByteCount byteCount = (request->nblks - request->blocksDone) * blockSize;
+        if (request->buffer->readBytes(request->blocksDone * blockSize, _dmaBuffer + (request->block + request->blocksDone - first) * blockSize, byteCount) != byteCount)
+            return kIOReturnUnsupported;
+        for (UInt32 i = 0; i < mergedCount; i++) {
+            byteCount = merged[i]->nblks * blockSize;
+            if (merged[i]->buffer->readBytes(0, _dmaBuffer + (merged[i]->block - first) * blockSize, byteCount) != byteCount)
+                return kIOReturnUnsupported;
+        }
+        if (mirror)
+            memcpy(mirror, _dmaBuffer, count * sectorSize);
+        status = writeChangedSectors(track, head, sector, lba, count, _dmaBuffer);
+    } else {
+        status = seek(track);
+        if (status == kIOReturnSuccess)
+            status = readWriteTrack(false, track, head, sector, count, NULL);
+        if (status == kIOReturnSuccess) {
+            updateSectorHashes(lba, count, _dmaBuffer);
+            if (mirror)
+                memcpy(mirror, _dmaBuffer, count * sectorSize);
+        }
+    }
+    setMirrorValid(lba, count, status == kIOReturnSuccess);
+    
+    // The requests are tried again on their own, unless the whole lot has to stop.
+    if (status != kIOReturnSuccess)
+        return checkAbort() != kIOReturnSuccess ? status : kIOReturnUnsupported;
+    
+    if (!write) {
+        IOByteCount byteCount = (request->nblks - request->blocksDone) * blockSize;
+        if (request->buffer->writeBytes(request->blocksDone * blockSize, _dmaBuffer + (request->block + request->blocksDone - first) * blockSize, byteCount) != byteCount)
+            return kIOReturnUnsupported;
+        for (UInt32 i = 0; i < mergedCount; i++) {
+            byteCount = merged[i]->nblks * blockSize;
+            if (merged[i]->buffer->writeBytes(0, _dmaBuffer + (merged[i]->block - first) * blockSize, byteCount) != byteCount)
+                return kIOReturnUnsupported;
+        }
+        
+        // Sectors read between merged requests are counted against the savings.
+        bool covered[FLOPPY_MAX_SECTORS_PER_TRACK * 2];
+        bzero(covered, sizeof (covered));
+        for (UInt64 block = request->block + request->blocksDone; block < request->block + request->nblks; block += blocksPerSector)
+            covered[(block - first) / blocksPerSector] = true;
+        for (UInt32 i = 0; i < mergedCount; i++) {
+            for (UInt64 block = merged[i]->block; block < merged[i]->block + merged[i]->nblks; block += blocksPerSector)
+                covered[(block - first) / blocksPerSector] = true;
+        }
+        for (UInt8 i = 0; i < count; i++)
+            _mergedGapSectors += !covered[i];
+    }
+    _mergedCommands++;
+    _mergedRequests += mergedCount;
+    publishMergeStatistics();
+    
+    // Chain the carried requests for the dispatcher to complete.
+    request->blocksDone = request->nblks;
+    for (UInt32 i = 0; i < mergedCount; i++) {
+        merged[i]->blocksDone = merged[i]->nblks;
+        merged[i]->mergeNext = request->mergeNext;
+        request->mergeNext = merged[i];
+    }
+    return kIOReturnSuccess;
+}
+
+/**
+ * Exports request merging counts to the registry. Requests merged per command is merged-requests over merged-commands.
+ */
+void VoodooFloppyController::publishMergeStatistics() {
+    OSDictionary *merging = OSDictionary::withCapacity(3);
+    if (!merging)
+        return;
+    
+    setNumber(merging, "merged-commands", _mergedCommands);
+    setNumber(merging, "merged-requests", _mergedRequests);
+    setNumber(merging, "gap-sectors", _mergedGapSectors);
+    
+    setProperty(kFloppyPropertyMergingKey, merging);
+    merging->release();
+}
+
+IOReturn VoodooFloppyController::imageGated(FloppyImageSession *session) {
+    DBGLOG("VoodooFloppyController::imageGated()\n");
+    FloppyImageRing *ring = session->ring;
+    
+    // Only one session runs at a time, as sessions hold the motor on.
+    if (_imageSessionRunning)
+        return kIOReturnBusy;
+    if (!_controllerReady)
+        return kIOReturnNotReady;
+    restoreController();
+    
+    // Determine cylinders on media. Slots hold physical sectors.
+    const FloppyMediaFormat *format = _driveState[session->device->getDriveNumber()].format;
+    UInt32 sectorsPerCylinder = format->sectorsPerTrack * 2;
+    UInt32 totalCylinders = format->cylinders;
+    if (session->firstCylinder >= totalCylinders || session->cylinderCount == 0)
+        return kIOReturnBadArgument;
+    if (session->cylinderCount > totalCylinders - session->firstCylinder)
+        session->cylinderCount = totalCylinders - session->firstCylinder;
+    
+    // Reset ring.
+    ring->producer = 0;
+    ring->consumer = 0;
+    ring->slotCount = kFloppyImageRingSlotCount;
+    ring->cylinderBytes = sectorsPerCylinder * FLOPPY_SECTOR_SIZE(format->sizeCode);
+    ring->sectorsPerCylinder = sectorsPerCylinder;
+    ring->cylinderCount = session->cylinderCount;
+    ring->result = kIOReturnSuccess;
+    ring->state = kFloppyImageStateRunning;
+    
+    // Keep the motor on for the whole session.
+    _imageSessionRunning = true;
+    _motorHeld = true;
+    
+    IOReturn status = kIOReturnSuccess;
+    for (UInt32 i = 0; i < session->cylinderCount; i++) {
+        // Wait for a slot. Reading needs a free slot, writing needs one the client has filled.
+        // The gate is released while waiting so other requests can run.
+        while (!*session->abort && (session->write ? (ring->producer == ring->consumer) : (ring->producer - ring->consumer >= kFloppyImageRingSlotCount))) {
+            UInt64 deadline;
+            clock_interval_to_deadline(kFloppyImageWaitMs, kMillisecondScale, &deadline);
+            _cmdGate->commandSleep(ring, deadline, THREAD_ABORTSAFE);
+        }
+        if (*session->abort) {
+            status = kIOReturnAborted;
+            break;
+        }
+        
+        // Transfer cylinder to or from the slot. Requests run while the gate was released may have selected another drive.
+        UInt32 index = session->write ? ring->consumer : ring->producer;
+        FloppyImageSlot *slot = &ring->slots[index % kFloppyImageRingSlotCount];
+        slot->cylinder = session->firstCylinder + i;
+        selectDrive(session->device);
+        IOReturn cylinderStatus = imageCylinder(session->write, slot->cylinder, slot);
+        
+        // Publish slot once its contents are complete.
+        __sync_synchronize();
+        if (session->write)
+            ring->consumer++;
+        else
+            ring->producer++;
+        
+        // Bad sectors are recorded in the slot, but losing the media ends the session.
+        if (cylinderStatus == kIOReturnNoMedia || cylinderStatus == kIOReturnNotWritable || cylinderStatus == kIOReturnNotReady) {
+            status = cylinderStatus;
+            break;
+        }
+    }
+    
+    // Release motor.
+    _motorHeld = false;
+    _imageSessionRunning = false;
+    _tmrMotorOffSource->setTimeoutMS(kFloppyMotorTimeoutMs);
+    
+    ring->result = status;
+    ring->state = status == kIOReturnAborted ? kFloppyImageStateAborted : kFloppyImageStateDone;
+    return status;
+}
+
+IOReturn VoodooFloppyController::wakeImageSessionGated(FloppyImageRing *ring) {
+    _cmdGate->commandWakeup(ring);
     return kIOReturnSuccess;
 }
 
 IOReturn VoodooFloppyController::probeMediaGated(VoodooFloppyStorageDevice *floppyDevice) {
     DBGLOG("VoodooFloppyController::probeMediaGated()\n");
+    if (!_controllerReady)
+        return kIOReturnNotReady;
+    restoreController();
     selectDrive(floppyDevice);
     
+    // Media may have been swapped since it was last seen.
+    forgetMedia(floppyDevice->getDriveNumber());
+    
     // Try to calibrate to check if media is present.
     if (seek(10) != kIOReturnSuccess || recalibrate() != kIOReturnSuccess)
         return kIOReturnNoMedia;
-    else {
-        // Try to read track.
-        if (seek(5) != kIOReturnSuccess || readWriteSectors(false, 5, 0, 5, 1) != kIOReturnSuccess)
-            return kIOReturnNoMedia;
+    
+    // Get the sector size from an ID field, and pick the matching format.
+    UInt8 sizeCode = FLOPPY_BYTES_SECTOR_UNKNOWN;
+    if (seek(5) != kIOReturnSuccess)
+        return kIOReturnNoMedia;
+    readId(0, &sizeCode);
+    const FloppyMediaFormat *format = findMediaFormat(floppyDevice->getDataRate(), sizeCode);
+    if (!format) {
+        if (sizeCode != FLOPPY_BYTES_SECTOR_UNKNOWN)
+            IOLog("VoodooFloppyController: Unsupported sector size code %u on drive %u.\n", sizeCode, floppyDevice->getDriveNumber());
+        return kIOReturnNoMedia;
     }
+    setFormat(floppyDevice, format);
+    
+    // Try to read track.
+    if (readWriteSectors(false, 5, 0, 5, 1, _dmaBuffer) != kIOReturnSuccess)
+        return kIOReturnNoMedia;
     
-    // Media is present.
+    // Media is present. Mirror it in idle time if enabled.
+    if (_mirrorEnabled)
+        startMirror(floppyDevice);
     return kIOReturnSuccess;
 }
 
+/**
+ * Lays down new ID fields on a range of cylinders, in one of the supported formats.
+ * The drive is read and written in the new format from then on, so only whole disks can change format.
+ */
+IOReturn VoodooFloppyController::formatGated(FloppyFormatSession *session) {
+    DBGLOG("VoodooFloppyController::formatGated()\n");
+    if (!_controllerReady)
+        return kIOReturnNotReady;
+    
+    // Check the format and range.
+    const FloppyMediaFormat *format = findMediaFormat(session->device->getDataRate(), session->sizeCode);
+    if (!format)
+        return kIOReturnUnsupported;
+    if (session->firstCylinder >= format->cylinders || session->cylinderCount == 0)
+        return kIOReturnBadArgument;
+    if (session->cylinderCount > format->cylinders - session->firstCylinder)
+        session->cylinderCount = format->cylinders - session->firstCylinder;
+    
+    // The rest of the disk would be left in the old format, unreadable in the new one.
+    bool partial = session->firstCylinder > 0 || session->cylinderCount < format->cylinders;
+    if (partial && format->sizeCode != _driveState[session->device->getDriveNumber()].format->sizeCode)
+        return kIOReturnBadArgument;
+    restoreController();
+    
+    // Keep the motor on for the whole run.
+    selectDrive(session->device);
+    _motorHeld = true;
+    
+    // Whatever was known about the old contents no longer holds.
+    forgetMedia(session->device->getDriveNumber());
+    setFormat(session->device, format);
+    
+    IOReturn status = kIOReturnSuccess;
+    for (UInt32 i = 0; i < session->cylinderCount && status == kIOReturnSuccess; i++) {
+        UInt8 cylinder = (UInt8)(session->firstCylinder + i);
+        status = seek(cylinder);
+        for (UInt8 head = 0; head < 2 && status == kIOReturnSuccess; head++)
+            status = formatTrack(cylinder, head);
+    }
+    
+    // Release motor.
+    _motorHeld = false;
+    _tmrMotorOffSource->setTimeoutMS(kFloppyMotorTimeoutMs);
+    
+    if (status != kIOReturnSuccess)
+        IOLog("VoodooFloppyController: Failed to format drive %u: 0x%X\n", session->device->getDriveNumber(), status);
+    return status;
+}
+
+/**
+ * Searches a range of cylinders for sectors matching a pattern, without moving sector data to the host.
+ * Each cylinder is screened by a SCAN command at media speed. Cylinders held in the RAM mirror are compared in memory instead.
+ */
+IOReturn VoodooFloppyController::scanGated(FloppyScanSession *session) {
+    DBGLOG("VoodooFloppyController::scanGated()\n");
+    static const UInt8 scanCommands[kFloppyScanConditionCount] = {
+        FLOPPY_CMD_SCAN_EQUAL,
+        FLOPPY_CMD_SCAN_LOW_OR_EQUAL,
+        FLOPPY_CMD_SCAN_HIGH_OR_EQUAL
+    };
+    if (!_controllerReady)
+        return kIOReturnNotReady;
+    
+    // Check the pattern and range against the media in the drive.
+    const FloppyMediaFormat *format = _driveState[session->device->getDriveNumber()].format;
+    UInt8 sectorsPerTrack = format->sectorsPerTrack;
+    UInt32 sectorSize = FLOPPY_SECTOR_SIZE(format->sizeCode);
+    if (session->condition >= kFloppyScanConditionCount || session->patternLength == 0 || session->patternLength > sectorSize)
+        return kIOReturnBadArgument;
+    if (session->firstCylinder >= format->cylinders || session->cylinderCount == 0)
+        return kIOReturnBadArgument;
+    if (session->cylinderCount > format->cylinders - session->firstCylinder)
+        session->cylinderCount = format->cylinders - session->firstCylinder;
+    restoreController();
+    
+    // Keep the motor on for the whole run.
+    selectDrive(session->device);
+    _motorHeld = true;
+    
+    // The controller takes a copy of the pattern for each sector it compares, so fill the DMA buffer with a cylinder's worth.
+    // Each copy is padded to a whole sector with bytes that match anything.
+    UInt32 sectorsPerCylinder = sectorsPerTrack * 2;
+    memset(_dmaBuffer, kFloppyScanDontCare, sectorSize);
+    memcpy(_dmaBuffer, session->pattern, session->patternLength);
+    for (UInt32 i = 1; i < sectorsPerCylinder; i++)
+        memcpy(_dmaBuffer + i * sectorSize, _dmaBuffer, sectorSize);
+    
+    IOReturn status = kIOReturnSuccess;
+    bool full = session->matchCount >= session->maxMatches;
+    for (UInt32 i = 0; i < session->cylinderCount && status == kIOReturnSuccess && !full; i++) {
+        UInt8 cylinder = (UInt8)(session->firstCylinder + i);
+        UInt32 cylinderLba = cylinder * sectorsPerCylinder;
+        UInt8 *mirror = isMirrored(cylinderLba, sectorsPerCylinder) && !isDiskChanged() ? getMirror(cylinderLba, sectorsPerCylinder) : NULL;
+        
+        // A scan stops at the first sector that matches. Carry on after it until the cylinder is done.
+        UInt8 head = 0, sector = 1;
+        while (head < 2 && !full) {
+            UInt8 hitHead = 0, hitSector = 0;
+            if (mirror) {
+                for (UInt32 j = head * sectorsPerTrack + sector - 1; j < sectorsPerCylinder && !hitSector; j++) {
+                    if (scanSector(session->condition, mirror + j * sectorSize, _dmaBuffer, session->patternLength)) {
+                        hitHead = j / sectorsPerTrack;
+                        hitSector = j % sectorsPerTrack + 1;
+                    }
+                }
+            } else {
+                status = seek(cylinder);
+                if (status == kIOReturnSuccess)
+                    status = scanCylinder(scanCommands[session->condition], cylinder, head, sector, &hitHead, &hitSector);
+            }
+            if (status != kIOReturnSuccess || !hitSector)
+                break;
+            
+            FloppyScanMatch *match = &session->matches[session->matchCount++];
+            match->cylinder = cylinder;
+            match->head = hitHead;
+            match->sector = hitSector;
+            match->reserved = 0;
+            full = session->matchCount >= session->maxMatches;
+            head = hitHead + hitSector / sectorsPerTrack;
+            sector = hitSector % sectorsPerTrack + 1;
+        }
+        
+        // Only count cylinders searched in full, so a search cut short can pick up again.
+        if (status == kIOReturnSuccess && !full)
+            session->cylindersScanned++;
+    }
+    
+    // Release motor.
+    _motorHeld = false;
+    _tmrMotorOffSource->setTimeoutMS(kFloppyMotorTimeoutMs);
+    
+    if (status != kIOReturnSuccess)
+        IOLog("VoodooFloppyController: Failed to scan drive %u: 0x%X\n", session->device->getDriveNumber(), status);
+    return status;
+}
+
+/**
+ * Copies a range of cylinders from one drive to the other, a cylinder at a time through the DMA buffer.
+ * Both motors stay on and each drive keeps its own head position, so switching drives costs neither a spin-up nor a recalibrate.
+ */
+IOReturn VoodooFloppyController::copyGated(FloppyCopySession *session) {
+    DBGLOG("VoodooFloppyController::copyGated()\n");
+    FloppyImageRing *ring = session->ring;
+    
+    // Copies report progress in the ring and hold the motors on, the same as imaging sessions.
+    if (_imageSessionRunning)
+        return kIOReturnBusy;
+    if (!_controllerReady)
+        return kIOReturnNotReady;
+    
+    // Both drives need media in the same format.
+    const FloppyMediaFormat *format = _driveState[session->source->getDriveNumber()].format;
+    if (format != _driveState[session->destination->getDriveNumber()].format)
+        return kIOReturnUnsupported;
+    if (session->firstCylinder >= format->cylinders || session->cylinderCount == 0)
+        return kIOReturnBadArgument;
+    if (session->cylinderCount > format->cylinders - session->firstCylinder)
+        session->cylinderCount = format->cylinders - session->firstCylinder;
+    
+    // Cylinders are staged in a slot as for imaging, so unreadable sectors are handled the same way.
+    FloppyImageSlot *slot = (FloppyImageSlot*)IOMalloc(sizeof (FloppyImageSlot));
+    if (!slot)
+        return kIOReturnNoMemory;
+    restoreController();
+    
+    // Progress goes in the ring header.
+    ring->producer = 0;
+    ring->consumer = 0;
+    ring->slotCount = kFloppyImageRingSlotCount;
+    ring->cylinderBytes = format->sectorsPerTrack * 2 * FLOPPY_SECTOR_SIZE(format->sizeCode);
+    ring->sectorsPerCylinder = format->sectorsPerTrack * 2;
+    ring->cylinderCount = session->cylinderCount;
+    ring->result = kIOReturnSuccess;
+    ring->state = kFloppyImageStateRunning;
+    
+    // Keep the motors on for the whole run.
+    _imageSessionRunning = true;
+    _motorHeld = true;
+    
+    IOReturn status = kIOReturnSuccess;
+    for (UInt32 i = 0; i < session->cylinderCount; i++) {
+        if (*session->abort) {
+            status = kIOReturnAborted;
+            break;
+        }
+        
+        // Read the cylinder from the source, then write it out to the destination, even if some sectors were bad.
+        FloppyCopyCylinder *result = &session->results[i];
+        UInt8 cylinder = (UInt8)(session->firstCylinder + i);
+        selectDrive(session->source);
+        IOReturn cylinderStatus = imageCylinder(false, cylinder, slot);
+        result->retriedSectors = slot->retriedSectors;
+        result->badSectors = slot->badSectors;
+        
+        bool fatal = cylinderStatus == kIOReturnNoMedia || cylinderStatus == kIOReturnNotReady;
+        if (!fatal) {
+            selectDrive(session->destination);
+            IOReturn writeStatus = imageCylinder(true, cylinder, slot);
+            result->retriedSectors += slot->retriedSectors;
+            result->badSectors += slot->badSectors;
+            if (cylinderStatus == kIOReturnSuccess)
+                cylinderStatus = writeStatus;
+            fatal = writeStatus == kIOReturnNoMedia || writeStatus == kIOReturnNotWritable || writeStatus == kIOReturnNotReady;
+        }
+        
+        result->status = cylinderStatus;
+        result->cylinder = cylinder;
+        bzero(result->reserved, sizeof (result->reserved));
+        session->cylindersCopied++;
+        __sync_synchronize();
+        ring->producer++;
+        
+        // Bad sectors are recorded in the results, but losing either disk ends the copy.
+        if (fatal) {
+            status = cylinderStatus;
+            break;
+        }
+    }
+    
+    // Release motors.
+    _motorHeld = false;
+    _imageSessionRunning = false;
+    _tmrMotorOffSource->setTimeoutMS(kFloppyMotorTimeoutMs);
+    IOFree(slot, sizeof (FloppyImageSlot));
+    
+    ring->result = status;
+    ring->state = status == kIOReturnAborted ? kFloppyImageStateAborted : kFloppyImageStateDone;
+    if (status != kIOReturnSuccess)
+        IOLog("VoodooFloppyController: Failed to copy drive %u to drive %u: 0x%X\n", session->source->getDriveNumber(), session->destination->getDriveNumber(), status);
+    return status;
+}
+
 /**
  * Waits for IRQ6 to be raised.
- * @return True if the IRQ was triggered; otherwise false if it timed out.
+ * If it doesn't come in time, MSR is checked before giving up, as some chipsets drop the interrupt.
+ * @param timeoutMs How long the command should take, from getCommandTimeoutMs().
+ * @return True if the IRQ was triggered or the command has reached its result phase; otherwise false if it timed out.
  */
-bool VoodooFloppyController::waitInterrupt(UInt16 timeout) {
-    // Wait until IRQ is triggered or we time out.
-    UInt8 ret = false;
+bool VoodooFloppyController::waitInterrupt(UInt32 timeoutMs, bool watchDiskChange) {
+    UInt64 deadline;
+    clock_interval_to_deadline(timeoutMs, kMillisecondScale, &deadline);
+    
+    // Wait until IRQ is triggered, we time out, or the request is aborted.
+    bool ret = false;
+    bool timedOut = false;
     while (!_irqTriggered) {
-        if(!timeout)
+        if (checkAbort(watchDiskChange) != kIOReturnSuccess)
+            break;
+        if (mach_absolute_time() > deadline) {
+            timedOut = true;
             break;
-        timeout--;
+        }
         IOSleep(10);
     }
     
     // Did we hit the IRQ?
-    if(_irqTriggered)
+    if (_irqTriggered)
         ret = true;
-    else
-        IOLog("VoodooFloppyController: IRQ timeout!\n");
+    else if (timedOut) {
+        _irqLost++;
+        
+        // Result bytes waiting means the command finished and only the interrupt went missing.
+        // There is no time for when that happened, so rotational references can't be taken from it.
+        UInt8 msr = readRegister(FLOPPY_REG_MSR);
+        if ((msr & (FLOPPY_MSR_RQM | FLOPPY_MSR_DIO)) == (FLOPPY_MSR_RQM | FLOPPY_MSR_DIO)) {
+            DBGLOG("VoodooFloppyController: Lost interrupt, command has finished.\n");
+            _irqRecovered++;
+            _irqTime = 0;
+            ret = true;
+        } else {
+            IOLog("VoodooFloppyController: IRQ timeout!\n");
+            
+            // A command still running won't finish now. Reset so it doesn't hold up the next one.
+            // Seeks and resets have no result phase, so their status is left for SENSE INTERRUPT.
+            // A controller that stays busy through its own reset is left for the caller to fail on.
+            if ((msr & FLOPPY_MSR_CMD_BUSY) && !_resetting)
+                resetController();
+        }
+        publishInterruptStatistics();
+    }
     
     // Reset triggered value.
     _irqTriggered = false;
     return ret;
 }
 
+/**
+ * Works out how long a command on the current drive should take, to bound the wait for its interrupt.
+ * @param steps Step pulses the command may give.
+ * @param revolutions Revolutions the command may need, including the wait for its first sector.
+ */
+UInt32 VoodooFloppyController::getCommandTimeoutMs(UInt8 steps, UInt8 revolutions) {
+    UInt32 timeoutUs = kFloppyIrqSlackMs * 1000;
+    if (!_currentDevice)
+        return kFloppyIrqSlackMs;
+    
+    // Step rates given with SPECIFY are for 500 Kbps, and scale with the data rate.
+    if (steps) {
+        UInt32 stepUs = (16 - FLOPPY_SPECIFY_STEP_RATE) * 1000;
+        switch (_currentDevice->getDataRate()) {
+            case FLOPPY_SPEED_1MBPS:
+                stepUs /= 2;
+                break;
+                
+            case FLOPPY_SPEED_300KBPS:
+                stepUs = stepUs * 5 / 3;
+                break;
+                
+            case FLOPPY_SPEED_250KBPS:
+                stepUs *= 2;
+                break;
+        }
+        timeoutUs += steps * stepUs + kFloppySeekSettleMs * 1000;
+    }
+    
+    // While the spindle comes up to speed, sectors only appear once it gets there.
+    if (revolutions) {
+        timeoutUs += revolutions * getRotationPeriod();
+        if (_driveState[_currentDevice->getDriveNumber()].motorOnTime)
+            timeoutUs += kFloppySpinUpMaxMs * 1000;
+    }
+    return timeoutUs / 1000;
+}
+
+/**
+ * Exports interrupt timeout counts to the registry.
+ */
+void VoodooFloppyController::publishInterruptStatistics() {
+    OSDictionary *interrupts = OSDictionary::withCapacity(2);
+    if (!interrupts)
+        return;
+    
+    setNumber(interrupts, "lost", _irqLost, 32);
+    setNumber(interrupts, "recovered", _irqRecovered, 32);
+    
+    setProperty(kFloppyPropertyInterruptsKey, interrupts);
+    interrupts->release();
+}
+
+/**
+ * Spins briefly for RQM, which drops for a few microseconds after each command or result byte.
+ * @return The last MSR value read.
+ */
+UInt8 VoodooFloppyController::spinRqm() {
+    UInt8 msr = readRegister(FLOPPY_REG_MSR);
+    for (UInt16 i = 0; i < kFloppyRqmSpinUs && !(msr & FLOPPY_MSR_RQM); i++) {
+        IODelay(1);
+        msr = readRegister(FLOPPY_REG_MSR);
+    }
+    return msr;
+}
+
+/**
+ * Waits for the controller to request a byte in the given direction.
+ * RQM normally returns within microseconds, so spin for that long before falling back to sleeping.
+ * @param read True if the host is to read a result byte; false to write a command byte.
+ * @return True if the controller is ready; otherwise false if it timed out, was aborted, or wants the other direction.
+ */
+bool VoodooFloppyController::waitRqm(bool read) {
+    UInt8 msr = spinRqm();
+    if (!(msr & FLOPPY_MSR_RQM)) {
+        _handshakeStalls++;
+        publishHandshakeStatistics();
+        for (UInt16 i = 0; i < FLOPPY_IRQ_WAIT_TIME && !(msr & FLOPPY_MSR_RQM); i++) {
+            if (checkAbort() != kIOReturnSuccess)
+                return false;
+            IOSleep(10);
+            msr = readRegister(FLOPPY_REG_MSR);
+        }
+        if (!(msr & FLOPPY_MSR_RQM)) {
+            DBGLOG("VoodooFloppyController: Data timeout!\n");
+            return false;
+        }
+    }
+    
+    // The controller is out of step with us if DIO points the other way.
+    if (((msr & FLOPPY_MSR_DIO) != 0) != read) {
+        DBGLOG("VoodooFloppyController: Data direction mismatch, MSR 0x%X.\n", msr);
+        _handshakeErrors++;
+        publishHandshakeStatistics();
+        return false;
+    }
+    return true;
+}
+
 /**
  * Write a byte to the floppy controller
  * @param data The byte to write.
  */
 bool VoodooFloppyController::writeData(UInt8 data) {
-    for (UInt16 i = 0; i < FLOPPY_IRQ_WAIT_TIME; i++) {
-        // Wait until register is ready.
-        if (inb(FLOPPY_REG_MSR) & FLOPPY_MSR_RQM) {
-            outb(FLOPPY_REG_FIFO, data);
-            return true;
-        }
-        IOSleep(10);
-    }
-    DBGLOG("VoodooFloppyController: Data timeout!\n");
-    return false;
+    if (!waitRqm(false))
+        return false;
+    writeRegister(FLOPPY_REG_FIFO, data);
+    return true;
 }
 
 /**
  * Read a byte from the floppy controller
- * @return The byte read. If a timeout occurs, 0.
+ * @return The byte read. If a timeout occurs, 0xFF.
  */
 UInt8 VoodooFloppyController::readData(void) {
-    for (UInt16 i = 0; i < FLOPPY_IRQ_WAIT_TIME; i++) {
-        // Wait until register is ready.
-        if (inb(FLOPPY_REG_MSR) & FLOPPY_MSR_RQM)
-            return inb(FLOPPY_REG_FIFO);
-        IOSleep(10);
+    if (!waitRqm(true))
+        return 0xFF;
+    return readRegister(FLOPPY_REG_FIFO);
+}
+
+/**
+ * Sends a whole command block to the controller.
+ * @return True if all bytes were accepted; otherwise false.
+ */
+bool VoodooFloppyController::sendCommand(const UInt8 *command, UInt8 length) {
+    for (UInt8 i = 0; i < length; i++) {
+        if (!writeData(command[i]))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Reads a whole result block from the controller. Bytes not read are set to 0xFF.
+ * @return True if all bytes were read; otherwise false.
+ */
+bool VoodooFloppyController::readResult(UInt8 *result, UInt8 length) {
+    for (UInt8 i = 0; i < length; i++) {
+        if (!waitRqm(true)) {
+            memset(result + i, 0xFF, length - i);
+            return false;
+        }
+        result[i] = readRegister(FLOPPY_REG_FIFO);
     }
-    DBGLOG("VoodooFloppyController: Data timeout!\n");
-    return 0xFF;
+    return true;
+}
+
+/**
+ * Exports command and result phase handshake counts to the registry.
+ */
+void VoodooFloppyController::publishHandshakeStatistics() {
+    OSDictionary *handshake = OSDictionary::withCapacity(2);
+    if (!handshake)
+        return;
+    
+    setNumber(handshake, "stalls", _handshakeStalls, 32);
+    setNumber(handshake, "direction-errors", _handshakeErrors, 32);
+    
+    setProperty(kFloppyPropertyHandshakeKey, handshake);
+    handshake->release();
 }
 
 /**
@@ -489,32 +1954,129 @@ UInt8 VoodooFloppyController::readData(void) {
  */
 void VoodooFloppyController::senseInterrupt(UInt8 *st0, UInt8 *cyl) {
     // Send command and get result.
-    writeData(FLOPPY_CMD_SENSE_INTERRUPT);
-    *st0 = readData();
-    *cyl = readData();
+    UInt8 command = FLOPPY_CMD_SENSE_INTERRUPT;
+    UInt8 result[2];
+    sendCommand(&command, 1);
+    readResult(result, sizeof (result));
+    *st0 = result[0];
+    *cyl = result[1];
 }
 
 /**
  * Sets drive data.
  */
 void VoodooFloppyController::setDriveData(UInt8 stepRate, UInt16 loadTime, UInt8 unloadTime, bool dma) {
+    UInt8 data[2];
+    data[0] = ((stepRate & 0xF) << 4) | (unloadTime & 0xF);
+    data[1] = ((loadTime & 0x7F) << 1) | (dma ? 0 : 1);
+    
+    // No need to send the command if the controller already has these values.
+    if (_specifyValid && _specifyShadow[0] == data[0] && _specifyShadow[1] == data[1])
+        return;
+    
     // Send specify command.
-    writeData(FLOPPY_CMD_SPECIFY);
-    UInt8 data = ((stepRate & 0xF) << 4) | (unloadTime & 0xF);
-    writeData(data);
-    data = (loadTime << 1 | dma ? 0 : 1);
-    writeData(data);
+    UInt8 command[3] = { FLOPPY_CMD_SPECIFY, data[0], data[1] };
+    sendCommand(command, sizeof (command));
+    
+    _specifyShadow[0] = data[0];
+    _specifyShadow[1] = data[1];
+    _specifyValid = true;
+}
+
+/**
+ * Reads a controller register.
+ * @param reg Register offset from the controller I/O base.
+ */
+UInt8 VoodooFloppyController::readRegister(UInt8 reg) {
+    return inb(_ioBase + reg);
+}
+
+/**
+ * Writes a controller register.
+ * @param reg Register offset from the controller I/O base.
+ */
+void VoodooFloppyController::writeRegister(UInt8 reg, UInt8 value) {
+    outb(_ioBase + reg, value);
+}
+
+/**
+ * Writes the DOR if the value differs from what was last written.
+ * @param value The new DOR value.
+ */
+void VoodooFloppyController::writeDor(UInt8 value) {
+    if (_dorValid && _dorShadow == value)
+        return;
+    
+    writeRegister(FLOPPY_REG_DOR, value);
+    _dorShadow = value;
+    _dorValid = true;
+}
+
+/**
+ * Marks shadowed register state as unknown so it gets sent again.
+ * @param includeLocked True to also drop DOR and locked CONFIGURE state, such as across power transitions.
+ */
+void VoodooFloppyController::invalidateRegisterShadow(bool includeLocked) {
+    _ccrValid = false;
+    _specifyValid = false;
+    
+    // Locked CONFIGURE values survive a software reset.
+    if (includeLocked || !_configureLocked)
+        _configureValid = false;
+    if (includeLocked) {
+        _configureLocked = false;
+        _dorValid = false;
+    }
+}
+
+/**
+ * Programs the data rate and drive timings for the current drive.
+ */
+void VoodooFloppyController::applyDriveSettings() {
+    setTransferSpeed(_currentDevice->getDataRate());
+    setDriveData(FLOPPY_SPECIFY_STEP_RATE, FLOPPY_SPECIFY_HEAD_LOAD, FLOPPY_SPECIFY_HEAD_UNLOAD, _useDma);
 }
 
 /**
- * Detects floppy drives in CMOS.
+ * Determines the I/O base and DMA channel of the controller.
+ * An explicit io-base property wins. Otherwise the ACPI _UID picks the primary or secondary base.
+ */
+void VoodooFloppyController::getResources(IOService *provider) {
+    OSNumber *ioBase = OSDynamicCast(OSNumber, provider->getProperty(kFloppyPropertyIoBaseKey));
+    if (!ioBase)
+        ioBase = OSDynamicCast(OSNumber, getProperty(kFloppyPropertyIoBaseKey));
+    
+    if (ioBase)
+        _ioBase = ioBase->unsigned16BitValue();
+    else {
+        // ACPI exposes _UID as a string or number depending on the firmware.
+        OSObject *uid = provider->getProperty(kFloppyAcpiUidKey);
+        OSString *uidString = OSDynamicCast(OSString, uid);
+        OSNumber *uidNumber = OSDynamicCast(OSNumber, uid);
+        bool secondary = (uidString && uidString->isEqualTo("1")) || (uidNumber && uidNumber->unsigned32BitValue() == 1);
+        _ioBase = secondary ? FLOPPY_BASE_SECONDARY : FLOPPY_BASE_PRIMARY;
+    }
+    
+    OSNumber *dmaChannel = OSDynamicCast(OSNumber, provider->getProperty(kFloppyPropertyDmaChannelKey));
+    if (!dmaChannel)
+        dmaChannel = OSDynamicCast(OSNumber, getProperty(kFloppyPropertyDmaChannelKey));
+    _dmaChannel = dmaChannel ? (dmaChannel->unsigned8BitValue() & 0x3) : FLOPPY_DMA_CHANNEL;
+    IOLog("VoodooFloppyController: I/O base 0x%X, DMA channel %u.\n", _ioBase, _dmaChannel);
+}
+
+/**
+ * Detects floppy drives in CMOS. CMOS only describes the primary controller, so
+ * drive-a-type and drive-b-type properties are used for other controllers or to override it.
  * @return True if drives were found; otherwise false.
  */
 bool VoodooFloppyController::detectDrives(UInt8 *outTypeA, UInt8 *outTypeB) {
     // Get data from CMOS.
-    IOLog("VoodooFloppyController: Detecting drives from CMOS...\n");
-    outb(0x70, 0x10);
-    UInt8 types = inb(0x71);
+    UInt8 types = 0;
+    if (_ioBase == FLOPPY_BASE_PRIMARY) {
+        IOLog("VoodooFloppyController: Detecting drives from CMOS...\n");
+        outb(0x70, 0x10);
+        types = inb(0x71);
+    }
     
     // Drive types.
     const char *driveTypes[6] = { "None", "360KB 5.25\"",
@@ -524,6 +2086,14 @@ bool VoodooFloppyController::detectDrives(UInt8 *outTypeA, UInt8 *outTypeB) {
     *outTypeA = types >> 4; // Get high nibble.
     *outTypeB = types & 0xF; // Get low nibble by ANDing out low nibble.
     
+    // Apply overrides.
+    OSNumber *typeA = OSDynamicCast(OSNumber, getProperty(kFloppyPropertyDriveATypeKey));
+    OSNumber *typeB = OSDynamicCast(OSNumber, getProperty(kFloppyPropertyDriveBTypeKey));
+    if (typeA)
+        *outTypeA = typeA->unsigned8BitValue();
+    if (typeB)
+        *outTypeB = typeB->unsigned8BitValue();
+    
     // Did we find any drives?
     if (*outTypeA > FLOPPY_TYPE_2880_35 || *outTypeB > FLOPPY_TYPE_2880_35)
         return false;
@@ -546,18 +2116,148 @@ UInt8 VoodooFloppyController::getControllerVersion() {
 void VoodooFloppyController::configureController() {
     DBGLOG("VoodooFloppyController::configureController()\n");
     
-    // Send configure command.
-    writeData(FLOPPY_CMD_CONFIGURE);
-    writeData(0); // Zero.
-    UInt8 data = (0 << 6) | (0 << 5) | (1 << 4) | 0; // Implied seek disabled, FIFO enabled, polling disabled, 0 FIFO threshold.
-    writeData(data);
-    writeData(0); // Zero for pretrack value.
+    UInt8 data[3];
+    data[0] = 0; // Zero.
+    data[1] = (0 << 6) | (0 << 5) | (1 << 4) | _fifoThreshold; // Implied seek disabled, FIFO enabled, polling disabled, current FIFO threshold.
+    data[2] = FLOPPY_PRETRACK; // Precompensation start track.
+    
+    // Send configure command if the controller does not already have these values.
+    if (!_configureValid || memcmp(_configureShadow, data, sizeof (data)) != 0) {
+        UInt8 command[4] = { FLOPPY_CMD_CONFIGURE, data[0], data[1], data[2] };
+        sendCommand(command, sizeof (command));
+        
+        memcpy(_configureShadow, data, sizeof (data));
+        _configureValid = true;
+    }
     
     // Lock configuration.
-    writeData(FLOPPY_CMD_LOCK);
+    if (!_configureLocked) {
+        writeData(FLOPPY_CMD_LOCK | FLOPPY_CMD_EXT_LOCK);
+        readData();
+        _configureLocked = true;
+    }
+}
+
+/**
+ * Raises the FIFO threshold after an overrun so the controller asks for service earlier.
+ * The locked configuration is updated straight away.
+ */
+void VoodooFloppyController::raiseFifoThreshold() {
+    _fifoOverruns++;
+    _fifoCleanTransfers = 0;
+    if (_fifoThreshold < FLOPPY_FIFO_THRESHOLD_MAX) {
+        _fifoThreshold = (_fifoThreshold << 1) | 1;
+        if (_fifoThreshold > FLOPPY_FIFO_THRESHOLD_MAX)
+            _fifoThreshold = FLOPPY_FIFO_THRESHOLD_MAX;
+        IOLog("VoodooFloppyController: Overrun, raising FIFO threshold to %u.\n", _fifoThreshold + 1);
+        applyFifoThreshold();
+    }
+    publishFifoStatistics();
+}
+
+/**
+ * Lowers the FIFO threshold by one step after a long run of transfers without overruns.
+ */
+void VoodooFloppyController::relaxFifoThreshold() {
+    if (_fifoThreshold <= FLOPPY_FIFO_THRESHOLD_MIN || ++_fifoCleanTransfers < kFloppyFifoRelaxTransfers)
+        return;
     
-    // Reset controller.
-    resetController();
+    _fifoCleanTransfers = 0;
+    _fifoThreshold >>= 1;
+    DBGLOG("VoodooFloppyController: Lowering FIFO threshold to %u.\n", _fifoThreshold + 1);
+    applyFifoThreshold();
+    publishFifoStatistics();
+}
+
+/**
+ * Sends CONFIGURE with the current FIFO threshold and updates the saved state used after wake.
+ */
+void VoodooFloppyController::applyFifoThreshold() {
+    configureController();
+    if (_savedRegsValid)
+        _savedRegs[FLOPPY_DUMPREG_CONFIGURE] = _configureShadow[1];
+}
+
+/**
+ * Exports FIFO threshold and overrun counts to the registry.
+ */
+void VoodooFloppyController::publishFifoStatistics() {
+    setProperty(kFloppyPropertyFifoThresholdKey, _fifoThreshold + 1, 8);
+    setProperty(kFloppyPropertyFifoOverrunsKey, _fifoOverruns, 32);
+    setProperty(kFloppyPropertyFifoTransfersKey, _fifoTransfers, 32);
+}
+
+/**
+ * Reads the controller configuration with DUMPREG.
+ * @param regs Buffer of FLOPPY_DUMPREG_LENGTH bytes.
+ * @return True if the full dump was read; otherwise false.
+ */
+bool VoodooFloppyController::dumpRegisters(UInt8 *regs) {
+    DBGLOG("VoodooFloppyController::dumpRegisters()\n");
+    if (!writeData(FLOPPY_CMD_DUMPREG))
+        return false;
+    
+    // Controllers without DUMPREG return a single invalid command byte.
+    for (UInt8 i = 0; i < FLOPPY_DUMPREG_LENGTH; i++) {
+        if ((spinRqm() & (FLOPPY_MSR_RQM | FLOPPY_MSR_DIO)) == FLOPPY_MSR_RQM)
+            return false;
+        regs[i] = readData();
+    }
+    return true;
+}
+
+/**
+ * Restores controller state after wake. Called before the first command following a power transition.
+ * If the controller kept its locked configuration, nothing is reset. Otherwise one reset is
+ * done and the configuration captured at start is replayed.
+ */
+void VoodooFloppyController::restoreController() {
+    if (!_needsRestore)
+        return;
+    DBGLOG("VoodooFloppyController::restoreController()\n");
+    _needsRestore = false;
+    
+    // Without a saved configuration, fall back to a full reset and configure.
+    if (!_savedRegsValid) {
+        resetController();
+        configureController();
+        return;
+    }
+    
+    // Heads may have moved while asleep.
+    invalidateCylinder();
+    
+    // Check if the controller kept its state. The sector count/EOT byte changes with every data command, so it is left out.
+    UInt8 regs[FLOPPY_DUMPREG_LENGTH];
+    bool retained = (spinRqm() & (FLOPPY_MSR_RQM | FLOPPY_MSR_DIO)) == FLOPPY_MSR_RQM
+        && dumpRegisters(regs)
+        && memcmp(&regs[FLOPPY_DUMPREG_SPECIFY], &_savedRegs[FLOPPY_DUMPREG_SPECIFY], FLOPPY_DUMPREG_SC_EOT - FLOPPY_DUMPREG_SPECIFY) == 0
+        && memcmp(&regs[FLOPPY_DUMPREG_LOCK], &_savedRegs[FLOPPY_DUMPREG_LOCK], FLOPPY_DUMPREG_LENGTH - FLOPPY_DUMPREG_LOCK) == 0;
+    
+    if (!retained) {
+        // Replay CONFIGURE and LOCK.
+        resetController();
+        UInt8 configure[4] = { FLOPPY_CMD_CONFIGURE, 0, _savedRegs[FLOPPY_DUMPREG_CONFIGURE], _savedRegs[FLOPPY_DUMPREG_CONFIGURE + 1] };
+        sendCommand(configure, sizeof (configure));
+        if (_savedRegs[FLOPPY_DUMPREG_LOCK] & FLOPPY_DUMPREG_LOCK_BIT) {
+            writeData(FLOPPY_CMD_LOCK | FLOPPY_CMD_EXT_LOCK);
+            readData();
+        }
+        
+        // Replay SPECIFY.
+        UInt8 specify[3] = { FLOPPY_CMD_SPECIFY, _savedRegs[FLOPPY_DUMPREG_SPECIFY], _savedRegs[FLOPPY_DUMPREG_SPECIFY + 1] };
+        sendCommand(specify, sizeof (specify));
+    }
+    
+    // Controller now matches the saved state.
+    _configureShadow[0] = 0;
+    _configureShadow[1] = _savedRegs[FLOPPY_DUMPREG_CONFIGURE];
+    _configureShadow[2] = _savedRegs[FLOPPY_DUMPREG_CONFIGURE + 1];
+    _configureValid = true;
+    _configureLocked = (_savedRegs[FLOPPY_DUMPREG_LOCK] & FLOPPY_DUMPREG_LOCK_BIT) != 0;
+    _specifyShadow[0] = _savedRegs[FLOPPY_DUMPREG_SPECIFY];
+    _specifyShadow[1] = _savedRegs[FLOPPY_DUMPREG_SPECIFY + 1];
+    _specifyValid = true;
 }
 
 /**
@@ -567,9 +2267,14 @@ void VoodooFloppyController::resetController() {
     DBGLOG("VoodooFloppyController::resetController()\n");
     
     // Disable and re-enable floppy controller.
-    outb(FLOPPY_REG_DOR, 0x00);
-    outb(FLOPPY_REG_DOR, FLOPPY_DOR_IRQ_DMA | FLOPPY_DOR_RESET);
-    waitInterrupt(FLOPPY_IRQ_WAIT_TIME);
+    _dorValid = false;
+    writeDor(0x00);
+    writeDor(FLOPPY_DOR_IRQ_DMA | FLOPPY_DOR_RESET);
+    invalidateRegisterShadow(false);
+    invalidateCylinder();
+    _resetting = true;
+    waitInterrupt(getCommandTimeoutMs(0, 0));
+    _resetting = false;
     
     // Clear any interrupts on drives.
     UInt8 st0, cyl;
@@ -581,14 +2286,14 @@ bool VoodooFloppyController::isControllerReady() {
     //DBGLOG("VoodooFloppyController::isControllerReady()\n");
     
     // Ensure we can send a command and that no operations are in progress.
-    bool result = (inb(FLOPPY_REG_MSR) & (FLOPPY_MSR_RQM | FLOPPY_MSR_DIO)) == FLOPPY_MSR_RQM;
+    bool result = (spinRqm() & (FLOPPY_MSR_RQM | FLOPPY_MSR_DIO)) == FLOPPY_MSR_RQM;
     
     // If controller is not ready, reset and try again.
     // If it's still not ready, fail.
     if (!result) {
         DBGLOG("VoodooFloppyController::isControllerReady(): not ready\n");
         resetController();
-        if ((inb(FLOPPY_REG_MSR) & (FLOPPY_MSR_RQM | FLOPPY_MSR_DIO)) != FLOPPY_MSR_RQM)
+        if ((spinRqm() & (FLOPPY_MSR_RQM | FLOPPY_MSR_DIO)) != FLOPPY_MSR_RQM)
             return false;
     }
     
@@ -628,13 +2333,15 @@ bool VoodooFloppyController::setMotorOn() {
     if (motor == -1)
         return false;
     
-    // If motor is already on, no need to turn it on again.
-    if (inb(FLOPPY_REG_DOR) & (driveNumber | motor))
-        return true;
+    // Turn motor on and select the drive. Other motors are left running, so going back to their drives costs no spin-up.
+    // Nothing is written if both are already set.
+    UInt8 motors = _dorValid ? _dorShadow & (FLOPPY_DOR_MOT_DRIVE0 | FLOPPY_DOR_MOT_DRIVE1 | FLOPPY_DOR_MOT_DRIVE2 | FLOPPY_DOR_MOT_DRIVE3) : 0;
+    bool motorOn = motors & (UInt8)motor;
+    writeDor(FLOPPY_DOR_RESET | FLOPPY_DOR_IRQ_DMA | driveNumber | motors | (UInt8)motor);
     
-    // Turn motor on or off and wait 500ms for motor to spin up.
-    outb(FLOPPY_REG_DOR, FLOPPY_DOR_RESET | FLOPPY_DOR_IRQ_DMA | driveNumber | motor);
-    IOSleep(500);
+    // Seeks can run while the spindle comes up to speed. Data commands wait in waitSpinUp().
+    if (!motorOn)
+        _driveState[driveNumber].motorOnTime = mach_absolute_time();
     return true;
 }
 
@@ -645,68 +2352,304 @@ bool VoodooFloppyController::setMotorOff() {
     if (motor == -1)
         return false;
     
-    // Turn motor off.
-    outb(FLOPPY_REG_DOR, FLOPPY_DOR_RESET | FLOPPY_DOR_IRQ_DMA);
+    // Turn all motors off. Rotational position is lost once the spindles stop.
+    writeDor(FLOPPY_DOR_RESET | FLOPPY_DOR_IRQ_DMA | driveNumber);
+    for (UInt8 i = 0; i < FLOPPY_MAX_DRIVES; i++)
+        _driveState[i].rotationSector = 0;
     return true;
 }
 
-void VoodooFloppyController::setTransferSpeed(UInt8 driveType) {
-    // Determine speed.
-    UInt8 speed = FLOPPY_SPEED_500KBPS;
-    switch (driveType) {
-            // TODO
+/**
+ * Waits for the spindle of the current drive to reach speed before a data command.
+ * In AT mode the 82077AA has no readable index status, so a successful READ ID is taken as the drive being ready.
+ * kFloppySpinUpMaxMs bounds the wait either way.
+ * @param readIdField True to look for ID fields; otherwise the full bound is waited out, as for media being formatted.
+ */
+IOReturn VoodooFloppyController::waitSpinUp(UInt8 head, bool readIdField) {
+    FloppyDriveState *driveState = &_driveState[_currentDevice->getDriveNumber()];
+    UInt64 elapsedNs;
+    IOReturn result;
+    
+    if (!driveState->motorOnTime)
+        return kIOReturnSuccess;
+    
+    // Each READ ID either returns the first ID field read or gives up after two index pulses.
+    while (readIdField) {
+        absolutetime_to_nanoseconds(mach_absolute_time() - driveState->motorOnTime, &elapsedNs);
+        if (elapsedNs >= kFloppySpinUpMaxMs * 1000000ULL)
+            break;
+        
+        readId(head);
+        if (!driveState->motorOnTime)
+            return kIOReturnSuccess;
+        
+        result = checkAbort(false, true);
+        if (result != kIOReturnSuccess)
+            return result;
+    }
+    
+    absolutetime_to_nanoseconds(mach_absolute_time() - driveState->motorOnTime, &elapsedNs);
+    if (elapsedNs < kFloppySpinUpMaxMs * 1000000ULL)
+        IOSleep((UInt32)(kFloppySpinUpMaxMs - elapsedNs / 1000000));
+    finishSpinUp(readIdField);
+    return kIOReturnSuccess;
+}
+
+/**
+ * Records the current drive as up to speed.
+ * @param timedOut True if readiness was assumed at kFloppySpinUpMaxMs after no ID field could be read.
+ */
+void VoodooFloppyController::finishSpinUp(bool timedOut) {
+    FloppyDriveState *driveState = &_driveState[_currentDevice->getDriveNumber()];
+    UInt64 elapsedNs;
+    
+    if (!driveState->motorOnTime)
+        return;
+    absolutetime_to_nanoseconds(mach_absolute_time() - driveState->motorOnTime, &elapsedNs);
+    driveState->motorOnTime = 0;
+    
+    // Waits where nothing was measured say nothing about the drive.
+    if (timedOut)
+        driveState->spinUpTimeouts++;
+    else {
+        driveState->spinUpCount++;
+        driveState->spinUpLastUs = elapsedNs / 1000;
+        driveState->spinUpTotalUs += driveState->spinUpLastUs;
+        if (driveState->spinUpLastUs > driveState->spinUpMaxUs)
+            driveState->spinUpMaxUs = driveState->spinUpLastUs;
+    }
+    publishSpinUpStatistics();
+}
+
+/**
+ * Exports measured spin-up times for each drive to the registry.
+ */
+void VoodooFloppyController::publishSpinUpStatistics() {
+    OSDictionary *spinUp = OSDictionary::withCapacity(FLOPPY_MAX_DRIVES);
+    if (!spinUp)
+        return;
+    
+    for (UInt8 i = 0; i < FLOPPY_MAX_DRIVES; i++) {
+        FloppyDriveState *driveState = &_driveState[i];
+        if (!driveState->spinUpCount && !driveState->spinUpTimeouts)
+            continue;
+        
+        OSDictionary *stats = OSDictionary::withCapacity(5);
+        if (!stats)
+            continue;
+        
+        setNumber(stats, "count", driveState->spinUpCount, 32);
+        setNumber(stats, "last-us", driveState->spinUpLastUs);
+        setNumber(stats, "average-us", driveState->spinUpCount ? driveState->spinUpTotalUs / driveState->spinUpCount : 0);
+        setNumber(stats, "max-us", driveState->spinUpMaxUs);
+        setNumber(stats, "timeouts", driveState->spinUpTimeouts, 32);
+        
+        char key[8];
+        snprintf(key, sizeof (key), "drive-%u", i);
+        spinUp->setObject(key, stats);
+        stats->release();
     }
+    setProperty(kFloppyPropertySpinUpKey, spinUp);
+    spinUp->release();
+}
+
+void VoodooFloppyController::setTransferSpeed(UInt8 dataRate) {
+    // Only write CCR if the rate has changed.
+    UInt8 speed = dataRate & 0x3;
+    if (_ccrValid && _ccrShadow == speed)
+        return;
     
     // Write speed to CCR.
-    outb(FLOPPY_REG_CCR, speed & 0x3);
+    writeRegister(FLOPPY_REG_CCR, speed);
+    _ccrShadow = speed;
+    _ccrValid = true;
 }
 
 
 
-void VoodooFloppyController::setDma(UInt32 length, bool write) {
-    // Ensure length is within limits.
-    if (length > FLOPPY_DMALENGTH)
-        length = FLOPPY_DMALENGTH;
+/**
+ * Programs the ISA DMA channel for a transfer to or from the DMA buffer.
+ * @return True if the channel was set up; otherwise false if the range can't be reached by the 8237.
+ */
+bool VoodooFloppyController::setDma(UInt32 offset, UInt32 length, bool write) {
+    // Ensure range is within the buffer.
+    if (length == 0 || offset >= FLOPPY_DMALENGTH || length > FLOPPY_DMALENGTH - offset) {
+        IOLog("VoodooFloppyController: Invalid DMA range 0x%X, %u bytes.\n", offset, length);
+        return false;
+    }
     
     // Determine address and length of buffer.
     union {
         UInt8 bytes[4];
         UInt32 data;
     } addr, count;
-    addr.data = FLOPPY_DMASTART;
+    addr.data = _dmaPhysAddr + offset;
     count.data = length - 1;
     
     // Ensure address is under 24 bits, and count is under 16 bits.
-    if ((addr.data >> 24) || (count.data >> 16) || (((addr.data & 0xFFFF) + count.data) >> 16))
-        panic("FLOPPY: Invalid DMA buffer location!\n");
+    if ((addr.data >> 24) || (count.data >> 16) || (((addr.data & 0xFFFF) + count.data) >> 16)) {
+        IOLog("VoodooFloppyController: DMA buffer at 0x%X can't be reached by ISA DMA.\n", addr.data);
+        return false;
+    }
+    
+    // The 8237 is shared between controllers, and the flip-flop makes programming it stateful.
+    IOInterruptState intState = IOSimpleLockLockDisableInterrupt(gDmaLock);
     
     // https://wiki.osdev.org/ISA_DMA#The_Registers.
-    // Mask DMA channel 2 and reset flip-flop.
-    outb(0x0A, 0x06);
-    outb(0x0C, 0xFF);
+    // Mask DMA channel and reset flip-flop.
+    outb(DMA_REG_MASK, DMA_MASK_ON | _dmaChannel);
+    outb(DMA_REG_FLIP_FLOP, 0xFF);
     
     // Send address and page register.
-    outb(0x04, addr.bytes[0]);
-    outb(0x04, addr.bytes[1]);
-    outb(0x81, addr.bytes[2]);
+    outb(dmaAddressPorts[_dmaChannel], addr.bytes[0]);
+    outb(dmaAddressPorts[_dmaChannel], addr.bytes[1]);
+    outb(dmaPagePorts[_dmaChannel], addr.bytes[2]);
     
     // Reset flip-flop and send count.
-    outb(0x0C, 0xFF);
-    outb(0x05, count.bytes[0]);
-    outb(0x05, count.bytes[1]);
+    outb(DMA_REG_FLIP_FLOP, 0xFF);
+    outb(dmaAddressPorts[_dmaChannel] + 1, count.bytes[0]);
+    outb(dmaAddressPorts[_dmaChannel] + 1, count.bytes[1]);
     
     // Send read/write mode.
-    outb(0x0B, write ? 0x5A : 0x56);
+    outb(DMA_REG_MODE, (write ? DMA_MODE_FROM_MEMORY : DMA_MODE_TO_MEMORY) | _dmaChannel);
     
-    // Unmask DMA channel 2.
-    outb(0x0A, 0x02);
+    // Unmask DMA channel.
+    outb(DMA_REG_MASK, _dmaChannel);
+    IOSimpleLockUnlockEnableInterrupt(gDmaLock, intState);
+    return true;
+}
+
+/**
+ * Checks if the ISA DMA controller is present by writing and reading back the channel address.
+ * @return True if DMA is usable; otherwise false.
+ */
+bool VoodooFloppyController::probeDma() {
+    IOInterruptState intState = IOSimpleLockLockDisableInterrupt(gDmaLock);
+    
+    // Mask DMA channel and reset flip-flop.
+    outb(DMA_REG_MASK, DMA_MASK_ON | _dmaChannel);
+    outb(DMA_REG_FLIP_FLOP, 0xFF);
+    
+    // Write test address.
+    outb(dmaAddressPorts[_dmaChannel], 0x5A);
+    outb(dmaAddressPorts[_dmaChannel], 0xA5);
+    
+    // Reset flip-flop and read address back. Channel stays masked until setDma is called.
+    outb(DMA_REG_FLIP_FLOP, 0xFF);
+    UInt8 low = inb(dmaAddressPorts[_dmaChannel]);
+    UInt8 high = inb(dmaAddressPorts[_dmaChannel]);
+    IOSimpleLockUnlockEnableInterrupt(gDmaLock, intState);
+    
+    DBGLOG("VoodooFloppyController::probeDma(): read back 0x%X 0x%X\n", low, high);
+    return low == 0x5A && high == 0xA5;
+}
+
+/**
+ * Moves one FIFO burst between the controller and the PIO buffer.
+ * Called from the interrupt handler, or from the waiting thread when polling.
+ * @return True if any data was moved.
+ */
+bool VoodooFloppyController::servicePio() {
+    bool serviced = false;
+    IOInterruptState intState = IOSimpleLockLockDisableInterrupt(_pioLock);
+    
+    // Burst size follows the CONFIGURE FIFO threshold. MSR is still checked per byte.
+    UInt8 burst = (_configureShadow[1] & 0xF) + 1;
+    UInt8 msr = readRegister(FLOPPY_REG_MSR);
+    for (UInt8 i = 0; i < burst && _pioActive && _pioOffset < _pioLength; i++) {
+        // Stop when the controller no longer wants execution phase data.
+        if ((msr & (FLOPPY_MSR_RQM | FLOPPY_MSR_NON_DMA)) != (FLOPPY_MSR_RQM | FLOPPY_MSR_NON_DMA))
+            break;
+        
+        if (_pioWrite)
+            writeRegister(FLOPPY_REG_FIFO, _pioBuffer[_pioOffset]);
+        else
+            _pioBuffer[_pioOffset] = readRegister(FLOPPY_REG_FIFO);
+        _pioOffset++;
+        serviced = true;
+        msr = readRegister(FLOPPY_REG_MSR);
+    }
+    
+    IOSimpleLockUnlockEnableInterrupt(_pioLock, intState);
+    return serviced;
+}
+
+/**
+ * Waits for a PIO command to reach its result phase.
+ * @return True if result bytes are ready; otherwise false if it timed out.
+ */
+bool VoodooFloppyController::waitPioComplete(UInt32 timeoutMs) {
+    UInt64 deadline;
+    clock_interval_to_deadline(timeoutMs, kMillisecondScale, &deadline);
+    
+    // Completion is determined from MSR, as the last burst and result phase interrupts can coalesce.
+    bool ret = false;
+    while (true) {
+        if (_pioPolling)
+            servicePio();
+        
+        if ((readRegister(FLOPPY_REG_MSR) & (FLOPPY_MSR_RQM | FLOPPY_MSR_DIO | FLOPPY_MSR_NON_DMA)) == (FLOPPY_MSR_RQM | FLOPPY_MSR_DIO)) {
+            ret = true;
+            break;
+        }
+        
+        if (mach_absolute_time() > deadline || checkAbort(true) != kIOReturnSuccess)
+            break;
+        
+        // Bursts are moved by the interrupt handler unless we are polling.
+        if (_pioPolling)
+            IODelay(10);
+        else
+            IOSleep(1);
+    }
+    
+    if (!ret)
+        IOLog("VoodooFloppyController: PIO timeout!\n");
+    
+    // Stop servicing and reset triggered value.
+    _pioActive = false;
+    _irqTriggered = false;
+    return ret;
+}
+
+/**
+ * Finds the supported format for a data rate and sector size.
+ * @return The format, or NULL if there is none.
+ */
+const FloppyMediaFormat *VoodooFloppyController::findMediaFormat(UInt8 dataRate, UInt8 sizeCode) {
+    for (UInt8 i = 0; i < sizeof (floppyMediaFormats) / sizeof (floppyMediaFormats[0]); i++) {
+        if (floppyMediaFormats[i].dataRate == dataRate && floppyMediaFormats[i].sizeCode == sizeCode)
+            return &floppyMediaFormats[i];
+    }
+    return NULL;
+}
+
+/**
+ * Gets the format of the media in the current drive.
+ */
+const FloppyMediaFormat *VoodooFloppyController::getFormat() {
+    return _driveState[_currentDevice->getDriveNumber()].format;
+}
+
+/**
+ * Sets the format of the media in a drive, along with the size the drive reports.
+ */
+void VoodooFloppyController::setFormat(VoodooFloppyStorageDevice *floppyDevice, const FloppyMediaFormat *format) {
+    FloppyDriveState *driveState = &_driveState[floppyDevice->getDriveNumber()];
+    
+    // Sectors pass at a different rate, so the rotational reference no longer holds.
+    if (driveState->format != format)
+        driveState->rotationSector = 0;
+    driveState->format = format;
+    floppyDevice->setMediaSize((UInt64)format->cylinders * 2 * format->sectorsPerTrack * FLOPPY_SECTOR_SIZE(format->sizeCode) / floppyDevice->getBlockSize());
 }
 
-// Convert LBA to CHS.
+// Convert LBA to CHS. LBAs count physical sectors on the current drive's media.
 void VoodooFloppyController::lbaToChs(UInt32 lba, UInt16* cyl, UInt16* head, UInt16* sector) {
-    *cyl = lba / (2 * FLOPPY_SECTORS_PER_TRACK);
-    *head = ((lba % (2 * FLOPPY_SECTORS_PER_TRACK)) / FLOPPY_SECTORS_PER_TRACK);
-    *sector = ((lba % (2 * FLOPPY_SECTORS_PER_TRACK)) % FLOPPY_SECTORS_PER_TRACK + 1);
+    UInt8 sectorsPerTrack = getFormat()->sectorsPerTrack;
+    *cyl = lba / (2 * sectorsPerTrack);
+    *head = ((lba % (2 * sectorsPerTrack)) / sectorsPerTrack);
+    *sector = ((lba % (2 * sectorsPerTrack)) % sectorsPerTrack + 1);
 }
 
 // Parse and print errors.
@@ -777,9 +2720,11 @@ IOReturn VoodooFloppyController::checkForMedia(bool *mediaPresent, UInt8 current
     // there probably isn't media in the drive.
     IOReturn result = kIOReturnSuccess;
     *mediaPresent = true;
-    if (inb(FLOPPY_REG_DIR) & kFloppyDirDskChg) {
+    if (readRegister(FLOPPY_REG_DIR) & kFloppyDirDskChg) {
         DBGLOG("VoodooFloppyController::checkForMedia(): no media, attempting clear.\n");
         *mediaPresent = false;
+        invalidateCylinder(_currentDevice->getDriveNumber());
+        forgetMedia(_currentDevice->getDriveNumber());
         
         // Recalibrate.
         result = recalibrate();
@@ -792,13 +2737,21 @@ IOReturn VoodooFloppyController::checkForMedia(bool *mediaPresent, UInt8 current
             return result;
         
         // If bit is still set, no media is present.
-        if (inb(FLOPPY_REG_DIR) & kFloppyDirDskChg)
+        if (readRegister(FLOPPY_REG_DIR) & kFloppyDirDskChg)
             result = kIOReturnNoMedia;
     }
     
     return result;
 }
 
+bool VoodooFloppyController::isDiskChanged() {
+    // Drives only drive the disk change line while selected with the motor on, and selectDrive() leaves the DOR alone.
+    // Turn the motor on first and leave it to the usual timeout.
+    bool changed = !setMotorOn() || (readRegister(FLOPPY_REG_DIR) & kFloppyDirDskChg);
+    _tmrMotorOffSource->setTimeoutMS(kFloppyMotorTimeoutMs);
+    return changed;
+}
+
 IOReturn VoodooFloppyController::recalibrate() {
     DBGLOG("VoodooFloppyController::recalibrate()\n");
     IOReturn result = kIOReturnSuccess;
@@ -818,18 +2771,20 @@ IOReturn VoodooFloppyController::recalibrate() {
             result = kIOReturnNotPermitted;
             goto done;
         }
+        applyDriveSettings();
         
         // Send calibrate command.
-        writeData(FLOPPY_CMD_RECALIBRATE);
-        writeData(_currentDevice->getDriveNumber());
-        waitInterrupt(FLOPPY_IRQ_WAIT_TIME);
+        UInt8 command[2] = { FLOPPY_CMD_RECALIBRATE, _currentDevice->getDriveNumber() };
+        sendCommand(command, sizeof (command));
+        waitInterrupt(getCommandTimeoutMs(kFloppyMaxSteps, 0));
         senseInterrupt(&st0, &cyl);
         
         // If the disk change bit is set, seek to some track and attempt re-calibration.
         // Only a successful seek/calibrate that actually did something can clear the bit.
         // We only want to try this once, because if the bit is still set after seeks,
         // there probably isn't media in the drive.
-        if (inb(FLOPPY_REG_DIR) & kFloppyDirDskChg) {
+        if (readRegister(FLOPPY_REG_DIR) & kFloppyDirDskChg) {
+            invalidateCylinder(_currentDevice->getDriveNumber());
             if (!seekCleared) {
                 DBGLOG("VoodooFloppyController::recalibrate(): no media, attempting clear.\n");
                 seek(10);
@@ -843,6 +2798,7 @@ IOReturn VoodooFloppyController::recalibrate() {
         
         // If current cylinder is zero, we are done.
         if (!cyl) {
+            _driveState[_currentDevice->getDriveNumber()].cylinder = 0;
             result = kIOReturnSuccess;
             IOSleep(100);
             goto done;
@@ -851,6 +2807,7 @@ IOReturn VoodooFloppyController::recalibrate() {
     
     // Calibrate failed if we get here.
     DBGLOG("VoodooFloppyController::recalibrate(): fail.\n");
+    invalidateCylinder(_currentDevice->getDriveNumber());
     result = kIOReturnIOError;
     
 done:
@@ -863,6 +2820,11 @@ IOReturn VoodooFloppyController::seek(UInt8 track) {
     DBGLOG("VoodooFloppyController::seek(%u)\n", track);
     IOReturn result = kIOReturnSuccess;
     UInt8 st0, cyl = 0;
+    FloppyDriveState *driveState = &_driveState[_currentDevice->getDriveNumber()];
+    
+    // Nothing to do if the heads are already on the track.
+    if (driveState->cylinder == track)
+        return kIOReturnSuccess;
     
     // Attempt seek.
     for (UInt8 i = 0; i < FLOPPY_CMD_RETRY_COUNT; i++) {
@@ -877,19 +2839,27 @@ IOReturn VoodooFloppyController::seek(UInt8 track) {
             result = kIOReturnNotPermitted;
             goto done;
         }
+        applyDriveSettings();
+        
+        // Heads in an unknown position may be anywhere.
+        UInt8 steps = kFloppyMaxSteps;
+        if (driveState->cylinder != FLOPPY_CYLINDER_UNKNOWN)
+            steps = track > driveState->cylinder ? track - driveState->cylinder : driveState->cylinder - track;
         
-        // Send seek command.
-        writeData(FLOPPY_CMD_SEEK);
-        writeData((0 << 2) | _currentDevice->getDriveNumber()); // Head 0, drive.
-        writeData(track);
+        // Send seek command. Head 0, drive, track.
+        UInt8 command[3] = { FLOPPY_CMD_SEEK, (UInt8)((0 << 2) | _currentDevice->getDriveNumber()), track };
+        sendCommand(command, sizeof (command));
         
         // Wait for response and check interrupt.
-        waitInterrupt(FLOPPY_IRQ_WAIT_TIME);
+        waitInterrupt(getCommandTimeoutMs(steps, 0));
         senseInterrupt(&st0, &cyl);
         
         // Ensure command completed successfully.
-        if (st0 & FLOPPY_ST0_INTERRUPT_CODE)
+        if (st0 & FLOPPY_ST0_INTERRUPT_CODE) {
+            driveState->cylinder = FLOPPY_CYLINDER_UNKNOWN;
             continue;
+        }
+        driveState->cylinder = cyl;
         
         // If we have reached the requested track, return.
         if (cyl == track) {
@@ -908,12 +2878,21 @@ done:
     return result;
 }
 
-IOReturn VoodooFloppyController::readWriteSectors(bool write, UInt8 track, UInt8 head, UInt8 sector, UInt8 count) {
+IOReturn VoodooFloppyController::readWriteSectors(bool write, UInt8 track, UInt8 head, UInt8 sector, UInt8 count, UInt8 *pioBuffer, UInt32 offset, UInt8 *retries) {
     DBGLOG("VoodooFloppyController::readWriteSectors(write %u, track %u, head %u, sector %u, count %u)\n", write, track, head, sector, count);
     IOReturn result = kIOReturnSuccess;
     bool mediaPresent = false;
-    
-    for (UInt8 i = 0; i < FLOPPY_CMD_RETRY_COUNT; i++) {
+    const FloppyMediaFormat *format = getFormat();
+    UInt32 sectorSize = FLOPPY_SECTOR_SIZE(format->sizeCode);
+    UInt32 dataOffset = offset;
+    UInt8 attempt;
+    
+    for (attempt = 0; attempt < FLOPPY_CMD_RETRY_COUNT; attempt++) {
+        // Stop retrying if the request was aborted or ran out of time.
+        result = checkAbort(false, true);
+        if (result != kIOReturnSuccess)
+            goto done;
+        
         // Make sure we are ready.
         if (!isControllerReady()) {
             result = kIOReturnNotReady;
@@ -931,26 +2910,54 @@ IOReturn VoodooFloppyController::readWriteSectors(bool write, UInt8 track, UInt8
         if (result != kIOReturnSuccess)
             goto done;
         
-        // Write speed to CCR.
-        setTransferSpeed(0);
-        setDriveData(0xC, 0x2, 0xF, true);
+        // Ensure data rate and drive timings are set. Nothing is sent if they are unchanged.
+        applyDriveSettings();
+        
+        // Data can't be transferred until the spindle is up to speed.
+        result = waitSpinUp(head, true);
+        if (result != kIOReturnSuccess)
+            goto done;
         
-        // Initialize DMA.
-        setDma(count * _currentDevice->getBlockSize(), write);
+        // Initialize DMA, or hand the buffer to the interrupt handler for PIO.
+        // After an overrun, only the unfinished sectors are transferred again.
+        if (_useDma) {
+            if (!setDma(dataOffset, count * sectorSize, write)) {
+                result = kIOReturnDMAError;
+                goto done;
+            }
+        } else {
+            _pioBuffer = pioBuffer + dataOffset;
+            _pioLength = count * sectorSize;
+            _pioOffset = 0;
+            _pioWrite = write;
+            _irqTriggered = false;
+            _pioActive = true;
+        }
         
         // Send read command to disk to read both sides of track.
-        writeData((write ? FLOPPY_CMD_WRITE_DATA : FLOPPY_CMD_READ_DATA) | FLOPPY_CMD_EXT_SKIP | FLOPPY_CMD_EXT_MFM | FLOPPY_CMD_EXT_MT);
-        writeData(head << 2 | _currentDevice->getDriveNumber());
-        writeData(track);     // Track.
-        writeData(head);         // Head 0.
-        writeData(sector);        // Start at sector 1.
-        writeData(FLOPPY_BYTES_SECTOR_512);
-        writeData(18);        // 18 sectors per track?
-        writeData(FLOPPY_GAP3_3_5);
-        writeData(0xFF);
-        
-        // Wait for IRQ.
-        waitInterrupt(FLOPPY_IRQ_WAIT_TIME);
+        // PIO has no TC, so those commands stop at EOT on a single head instead.
+        UInt8 command[9] = {
+            (UInt8)((write ? FLOPPY_CMD_WRITE_DATA : FLOPPY_CMD_READ_DATA) | FLOPPY_CMD_EXT_SKIP | FLOPPY_CMD_EXT_MFM | (_useDma ? FLOPPY_CMD_EXT_MT : 0)),
+            (UInt8)(head << 2 | _currentDevice->getDriveNumber()),
+            track,      // Track.
+            head,       // Head.
+            sector,     // First sector.
+            format->sizeCode,
+            (UInt8)(_useDma ? format->sectorsPerTrack : sector + count - 1), // End of track.
+            format->gap3,
+            0xFF
+        };
+        sendCommand(command, sizeof (command));
+        
+        // Wait for IRQ, or for the PIO transfer to finish. The disk being pulled ends the wait early.
+        // Allow a revolution to find the first sector, and one for each track's worth of sectors.
+        UInt32 timeoutMs = getCommandTimeoutMs(0, 1 + (count + format->sectorsPerTrack - 1) / format->sectorsPerTrack);
+        bool completed = _useDma ? waitInterrupt(timeoutMs, true) : waitPioComplete(timeoutMs);
+        
+        // The command is still running if we were aborted. The dispatcher resets the controller.
+        result = checkAbort();
+        if (result != kIOReturnSuccess)
+            goto done;
         
         // Check for media. If media was not present before, try the read again.
         result = checkForMedia(&mediaPresent, track);
@@ -959,21 +2966,54 @@ IOReturn VoodooFloppyController::readWriteSectors(bool write, UInt8 track, UInt8
         if (!mediaPresent)
             continue;
         
-        UInt8 resultBytes[7];
-        for (UInt8 i = 0; i < 7; i++) {
-            resultBytes[i] = readData();
+        // Nothing to read back from a command that never finished.
+        if (!completed) {
+            result = kIOReturnTimeout;
+            continue;
         }
+        
+        UInt8 resultBytes[7];
+        readResult(resultBytes, sizeof (resultBytes));
         DBGLOG("VoodooFloppyController::readWriteSectors(write %u, track %u, head %u, sector %u) result: 0x%X 0x%X 0x%X 0x%X 0x%X 0x%X 0x%X\n", write, track, head, sector, resultBytes[0], resultBytes[1], resultBytes[2], resultBytes[3], resultBytes[4], resultBytes[5], resultBytes[6]);
         
+        // Without TC, a PIO command ends at EOT with an end of cylinder error. That is expected once all data has moved.
+        if (!_useDma && _pioOffset == _pioLength && (resultBytes[0] & FLOPPY_ST0_INTERRUPT_CODE) == FLOPPY_ST0_IC_ABNORMAL
+            && resultBytes[1] == FLOPPY_ST1_END_OF_CYLINDER && resultBytes[2] == 0) {
+            resultBytes[0] &= ~FLOPPY_ST0_INTERRUPT_CODE;
+            resultBytes[1] = 0;
+        }
+        
         // Determine errors if any.
         result = parseError(resultBytes[0], resultBytes[1], resultBytes[2]);
+        _fifoTransfers++;
         
-        // If no error, we are done.
-        if (result == kIOReturnSuccess || result == kIOReturnNotWritable)
+        // If no error, we are done. Data commands don't move the heads, so we are still on the track.
+        // The result C byte can't be used here as it points to the next cylinder after the final sector.
+        if (result == kIOReturnSuccess || result == kIOReturnNotWritable) {
+            relaxFifoThreshold();
+            if (result == kIOReturnSuccess)
+                updateRotation(((sector - 1 + count - 1) % format->sectorsPerTrack) + 1);
             goto done;
+        }
+        
+        // On an overrun, the result H and R bytes give the sector that was being transferred.
+        // Sectors before it are complete, so pick up from there with a higher FIFO threshold.
+        if (resultBytes[1] & FLOPPY_ST1_OVERRUN_UNDERRUN) {
+            raiseFifoThreshold();
+            SInt32 completed = (resultBytes[4] - head) * format->sectorsPerTrack + (resultBytes[5] - sector);
+            if (resultBytes[3] == track && completed > 0 && completed < count) {
+                DBGLOG("VoodooFloppyController::readWriteSectors(): overrun after %d sectors, resuming.\n", completed);
+                head = resultBytes[4];
+                sector = resultBytes[5];
+                count -= completed;
+                dataOffset += completed * sectorSize;
+            }
+            continue;
+        }
         
-        // Recalibrate the drive if it wasn't a DMA issue.
+        // Recalibrate the drive if it wasn't a DMA issue. Heads may not be where we think they are.
         if (result != kIOReturnDMAError) {
+            invalidateCylinder(_currentDevice->getDriveNumber());
             seek(10);
             result = recalibrate();
             if (result != kIOReturnSuccess)
@@ -991,7 +3031,762 @@ IOReturn VoodooFloppyController::readWriteSectors(bool write, UInt8 track, UInt8
     DBGLOG("VoodooFloppyController::readWriteSectors(write %u, track %u, head %u, sector %u) fail.\n", write, track, head, sector);
     result = kIOReturnIOError;
     
+done:
+    if (retries)
+        *retries = attempt;
+    _tmrMotorOffSource->setTimeoutMS(kFloppyMotorTimeoutMs);
+    return result;
+}
+
+/**
+ * Reads or writes sectors on the current track, starting with the sector about to pass under the head.
+ * If that sector is inside the range, the range is split into two commands: from there to the end of
+ * the range, then from the start of the range up to it.
+ * @param retries Receives the number of retries needed.
+ */
+IOReturn VoodooFloppyController::readWriteTrack(bool write, UInt8 track, UInt8 head, UInt8 sector, UInt8 count, UInt8 *pioBuffer, UInt8 *retries) {
+    UInt8 sectorsPerTrack = getFormat()->sectorsPerTrack;
+    UInt32 sectorSize = FLOPPY_SECTOR_SIZE(getFormat()->sizeCode);
+    UInt8 lastSector = sector + count - 1;
+    UInt8 split = 0;
+    
+    // The wrapped command has to be issued before the start of the range comes round again. Ranges
+    // covering the whole track leave no time for that, so they would lose a revolution instead.
+    if (count > 1 && lastSector <= sectorsPerTrack && count + kFloppyRotationMargin <= sectorsPerTrack) {
+        // With most of a track to do, a READ ID is cheaper than the average half revolution it saves.
+        UInt8 next = predictSector();
+        if (!next && count >= sectorsPerTrack / 2 && readId(head) == kIOReturnSuccess)
+            next = predictSector();
+        if (next > sector && next <= lastSector)
+            split = next;
+    }
+    if (!split)
+        return readWriteSectors(write, track, head, sector, count, pioBuffer, 0, retries);
+    
+    // Transfer from the predicted sector to the end, then wrap around to the start.
+    DBGLOG("VoodooFloppyController::readWriteTrack(): starting at sector %u\n", split);
+    UInt8 wrapCount = split - sector;
+    UInt8 moreRetries = 0;
+    IOReturn status = readWriteSectors(write, track, head, split, count - wrapCount, pioBuffer, wrapCount * sectorSize, retries);
+    if (status == kIOReturnSuccess) {
+        status = readWriteSectors(write, track, head, sector, wrapCount, pioBuffer, 0, &moreRetries);
+        if (retries)
+            *retries += moreRetries;
+    }
+    return status;
+}
+
+/**
+ * Reads the next sector ID on the current track to get a rotational reference for the current drive.
+ * @param sizeCode Receives the sector size the ID gives, even if it doesn't match the drive's format.
+ */
+IOReturn VoodooFloppyController::readId(UInt8 head, UInt8 *sizeCode) {
+    DBGLOG("VoodooFloppyController::readId(%u)\n", head);
+    if (!isControllerReady())
+        return kIOReturnNotReady;
+    if (!setMotorOn())
+        return kIOReturnNotPermitted;
+    applyDriveSettings();
+    
+    // Send READ ID. The interrupt comes as soon as an ID field has been read.
+    // Without any ID fields, the controller gives up after two index pulses.
+    UInt8 command[2] = { FLOPPY_CMD_READ_ID | FLOPPY_CMD_EXT_MFM, (UInt8)(head << 2 | _currentDevice->getDriveNumber()) };
+    sendCommand(command, sizeof (command));
+    if (!waitInterrupt(getCommandTimeoutMs(0, 2)))
+        return kIOReturnTimeout;
+    
+    UInt8 resultBytes[7];
+    if (!readResult(resultBytes, sizeof (resultBytes)))
+        return kIOReturnIOError;
+    
+    IOReturn result = parseError(resultBytes[0], resultBytes[1], resultBytes[2]);
+    if (result != kIOReturnSuccess)
+        return kIOReturnIOError;
+    if (sizeCode)
+        *sizeCode = resultBytes[6];
+    
+    // Any ID field read back means the spindle is up to speed.
+    finishSpinUp(false);
+    
+    // IDs from another format say nothing about where this format's sectors are.
+    const FloppyMediaFormat *format = getFormat();
+    if (resultBytes[6] != format->sizeCode || resultBytes[5] < 1 || resultBytes[5] > format->sectorsPerTrack)
+        return kIOReturnIOError;
+    
+    // The data field of the sector whose ID was just read is next, so the one before it has just passed.
+    updateRotation(resultBytes[5] == 1 ? format->sectorsPerTrack : resultBytes[5] - 1);
+    return kIOReturnSuccess;
+}
+
+/**
+ * Formats a track on the current drive in the drive's format, with sectors in order and filled with FLOPPY_FORMAT_FILL.
+ * The ID fields are passed to the controller like sector data, four bytes per sector.
+ */
+IOReturn VoodooFloppyController::formatTrack(UInt8 track, UInt8 head) {
+    DBGLOG("VoodooFloppyController::formatTrack(%u, %u)\n", track, head);
+    const FloppyMediaFormat *format = getFormat();
+    UInt32 length = format->sectorsPerTrack * 4;
+    bool mediaPresent = false;
+    UInt8 resultBytes[7];
+    IOReturn result;
+    
+    // The command runs from one index pulse to the next.
+    UInt8 command[6] = {
+        FLOPPY_CMD_FORMAT_TRACK | FLOPPY_CMD_EXT_MFM,
+        (UInt8)(head << 2 | _currentDevice->getDriveNumber()),
+        format->sizeCode,
+        format->sectorsPerTrack,
+        format->formatGap,
+        FLOPPY_FORMAT_FILL
+    };
+    
+    if (!isControllerReady())
+        return kIOReturnNotReady;
+    if (!setMotorOn())
+        return kIOReturnNotPermitted;
+    result = checkForMedia(&mediaPresent, track);
+    if (result != kIOReturnSuccess)
+        goto done;
+    applyDriveSettings();
+    
+    // Blank media has no ID fields to show the spindle is up to speed.
+    result = waitSpinUp(head, false);
+    if (result != kIOReturnSuccess)
+        goto done;
+    
+    // Build C, H, R, N for each sector.
+    for (UInt8 i = 0; i < format->sectorsPerTrack; i++) {
+        _dmaBuffer[i * 4] = track;
+        _dmaBuffer[i * 4 + 1] = head;
+        _dmaBuffer[i * 4 + 2] = i + 1;
+        _dmaBuffer[i * 4 + 3] = format->sizeCode;
+    }
+    if (_useDma) {
+        if (!setDma(0, length, true)) {
+            result = kIOReturnDMAError;
+            goto done;
+        }
+    } else {
+        _pioBuffer = _dmaBuffer;
+        _pioLength = length;
+        _pioOffset = 0;
+        _pioWrite = true;
+        _irqTriggered = false;
+        _pioActive = true;
+    }
+    
+    // Up to a revolution to reach the index pulse, then one to format the track.
+    sendCommand(command, sizeof (command));
+    if (!(_useDma ? waitInterrupt(getCommandTimeoutMs(0, 2), true) : waitPioComplete(getCommandTimeoutMs(0, 2)))) {
+        result = kIOReturnTimeout;
+        goto done;
+    }
+    
+    if (!readResult(resultBytes, sizeof (resultBytes))) {
+        result = kIOReturnIOError;
+        goto done;
+    }
+    result = parseError(resultBytes[0], resultBytes[1], resultBytes[2]);
+    
+done:
+    _tmrMotorOffSource->setTimeoutMS(kFloppyMotorTimeoutMs);
+    return result;
+}
+
+/**
+ * Screens a cylinder on the current drive with a SCAN command, from a sector to the end of the cylinder.
+ * The controller compares each sector against its own copy of the pattern, taken from the DMA buffer.
+ * @param opcode The SCAN command to issue.
+ * @param hitHead Set to the head of the first sector that met the condition.
+ * @param hitSector Set to the first sector that met the condition, or 0 if none did.
+ */
+IOReturn VoodooFloppyController::scanCylinder(UInt8 opcode, UInt8 track, UInt8 head, UInt8 sector, UInt8 *hitHead, UInt8 *hitSector) {
+    DBGLOG("VoodooFloppyController::scanCylinder(0x%X, %u, %u, %u)\n", opcode, track, head, sector);
+    const FloppyMediaFormat *format = getFormat();
+    UInt32 length = ((2 - head) * format->sectorsPerTrack - sector + 1) * FLOPPY_SECTOR_SIZE(format->sizeCode);
+    bool mediaPresent = false;
+    UInt8 resultBytes[7];
+    IOReturn result;
+    
+    // Sectors are compared one after the other, with a step of one, carrying on to head 1.
+    UInt8 command[9] = {
+        (UInt8)(opcode | FLOPPY_CMD_EXT_SKIP | FLOPPY_CMD_EXT_MFM | FLOPPY_CMD_EXT_MT),
+        (UInt8)(head << 2 | _currentDevice->getDriveNumber()),
+        track,
+        head,
+        sector,
+        format->sizeCode,
+        format->sectorsPerTrack,
+        format->gap3,
+        1
+    };
+    
+    *hitHead = 0;
+    *hitSector = 0;
+    if (!isControllerReady())
+        return kIOReturnNotReady;
+    if (!setMotorOn())
+        return kIOReturnNotPermitted;
+    result = checkForMedia(&mediaPresent, track);
+    if (result != kIOReturnSuccess)
+        goto done;
+    applyDriveSettings();
+    result = waitSpinUp(head, true);
+    if (result != kIOReturnSuccess)
+        goto done;
+    
+    if (_useDma) {
+        if (!setDma(0, length, true)) {
+            result = kIOReturnDMAError;
+            goto done;
+        }
+    } else {
+        _pioBuffer = _dmaBuffer;
+        _pioLength = length;
+        _pioOffset = 0;
+        _pioWrite = true;
+        _irqTriggered = false;
+        _pioActive = true;
+    }
+    
+    // Controllers without SCAN reject the first byte and go straight to the result phase.
+    if (!sendCommand(command, sizeof (command))) {
+        _pioActive = false;
+        result = readData() == FLOPPY_ST0_IC_INVALID ? kIOReturnUnsupported : kIOReturnIOError;
+        goto done;
+    }
+    
+    // Up to a revolution to find the first sector, then one for each head scanned.
+    if (!(_useDma ? waitInterrupt(getCommandTimeoutMs(0, 3 - head), true) : waitPioComplete(getCommandTimeoutMs(0, 3 - head)))) {
+        result = kIOReturnTimeout;
+        goto done;
+    }
+    
+    if (!readResult(resultBytes, sizeof (resultBytes))) {
+        result = kIOReturnIOError;
+        goto done;
+    }
+    DBGLOG("VoodooFloppyController::scanCylinder() result: 0x%X 0x%X 0x%X 0x%X 0x%X 0x%X 0x%X\n", resultBytes[0], resultBytes[1], resultBytes[2], resultBytes[3], resultBytes[4], resultBytes[5], resultBytes[6]);
+    
+    // Without TC, a PIO scan that finds nothing ends at EOT with an end of cylinder error.
+    if ((resultBytes[2] & FLOPPY_ST2_SCAN_NOT_SATISFIED) && (resultBytes[0] & FLOPPY_ST0_INTERRUPT_CODE) == FLOPPY_ST0_IC_ABNORMAL
+        && resultBytes[1] == FLOPPY_ST1_END_OF_CYLINDER) {
+        resultBytes[0] &= ~FLOPPY_ST0_INTERRUPT_CODE;
+        resultBytes[1] = 0;
+    }
+    result = parseError(resultBytes[0], resultBytes[1], resultBytes[2]);
+    if (result != kIOReturnSuccess)
+        goto done;
+    
+    // As with any command ending normally, H and R give the sector after the last one compared.
+    // After EOT they wrap to sector 1 of head 1, or of head 0 on the next cylinder.
+    if (!(resultBytes[2] & FLOPPY_ST2_SCAN_NOT_SATISFIED)) {
+        if (resultBytes[5] == 1) {
+            *hitHead = resultBytes[4] == 1 ? 0 : 1;
+            *hitSector = format->sectorsPerTrack;
+        } else {
+            *hitHead = resultBytes[4];
+            *hitSector = resultBytes[5] - 1;
+        }
+    }
+    
 done:
     _tmrMotorOffSource->setTimeoutMS(kFloppyMotorTimeoutMs);
     return result;
 }
+
+/**
+ * Compares a sector against a pattern the way the SCAN commands do. Bytes of kFloppyScanDontCare, in the pattern
+ * or on the disk, match anything.
+ * @return True if every byte compared meets the condition.
+ */
+bool VoodooFloppyController::scanSector(UInt8 condition, const UInt8 *data, const UInt8 *pattern, UInt32 length) {
+    for (UInt32 i = 0; i < length; i++) {
+        if (pattern[i] == kFloppyScanDontCare || data[i] == kFloppyScanDontCare)
+            continue;
+        if ((condition == kFloppyScanEqual && data[i] != pattern[i])
+            || (condition == kFloppyScanLowOrEqual && data[i] > pattern[i])
+            || (condition == kFloppyScanHighOrEqual && data[i] < pattern[i]))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Gets the rotation period of the current drive in microseconds.
+ */
+UInt32 VoodooFloppyController::getRotationPeriod() {
+    // 1.2MB drives spin at 360 RPM, all others at 300 RPM.
+    return _currentDevice->getDriveType() == FLOPPY_TYPE_1200_525 ? FLOPPY_ROTATION_360RPM_US : FLOPPY_ROTATION_300RPM_US;
+}
+
+/**
+ * Records that a sector has just finished passing under the head of the current drive.
+ */
+void VoodooFloppyController::updateRotation(UInt8 lastSector) {
+    FloppyDriveState *driveState = &_driveState[_currentDevice->getDriveNumber()];
+    
+    // Without the interrupt, there's no telling when the sector passed.
+    driveState->rotationSector = _irqTime ? lastSector : 0;
+    driveState->rotationTime = _irqTime;
+}
+
+/**
+ * Predicts the first sector a command issued now can catch on the current drive.
+ * @return The sector number, or 0 if the rotational position is unknown.
+ */
+UInt8 VoodooFloppyController::predictSector() {
+    FloppyDriveState *driveState = &_driveState[_currentDevice->getDriveNumber()];
+    if (!driveState->rotationSector)
+        return 0;
+    
+    // Get time since the reference sector passed.
+    UInt64 elapsedNs;
+    absolutetime_to_nanoseconds(mach_absolute_time() - driveState->rotationTime, &elapsedNs);
+    UInt64 elapsedUs = elapsedNs / 1000;
+    if (elapsedUs > kFloppyRotationValidUs)
+        return 0;
+    
+    // Count sectors that have passed since, plus a margin for issuing the command.
+    UInt32 sectorUs = getRotationPeriod() / driveState->format->sectorsPerTrack;
+    UInt32 passed = (UInt32)(elapsedUs / sectorUs) + kFloppyRotationMargin;
+    return ((driveState->rotationSector + passed) % driveState->format->sectorsPerTrack) + 1;
+}
+
+/**
+ * Reads or writes sectors on the current track to or from a kernel buffer.
+ * DMA transfers bounce through the DMA buffer; PIO transfers are split per head.
+ * @param retries Receives the number of retries needed.
+ */
+IOReturn VoodooFloppyController::transferSectors(bool write, UInt8 track, UInt8 head, UInt8 sector, UInt8 count, UInt8 *data, UInt8 *retries) {
+    UInt8 sectorsPerTrack = getFormat()->sectorsPerTrack;
+    UInt32 sectorSize = FLOPPY_SECTOR_SIZE(getFormat()->sizeCode);
+    IOReturn status;
+    
+    UInt32 lba = (track * 2 + head) * sectorsPerTrack + sector - 1;
+    
+    // Sectors being written are unknown until the write succeeds. Imaging writes don't go through the mirror.
+    if (write) {
+        updateSectorHashes(lba, count, NULL);
+        setMirrorValid(lba, count, false);
+    }
+    
+    if (_useDma) {
+        if (write)
+            memcpy(_dmaBuffer, data, count * sectorSize);
+        status = readWriteTrack(write, track, head, sector, count, NULL, retries);
+        if (!write && status == kIOReturnSuccess)
+            memcpy(data, _dmaBuffer, count * sectorSize);
+        if (status == kIOReturnSuccess)
+            updateSectorHashes(lba, count, data);
+        return status;
+    }
+    
+    // Transfer sectors on the first head.
+    UInt8 firstCount = count;
+    if (firstCount > sectorsPerTrack - sector + 1)
+        firstCount = sectorsPerTrack - sector + 1;
+    status = readWriteTrack(write, track, head, sector, firstCount, data, retries);
+    
+    // Transfer any remaining sectors on the second head.
+    if (status == kIOReturnSuccess && count > firstCount) {
+        UInt8 moreRetries = 0;
+        status = readWriteTrack(write, track, head + 1, 1, count - firstCount, data + firstCount * sectorSize, &moreRetries);
+        *retries += moreRetries;
+    }
+    if (status == kIOReturnSuccess)
+        updateSectorHashes(lba, count, data);
+    return status;
+}
+
+/**
+ * Gets a 64-bit FNV-1a hash of a sector's contents. Zero is reserved to mean unknown.
+ */
+UInt64 VoodooFloppyController::hashSector(const UInt8 *data, UInt32 length) {
+    UInt64 hash = 0xCBF29CE484222325ULL;
+    for (UInt32 i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash ? hash : 1;
+}
+
+/**
+ * Gets the sector hashes of the current drive.
+ * @param create True to allocate them if they don't exist yet.
+ * @return The hashes, or NULL if there are none.
+ */
+UInt64 *VoodooFloppyController::getSectorHashes(bool create) {
+    FloppyDriveState *driveState = &_driveState[_currentDevice->getDriveNumber()];
+    if (!driveState->sectorHashes && create) {
+        driveState->sectorHashes = (UInt64*)IOMalloc(kFloppyHashSectors * sizeof (UInt64));
+        if (driveState->sectorHashes)
+            bzero(driveState->sectorHashes, kFloppyHashSectors * sizeof (UInt64));
+    }
+    return driveState->sectorHashes;
+}
+
+/**
+ * Records the contents of sectors on the current drive's media, or forgets them if data is NULL.
+ * Sectors past kFloppyHashSectors are never recorded, so they are always written.
+ */
+void VoodooFloppyController::updateSectorHashes(UInt32 lba, UInt32 count, const UInt8 *data) {
+    UInt64 *sectorHashes = getSectorHashes(data != NULL);
+    UInt32 sectorSize = FLOPPY_SECTOR_SIZE(getFormat()->sizeCode);
+    if (!sectorHashes)
+        return;
+    
+    for (UInt32 i = 0; i < count && lba + i < kFloppyHashSectors; i++)
+        sectorHashes[lba + i] = data ? hashSector(data + i * sectorSize, sectorSize) : 0;
+}
+
+/**
+ * Forgets the media contents of a drive. Used when the disk may have changed.
+ * @param driveNumber The drive, or -1 for all drives.
+ */
+void VoodooFloppyController::dropSectorHashes(SInt8 driveNumber) {
+    for (UInt8 i = 0; i < FLOPPY_MAX_DRIVES; i++) {
+        if ((driveNumber == -1 || driveNumber == i) && _driveState[i].sectorHashes)
+            bzero(_driveState[i].sectorHashes, kFloppyHashSectors * sizeof (UInt64));
+    }
+}
+
+/**
+ * Writes sectors on the current track, skipping those the media is known to hold already.
+ * The remaining dirty runs are written with one command each. Runs separated by no more than
+ * kFloppyElisionMergeGap unchanged sectors are merged, as the gap is too short to issue another command in.
+ * @param data Sector data. With DMA this is the DMA buffer, and runs are moved to its start as they are written.
+ */
+IOReturn VoodooFloppyController::writeChangedSectors(UInt8 track, UInt8 head, UInt8 sector, UInt32 lba, UInt8 count, UInt8 *data) {
+    UInt8 sectorsPerTrack = getFormat()->sectorsPerTrack;
+    UInt32 sectorSize = FLOPPY_SECTOR_SIZE(getFormat()->sizeCode);
+    UInt64 hashes[FLOPPY_MAX_SECTORS_PER_TRACK * 2];
+    bool dirty[FLOPPY_MAX_SECTORS_PER_TRACK * 2];
+    UInt8 dirtyCount = 0;
+    bool mediaPresent;
+    IOReturn status = kIOReturnSuccess;
+    
+    // The hashes only describe the disk they were taken from, so look for a change before trusting them.
+    // A changed disk has its hashes forgotten, and everything is written.
+    if (!setMotorOn())
+        return kIOReturnNotPermitted;
+    status = checkForMedia(&mediaPresent, track);
+    _tmrMotorOffSource->setTimeoutMS(kFloppyMotorTimeoutMs);
+    if (status != kIOReturnSuccess)
+        return status;
+    UInt64 *sectorHashes = getSectorHashes(true);
+    
+    // Hash everything up front, as the DMA buffer is rearranged while writing.
+    for (UInt8 i = 0; i < count; i++) {
+        hashes[i] = hashSector(data + i * sectorSize, sectorSize);
+        dirty[i] = !sectorHashes || lba + i >= kFloppyHashSectors || sectorHashes[lba + i] != hashes[i];
+        if (dirty[i])
+            dirtyCount++;
+    }
+    
+    // Nothing changed, so there is no need to wait for the sectors to come round at all.
+    if (dirtyCount == 0) {
+        DBGLOG("VoodooFloppyController::writeChangedSectors(): all %u sectors unchanged.\n", count);
+        _elidedSectors += count;
+        _elidedBytes += count * sectorSize;
+        _elidedCommands++;
+        _elisionChanged = true;
+        return kIOReturnSuccess;
+    }
+    
+    status = seek(track);
+    if (status != kIOReturnSuccess)
+        return status;
+    
+    UInt8 skipped = 0;
+    UInt8 i = 0;
+    while (i < count) {
+        if (!dirty[i]) {
+            skipped++;
+            i++;
+            continue;
+        }
+        
+        // Extend the run to the last dirty sector not separated by a longer clean gap.
+        UInt8 last = i;
+        for (UInt8 j = i + 1; j < count && j - last - 1 <= kFloppyElisionMergeGap; j++) {
+            if (dirty[j])
+                last = j;
+        }
+        UInt8 runCount = last - i + 1;
+        UInt8 runHead = head + (sector - 1 + i) / sectorsPerTrack;
+        UInt8 runSector = ((sector - 1 + i) % sectorsPerTrack) + 1;
+        
+        // Runs go in order, so moving one to the start of the DMA buffer never overwrites a later one.
+        if (_useDma) {
+            if (i)
+                memmove(_dmaBuffer, _dmaBuffer + i * sectorSize, runCount * sectorSize);
+            status = readWriteTrack(true, track, runHead, runSector, runCount, NULL);
+        } else
+            status = readWriteTrack(true, track, runHead, runSector, runCount, data + i * sectorSize);
+        
+        // A failed write may have left the run half written.
+        if (status != kIOReturnSuccess) {
+            updateSectorHashes(lba + i, runCount, NULL);
+            break;
+        }
+        
+        for (UInt8 k = i; sectorHashes && k <= last && lba + k < kFloppyHashSectors; k++)
+            sectorHashes[lba + k] = hashes[k];
+        i = last + 1;
+    }
+    
+    // Only sectors passed over count. Those after a failed run were never tried.
+    if (skipped) {
+        _elidedSectors += skipped;
+        _elidedBytes += skipped * sectorSize;
+        _elisionChanged = true;
+    }
+    return status;
+}
+
+/**
+ * Exports write elision savings to the registry. Each skipped sector saves its time under the head,
+ * and each skipped command saves half a revolution of rotational latency on average.
+ */
+void VoodooFloppyController::publishElisionStatistics() {
+    OSDictionary *elision = OSDictionary::withCapacity(4);
+    if (!elision)
+        return;
+    
+    UInt8 sectorsPerTrack = getFormat()->sectorsPerTrack;
+    UInt64 revolutionSectors = _elidedSectors + _elidedCommands * (sectorsPerTrack / 2);
+    setNumber(elision, "sectors-elided", _elidedSectors);
+    setNumber(elision, "bytes-saved", _elidedBytes);
+    setNumber(elision, "commands-elided", _elidedCommands);
+    setNumber(elision, "revolutions-saved", revolutionSectors / sectorsPerTrack);
+    
+    setProperty(kFloppyPropertyElisionKey, elision);
+    elision->release();
+    _elisionChanged = false;
+}
+
+/**
+ * Forgets everything known about the media in a drive. Used when the disk may have changed.
+ * @param driveNumber The drive, or -1 for all drives.
+ */
+void VoodooFloppyController::forgetMedia(SInt8 driveNumber) {
+    dropSectorHashes(driveNumber);
+    discardMirror(driveNumber);
+}
+
+/**
+ * Starts filling a RAM mirror of the media in a drive, one cylinder at a time while the controller is idle.
+ * The buffers are kept until the controller stops, so a fill in flight never writes to freed memory.
+ */
+void VoodooFloppyController::startMirror(VoodooFloppyStorageDevice *floppyDevice) {
+    FloppyDriveState *driveState = &_driveState[floppyDevice->getDriveNumber()];
+    UInt32 sectors = driveState->format->cylinders * 2 * driveState->format->sectorsPerTrack;
+    UInt32 sectorSize = FLOPPY_SECTOR_SIZE(driveState->format->sizeCode);
+    
+    // Reallocate if the media has a different size.
+    if (driveState->mirror && (driveState->mirrorSectors != sectors || driveState->mirrorBlockSize != sectorSize)) {
+        IOFree(driveState->mirror, driveState->mirrorSectors * driveState->mirrorBlockSize);
+        IOFree(driveState->mirrorValid, driveState->mirrorSectors);
+        driveState->mirror = NULL;
+        driveState->mirrorValid = NULL;
+    }
+    if (!driveState->mirror) {
+        driveState->mirror = (UInt8*)IOMalloc(sectors * sectorSize);
+        driveState->mirrorValid = (UInt8*)IOMalloc(sectors);
+        if (!driveState->mirror || !driveState->mirrorValid) {
+            IOLog("VoodooFloppyController: Failed to allocate RAM mirror.\n");
+            if (driveState->mirror)
+                IOFree(driveState->mirror, sectors * sectorSize);
+            if (driveState->mirrorValid)
+                IOFree(driveState->mirrorValid, sectors);
+            driveState->mirror = NULL;
+            driveState->mirrorValid = NULL;
+            return;
+        }
+        driveState->mirrorSectors = sectors;
+        driveState->mirrorBlockSize = sectorSize;
+    }
+    
+    bzero(driveState->mirrorValid, sectors);
+    driveState->mirrorCylinder = 0;
+    driveState->mirrorStartTime = mach_absolute_time();
+    _tmrMirrorSource->setTimeoutMS(kFloppyMirrorIdleMs);
+}
+
+/**
+ * Discards the RAM mirror of a drive and stops filling it.
+ * @param driveNumber The drive, or -1 for all drives.
+ */
+void VoodooFloppyController::discardMirror(SInt8 driveNumber) {
+    for (UInt8 i = 0; i < FLOPPY_MAX_DRIVES; i++) {
+        if ((driveNumber == -1 || driveNumber == i) && _driveState[i].mirror) {
+            bzero(_driveState[i].mirrorValid, _driveState[i].mirrorSectors);
+            _driveState[i].mirrorCylinder = kFloppyMirrorStopped;
+        }
+    }
+}
+
+/**
+ * Gets the mirror of sectors on the current drive.
+ * @return The mirrored data, or NULL if the drive has no live mirror covering the sectors.
+ */
+UInt8 *VoodooFloppyController::getMirror(UInt32 lba, UInt32 count) {
+    FloppyDriveState *driveState = &_driveState[_currentDevice->getDriveNumber()];
+    if (!driveState->mirror || driveState->mirrorCylinder == kFloppyMirrorStopped || lba + count > driveState->mirrorSectors)
+        return NULL;
+    return driveState->mirror + lba * driveState->mirrorBlockSize;
+}
+
+/**
+ * Checks if all sectors are held in the current drive's mirror.
+ */
+bool VoodooFloppyController::isMirrored(UInt32 lba, UInt32 count) {
+    if (!getMirror(lba, count))
+        return false;
+    
+    UInt8 *mirrorValid = _driveState[_currentDevice->getDriveNumber()].mirrorValid;
+    for (UInt32 i = 0; i < count; i++) {
+        if (!mirrorValid[lba + i])
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Marks sectors in the current drive's mirror as holding the media contents or not.
+ */
+void VoodooFloppyController::setMirrorValid(UInt32 lba, UInt32 count, bool valid) {
+    if (!getMirror(lba, count))
+        return;
+    memset(_driveState[_currentDevice->getDriveNumber()].mirrorValid + lba, valid, count);
+}
+
+/**
+ * Reads the next cylinder of a drive into its mirror. Unreadable cylinders are left out and read from disk on demand.
+ * @return True if there is more to fill; otherwise false if the mirror is complete or the fill was interrupted.
+ */
+bool VoodooFloppyController::fillMirror(VoodooFloppyStorageDevice *floppyDevice) {
+    FloppyDriveState *driveState = &_driveState[floppyDevice->getDriveNumber()];
+    UInt32 sectorsPerCylinder = driveState->format->sectorsPerTrack * 2;
+    UInt16 cylinder = driveState->mirrorCylinder;
+    UInt32 lba = cylinder * sectorsPerCylinder;
+    UInt64 deadline;
+    UInt8 retries = 0;
+    IOReturn status;
+    IOReturn abortStatus;
+    
+    // Requests submitted from here on preempt the fill. Anything already queued goes first.
+    _mirrorPreempt = false;
+    _mirrorFilling = true;
+    if (nextRequest()) {
+        _mirrorFilling = false;
+        return false;
+    }
+    
+    restoreController();
+    selectDrive(floppyDevice);
+    
+    // Bound the fill like a request, so it also stops on disk change.
+    clock_interval_to_deadline(kFloppyCylinderTimeoutMs * 2, kMillisecondScale, &deadline);
+    _requestDeadline = deadline;
+    status = seek(cylinder);
+    if (status == kIOReturnSuccess)
+        status = transferSectors(false, cylinder, 0, 1, sectorsPerCylinder, getMirror(lba, sectorsPerCylinder), &retries);
+    abortStatus = checkAbort();
+    _requestDeadline = 0;
+    _mirrorFilling = false;
+    
+    if (status != kIOReturnSuccess && abortStatus != kIOReturnSuccess) {
+        // The controller may be in the middle of a command. A new disk gets a fresh fill once probed.
+        DBGLOG("VoodooFloppyController::fillMirror(): interrupted at cylinder %u: 0x%X\n", cylinder, abortStatus);
+        resetController();
+        if (_abortStatus == kIOReturnNoMedia)
+            _abortStatus = kIOReturnSuccess;
+        return false;
+    }
+    
+    // A request came in. The command in flight was left to finish, so the controller and the other drives are as they were.
+    // Whatever was read is dropped, and the cylinder is read again on the next fill.
+    if (_mirrorPreempt) {
+        DBGLOG("VoodooFloppyController::fillMirror(): preempted at cylinder %u.\n", cylinder);
+        return false;
+    }
+    if (status == kIOReturnNoMedia) {
+        discardMirror(floppyDevice->getDriveNumber());
+        return false;
+    }
+    
+    // The mirror may have been discarded during the transfer if the disk changed.
+    if (driveState->mirrorCylinder != cylinder)
+        return false;
+    if (status == kIOReturnSuccess)
+        setMirrorValid(lba, sectorsPerCylinder, true);
+    else
+        DBGLOG("VoodooFloppyController::fillMirror(): skipping cylinder %u: 0x%X\n", cylinder, status);
+    
+    driveState->mirrorCylinder++;
+    if (driveState->mirrorCylinder < driveState->mirrorSectors / sectorsPerCylinder)
+        return true;
+    
+    UInt64 elapsedNs;
+    absolutetime_to_nanoseconds(mach_absolute_time() - driveState->mirrorStartTime, &elapsedNs);
+    IOLog("VoodooFloppyController: Mirrored drive %u in %llu ms.\n", floppyDevice->getDriveNumber(), elapsedNs / 1000000);
+    return false;
+}
+
+/**
+ * Reads or writes a whole cylinder for imaging, recording per-sector status in the slot.
+ * If the cylinder fails as a whole, sectors are retried one at a time to find the bad ones.
+ */
+IOReturn VoodooFloppyController::imageCylinder(bool write, UInt8 cylinder, FloppyImageSlot *slot) {
+    UInt8 sectorsPerTrack = getFormat()->sectorsPerTrack;
+    UInt16 sectorCount = sectorsPerTrack * 2;
+    UInt32 sectorSize = FLOPPY_SECTOR_SIZE(getFormat()->sizeCode);
+    UInt8 retries = 0;
+    
+    slot->sectorCount = sectorCount;
+    slot->goodSectors = 0;
+    slot->retriedSectors = 0;
+    slot->badSectors = 0;
+    
+    // Try the whole cylinder in one go, one revolution per head.
+    IOReturn status = seek(cylinder);
+    if (status == kIOReturnSuccess)
+        status = transferSectors(write, cylinder, 0, 1, sectorCount, slot->data, &retries);
+    
+    if (status == kIOReturnSuccess) {
+        memset(slot->sectorStatus, retries ? kFloppyImageSectorRetried : kFloppyImageSectorGood, sectorCount);
+        if (retries)
+            slot->retriedSectors = sectorCount;
+        else
+            slot->goodSectors = sectorCount;
+    } else if (status != kIOReturnNoMedia && status != kIOReturnNotWritable && status != kIOReturnNotReady) {
+        // Fall back to single sectors.
+        status = kIOReturnSuccess;
+        for (UInt16 i = 0; i < sectorCount; i++) {
+            UInt8 head = i / sectorsPerTrack;
+            UInt8 sector = (i % sectorsPerTrack) + 1;
+            UInt8 *data = slot->data + i * sectorSize;
+            
+            IOReturn sectorStatus = seek(cylinder);
+            if (sectorStatus == kIOReturnSuccess)
+                sectorStatus = transferSectors(write, cylinder, head, sector, 1, data, &retries);
+            
+            if (sectorStatus == kIOReturnSuccess) {
+                slot->sectorStatus[i] = kFloppyImageSectorRetried;
+                slot->retriedSectors++;
+            } else {
+                // Bad sectors read back as zeroes.
+                if (!write)
+                    bzero(data, sectorSize);
+                slot->sectorStatus[i] = kFloppyImageSectorBad;
+                slot->badSectors++;
+                status = sectorStatus;
+            }
+        }
+    }
+    
+    slot->status = status;
+    return status;
+}
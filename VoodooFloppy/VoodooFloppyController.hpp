@@ -32,8 +32,11 @@
 #include <IOKit/IOTimerEventSource.h>
 #include <IOKit/IOCommandGate.h>
 #include <IOKit/IOMemoryDescriptor.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
 #include <IOKit/storage/IOBlockStorageDevice.h>
 
+#include "VoodooFloppyUserClientShared.h"
+
 #if DEBUG
 #define DBGLOG(args...) IOLog(args)
 #else
@@ -43,6 +46,13 @@
 // Floppy drive IRQ.
 #define FLOPPY_IRQ  6
 
+// Controller I/O bases.
+#define FLOPPY_BASE_PRIMARY     0x3F0
+#define FLOPPY_BASE_SECONDARY   0x370
+
+// ISA DMA channel used by default.
+#define FLOPPY_DMA_CHANNEL      2
+
 // Floppy drive types (from CMOS).
 #define FLOPPY_TYPE_NONE        0x0
 #define FLOPPY_TYPE_360_525     0x1
@@ -51,19 +61,30 @@
 #define FLOPPY_TYPE_1440_35     0x4
 #define FLOPPY_TYPE_2880_35     0x5
 
-// Floppy registers.
+// Floppy registers, relative to the controller I/O base.
 enum {
-    FLOPPY_REG_SRA  = 0x3F0, // Status Register A, read-only.
-    FLOPPY_REG_SRB  = 0x3F1, // Status Register B, read-only.
-    FLOPPY_REG_DOR  = 0x3F2, // Digital Output Register, read-write.
-    FLOPPY_REG_TDR  = 0x3F3, // Tape Drive Register, read-write.
-    FLOPPY_REG_MSR  = 0x3F4, // Main Status Register, read-only.
-    FLOPPY_REG_DSR  = 0x3F4, // Data Rate Select Register, write-only.
-    FLOPPY_REG_FIFO = 0x3F5, // Data (FIFO), read-write.
-    FLOPPY_REG_DIR  = 0x3F7, // Digital Input Register, read-only.
-    FLOPPY_REG_CCR  = 0x3F7  // Configuration Control Register, write-only.
+    FLOPPY_REG_SRA  = 0x0, // Status Register A, read-only.
+    FLOPPY_REG_SRB  = 0x1, // Status Register B, read-only.
+    FLOPPY_REG_DOR  = 0x2, // Digital Output Register, read-write.
+    FLOPPY_REG_TDR  = 0x3, // Tape Drive Register, read-write.
+    FLOPPY_REG_MSR  = 0x4, // Main Status Register, read-only.
+    FLOPPY_REG_DSR  = 0x4, // Data Rate Select Register, write-only.
+    FLOPPY_REG_FIFO = 0x5, // Data (FIFO), read-write.
+    FLOPPY_REG_DIR  = 0x7, // Digital Input Register, read-only.
+    FLOPPY_REG_CCR  = 0x7  // Configuration Control Register, write-only.
 };
 
+// 8237 DMA controller registers, for 8-bit channels 0-3.
+enum {
+    DMA_REG_MASK        = 0x0A, // Single channel mask.
+    DMA_REG_MODE        = 0x0B, // Mode.
+    DMA_REG_FLIP_FLOP   = 0x0C  // Clear byte pointer flip-flop.
+};
+#define DMA_MASK_ON         0x04
+#define DMA_MODE_TO_MEMORY  0x54 // Single mode, auto-initialize, write to memory.
+#define DMA_MODE_FROM_MEMORY 0x58 // Single mode, auto-initialize, read from memory.
+
+
 // Floppy commands.
 enum {
     FLOPPY_CMD_READ_TRACK           = 0x02, // Read track.
@@ -95,7 +116,8 @@ enum {
     FLOPPY_CMD_EXT_SKIP     = 0x20, // Skip flag. When set to 1, sectors containing a deleted data address
     // mark will automatically be skipped during the execution of READ DATA.
     FLOPPY_CMD_EXT_MFM      = 0x40, // MFM mode selector. A one selects the double density (MFM) mode.
-    FLOPPY_CMD_EXT_MT       = 0x80  // Multi-track selector. When set, this flag selects the multi-track operating mode.
+    FLOPPY_CMD_EXT_MT       = 0x80, // Multi-track selector. When set, this flag selects the multi-track operating mode.
+    FLOPPY_CMD_EXT_LOCK     = 0x80  // Lock selector for the LOCK command. When set, FIFO settings survive a software reset.
 };
 
 // Floppy DOR bits.
@@ -109,7 +131,8 @@ enum {
     FLOPPY_DOR_MOT_DRIVE0   = 0x10, // Set to turn drive 0's motor on.
     FLOPPY_DOR_MOT_DRIVE1   = 0x20, // Set to turn drive 1's motor on.
     FLOPPY_DOR_MOT_DRIVE2   = 0x40, // Set to turn drive 2's motor on.
-    FLOPPY_DOR_MOT_DRIVE3   = 0x80  // Set to turn drive 3's motor on.
+    FLOPPY_DOR_MOT_DRIVE3   = 0x80, // Set to turn drive 3's motor on.
+    FLOPPY_DOR_SEL_MASK     = 0x03  // Mask for the drive select bits.
 };
 
 // Floppy MSR bits.
@@ -133,7 +156,9 @@ enum {
     FLOPPY_ST0_ACTIVE_HEAD      = 0x04, // The current head address.
     FLOPPY_ST0_FAIL             = 0x08, // Drive not ready.
     FLOPPY_ST0_SEEK_END         = 0x10, // The 82077AA completed a SEEK or RECALIBRATE command, or a READ or WRITE with implied seek command.
-    FLOPPY_ST0_INTERRUPT_CODE   = 0xC0  // Command failed.
+    FLOPPY_ST0_INTERRUPT_CODE   = 0xC0, // Command failed.
+    FLOPPY_ST0_IC_ABNORMAL      = 0x40, // Interrupt code for abnormal termination.
+    FLOPPY_ST0_IC_INVALID       = 0x80  // Interrupt code for an invalid command.
 };
 
 // Floppy ST1 masks.
@@ -153,6 +178,8 @@ enum {
     FLOPPY_ST2_BAD_CYLINDER         = 0x02, // The track address from the sector ID field is different from the track address
     // maintained inside the 82077AA and is equal to FF hex which indicates a bad track
     // with a hard error according to the IBM soft-sectored format.
+    FLOPPY_ST2_SCAN_NOT_SATISFIED   = 0x04, // No sector on the track met the SCAN condition.
+    FLOPPY_ST2_SCAN_HIT             = 0x08, // A sector met the SCAN condition with equal data.
     FLOPPY_ST2_WRONG_CYLINDER       = 0x10, // The track address from the sector ID field is different from the track address maintained inside the 82077AA.
     FLOPPY_ST2_DATA_ERROR_IN_FIELD  = 0x20, // The 82077AA detected a CRC error in the data field.
     FLOPPY_ST2_CONTROL_MARK         = 0x40  // Data address mark found.
@@ -174,16 +201,24 @@ enum {
     FLOPPY_BYTES_SECTOR_128     = 0x00,
     FLOPPY_BYTES_SECTOR_256     = 0x01,
     FLOPPY_BYTES_SECTOR_512     = 0x02,
-    FLOPPY_BYTES_SECTOR_1024    = 0x04
+    FLOPPY_BYTES_SECTOR_1024    = 0x03,
+    FLOPPY_BYTES_SECTOR_UNKNOWN = 0xFF
 };
+#define FLOPPY_SECTOR_SIZE(sizeCode) (128U << (sizeCode))
 
 // Floppy sector gap sizes.
 enum {
     FLOPPY_GAP3_STANDARD    = 0x2A,
     FLOPPY_GAP3_5_25        = 0x20,
-    FLOPPY_GAP3_3_5         = 0x1B
+    FLOPPY_GAP3_3_5         = 0x1B,
+    FLOPPY_GAP3_1024        = 0x35, // Data commands on 1024-byte sectors.
+    FLOPPY_GAP3_FORMAT_512  = 0x6C, // FORMAT TRACK on 18 x 512 HD tracks.
+    FLOPPY_GAP3_FORMAT_1024 = 0x74  // FORMAT TRACK on 10 x 1024 HD tracks.
 };
 
+// Data byte written to sectors by FORMAT TRACK.
+#define FLOPPY_FORMAT_FILL      0xF6
+
 
 // DIR values.
 #define kFloppyDirDskChg    0x80
@@ -194,25 +229,211 @@ enum {
 #define FLOPPY_SPEED_250KBPS    0x2
 #define FLOPPY_SPEED_1MBPS      0x3
 
+// SPECIFY parameters used for all drives.
+#define FLOPPY_SPECIFY_STEP_RATE    0xC
+#define FLOPPY_SPECIFY_HEAD_LOAD    0x2
+#define FLOPPY_SPECIFY_HEAD_UNLOAD  0xF
+
 #define FLOPPY_CMD_RETRY_COUNT  5
 #define FLOPPY_IRQ_WAIT_TIME    500
-#define FLOPPY_DMASTART  0x500
-#define FLOPPY_DMALENGTH 0x4800
-#define FLOPPY_SECTORS_PER_TRACK 18
+#define FLOPPY_DMALENGTH 0x10000 // One ISA DMA page, several cylinders.
+#define FLOPPY_DMAMASK   0x00FF0000ULL // Below 16MB and 64KB-aligned, so transfers never cross a DMA page.
+#define FLOPPY_MAX_SECTORS_PER_TRACK 18 // Most sectors per track of any supported format.
 #define FLOPPY_VERSION_NONE     0xFF
 #define FLOPPY_VERSION_ENHANCED 0x90
 
+// FIFO threshold limits, in CONFIGURE encoding (bytes - 1).
+#define FLOPPY_FIFO_THRESHOLD_MIN   0
+#define FLOPPY_FIFO_THRESHOLD_MAX   15
+#define FLOPPY_PRETRACK             0
+
+// Rotation periods, in microseconds.
+#define FLOPPY_ROTATION_300RPM_US   200000
+#define FLOPPY_ROTATION_360RPM_US   166667
+
+// How long a rotational reference is trusted for, allowing for spindle speed drift.
+#define kFloppyRotationValidUs      2000000
+
+// Sectors allowed for issuing a command before the target sector must arrive.
+#define kFloppyRotationMargin       1
+
+// Clean transfers needed before the FIFO threshold is lowered again.
+#define kFloppyFifoRelaxTransfers   1024
+
+// Microseconds to spin for RQM between command and result bytes before sleeping.
+#define kFloppyRqmSpinUs            100
+
+// Sectors covered by content hashes for write elision, enough for 2.88MB media.
+#define kFloppyHashSectors          5760
+
+// Unchanged sectors between two dirty runs that are rewritten rather than starting another command.
+#define kFloppyElisionMergeGap      kFloppyRotationMargin
+
+// Most queued requests carried along by one merged command.
+#define kFloppyMergeMaxRequests     16
+
+// DUMPREG result bytes.
+enum {
+    FLOPPY_DUMPREG_PCN0         = 0, // Present cylinder numbers, drives 0-3.
+    FLOPPY_DUMPREG_SPECIFY      = 4, // SRT/HUT, then HLT/ND, as sent with SPECIFY.
+    FLOPPY_DUMPREG_SC_EOT       = 6, // Sector count or EOT.
+    FLOPPY_DUMPREG_LOCK         = 7, // LOCK, perpendicular mode and GAP/WGATE.
+    FLOPPY_DUMPREG_CONFIGURE    = 8, // EIS/EFIFO/POLL/FIFOTHR, then PRETRK, as sent with CONFIGURE.
+    FLOPPY_DUMPREG_LENGTH       = 10
+};
+#define FLOPPY_DUMPREG_LOCK_BIT 0x80
+
 #define FLOPPY_IOREG_DRIVE_TYPE "drive-type"
 
-#define kFloppyPropertyDriveIdKey   "floppy-id"
+#define kFloppyPropertyDriveIdKey       "floppy-id"
+#define kFloppyPropertyTransferModeKey  "transfer-mode"
+#define kFloppyPropertyPioPollingKey    "pio-polling"
+#define kFloppyPropertyIoBaseKey        "io-base"
+#define kFloppyPropertyDmaChannelKey    "dma-channel"
+#define kFloppyPropertyDriveATypeKey    "drive-a-type"
+#define kFloppyPropertyDriveBTypeKey    "drive-b-type"
+#define kFloppyAcpiUidKey               "_UID"
+#define kFloppyPropertyFifoThresholdKey "fifo-threshold"
+#define kFloppyPropertyFifoOverrunsKey  "fifo-overruns"
+#define kFloppyPropertyFifoTransfersKey "fifo-transfers"
+#define kFloppyPropertyMaxGateHoldKey   "max-gate-hold-ms"
+#define kFloppyPropertyLatencyKey       "request-latency"
+#define kFloppyPropertyElisionKey       "write-elision"
+#define kFloppyPropertyHandshakeKey     "handshake"
+#define kFloppyPropertyRamMirrorKey     "ram-mirror"
+#define kFloppyPropertyTraceKey         "io-trace"
+#define kFloppyPropertySpinUpKey        "spin-up"
+#define kFloppyPropertyMergingKey       "request-merging"
+#define kFloppyPropertyInterruptsKey    "interrupts"
+
+#define kFloppyPropertyRequestTimeoutKey "request-timeout-ms"
+
+#define kFloppyMaxGateHoldMsDefault     250
+#define kFloppyRequestTimeoutMsDefault  10000
+#define kFloppyCylinderTimeoutMs        1000
+
+// Transfer mode values.
+#define kFloppyTransferModeAuto "auto"
+#define kFloppyTransferModeDma  "dma"
+#define kFloppyTransferModePio  "pio"
 
 
 #define kFloppyMotorTimeoutMs 2000
+#define kFloppySpinUpMaxMs    500 // Longest a drive may take to reach speed.
+#define kFloppySeekSettleMs   15
+#define kFloppyIrqSlackMs     100 // Allowed on top of the expected duration of a command before its interrupt is given up on.
+#define kFloppyMaxSteps       80 // Most step pulses a seek from an unknown position or a RECALIBRATE can give.
+#define kFloppyImageWaitMs    5
+#define kFloppyMirrorIdleMs   500
+#define kFloppyMirrorStopped  0xFFFF
+
+// Drives per controller.
+#define FLOPPY_MAX_DRIVES       4
+#define FLOPPY_CYLINDER_UNKNOWN -1
+
+// Media layout, matched to what READ ID finds on the disk.
+typedef struct {
+    UInt8 dataRate;
+    UInt8 sizeCode; // Sector size, as N in data commands.
+    UInt8 sectorsPerTrack;
+    UInt8 cylinders;
+    UInt8 gap3; // GAP3 sent with data commands.
+    UInt8 formatGap; // GAP3 laid down by FORMAT TRACK.
+} FloppyMediaFormat;
+
+// Per-drive state tracked by the controller.
+typedef struct {
+    const FloppyMediaFormat *format; // Layout of the media in the drive.
+    SInt16 cylinder; // Cylinder the heads are on, or FLOPPY_CYLINDER_UNKNOWN.
+    UInt8 rotationSector; // Last sector seen passing under the head, or 0 if unknown.
+    UInt64 rotationTime; // Absolute time rotationSector finished passing.
+    UInt64 *sectorHashes; // Content hashes of physical sectors on the media, 0 if unknown. Allocated on first use.
+    UInt8 *mirror; // RAM copy of the media when mirroring, or NULL.
+    UInt8 *mirrorValid; // Set for each physical sector held in the mirror.
+    UInt32 mirrorSectors;
+    UInt32 mirrorBlockSize;
+    UInt16 mirrorCylinder; // Next cylinder to fill, or kFloppyMirrorStopped once discarded.
+    UInt64 mirrorStartTime;
+    UInt64 motorOnTime; // Absolute time the motor was turned on, or 0 once the spindle is up to speed.
+    UInt32 spinUpCount;
+    UInt32 spinUpTimeouts; // Spin-ups where no ID field was read within kFloppySpinUpMaxMs.
+    UInt64 spinUpLastUs;
+    UInt64 spinUpMaxUs;
+    UInt64 spinUpTotalUs;
+} FloppyDriveState;
 
 class VoodooFloppyStorageDevice;
 
+// Queued block request.
+typedef struct FloppyRequest {
+    struct FloppyRequest *next;
+    VoodooFloppyStorageDevice *device;
+    IOMemoryDescriptor *buffer;
+    IOMemoryMap *bufferMap; // Client buffer mapping for PIO.
+    UInt64 block;
+    UInt64 nblks;
+    UInt64 blocksDone;
+    IOStoragePriority priority;
+    IOStorageCompletion completion;
+    UInt64 submitTime;
+    UInt64 deadline; // Set when the request is first dispatched.
+    struct FloppyRequest *mergeNext; // Queued requests done by the same command as this one.
+} FloppyRequest;
+
+// Priority classes for latency statistics.
+enum {
+    kFloppyPriorityClassHigh    = 0,
+    kFloppyPriorityClassDefault = 1,
+    kFloppyPriorityClassLow     = 2,
+    kFloppyPriorityClassCount
+};
+
+// Imaging session parameters.
+typedef struct {
+    VoodooFloppyStorageDevice *device;
+    bool write;
+    FloppyImageRing *ring;
+    UInt32 firstCylinder;
+    UInt32 cylinderCount;
+    volatile bool *abort;
+} FloppyImageSession;
+
+// Formatting parameters.
+typedef struct {
+    VoodooFloppyStorageDevice *device;
+    UInt32 firstCylinder;
+    UInt32 cylinderCount;
+    UInt8 sizeCode;
+} FloppyFormatSession;
+
+// Search parameters and results.
+typedef struct {
+    VoodooFloppyStorageDevice *device;
+    UInt32 firstCylinder;
+    UInt32 cylinderCount;
+    UInt8 condition;
+    const UInt8 *pattern;
+    UInt32 patternLength;
+    FloppyScanMatch *matches;
+    UInt32 maxMatches;
+    UInt32 matchCount;
+    UInt32 cylindersScanned;
+} FloppyScanSession;
+
+// Drive-to-drive copy parameters and results.
+typedef struct {
+    VoodooFloppyStorageDevice *source;
+    VoodooFloppyStorageDevice *destination;
+    FloppyImageRing *ring; // Progress, in the ring header.
+    UInt32 firstCylinder;
+    UInt32 cylinderCount;
+    volatile bool *abort;
+    FloppyCopyCylinder *results;
+    UInt32 cylindersCopied;
+} FloppyCopySession;
+
 // VoodooFloppyController class.
-class VoodooFloppyController : IOService {
+class VoodooFloppyController : public IOService {
     typedef IOService super;
     OSDeclareDefaultStructors(VoodooFloppyController);
     
@@ -224,73 +445,246 @@ public:
     virtual IOReturn setPowerState(unsigned long powerStateOrdinal, IOService *whatDevice);
     
     IOReturn probeDriveMedia(VoodooFloppyStorageDevice *floppyDevice);
-    IOReturn readWriteDrive(VoodooFloppyStorageDevice *floppyDevice, IOMemoryDescriptor *buffer, UInt64 block, UInt64 nblks);
+    IOReturn submitReadWrite(VoodooFloppyStorageDevice *floppyDevice, IOMemoryDescriptor *buffer, UInt64 block, UInt64 nblks, IOStorageAttributes *attributes, IOStorageCompletion *completion);
+    IOReturn imageDrive(UInt8 driveNumber, bool write, FloppyImageRing *ring, UInt32 firstCylinder, UInt32 cylinderCount, volatile bool *abort);
+    void wakeImageSession(FloppyImageRing *ring);
+    IOReturn formatDrive(UInt8 driveNumber, UInt32 firstCylinder, UInt32 cylinderCount, UInt8 sizeCode);
+    IOReturn scanDrive(UInt8 driveNumber, UInt32 firstCylinder, UInt32 cylinderCount, UInt8 condition, const UInt8 *pattern, UInt32 patternLength,
+                       FloppyScanMatch *matches, UInt32 *matchCount, UInt32 *cylindersScanned);
+    IOReturn copyDrive(UInt8 sourceDrive, UInt8 destinationDrive, FloppyImageRing *ring, UInt32 firstCylinder, UInt32 cylinderCount,
+                       volatile bool *abort, FloppyCopyCylinder *results, UInt32 *cylindersCopied);
+    IOReturn setTracing(bool enabled);
+    IOBufferMemoryDescriptor *getTraceMemory();
     
 
 private:
     // Drives.
     UInt8 _driveAType;
     UInt8 _driveBType;
+    
+    // Controller resources.
+    UInt16 _ioBase;
+    UInt8 _dmaChannel;
+    UInt32 _dmaPhysAddr;
     VoodooFloppyStorageDevice *_driveADevice;
     VoodooFloppyStorageDevice *_driveBDevice;
     VoodooFloppyStorageDevice *_currentDevice;
+    FloppyDriveState _driveState[FLOPPY_MAX_DRIVES];
     
     // Work loop and interrupts.
     IOWorkLoop *_workLoop;
     IOTimerEventSource *_tmrMotorOffSource;
+    IOTimerEventSource *_tmrBringUpSource;
+    IOTimerEventSource *_tmrMirrorSource;
+    
+    // Request queue.
+    IOInterruptEventSource *_dispatchSource;
+    IOLock *_queueLock;
+    FloppyRequest *_queueHead;
+    UInt32 _maxGateHoldMs;
+    UInt32 _requestTimeoutMs;
+    volatile UInt64 _requestDeadline;
+    volatile IOReturn _abortStatus;
+    UInt64 _latencyCount[kFloppyPriorityClassCount];
+    UInt64 _latencyTotalUs[kFloppyPriorityClassCount];
+    UInt64 _latencyMaxUs[kFloppyPriorityClassCount];
+    bool _controllerReady;
+    bool _motorHeld;
+    bool _imageSessionRunning; // Kept here, as the ring state can be written by the client.
+    bool _mirrorEnabled;
+    volatile bool _mirrorFilling;
+    volatile bool _mirrorPreempt;
     bool _irqTriggered;
+    UInt64 _irqTime;
+    
+    // Request trace ring, guarded by the queue lock.
+    IOBufferMemoryDescriptor *_traceMemory;
+    FloppyTraceRing *_traceRing;
+    UInt64 _traceStartTime;
+    bool _traceEnabled;
     
     // DMA buffer.
-    IOMemoryDescriptor *_dmaMemoryDesc;
-    IOMemoryMap *_dmaMemoryMap;
+    IOBufferMemoryDescriptor *_dmaMemoryDesc;
     UInt8 *_dmaBuffer;
+    bool _useDma;
+    
+    // PIO transfer state, shared with the interrupt handler.
+    IOSimpleLock *_pioLock;
+    UInt8 *volatile _pioBuffer;
+    volatile UInt32 _pioLength;
+    volatile UInt32 _pioOffset;
+    volatile bool _pioWrite;
+    volatile bool _pioActive;
+    bool _pioPolling;
     
     // Command gate.
     IOCommandGate *_cmdGate;
+    
+    // Shadowed register state. Values are only sent to the controller when they change.
+    UInt8 _dorShadow;
+    bool _dorValid;
+    UInt8 _ccrShadow;
+    bool _ccrValid;
+    UInt8 _specifyShadow[2];
+    bool _specifyValid;
+    UInt8 _configureShadow[3];
+    bool _configureValid;
+    bool _configureLocked;
+    
+    // FIFO threshold management.
+    UInt8 _fifoThreshold;
+    UInt32 _fifoOverruns;
+    UInt32 _fifoTransfers;
+    UInt32 _fifoCleanTransfers;
+    
+    // Command and result phase handshake statistics.
+    UInt32 _handshakeStalls;
+    UInt32 _handshakeErrors;
+    
+    // Interrupts that didn't arrive within the expected duration of their command, and those where MSR showed it had finished.
+    UInt32 _irqLost;
+    UInt32 _irqRecovered;
+    bool _resetting;
+    
+    // Write elision statistics.
+    UInt64 _elidedSectors;
+    UInt64 _elidedBytes;
+    UInt64 _elidedCommands;
+    bool _elisionChanged;
+    
+    // Request merging statistics.
+    UInt64 _mergedCommands;
+    UInt64 _mergedRequests;
+    UInt64 _mergedGapSectors;
+    
+    // Controller state captured with DUMPREG, replayed on the first command after wake.
+    UInt8 _savedRegs[FLOPPY_DUMPREG_LENGTH];
+    bool _savedRegsValid;
+    bool _needsRestore;
 
     // Handlers.
     static void interruptHandler(OSObject *target, void *refCon, IOService *nub, int source);
     void timerHandler(OSObject *owner, IOTimerEventSource *sender);
+    void bringUpHandler(OSObject *owner, IOTimerEventSource *sender);
+    void dispatchHandler(OSObject *owner, IOInterruptEventSource *sender, int count);
+    void mirrorHandler(OSObject *owner, IOTimerEventSource *sender);
+    
+    // Request queue.
+    FloppyRequest *nextRequest();
+    IOReturn checkAbort(bool watchDiskChange = false, bool betweenCommands = false);
+    IOReturn abortQueueGated();
+    void completeRequest(FloppyRequest *request, IOReturn status);
+    static void setNumber(OSDictionary *dictionary, const char *key, UInt64 value, UInt32 bits = 64);
+    void publishLatencyStatistics();
+    IOReturn readWriteChunk(FloppyRequest *request);
+    IOReturn readWriteMerged(FloppyRequest *request);
+    void publishMergeStatistics();
     
     // Gated fuctions.
     IOReturn setPowerStateGated(UInt32 *powerState);
     IOReturn probeMediaGated(VoodooFloppyStorageDevice *floppyDevice);
-    IOReturn readWriteGated(VoodooFloppyStorageDevice *floppyDevice, IOMemoryDescriptor *buffer, UInt64 *block, UInt64 *nblks);
+    IOReturn imageGated(FloppyImageSession *session);
+    IOReturn wakeImageSessionGated(FloppyImageRing *ring);
+    IOReturn formatGated(FloppyFormatSession *session);
+    IOReturn scanGated(FloppyScanSession *session);
+    IOReturn copyGated(FloppyCopySession *session);
     
     
     
-    bool waitInterrupt(UInt16 timeout);
+    bool waitInterrupt(UInt32 timeoutMs, bool watchDiskChange = false);
+    UInt32 getCommandTimeoutMs(UInt8 steps, UInt8 revolutions);
+    void publishInterruptStatistics();
+    UInt8 spinRqm();
+    bool waitRqm(bool read);
     bool writeData(UInt8 data);
     UInt8 readData(void);
+    bool sendCommand(const UInt8 *command, UInt8 length);
+    bool readResult(UInt8 *result, UInt8 length);
+    void publishHandshakeStatistics();
     void senseInterrupt(UInt8 *st0, UInt8 *cyl);
     void setDriveData(UInt8 stepRate, UInt16 loadTime, UInt8 unloadTime, bool dma);
+    void writeDor(UInt8 value);
+    void invalidateRegisterShadow(bool includeLocked);
+    void applyDriveSettings();
+    void getResources(IOService *provider);
     bool detectDrives(UInt8 *outTypeA, UInt8 *outTypeB);
+    VoodooFloppyStorageDevice *createDevice(UInt8 driveNumber, UInt8 driveType);
+    
+    UInt8 readRegister(UInt8 reg);
+    void writeRegister(UInt8 reg, UInt8 value);
     UInt8 getControllerVersion();
     void configureController();
     void resetController();
+    void raiseFifoThreshold();
+    void relaxFifoThreshold();
+    void applyFifoThreshold();
+    void publishFifoStatistics();
+    bool dumpRegisters(UInt8 *regs);
+    void restoreController();
     
     bool isControllerReady();
     
     SInt8 getMotorNum(UInt8 driveNumber);
     bool setMotorOn();
     bool setMotorOff();
+    IOReturn waitSpinUp(UInt8 head, bool readIdField);
+    void finishSpinUp(bool timedOut);
+    void publishSpinUpStatistics();
+    
+    void setTransferSpeed(UInt8 dataRate);
     
-    void setTransferSpeed(UInt8 driveType);
+    bool setDma(UInt32 offset, UInt32 length, bool write);
+    bool probeDma();
     
-    void setDma(UInt32 length, bool write);
+    bool servicePio();
+    bool waitPioComplete(UInt32 timeoutMs);
     
     
     
+    const FloppyMediaFormat *findMediaFormat(UInt8 dataRate, UInt8 sizeCode);
+    const FloppyMediaFormat *getFormat();
+    void setFormat(VoodooFloppyStorageDevice *floppyDevice, const FloppyMediaFormat *format);
     void lbaToChs(UInt32 lba, UInt16* cyl, UInt16* head, UInt16* sector);
     IOReturn parseError(UInt8 st0, UInt8 st1, UInt8 st2);
     
     void selectDrive(VoodooFloppyStorageDevice *floppyDevice);
+    void invalidateCylinder(SInt8 driveNumber = -1);
     IOReturn checkForMedia(bool *mediaPresent, UInt8 currentTrack = 0);
+    bool isDiskChanged();
     IOReturn recalibrate();
     IOReturn seek(UInt8 track);
     
-    IOReturn readWriteSectors(bool write, UInt8 track, UInt8 head, UInt8 sector, UInt8 count);
+    IOReturn readWriteSectors(bool write, UInt8 track, UInt8 head, UInt8 sector, UInt8 count, UInt8 *pioBuffer, UInt32 offset = 0, UInt8 *retries = NULL);
+    IOReturn readWriteTrack(bool write, UInt8 track, UInt8 head, UInt8 sector, UInt8 count, UInt8 *pioBuffer, UInt8 *retries = NULL);
+    IOReturn readId(UInt8 head, UInt8 *sizeCode = NULL);
+    IOReturn formatTrack(UInt8 track, UInt8 head);
+    IOReturn scanCylinder(UInt8 opcode, UInt8 track, UInt8 head, UInt8 sector, UInt8 *hitHead, UInt8 *hitSector);
+    bool scanSector(UInt8 condition, const UInt8 *data, const UInt8 *pattern, UInt32 length);
+    UInt32 getRotationPeriod();
+    void updateRotation(UInt8 lastSector);
+    UInt8 predictSector();
+    IOReturn transferSectors(bool write, UInt8 track, UInt8 head, UInt8 sector, UInt8 count, UInt8 *data, UInt8 *retries);
     
+    UInt64 hashSector(const UInt8 *data, UInt32 length);
+    UInt64 *getSectorHashes(bool create);
+    void updateSectorHashes(UInt32 lba, UInt32 count, const UInt8 *data);
+    void dropSectorHashes(SInt8 driveNumber = -1);
+    void forgetMedia(SInt8 driveNumber);
+    
+    void startMirror(VoodooFloppyStorageDevice *floppyDevice);
+    void discardMirror(SInt8 driveNumber = -1);
+    UInt8 *getMirror(UInt32 lba, UInt32 count);
+    bool isMirrored(UInt32 lba, UInt32 count);
+    void setMirrorValid(UInt32 lba, UInt32 count, bool valid);
+    bool fillMirror(VoodooFloppyStorageDevice *floppyDevice);
+    IOReturn writeChangedSectors(UInt8 track, UInt8 head, UInt8 sector, UInt32 lba, UInt8 count, UInt8 *data);
+    void publishElisionStatistics();
+    IOReturn imageCylinder(bool write, UInt8 cylinder, FloppyImageSlot *slot);
+    
+#ifdef FLOPPY_HOST_HARNESS
+    // Host microbenchmarks call the private hot paths directly.
+    friend class FloppyMicroBench;
+#endif
 };
 
 #endif /* VoodooFloppyController_hpp */
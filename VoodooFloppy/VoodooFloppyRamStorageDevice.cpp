@@ -0,0 +1,459 @@
+/*
+ * File: VoodooFloppyRamStorageDevice.cpp
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOUserClient.h>
+#include <IOKit/storage/IOBlockStorageDriver.h>
+#include <kern/clock.h>
+#include <libkern/c++/OSData.h>
+
+#include "VoodooFloppyRamStorageDevice.hpp"
+#include "IO.h"
+
+// This required macro defines the class's constructors, destructors,
+// and several other methods I/O Kit requires.
+OSDefineMetaClassAndStructors(VoodooFloppyRamStorageDevice, VoodooFloppyStorageDevice)
+
+IOService *VoodooFloppyRamStorageDevice::probe(IOService *provider, SInt32 *score) {
+    DBGLOG("VoodooFloppyRamStorageDevice::probe()\n");
+    
+    // Only match when asked for, so the device stays out of the way of real drives.
+    OSBoolean *enabled = OSDynamicCast(OSBoolean, getProperty(kFloppyRamPropertyEnabledKey));
+    if (!enabled || !enabled->isTrue())
+        return NULL;
+    return super::probe(provider, score);
+}
+
+bool VoodooFloppyRamStorageDevice::attach(IOService *provider) {
+    DBGLOG("VoodooFloppyRamStorageDevice::attach()\n");
+    
+    // Skip the base class, which takes the drive details from the controller. There is none here.
+    if (!IOBlockStorageDevice::attach(provider))
+        return false;
+    
+    _mediaPresent = false;
+    _writeProtected = false;
+    _blockSize = 512;
+    _maxValidBlock = kFloppyRamBlocksDefault - 1;
+    
+    _controller = NULL;
+    _driveNumber = 0;
+    _driveType = FLOPPY_TYPE_1440_35;
+    _dataRate = FLOPPY_SPEED_500KBPS;
+    
+    // Nothing is allocated or queued yet, and the motor is off.
+    _workLoop = NULL;
+    _tmrCompleteSource = NULL;
+    _imageLock = NULL;
+    _image = NULL;
+    _imageBlocks = 0;
+    _queueHead = _queueTail = NULL;
+    _busyUntilUs = 0;
+    return true;
+}
+
+bool VoodooFloppyRamStorageDevice::start(IOService *provider) {
+    DBGLOG("VoodooFloppyRamStorageDevice::start()\n");
+    OSNumber *blocks;
+    OSBoolean *mechanics;
+    OSBoolean *writeProtected;
+    UInt64 blockCount;
+    UInt8 *image;
+    IOReturn status;
+    
+    if (!super::start(provider))
+        return false;
+    
+    // Get image size and options.
+    blocks = OSDynamicCast(OSNumber, getProperty(kFloppyRamPropertyBlocksKey));
+    blockCount = blocks ? blocks->unsigned64BitValue() : kFloppyRamBlocksDefault;
+    if (blockCount == 0 || blockCount > kFloppyRamBlocksMax) {
+        IOLog("VoodooFloppyRamStorageDevice: Invalid image size of %llu blocks.\n", blockCount);
+        goto fail;
+    }
+    mechanics = OSDynamicCast(OSBoolean, getProperty(kFloppyRamPropertyMechanicsKey));
+    _mechanicsEnabled = mechanics && mechanics->isTrue();
+    writeProtected = OSDynamicCast(OSBoolean, getProperty(kFloppyRamPropertyWriteProtectedKey));
+    _writeProtected = writeProtected && writeProtected->isTrue();
+    
+    // Create image and queue lock.
+    _imageLock = IOLockAlloc();
+    if (!_imageLock) {
+        IOLog("VoodooFloppyRamStorageDevice: Failed to create IOLock.\n");
+        goto fail;
+    }
+    
+    // Setup new workloop.
+    _workLoop = IOWorkLoop::workLoop();
+    if (!_workLoop) {
+        IOLog("VoodooFloppyRamStorageDevice: Failed to create IOWorkLoop.\n");
+        goto fail;
+    }
+    
+    // Create IOTimerEventSource for completing requests once their modelled latency has passed.
+    _tmrCompleteSource = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &VoodooFloppyRamStorageDevice::completeHandler));
+    if (!_tmrCompleteSource) {
+        IOLog("VoodooFloppyRamStorageDevice: Failed to create IOTimerEventSource.\n");
+        goto fail;
+    }
+    
+    // Add to work loop.
+    status = _workLoop->addEventSource(_tmrCompleteSource);
+    if (status != kIOReturnSuccess) {
+        IOLog("VoodooFloppyRamStorageDevice: Failed to add IOTimerEventSource to work loop: 0x%X\n", status);
+        goto fail;
+    }
+    
+    // Start with blank media in the drive.
+    image = (UInt8*)IOMalloc(blockCount * _blockSize);
+    if (!image) {
+        IOLog("VoodooFloppyRamStorageDevice: Failed to allocate image.\n");
+        goto fail;
+    }
+    bzero(image, blockCount * _blockSize);
+    setImage(image, blockCount);
+    _mediaPresent = true;
+    setProperty(kFloppyRamPropertyMediaPresentKey, true);
+    
+    registerService();
+    IOLog("VoodooFloppyRamStorageDevice: Started with %llu blocks%s.\n", blockCount, _mechanicsEnabled ? ", modelling drive mechanics" : "");
+    return true;
+    
+fail:
+    // If we get here that means something failed, so stop the device.
+    IOLog("VoodooFloppyRamStorageDevice::start(): fail.\n");
+    stop(provider);
+    return false;
+}
+
+void VoodooFloppyRamStorageDevice::stop(IOService *provider) {
+    DBGLOG("VoodooFloppyRamStorageDevice::stop()\n");
+    FloppyRamRequest *request = NULL;
+    
+    // Stop the timer and take it off the work loop, so completeHandler() can't run while the queue and lock are freed.
+    if (_tmrCompleteSource) {
+        _tmrCompleteSource->cancelTimeout();
+        if (_workLoop)
+            _workLoop->removeEventSource(_tmrCompleteSource);
+    }
+    
+    // Fail requests still waiting out their latency.
+    if (_imageLock) {
+        IOLockLock(_imageLock);
+        request = _queueHead;
+        _queueHead = _queueTail = NULL;
+        IOLockUnlock(_imageLock);
+    }
+    while (request) {
+        FloppyRamRequest *next = request->next;
+        IOStorage::complete(&request->completion, kIOReturnAborted, 0);
+        IOFree(request, sizeof (FloppyRamRequest));
+        request = next;
+    }
+    
+    // Free IOTimerEventSource and work loop.
+    OSSafeReleaseNULL(_tmrCompleteSource);
+    OSSafeReleaseNULL(_workLoop);
+    
+    // Free image.
+    if (_image) {
+        IOFree(_image, _imageBlocks * _blockSize);
+        _image = NULL;
+    }
+    if (_imageLock) {
+        IOLockFree(_imageLock);
+        _imageLock = NULL;
+    }
+    super::stop(provider);
+}
+
+/*!
+ * @function setProperties
+ * Changes the media from user space. An image can be loaded, and the write-protect tab and media presence changed.
+ */
+IOReturn VoodooFloppyRamStorageDevice::setProperties(OSObject *properties) {
+    OSDictionary *dictionary = OSDynamicCast(OSDictionary, properties);
+    OSBoolean *writeProtected;
+    OSBoolean *mediaPresent;
+    OSData *image;
+    IOReturn status;
+    
+    if (!dictionary)
+        return kIOReturnBadArgument;
+    
+    // Changing media is limited to administrators, as is raw access through the user client.
+    status = IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator);
+    if (status != kIOReturnSuccess)
+        return status;
+    
+    // The tab is set first, so a protected image is never online as writable.
+    writeProtected = OSDynamicCast(OSBoolean, dictionary->getObject(kFloppyRamPropertyWriteProtectedKey));
+    if (writeProtected)
+        setWriteProtected(writeProtected->isTrue());
+    
+    image = OSDynamicCast(OSData, dictionary->getObject(kFloppyRamPropertyImageKey));
+    if (image) {
+        status = loadImage(image->getBytesNoCopy(), image->getLength());
+        if (status != kIOReturnSuccess)
+            return status;
+    }
+    
+    mediaPresent = OSDynamicCast(OSBoolean, dictionary->getObject(kFloppyRamPropertyMediaPresentKey));
+    if (mediaPresent)
+        setMediaPresent(mediaPresent->isTrue());
+    return kIOReturnSuccess;
+}
+
+IOReturn VoodooFloppyRamStorageDevice::doAsyncReadWrite(IOMemoryDescriptor *buffer, UInt64 block, UInt64 nblks, IOStorageAttributes *attributes, IOStorageCompletion *completion) {
+    IODirection direction = buffer->getDirection();
+    DBGLOG("VoodooFloppyRamStorageDevice::doAsyncReadWrite(start %llu, %llu blocks, 0x%X)\n", block, nblks, direction);
+    FloppyRamRequest *request = NULL;
+    IOReturn status = kIOReturnSuccess;
+    UInt64 byteCount = 0;
+    UInt64 copied;
+    bool queueWasEmpty;
+    
+    if (direction != kIODirectionIn && direction != kIODirectionOut)
+        return kIOReturnBadArgument;
+    
+    // Requests wait out their latency in order, so allocate before taking the lock.
+    if (_mechanicsEnabled) {
+        request = (FloppyRamRequest*)IOMalloc(sizeof (FloppyRamRequest));
+        if (!request)
+            return kIOReturnNoMemory;
+    }
+    
+    // Check the request the way the drive would, then copy at memory speed.
+    IOLockLock(_imageLock);
+    if (!_mediaPresent) {
+        status = kIOReturnNoMedia;
+    } else if (block > _maxValidBlock || nblks > _maxValidBlock - block + 1) {
+        status = kIOReturnBadArgument;
+    } else if (direction == kIODirectionOut && _writeProtected) {
+        status = kIOReturnNotWritable;
+    } else {
+        byteCount = nblks * _blockSize;
+        if (direction == kIODirectionIn)
+            copied = buffer->writeBytes(0, _image + block * _blockSize, (IOByteCount)byteCount);
+        else
+            copied = buffer->readBytes(0, _image + block * _blockSize, (IOByteCount)byteCount);
+        if (copied != byteCount) {
+            status = kIOReturnUnderrun;
+            byteCount = 0;
+        }
+    }
+    
+    // Without mechanics, complete right away.
+    if (!request) {
+        IOLockUnlock(_imageLock);
+        if (status != kIOReturnSuccess)
+            handleError(status);
+        IOStorage::complete(completion, status, byteCount);
+        return kIOReturnSuccess;
+    }
+    
+    // Failed requests never reach the media, but still wait for the requests ahead of them.
+    request->completion = *completion;
+    request->status = status;
+    request->byteCount = byteCount;
+    request->completeTime = getCompleteTime(block, status == kIOReturnSuccess ? nblks : 0);
+    request->next = NULL;
+    
+    // Add to end of queue.
+    queueWasEmpty = !_queueHead;
+    if (_queueTail)
+        _queueTail->next = request;
+    else
+        _queueHead = request;
+    _queueTail = request;
+    IOLockUnlock(_imageLock);
+    
+    // Completion times only increase along the queue, so the timer is only armed for a new head.
+    if (queueWasEmpty)
+        _tmrCompleteSource->wakeAtTime(request->completeTime);
+    return kIOReturnSuccess;
+}
+
+/*!
+ * @function loadImage
+ * Replaces the media with a copy of an image. The drive is seen to go empty and then take the new media.
+ */
+IOReturn VoodooFloppyRamStorageDevice::loadImage(const void *bytes, UInt64 length) {
+    UInt64 blockCount = length / _blockSize;
+    UInt8 *oldImage;
+    UInt64 oldBlockCount;
+    UInt8 *image;
+    
+    if (length == 0 || length % _blockSize || blockCount > kFloppyRamBlocksMax) {
+        IOLog("VoodooFloppyRamStorageDevice: Invalid image size of %llu bytes.\n", length);
+        return kIOReturnBadArgument;
+    }
+    
+    image = (UInt8*)IOMalloc(length);
+    if (!image) {
+        IOLog("VoodooFloppyRamStorageDevice: Failed to allocate image.\n");
+        return kIOReturnNoMemory;
+    }
+    bcopy(bytes, image, (size_t)length);
+    
+    // Eject, then swap the image while the drive is empty.
+    setMediaPresent(false);
+    IOLockLock(_imageLock);
+    oldImage = _image;
+    oldBlockCount = _imageBlocks;
+    setImage(image, blockCount);
+    IOLockUnlock(_imageLock);
+    if (oldImage)
+        IOFree(oldImage, oldBlockCount * _blockSize);
+    
+    IOLog("VoodooFloppyRamStorageDevice: Loaded image of %llu blocks.\n", blockCount);
+    setMediaPresent(true);
+    return kIOReturnSuccess;
+}
+
+/*!
+ * @function setMediaPresent
+ * Inserts or removes the media, keeping the image for when it is inserted again.
+ */
+void VoodooFloppyRamStorageDevice::setMediaPresent(bool present) {
+    IOMediaState mediaState = present ? kIOMediaStateOnline : kIOMediaStateOffline;
+    bool changed;
+    
+    IOLockLock(_imageLock);
+    changed = present != _mediaPresent;
+    _mediaPresent = present;
+    IOLockUnlock(_imageLock);
+    
+    // Let the upper layers know.
+    setProperty(kFloppyRamPropertyMediaPresentKey, present);
+    if (changed)
+        messageClients(kIOMessageMediaStateHasChanged, &mediaState);
+}
+
+/*!
+ * @function setWriteProtected
+ * Moves the write-protect tab.
+ */
+void VoodooFloppyRamStorageDevice::setWriteProtected(bool writeProtected) {
+    bool changed;
+    
+    IOLockLock(_imageLock);
+    changed = writeProtected != _writeProtected;
+    _writeProtected = writeProtected;
+    IOLockUnlock(_imageLock);
+    
+    // Let the upper layers know if the media is online.
+    setProperty(kFloppyRamPropertyWriteProtectedKey, writeProtected);
+    if (changed && _mediaPresent)
+        messageClients(kIOMessageMediaParametersHaveChanged);
+}
+
+/*!
+ * @function setImage
+ * Sets the image and the geometry modelled for it. Called with the image lock held.
+ */
+void VoodooFloppyRamStorageDevice::setImage(UInt8 *image, UInt64 blockCount) {
+    _image = image;
+    _imageBlocks = blockCount;
+    _maxValidBlock = blockCount - 1;
+    _sectorsPerTrack = blockCount % (kFloppyRamCylinders * 2) == 0 ? (UInt8)(blockCount / (kFloppyRamCylinders * 2)) : FLOPPY_MAX_SECTORS_PER_TRACK;
+    _cylinder = 0;
+}
+
+/*!
+ * @function getCompleteTime
+ * Models when a request would finish on a real drive, as an absolute time. Requests are served one at a time,
+ * each stepping to its cylinders and waiting for the first sector of each track to come around. Called with the
+ * image lock held.
+ */
+UInt64 VoodooFloppyRamStorageDevice::getCompleteTime(UInt64 block, UInt64 nblks) {
+    UInt64 nowNs;
+    UInt64 timeUs;
+    UInt64 deadline;
+    
+    absolutetime_to_nanoseconds(mach_absolute_time(), &nowNs);
+    timeUs = nowNs / 1000;
+    if (timeUs < _busyUntilUs)
+        timeUs = _busyUntilUs;
+    
+    if (nblks) {
+        UInt32 sectorUs = FLOPPY_ROTATION_300RPM_US / _sectorsPerTrack;
+        
+        // The motor turns off when idle, and has to spin back up.
+        if (_busyUntilUs == 0 || timeUs - _busyUntilUs >= kFloppyMotorTimeoutMs * 1000ULL)
+            timeUs += kFloppyRamSpinUpUs;
+        
+        while (nblks) {
+            UInt8 cylinder = (UInt8)(block / (_sectorsPerTrack * 2));
+            UInt32 sector = (UInt32)(block % _sectorsPerTrack);
+            UInt64 count = nblks < _sectorsPerTrack - sector ? nblks : _sectorsPerTrack - sector;
+            
+            // Step to the cylinder, then wait for the sector.
+            timeUs += (cylinder > _cylinder ? cylinder - _cylinder : _cylinder - cylinder) * kFloppyRamStepUs;
+            _cylinder = cylinder;
+            timeUs += (sector * sectorUs + FLOPPY_ROTATION_300RPM_US - timeUs % FLOPPY_ROTATION_300RPM_US) % FLOPPY_ROTATION_300RPM_US;
+            timeUs += count * sectorUs;
+            
+            block += count;
+            nblks -= count;
+        }
+        _busyUntilUs = timeUs;
+    }
+    
+    nanoseconds_to_absolutetime(timeUs * 1000, &deadline);
+    return deadline;
+}
+
+/*!
+ * @function completeHandler
+ * Completes requests whose modelled latency has passed, then waits for the next.
+ */
+void VoodooFloppyRamStorageDevice::completeHandler(OSObject *owner, IOTimerEventSource *sender) {
+    FloppyRamRequest *request;
+    UInt64 nextTime;
+    
+    while (true) {
+        IOLockLock(_imageLock);
+        request = _queueHead;
+        if (request && request->completeTime <= mach_absolute_time()) {
+            _queueHead = request->next;
+            if (!_queueHead)
+                _queueTail = NULL;
+        } else {
+            request = NULL;
+        }
+        nextTime = _queueHead ? _queueHead->completeTime : 0;
+        IOLockUnlock(_imageLock);
+        
+        if (!request)
+            break;
+        if (request->status != kIOReturnSuccess)
+            handleError(request->status);
+        IOStorage::complete(&request->completion, request->status, request->byteCount);
+        IOFree(request, sizeof (FloppyRamRequest));
+    }
+    
+    if (nextTime)
+        _tmrCompleteSource->wakeAtTime(nextTime);
+}
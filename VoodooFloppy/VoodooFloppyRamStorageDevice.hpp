@@ -0,0 +1,102 @@
+/*
+ * File: VoodooFloppyRamStorageDevice.hpp
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef VoodooFloppyRamStorageDevice_hpp
+#define VoodooFloppyRamStorageDevice_hpp
+
+#include <IOKit/IOWorkLoop.h>
+#include <IOKit/IOTimerEventSource.h>
+#include "VoodooFloppyStorageDevice.hpp"
+
+#define kFloppyRamPropertyEnabledKey        "ram-disk-enabled"
+#define kFloppyRamPropertyBlocksKey         "ram-disk-blocks"
+#define kFloppyRamPropertyMechanicsKey      "ram-disk-mechanics"
+#define kFloppyRamPropertyWriteProtectedKey "ram-disk-write-protected"
+#define kFloppyRamPropertyMediaPresentKey   "ram-disk-media-present"
+#define kFloppyRamPropertyImageKey          "ram-disk-image"
+
+// Image sizes, in 512-byte blocks. Images that divide evenly over 80 cylinders of two heads are modelled with that
+// many blocks per track, others as 1.44MB media.
+#define kFloppyRamBlocksDefault     2880
+#define kFloppyRamBlocksMax         kFloppyHashSectors
+#define kFloppyRamCylinders         80
+
+// Modelled mechanics, matching what the controller programs into real drives.
+#define kFloppyRamStepUs            ((16 - FLOPPY_SPECIFY_STEP_RATE) * 1000)
+#define kFloppyRamSpinUpUs          500000
+
+// Request waiting out its modelled latency.
+typedef struct FloppyRamRequest {
+    IOStorageCompletion completion;
+    IOReturn status;
+    UInt64 byteCount;
+    UInt64 completeTime;
+    struct FloppyRamRequest *next;
+} FloppyRamRequest;
+
+// VoodooFloppyRamStorageDevice class.
+// A floppy device backed by a disk image in memory instead of a controller, for testing the layers above without hardware.
+class VoodooFloppyRamStorageDevice : public VoodooFloppyStorageDevice {
+    typedef VoodooFloppyStorageDevice super;
+    OSDeclareDefaultStructors(VoodooFloppyRamStorageDevice);
+    
+public:
+    // IOService overrides.
+    IOService *probe(IOService *provider, SInt32 *score);
+    bool attach(IOService *provider);
+    bool start(IOService *provider);
+    void stop(IOService *provider);
+    IOReturn setProperties(OSObject *properties);
+    
+    // IOBlockStorageDevice overrides.
+    IOReturn doAsyncReadWrite(IOMemoryDescriptor *buffer, UInt64 block, UInt64 nblks, IOStorageAttributes *attributes, IOStorageCompletion *completion);
+    
+    // Media changes.
+    IOReturn loadImage(const void *bytes, UInt64 length);
+    void setMediaPresent(bool present);
+    void setWriteProtected(bool writeProtected);
+    
+private:
+    IOWorkLoop *_workLoop;
+    IOTimerEventSource *_tmrCompleteSource;
+    
+    // Image and requests waiting to complete, guarded by the lock.
+    IOLock *_imageLock;
+    UInt8 *_image;
+    UInt64 _imageBlocks;
+    FloppyRamRequest *_queueHead;
+    FloppyRamRequest *_queueTail;
+    
+    // Mechanics model. Times are in microseconds of uptime.
+    bool _mechanicsEnabled;
+    UInt8 _sectorsPerTrack;
+    UInt8 _cylinder;
+    UInt64 _busyUntilUs;
+    
+    void setImage(UInt8 *image, UInt64 blockCount);
+    UInt64 getCompleteTime(UInt64 block, UInt64 nblks);
+    void completeHandler(OSObject *owner, IOTimerEventSource *sender);
+};
+
+#endif /* VoodooFloppyRamStorageDevice_hpp */
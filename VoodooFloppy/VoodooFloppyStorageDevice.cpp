@@ -38,17 +38,20 @@ bool VoodooFloppyStorageDevice::attach(IOService *provider) {
     if (!super::attach(provider))
         return false;
     
-    // Media is present.
-    _mediaPresent = true;
+    // Media state is unknown until the controller probes the drive in the background.
+    _mediaPresent = false;
     _writeProtected = false;
     _blockSize = 512;
     _maxValidBlock = 2880 - 1;
     
+    // Get drive properties.
+    _driveNumber = ((OSNumber*)getProperty(kFloppyPropertyDriveIdKey))->unsigned8BitValue();
+    _driveType = ((OSNumber*)getProperty(FLOPPY_IOREG_DRIVE_TYPE))->unsigned8BitValue();
+    _dataRate = FLOPPY_SPEED_500KBPS;
+    
     // Save reference to controller.
     _controller = (VoodooFloppyController*)provider;
     DBGLOG("VoodooFloppyStorageDevice: Drive number %u, type 0x%X\n", ((OSNumber*)getProperty(kFloppyPropertyDriveIdKey))->unsigned8BitValue(), ((OSNumber*)getProperty(FLOPPY_IOREG_DRIVE_TYPE))->unsigned8BitValue());
-    
-    probeMedia();
     return true;
 }
 
@@ -289,30 +292,24 @@ IOReturn VoodooFloppyStorageDevice::reportWriteProtection(bool *isWriteProtected
 IOReturn VoodooFloppyStorageDevice::doAsyncReadWrite(IOMemoryDescriptor *buffer, UInt64 block, UInt64 nblks, IOStorageAttributes *attributes, IOStorageCompletion *completion) {
     IODirection direction = buffer->getDirection();
     DBGLOG("VoodooFloppyStorageDevice::doAsyncReadWrite(start %llu, %llu blocks, 0x%X)\n", block, nblks, direction);
-    //_controller->readDrive(0, buffer, block, nblks, attributes);
-    
-  /*  IOReturn status = kIOReturnSuccess;
-    if (direction == kIODirectionIn) // Rading from device.
-        status = _controller->readSectors(this, block, nblks, buffer);
-    else if (direction == kIODirectionOut) // Writing to device.
-        status = _controller->writeSectors(this, block, nblks, buffer);*/
     
-    IOReturn status = _controller->readWriteDrive(this, buffer, block, nblks);
-    
-    if (status != kIOReturnSuccess) {
-        // If media is gone, let the upper layers know.
-        if (status == kIOReturnNoMedia) {
-            IOMediaState mediaState = kIOMediaStateOffline;
-            messageClients(kIOMessageMediaStateHasChanged, &mediaState);
-        } else if (status == kIOReturnNotWritable) {
-            _writeProtected = true;
-            messageClients(kIOMessageMediaParametersHaveChanged);
-        }
-        return status;
+    // Queue request on the controller. It is completed from the controller's work loop.
+    return _controller->submitReadWrite(this, buffer, block, nblks, attributes, completion);
+}
+
+/*!
+ * @function handleError
+ * Updates media state after a failed request.
+ */
+void VoodooFloppyStorageDevice::handleError(IOReturn status) {
+    // If media is gone, let the upper layers know.
+    if (status == kIOReturnNoMedia) {
+        IOMediaState mediaState = kIOMediaStateOffline;
+        messageClients(kIOMessageMediaStateHasChanged, &mediaState);
+    } else if (status == kIOReturnNotWritable) {
+        _writeProtected = true;
+        messageClients(kIOMessageMediaParametersHaveChanged);
     }
-    
-    IOStorage::complete(completion, kIOReturnSuccess, nblks * _blockSize);
-    return kIOReturnSuccess;
 }
 
 void VoodooFloppyStorageDevice::probeMedia() {
@@ -327,6 +324,20 @@ void VoodooFloppyStorageDevice::probeMedia() {
     _mediaPresent = newMediaPresent;
 }
 
+/*!
+ * @function setMediaSize
+ * Sets the number of blocks on the media, which depends on the format found on it.
+ */
+void VoodooFloppyStorageDevice::setMediaSize(UInt64 blockCount) {
+    if (blockCount - 1 == _maxValidBlock)
+        return;
+    
+    // Let the upper layers know if the media was already online.
+    _maxValidBlock = blockCount - 1;
+    if (_mediaPresent)
+        messageClients(kIOMessageMediaParametersHaveChanged);
+}
+
 
 /*!
  * @function getDriveNumber
@@ -337,6 +348,24 @@ UInt8 VoodooFloppyStorageDevice::getDriveNumber() {
     return _driveNumber;
 }
 
+/*!
+ * @function getDriveType
+ * Gets the CMOS drive type.
+ */
+UInt8 VoodooFloppyStorageDevice::getDriveType() {
+    // Return drive type.
+    return _driveType;
+}
+
+/*!
+ * @function getDataRate
+ * Gets the data rate used for the media in the drive.
+ */
+UInt8 VoodooFloppyStorageDevice::getDataRate() {
+    // Return data rate.
+    return _dataRate;
+}
+
 UInt32 VoodooFloppyStorageDevice::getBlockSize() {
     // Return block size.
     return _blockSize;
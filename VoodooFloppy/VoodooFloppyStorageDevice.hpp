@@ -65,13 +65,16 @@ public:
     
     // Floppy functions.
     void probeMedia();
+    void handleError(IOReturn status);
+    void setMediaSize(UInt64 blockCount);
     
     UInt8 getDriveNumber();
+    UInt8 getDriveType();
     UInt8 getDataRate();
     
     UInt32 getBlockSize();
     
-private:
+protected:
     // Parent controller.
     VoodooFloppyController *_controller;
     
@@ -0,0 +1,241 @@
+/*
+ * File: VoodooFloppyUserClient.cpp
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <IOKit/IOLib.h>
+
+#include "VoodooFloppyUserClient.hpp"
+
+// This required macro defines the class's constructors, destructors,
+// and several other methods I/O Kit requires.
+OSDefineMetaClassAndStructors(VoodooFloppyUserClient, IOUserClient)
+
+// Method table.
+const IOExternalMethodDispatch VoodooFloppyUserClient::sMethods[kFloppyUserClientMethodCount] = {
+    { (IOExternalMethodAction)&VoodooFloppyUserClient::sImage, 4, 0, 0, 0 },
+    { (IOExternalMethodAction)&VoodooFloppyUserClient::sAbort, 0, 0, 0, 0 },
+    { (IOExternalMethodAction)&VoodooFloppyUserClient::sFormat, 4, 0, 0, 0 },
+    { (IOExternalMethodAction)&VoodooFloppyUserClient::sScan, 4, kIOUCVariableStructureSize, 2, kIOUCVariableStructureSize },
+    { (IOExternalMethodAction)&VoodooFloppyUserClient::sTrace, 1, 0, 0, 0 },
+    { (IOExternalMethodAction)&VoodooFloppyUserClient::sCopy, 4, 0, 1, kIOUCVariableStructureSize }
+};
+
+bool VoodooFloppyUserClient::initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties) {
+    DBGLOG("VoodooFloppyUserClient::initWithTask()\n");
+    if (!super::initWithTask(owningTask, securityToken, type, properties))
+        return false;
+
+    // Raw drive access is limited to administrators.
+    if (clientHasPrivilege(securityToken, kIOClientPrivilegeAdministrator) != kIOReturnSuccess)
+        return false;
+
+    _controller = NULL;
+    _ringMemory = NULL;
+    _ring = NULL;
+    _abort = false;
+    return true;
+}
+
+bool VoodooFloppyUserClient::start(IOService *provider) {
+    DBGLOG("VoodooFloppyUserClient::start()\n");
+    if (!super::start(provider))
+        return false;
+
+    _controller = OSDynamicCast(VoodooFloppyController, provider);
+    if (!_controller)
+        return false;
+
+    // Allocate imaging ring. This is mapped into the client with IOConnectMapMemory.
+    _ringMemory = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionInOut | kIOMemoryKernelUserShared, sizeof (FloppyImageRing), PAGE_SIZE);
+    if (!_ringMemory) {
+        IOLog("VoodooFloppyUserClient: Failed to allocate imaging ring.\n");
+        return false;
+    }
+    _ring = (FloppyImageRing*)_ringMemory->getBytesNoCopy();
+    bzero(_ring, sizeof (FloppyImageRing));
+    _ring->slotCount = kFloppyImageRingSlotCount;
+    return true;
+}
+
+void VoodooFloppyUserClient::stop(IOService *provider) {
+    DBGLOG("VoodooFloppyUserClient::stop()\n");
+
+    // Release ring.
+    _ring = NULL;
+    OSSafeReleaseNULL(_ringMemory);
+    super::stop(provider);
+}
+
+IOReturn VoodooFloppyUserClient::clientClose() {
+    DBGLOG("VoodooFloppyUserClient::clientClose()\n");
+
+    // Stop any running session and detach.
+    abortSession();
+    terminate();
+    return kIOReturnSuccess;
+}
+
+/**
+ * Aborts the running imaging session or copy, waking it if it is waiting for the client.
+ */
+void VoodooFloppyUserClient::abortSession() {
+    _abort = true;
+    if (_ring)
+        _controller->wakeImageSession(_ring);
+}
+
+IOReturn VoodooFloppyUserClient::externalMethod(UInt32 selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch *dispatch, OSObject *target, void *reference) {
+    if (selector >= kFloppyUserClientMethodCount)
+        return kIOReturnUnsupported;
+
+    dispatch = (IOExternalMethodDispatch*)&sMethods[selector];
+    target = this;
+    return super::externalMethod(selector, arguments, dispatch, target, reference);
+}
+
+IOReturn VoodooFloppyUserClient::clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory) {
+    IOBufferMemoryDescriptor *clientMemory;
+    if (type == kFloppyUserClientMemoryRing)
+        clientMemory = _ringMemory;
+    else if (type == kFloppyUserClientMemoryTrace)
+        clientMemory = _controller->getTraceMemory();
+    else
+        return kIOReturnBadArgument;
+
+    // The trace ring only exists once tracing has been started.
+    if (!clientMemory)
+        return kIOReturnNotReady;
+
+    // Caller releases the reference.
+    clientMemory->retain();
+    *memory = clientMemory;
+    return kIOReturnSuccess;
+}
+
+/**
+ * Images a drive through the shared ring. Blocks until the session finishes or is aborted.
+ */
+IOReturn VoodooFloppyUserClient::sImage(VoodooFloppyUserClient *target, void *reference, IOExternalMethodArguments *arguments) {
+    UInt8 driveNumber = (UInt8)arguments->scalarInput[0];
+    bool write = arguments->scalarInput[1] != 0;
+    UInt32 firstCylinder = (UInt32)arguments->scalarInput[2];
+    UInt32 cylinderCount = (UInt32)arguments->scalarInput[3];
+
+    // The session can outlive the client closing, so hold the ring until it returns.
+    IOBufferMemoryDescriptor *ringMemory = target->_ringMemory;
+    if (!ringMemory)
+        return kIOReturnNotReady;
+    ringMemory->retain();
+
+    target->_abort = false;
+    IOReturn status = target->_controller->imageDrive(driveNumber, write, (FloppyImageRing*)ringMemory->getBytesNoCopy(), firstCylinder, cylinderCount, &target->_abort);
+    ringMemory->release();
+    return status;
+}
+
+/**
+ * Aborts the running imaging session or copy.
+ */
+IOReturn VoodooFloppyUserClient::sAbort(VoodooFloppyUserClient *target, void *reference, IOExternalMethodArguments *arguments) {
+    target->abortSession();
+    return kIOReturnSuccess;
+}
+
+/**
+ * Formats cylinders on a drive. Blocks until they are done.
+ */
+IOReturn VoodooFloppyUserClient::sFormat(VoodooFloppyUserClient *target, void *reference, IOExternalMethodArguments *arguments) {
+    UInt8 driveNumber = (UInt8)arguments->scalarInput[0];
+    UInt32 firstCylinder = (UInt32)arguments->scalarInput[1];
+    UInt32 cylinderCount = (UInt32)arguments->scalarInput[2];
+    UInt8 sizeCode = (UInt8)arguments->scalarInput[3];
+
+    return target->_controller->formatDrive(driveNumber, firstCylinder, cylinderCount, sizeCode);
+}
+
+/**
+ * Searches cylinders on a drive for sectors matching a pattern. Blocks until they are done.
+ */
+IOReturn VoodooFloppyUserClient::sScan(VoodooFloppyUserClient *target, void *reference, IOExternalMethodArguments *arguments) {
+    UInt8 driveNumber = (UInt8)arguments->scalarInput[0];
+    UInt32 firstCylinder = (UInt32)arguments->scalarInput[1];
+    UInt32 cylinderCount = (UInt32)arguments->scalarInput[2];
+    UInt8 condition = (UInt8)arguments->scalarInput[3];
+
+    // Patterns and matches are small enough to always come inline.
+    if (arguments->structureInputDescriptor || arguments->structureOutputDescriptor)
+        return kIOReturnBadArgument;
+    if (arguments->structureInputSize == 0 || arguments->structureInputSize > kFloppyScanMaxPatternBytes)
+        return kIOReturnBadArgument;
+    UInt32 matchCount = arguments->structureOutputSize / sizeof (FloppyScanMatch);
+    if (matchCount == 0 || matchCount > kFloppyScanMaxMatches)
+        return kIOReturnBadArgument;
+
+    UInt32 cylindersScanned = 0;
+    IOReturn status = target->_controller->scanDrive(driveNumber, firstCylinder, cylinderCount, condition,
+                                                     (const UInt8*)arguments->structureInput, arguments->structureInputSize,
+                                                     (FloppyScanMatch*)arguments->structureOutput, &matchCount, &cylindersScanned);
+    arguments->structureOutputSize = matchCount * sizeof (FloppyScanMatch);
+    arguments->scalarOutput[0] = matchCount;
+    arguments->scalarOutput[1] = cylindersScanned;
+    return status;
+}
+
+/**
+ * Starts or stops request tracing. The ring is read through kFloppyUserClientMemoryTrace.
+ */
+IOReturn VoodooFloppyUserClient::sTrace(VoodooFloppyUserClient *target, void *reference, IOExternalMethodArguments *arguments) {
+    return target->_controller->setTracing(arguments->scalarInput[0] != 0);
+}
+
+/**
+ * Copies cylinders from one drive to the other. Blocks until they are done or the copy is aborted.
+ * Progress can be followed in the imaging ring header meanwhile.
+ */
+IOReturn VoodooFloppyUserClient::sCopy(VoodooFloppyUserClient *target, void *reference, IOExternalMethodArguments *arguments) {
+    UInt8 sourceDrive = (UInt8)arguments->scalarInput[0];
+    UInt8 destinationDrive = (UInt8)arguments->scalarInput[1];
+    UInt32 firstCylinder = (UInt32)arguments->scalarInput[2];
+    UInt32 cylinderCount = (UInt32)arguments->scalarInput[3];
+
+    // Results are small enough to always come inline, and there must be room for one per cylinder.
+    if (arguments->structureOutputDescriptor)
+        return kIOReturnBadArgument;
+    if (cylinderCount == 0 || cylinderCount > kFloppyCopyMaxCylinders || arguments->structureOutputSize < cylinderCount * sizeof (FloppyCopyCylinder))
+        return kIOReturnBadArgument;
+
+    // The copy can outlive the client closing, so hold the ring until it returns.
+    IOBufferMemoryDescriptor *ringMemory = target->_ringMemory;
+    if (!ringMemory)
+        return kIOReturnNotReady;
+    ringMemory->retain();
+
+    UInt32 cylindersCopied = 0;
+    target->_abort = false;
+    IOReturn status = target->_controller->copyDrive(sourceDrive, destinationDrive, (FloppyImageRing*)ringMemory->getBytesNoCopy(), firstCylinder, cylinderCount,
+                                                     &target->_abort, (FloppyCopyCylinder*)arguments->structureOutput, &cylindersCopied);
+    ringMemory->release();
+    arguments->structureOutputSize = cylindersCopied * sizeof (FloppyCopyCylinder);
+    arguments->scalarOutput[0] = cylindersCopied;
+    return status;
+}
@@ -0,0 +1,71 @@
+/*
+ * File: VoodooFloppyUserClient.hpp
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef VoodooFloppyUserClient_hpp
+#define VoodooFloppyUserClient_hpp
+
+#include <IOKit/IOUserClient.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+
+#include "VoodooFloppyController.hpp"
+#include "VoodooFloppyUserClientShared.h"
+
+// VoodooFloppyUserClient class.
+class VoodooFloppyUserClient : public IOUserClient {
+    typedef IOUserClient super;
+    OSDeclareDefaultStructors(VoodooFloppyUserClient);
+
+public:
+    // IOService overrides.
+    virtual bool initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties);
+    virtual bool start(IOService *provider);
+    virtual void stop(IOService *provider);
+
+    // IOUserClient overrides.
+    virtual IOReturn clientClose();
+    virtual IOReturn externalMethod(UInt32 selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch *dispatch = 0, OSObject *target = 0, void *reference = 0);
+    virtual IOReturn clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory);
+
+private:
+    // Parent controller.
+    VoodooFloppyController *_controller;
+
+    // Imaging ring shared with the client.
+    IOBufferMemoryDescriptor *_ringMemory;
+    FloppyImageRing *_ring;
+    volatile bool _abort;
+
+    void abortSession();
+
+    // Methods.
+    static const IOExternalMethodDispatch sMethods[kFloppyUserClientMethodCount];
+    static IOReturn sImage(VoodooFloppyUserClient *target, void *reference, IOExternalMethodArguments *arguments);
+    static IOReturn sAbort(VoodooFloppyUserClient *target, void *reference, IOExternalMethodArguments *arguments);
+    static IOReturn sFormat(VoodooFloppyUserClient *target, void *reference, IOExternalMethodArguments *arguments);
+    static IOReturn sScan(VoodooFloppyUserClient *target, void *reference, IOExternalMethodArguments *arguments);
+    static IOReturn sTrace(VoodooFloppyUserClient *target, void *reference, IOExternalMethodArguments *arguments);
+    static IOReturn sCopy(VoodooFloppyUserClient *target, void *reference, IOExternalMethodArguments *arguments);
+};
+
+#endif /* VoodooFloppyUserClient_hpp */
@@ -0,0 +1,166 @@
+/*
+ * File: VoodooFloppyUserClientShared.h
+ *
+ * Copyright (c) 2018 John Davis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Definitions shared between VoodooFloppyUserClient and user space tools.
+
+#ifndef VoodooFloppyUserClientShared_h
+#define VoodooFloppyUserClientShared_h
+
+#include <stdint.h>
+
+// User client methods.
+enum {
+    kFloppyUserClientMethodImage    = 0, // Image a drive. Scalars in: drive, write, first cylinder, cylinder count.
+    kFloppyUserClientMethodAbort    = 1, // Abort the running imaging session or copy.
+    kFloppyUserClientMethodFormat   = 2, // Format cylinders. Scalars in: drive, first cylinder, cylinder count, sector size code.
+                                         // Only whole disks can change sector size.
+    kFloppyUserClientMethodScan     = 3, // Search cylinders for sectors matching a pattern. Scalars in: drive, first cylinder, cylinder count, condition.
+                                         // Structure in: pattern. Structure out: FloppyScanMatch array. Scalars out: match count, cylinders scanned.
+    kFloppyUserClientMethodTrace    = 4, // Start or stop request tracing. Scalars in: enable.
+    kFloppyUserClientMethodCopy     = 5, // Copy cylinders from one drive to the other. Scalars in: source drive, destination drive, first cylinder,
+                                         // cylinder count. Structure out: FloppyCopyCylinder array. Scalars out: cylinders copied.
+    kFloppyUserClientMethodCount
+};
+
+// Memory types for IOConnectMapMemory.
+enum {
+    kFloppyUserClientMemoryRing     = 0, // Imaging ring.
+    kFloppyUserClientMemoryTrace    = 1  // Request trace ring, once tracing has been started.
+};
+
+// Imaging ring limits. Slots are sized for the largest supported cylinder (2.88MB media).
+// Slots hold physical sectors, which may be bigger than 512 bytes; the ring header gives the sizes in use.
+#define kFloppyImageRingSlotCount       8
+#define kFloppyImageMaxSectors          72
+#define kFloppyImageSectorSize          512
+#define kFloppyImageMaxCylinderBytes    (kFloppyImageMaxSectors * kFloppyImageSectorSize)
+
+// Imaging session states.
+enum {
+    kFloppyImageStateIdle       = 0,
+    kFloppyImageStateRunning    = 1,
+    kFloppyImageStateDone       = 2,
+    kFloppyImageStateAborted    = 3
+};
+
+// Per-sector status.
+enum {
+    kFloppyImageSectorGood      = 0, // Transferred on the first attempt.
+    kFloppyImageSectorRetried   = 1, // Transferred after one or more retries.
+    kFloppyImageSectorBad       = 2  // Could not be transferred.
+};
+
+// A single cylinder in the ring. Status sits next to the data it describes.
+typedef struct {
+    uint32_t cylinder;
+    int32_t status;
+    uint16_t sectorCount;
+    uint16_t goodSectors;
+    uint16_t retriedSectors;
+    uint16_t badSectors;
+    uint8_t sectorStatus[kFloppyImageMaxSectors];
+    uint8_t data[kFloppyImageMaxCylinderBytes];
+} FloppyImageSlot;
+
+// Ring header. When reading, the driver produces slots and the client consumes them.
+// When writing, the client produces slots and the driver consumes them.
+// Indexes only ever increase; the slot used is index % slotCount.
+typedef struct {
+    volatile uint32_t producer;
+    volatile uint32_t consumer;
+    uint32_t slotCount;
+    uint32_t cylinderBytes;
+    uint32_t sectorsPerCylinder;
+    uint32_t cylinderCount;
+    volatile uint32_t state;
+    volatile int32_t result;
+    FloppyImageSlot slots[kFloppyImageRingSlotCount];
+} FloppyImageRing;
+
+// Search conditions, compared byte by byte between each sector and the pattern.
+enum {
+    kFloppyScanEqual            = 0, // Sector bytes equal the pattern.
+    kFloppyScanLowOrEqual       = 1, // Sector bytes are no higher than the pattern.
+    kFloppyScanHighOrEqual      = 2, // Sector bytes are no lower than the pattern.
+    kFloppyScanConditionCount
+};
+
+// Patterns cover the start of a sector, up to a whole 1024-byte sector. Bytes of 0xFF, in the pattern or in the
+// sector, match anything, and sector bytes past the end of the pattern are not compared.
+#define kFloppyScanMaxPatternBytes  1024
+#define kFloppyScanDontCare         0xFF
+
+// Matches fit inline in the method's structure output. A full array ends the search early, and the
+// cylinders scanned count only covers cylinders searched in full, so the search can pick up from there.
+#define kFloppyScanMaxMatches       1024
+
+// A sector that met the condition.
+typedef struct {
+    uint8_t cylinder;
+    uint8_t head;
+    uint8_t sector;
+    uint8_t reserved;
+} FloppyScanMatch;
+
+// Copy results fit inline in the method's structure output, one for each cylinder copied.
+// While a copy runs, the imaging ring header shows its progress: cylinderCount is the number of cylinders to copy,
+// producer counts those done, and state and result are set as for imaging. Slots are not used.
+#define kFloppyCopyMaxCylinders     80
+
+// Outcome of copying one cylinder. Sectors that can't be read from the source are written as zeroes.
+typedef struct {
+    int32_t status; // First error reading or writing the cylinder, or kIOReturnSuccess.
+    uint16_t retriedSectors; // Read or written after one or more retries.
+    uint16_t badSectors; // Could not be read from the source or written to the destination.
+    uint8_t cylinder;
+    uint8_t reserved[3];
+} FloppyCopyCylinder;
+
+// Request trace ring size. Records are also the format of saved trace files.
+#define kFloppyTraceRecordCount     4096
+
+// Trace record flags. The drive number sits in the upper bits.
+#define kFloppyTraceFlagWrite       0x01
+#define kFloppyTraceDriveShift      4
+
+// A block request as given to the driver, before any queueing.
+typedef struct {
+    uint64_t timestamp; // Nanoseconds since tracing started.
+    uint32_t block;
+    uint16_t blockCount;
+    uint8_t priority; // IOStoragePriority.
+    uint8_t flags;
+} FloppyTraceRecord;
+
+// Trace ring header. The driver appends a record for each request, overwriting the oldest once the ring is full.
+// The producer index only ever increases, and is reset when tracing restarts; the record used is index % recordCount.
+// Readers keep their own index, and a record they copied is only good if the producer has not since moved a full
+// ring past it.
+typedef struct {
+    volatile uint32_t producer;
+    uint32_t recordCount;
+    FloppyTraceRecord records[kFloppyTraceRecordCount];
+} FloppyTraceRing;
+
+#endif /* VoodooFloppyUserClientShared_h */